@@ -0,0 +1 @@
+../db/lib/CDBResult.h
\ No newline at end of file
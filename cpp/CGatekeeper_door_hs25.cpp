@@ -39,9 +39,15 @@ CGatekeeper_door_hs25::CGatekeeper_door_hs25()
   _id = 0;
   _base_topic = "";
   _log = NULL;
-  _db = NULL;
+  _db_pool = NULL;
   door_short_name = "";
   _entry_announce = "";
+  _unlock_topic = NULL;
+  _door_button_topic = NULL;
+  _entry_known_topic = NULL;
+  _entry_unknown_topic = NULL;
+  memset(_display_topic, 0, sizeof(_display_topic));
+  memset(_buzzer_topic, 0, sizeof(_buzzer_topic));
   memset(&_last_valid_read, 0, sizeof(_last_valid_read));
 }
 
@@ -50,32 +56,48 @@ CGatekeeper_door_hs25::~CGatekeeper_door_hs25()
   dbg("Deleted");
 }
 
-void CGatekeeper_door_hs25::set_opts(int id, string base_topic, CLogging *log, CNHDBAccess *db, InstCBI *cb, string entry_announce, int read_timeout, string door_state, string exit_message)
+void CGatekeeper_door_hs25::set_opts(int id, string base_topic, CLogging *log, CNHDBPool *db_pool, InstCBI *cb, string entry_announce, int read_timeout, string door_state, string exit_message)
 {
   _id  = id;
   _base_topic = base_topic;
   _log = log;
-  _db  = db;
+  _db_pool = db_pool;
   _cb  = cb;
   _entry_announce = entry_announce;
   _read_timeout = read_timeout;
   _exit_message = exit_message;
 
+  string door_topic = _base_topic + "/" + CNHmqtt::itos(_id) + "/";
+  const char sides[] = "ABZ";
+  _unlock_topic        = cb->cbiTopicHandle(door_topic + "Unlock", false, false);
+  _door_button_topic   = cb->cbiTopicHandle(_base_topic + "/DoorButton", false, false);
+  _entry_known_topic   = cb->cbiTopicHandle(_entry_announce + "/known", false, false);
+  _entry_unknown_topic = cb->cbiTopicHandle(_entry_announce + "/unknown", false, false);
+  for (int n=0; n < 3; n++)
+  {
+    _display_topic[n] = cb->cbiTopicHandle(door_topic + sides[n] + "/Display", false, false);
+    _buzzer_topic[n]  = cb->cbiTopicHandle(door_topic + sides[n] + "/Buzzer", false, false);
+  }
+
   // Now the door_id has been set, get the list of door bells that should be rang when the button is pushed
   _door_bells.clear();
 
   // Get a list of all bells to be rung...
-  dbrows bells;
-  db->sp_gatekeeper_get_door_bells(_id, &bells);
+  CDBResult bells;
+  {
+    CNHDBPool::conn db(db_pool);
+    db->sp_gatekeeper_get_door_bells(_id, &bells);
+  }
 
   dbg("Door button will ring:");
-  for (dbrows::const_iterator iterator = bells.begin(), end = bells.end(); iterator != end; ++iterator) 
+  int col_topic   = bells.column("bell_topic");
+  int col_message = bells.column("bell_message");
+  for (unsigned int n=0; n < bells.size(); n++)
   {
     door_bell bell;
-    dbrow row = *iterator;
 
-    bell.mqtt_topic   = row["bell_topic"].asStr();
-    bell.mqtt_message = row["bell_message"].asStr();
+    bell.mqtt_topic   = bells[n].asStr(col_topic);
+    bell.mqtt_message = bells[n].asStr(col_message);
     _door_bells.push_back(bell);
 
     dbg("\t" + bell.mqtt_topic + "\t" + bell.mqtt_message);
@@ -106,13 +128,14 @@ CGatekeeper_door_hs25::DoorState CGatekeeper_door_hs25::get_door_state_from_str(
 
 void CGatekeeper_door_hs25::process_door_event(string type, string payload)
 {
-  if ((_db == NULL) || (_cb == NULL))
+  if ((_db_pool == NULL) || (_cb == NULL))
     return;
 
+  CNHDBPool::conn db(_db_pool);
+
   time_t current_time;
   string display_message;
   string err;
-  string unlock_topic = _base_topic + "/" + CNHmqtt::itos(_id) + "/Unlock";
   
   char door_side = 'Z'; // default to Z: applies to both sides
 
@@ -135,7 +158,7 @@ void CGatekeeper_door_hs25::process_door_event(string type, string payload)
       time (&current_time);
       int skip_count=0;
 
-      _db->sp_set_door_state(_id, payload);
+      db->sp_set_door_state(_id, payload);
       _door_state = new_door_state;
 
       if (new_door_state == DS_OPEN)
@@ -161,7 +184,7 @@ void CGatekeeper_door_hs25::process_door_event(string type, string payload)
         if (!entry_count)
         {
           // Ok, this is a little odd. The door has been opened, but we have no record of unlocking it recently.
-          _cb->cbiSendMessage(_entry_announce + "/unknown", door_short_name + " door opened");
+          _cb->cbiSendMessage(_entry_unknown_topic, door_short_name + " door opened");
         }
       }
     }
@@ -174,10 +197,10 @@ void CGatekeeper_door_hs25::process_door_event(string type, string payload)
       _cb->cbiSendMessage((*i).mqtt_topic, (*i).mqtt_message);
 
     // Send a message with the door name for the matrix displays / IRC / slack
-    _cb->cbiSendMessage(_base_topic + "/DoorButton", door_short_name);
+    _cb->cbiSendMessage(_door_button_topic, door_short_name);
 
     // Log an event recording this door button was pushed
-    _db->sp_log_event("DOORBELL", CNHmqtt::itos(_id));
+    db->sp_log_event("DOORBELL", CNHmqtt::itos(_id));
   }
 
   else if (type=="RFID")
@@ -191,11 +214,21 @@ void CGatekeeper_door_hs25::process_door_event(string type, string payload)
     string side = " ";
     side[0] = door_side;
     string dbg_msg="";
+    int ret;
 
-    _db->sp_rfid_update(payload, CNHmqtt::hex2legacy_rfid(payload), dbg_msg);
+    db->sp_rfid_update(payload, CNHmqtt::hex2legacy_rfid(payload), dbg_msg);
     dbg(dbg_msg);
 
-    if(_db->sp_gatekeeper_check_rfid(payload, _id, side, display_message, handle, last_seen, access_result, new_zone_id, member_id, err))
+    ret = db->sp_gatekeeper_check_rfid(payload, _id, side, display_message, handle, last_seen, access_result, new_zone_id, member_id, err);
+    if (ret == DB_ERR_UNAVAILABLE)
+    {
+      // The database is down (or not answering) - so say so straight away, rather than leaving
+      // whoever's at the door (and every other door) waiting on it
+      dbg("Database unavailable - unable to check card");
+      display_message_lcd(door_side, "Access Denied: database unavailable", 2000);
+      beep(door_side, 500, 3000);
+    }
+    else if (ret)
     {
       dbg("Call to sp_gatekeeper_check_rfid failed");
       display_message_lcd(door_side, "Access Denied: internal error", 2000);
@@ -212,7 +245,7 @@ void CGatekeeper_door_hs25::process_door_event(string type, string payload)
       if (access_result == 1)
       {
         beep(door_side);
-        _cb->cbiSendMessage(unlock_topic, "1");
+        _cb->cbiSendMessage(_unlock_topic, "1");
         time(&_last_valid_read);
 
         // If the door is already open, update the zone recorded against the member now.
@@ -247,9 +280,9 @@ void CGatekeeper_door_hs25::process_door_event(string type, string payload)
   {
     // todo
     string handle="";
-    _db->sp_check_pin(payload, _id, display_message, handle, err);
+    db->sp_check_pin(payload, _id, display_message, handle, err);
     dbg("err = [" + err + "]");
-    _cb->cbiSendMessage(unlock_topic, display_message);
+    _cb->cbiSendMessage(_unlock_topic, display_message);
   }
 */
 }
@@ -258,7 +291,8 @@ int CGatekeeper_door_hs25::set_member_zone(int member_id, int new_zone_id, strin
 {
   string direction;
   dbg("Updating current zone for member [" + CNHmqtt::itos(member_id) + "] to be [" + CNHmqtt::itos(new_zone_id) + "]");
-  _db->sp_gatekeeper_set_zone(member_id, new_zone_id);
+  CNHDBPool::conn db(_db_pool); // (the same connection process_door_event() has checked out)
+  db->sp_gatekeeper_set_zone(member_id, new_zone_id);
 
   if (new_zone_id == 0)
     direction = "->";
@@ -266,9 +300,9 @@ int CGatekeeper_door_hs25::set_member_zone(int member_id, int new_zone_id, strin
     direction = "<-";
 
   if (last_seen.length() > 1)
-    _cb->cbiSendMessage(_entry_announce + "/known", door_short_name + " (" + direction + ") door opened by: " + handle + " (last seen " + last_seen + " ago)");
+    _cb->cbiSendMessage(_entry_known_topic, door_short_name + " (" + direction + ") door opened by: " + handle + " (last seen " + last_seen + " ago)");
   else
-    _cb->cbiSendMessage(_entry_announce + "/known", door_short_name + " (" + direction + ") door opened by: " + handle);
+    _cb->cbiSendMessage(_entry_known_topic, door_short_name + " (" + direction + ") door opened by: " + handle);
 
   return 0;
 }
@@ -292,21 +326,30 @@ void CGatekeeper_door_hs25::display_message_lcd(char side, string message, int d
 // Send message to be displayed on the LCD of one side of the door
 {
   char payload[32 + 5 + 1] = ""; // display is 32 char (2x16), + 5 for duration + terminator
-  string display_topic = _base_topic + "/" + CNHmqtt::itos(_id) + "/" + side + "/Display";
 
   snprintf(payload, sizeof(payload), "%04d:%s", duration, message.c_str());
   payload[sizeof(payload)-1] = '\0';
 
-  _cb->cbiSendMessage(display_topic, payload);
+  _cb->cbiSendMessage(_display_topic[side_index(side)], payload);
 }
 
 void CGatekeeper_door_hs25::beep(char side, int tone, int duration)
 {
   char payload[11] = ""; 
-  string buzzer_topic = _base_topic + "/" + CNHmqtt::itos(_id) + "/" + side + "/Buzzer";
 
   snprintf(payload, sizeof(payload), "%05d:%04d", tone, duration);
   payload[sizeof(payload)-1] = '\0';
 
-  _cb->cbiSendMessage(buzzer_topic, payload);
+  _cb->cbiSendMessage(_buzzer_topic[side_index(side)], payload);
+}
+
+int CGatekeeper_door_hs25::side_index(char side)
+// Index into _display_topic/_buzzer_topic
+{
+  switch (side)
+  {
+    case 'A': return 0;
+    case 'B': return 1;
+    default:  return 2;
+  }
 }
@@ -5,7 +5,7 @@
 #include <queue>
 
 #include "CLogging.h"
-#include "CNHDBAccess.h"
+#include "CNHDBPool.h"
 #include "nh-cbi.h"
 #include "CGatekeeper_door.h"
 
@@ -15,7 +15,7 @@ class CGatekeeper_door_hs25 : public CGatekeeper_door
     CGatekeeper_door_hs25();
     ~CGatekeeper_door_hs25();
 
-    void set_opts(int id, std::string base_topic, CLogging *log, CNHDBAccess *db, InstCBI *cb, std::string entry_announce, int read_timeout, std::string door_state, std::string exit_message);
+    void set_opts(int id, std::string base_topic, CLogging *log, CNHDBPool *db_pool, InstCBI *cb, std::string entry_announce, int read_timeout, std::string door_state, std::string exit_message);
     void process_door_event(std::string type, std::string payload);
 
     enum DoorState {DS_OPEN, DS_CLOSED, DS_UNKNWON};
@@ -42,6 +42,7 @@ class CGatekeeper_door_hs25 : public CGatekeeper_door
     DoorState get_door_state_from_str(std::string door_state);
     int set_member_zone(int member_id, int new_zone_id, std::string handle, std::string last_seen);
     void add_pending_arrival(struct member_arrival ma);
+    static int side_index(char side);
 
     std::list<door_bell> _door_bells;
     int _id;
@@ -53,8 +54,16 @@ class CGatekeeper_door_hs25 : public CGatekeeper_door
     std::deque<member_arrival> _pending_arrivals; // members who have swiped their card on the read, but not opened the door yet (entries should only exist in here for a few seconds normally)
     std::string _exit_message;
 
+    // Precomputed handles for the topics published to, set in set_opts(). Display/buzzer are per side (A, B, Z)
+    mqtt_topic *_unlock_topic;
+    mqtt_topic *_door_button_topic;
+    mqtt_topic *_entry_known_topic;
+    mqtt_topic *_entry_unknown_topic;
+    mqtt_topic *_display_topic[3];
+    mqtt_topic *_buzzer_topic[3];
+
     CLogging *_log;
-    CNHDBAccess *_db;
+    CNHDBPool *_db_pool;
     InstCBI *_cb;
 };
 
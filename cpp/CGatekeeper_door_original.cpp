@@ -39,7 +39,7 @@ CGatekeeper_door_original::CGatekeeper_door_original()
   _id = 0;
   _base_topic = "";
   _log = NULL;
-  _db = NULL;
+  _db_pool = NULL;
   door_short_name = "";
   _handle = "";
   _entry_announce = "";
@@ -53,12 +53,12 @@ CGatekeeper_door_original::~CGatekeeper_door_original()
   dbg("Deleted");
 }
 
-void CGatekeeper_door_original::set_opts(int id, string base_topic, CLogging *log, CNHDBAccess *db, InstCBI *cb, string entry_announce, int read_timeout, string, string)
+void CGatekeeper_door_original::set_opts(int id, string base_topic, CLogging *log, CNHDBPool *db_pool, InstCBI *cb, string entry_announce, int read_timeout, string, string)
 {
   _id  = id;
   _base_topic = base_topic;
   _log = log;
-  _db  = db;
+  _db_pool = db_pool;
   _cb  = cb;
   _entry_announce = entry_announce;
   _read_timeout = read_timeout;
@@ -67,17 +67,21 @@ void CGatekeeper_door_original::set_opts(int id, string base_topic, CLogging *lo
   _door_bells.clear();
 
   // Get a list of all bells to be rung...
-  dbrows bells;
-  db->sp_gatekeeper_get_door_bells(_id, &bells);
+  CDBResult bells;
+  {
+    CNHDBPool::conn db(db_pool);
+    db->sp_gatekeeper_get_door_bells(_id, &bells);
+  }
 
   dbg("Door button will ring:");
-  for (dbrows::const_iterator iterator = bells.begin(), end = bells.end(); iterator != end; ++iterator) 
+  int col_topic   = bells.column("bell_topic");
+  int col_message = bells.column("bell_message");
+  for (unsigned int n=0; n < bells.size(); n++)
   {
     door_bell bell;
-    dbrow row = *iterator;
 
-    bell.mqtt_topic   = row["bell_topic"].asStr();
-    bell.mqtt_message = row["bell_message"].asStr();
+    bell.mqtt_topic   = bells[n].asStr(col_topic);
+    bell.mqtt_message = bells[n].asStr(col_message);
     _door_bells.push_back(bell);
 
     dbg("\t" + bell.mqtt_topic + "\t" + bell.mqtt_message);
@@ -97,9 +101,11 @@ void CGatekeeper_door_original::dbg(string msg)
 
 void CGatekeeper_door_original::process_door_event(string type, string payload)
 {
-  if ((_db == NULL) || (_cb == NULL))
+  if ((_db_pool == NULL) || (_cb == NULL))
     return;
 
+  CNHDBPool::conn db(_db_pool);
+
   time_t current_time;
   string unlock_text;
   string err;
@@ -107,7 +113,7 @@ void CGatekeeper_door_original::process_door_event(string type, string payload)
 
   if (type=="DoorState")
   {
-    _db->sp_set_door_state(_id, payload);
+    db->sp_set_door_state(_id, payload);
 
     if ((payload == "OPEN") && (_handle != ""))
     {
@@ -124,7 +130,7 @@ void CGatekeeper_door_original::process_door_event(string type, string payload)
       if (_new_zone_id != -1)
       {
         dbg("Updating current zone for member [" + CNHmqtt::itos(_member_id) + "] to be [" + CNHmqtt::itos(_new_zone_id) + "]");
-        _db->sp_gatekeeper_set_zone(_member_id, _new_zone_id);
+        db->sp_gatekeeper_set_zone(_member_id, _new_zone_id);
       }
 
       _handle = "";
@@ -155,7 +161,7 @@ void CGatekeeper_door_original::process_door_event(string type, string payload)
     _cb->cbiSendMessage(_base_topic + "/DoorButton", door_short_name);
 
     // Log an event recording this door button was pushed
-    _db->sp_log_event("DOORBELL", CNHmqtt::itos(_id));
+    db->sp_log_event("DOORBELL", CNHmqtt::itos(_id));
   }
 
   else if (type=="RFID")
@@ -167,10 +173,10 @@ void CGatekeeper_door_original::process_door_event(string type, string payload)
       string door_side = "A";
       string msg;
 
-      _db->sp_rfid_update(payload, CNHmqtt::hex2legacy_rfid(payload), msg);
+      db->sp_rfid_update(payload, CNHmqtt::hex2legacy_rfid(payload), msg);
       dbg(msg);
 
-      if(_db->sp_gatekeeper_check_rfid(payload, _id, door_side, unlock_text, _handle, _last_seen, access_result, _new_zone_id, _member_id, err))
+      if(db->sp_gatekeeper_check_rfid(payload, _id, door_side, unlock_text, _handle, _last_seen, access_result, _new_zone_id, _member_id, err))
       {
         dbg("Call to sp_gatekeeper_check_rfid failed");
         _cb->cbiSendMessage(unlock_topic, "Access Denied: Internal error");
@@ -202,7 +208,7 @@ void CGatekeeper_door_original::process_door_event(string type, string payload)
   else if (type=="Keypad")
   {
     string door_side = "A";
-    _db->sp_gatekeeper_check_pin(payload, _id, door_side, _member_id, _new_zone_id, unlock_text, _handle, err);
+    db->sp_gatekeeper_check_pin(payload, _id, door_side, _member_id, _new_zone_id, unlock_text, _handle, err);
     dbg("err = [" + err + "]");
     _cb->cbiSendMessage(unlock_topic, unlock_text);
   }
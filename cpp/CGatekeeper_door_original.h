@@ -4,7 +4,7 @@
 #include <list>
 
 #include "CLogging.h"
-#include "CNHDBAccess.h"
+#include "CNHDBPool.h"
 #include "nh-cbi.h"
 #include "CGatekeeper_door.h"
 
@@ -14,7 +14,7 @@ class CGatekeeper_door_original : public CGatekeeper_door
     CGatekeeper_door_original();
     ~CGatekeeper_door_original();
   //  std::string door_short_name;
-    void set_opts(int id, std::string base_topic, CLogging *log, CNHDBAccess *db, InstCBI *cb, std::string entry_announce, int read_timeout, std::string door_state, std::string exit_message);
+    void set_opts(int id, std::string base_topic, CLogging *log, CNHDBPool *db_pool, InstCBI *cb, std::string entry_announce, int read_timeout, std::string door_state, std::string exit_message);
     void process_door_event(std::string type, std::string payload);
 
   private:
@@ -38,7 +38,7 @@ class CGatekeeper_door_original : public CGatekeeper_door
     int _member_id;
 
     CLogging *_log;
-    CNHDBAccess *_db;
+    CNHDBPool *_db_pool;
     InstCBI *_cb;
 };
 
@@ -0,0 +1,407 @@
+#include "CLogCompressor.h"
+#include "CLogging.h"
+#include <zlib.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+// No glibc wrapper for ioprio_set
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_CLASS_SHIFT  13
+
+#define COMPRESS_CHUNK 65536
+
+using namespace std;
+
+static uint64_t clock_us(clockid_t clock)
+{
+  struct timespec ts;
+
+  clock_gettime(clock, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+CLogCompressor::CLogCompressor(CLogging *log)
+{
+  _log = log;
+  _level = 0;
+  _keep_days = 0;
+  _compressed = 0;
+  _running = false;
+  _exit = false;
+  pthread_mutex_init(&_mutex, NULL);
+  pthread_cond_init(&_cond, NULL);
+}
+
+CLogCompressor::~CLogCompressor()
+{
+  stop();
+  pthread_mutex_destroy(&_mutex);
+  pthread_cond_destroy(&_cond);
+}
+
+int CLogCompressor::start(string pattern, int level, unsigned int keep_days)
+{
+  if (_running)
+    return 0;
+
+  if ((level < 0) || (level > 9) || ((level == 0) && (keep_days == 0)))
+    return -1;
+
+  _glob = pattern_glob(pattern);
+  _level = level;
+  _keep_days = keep_days;
+  _exit = false;
+
+  if (pthread_create(&_thread, NULL, CLogCompressor::s_thread, this))
+    return -1;
+
+  _running = true;
+  return 0;
+}
+
+void CLogCompressor::stop()
+/* Anything not compressed yet is picked up by find_uncompressed() next time */
+{
+  if (!_running)
+    return;
+
+  pthread_mutex_lock(&_mutex);
+  _exit = true;
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_mutex);
+
+  pthread_join(_thread, NULL);
+  _running = false;
+  _queue.clear();
+}
+
+void CLogCompressor::add(string filename)
+{
+  pthread_mutex_lock(&_mutex);
+  if (_running)
+  {
+    _queue.push_back(filename);
+    pthread_cond_signal(&_cond);
+  }
+  pthread_mutex_unlock(&_mutex);
+}
+
+uint64_t CLogCompressor::compressed()
+{
+  uint64_t count;
+
+  pthread_mutex_lock(&_mutex);
+  count = _compressed;
+  pthread_mutex_unlock(&_mutex);
+
+  return count;
+}
+
+bool CLogCompressor::exiting()
+{
+  bool ret;
+
+  pthread_mutex_lock(&_mutex);
+  ret = _exit;
+  pthread_mutex_unlock(&_mutex);
+
+  return ret;
+}
+
+void *CLogCompressor::s_thread(void *arg)
+{
+  ((CLogCompressor*)arg)->thread();
+  return NULL;
+}
+
+void CLogCompressor::thread()
+{
+  pid_t tid = syscall(SYS_gettid);
+
+  // Only use CPU & disk time nothing else wants. On Linux, nice applies per thread.
+  setpriority(PRIO_PROCESS, tid, 19);
+  syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+
+  if (_level > 0)
+    find_uncompressed();
+  expire();
+
+  pthread_mutex_lock(&_mutex);
+  while (!_exit)
+  {
+    if (_queue.empty())
+    {
+      pthread_cond_wait(&_cond, &_mutex);
+      continue;
+    }
+
+    string filename = _queue.front();
+    _queue.pop_front();
+    pthread_mutex_unlock(&_mutex);
+
+    if (_level > 0)
+      compress(filename);
+    expire();
+
+    pthread_mutex_lock(&_mutex);
+  }
+  pthread_mutex_unlock(&_mutex);
+}
+
+void CLogCompressor::find_uncompressed()
+/* Queue any logfiles left uncompressed, e.g. if the process wasn't running when the name changed */
+{
+  vector<string> files;
+
+  glob_files(_glob, files);
+
+  pthread_mutex_lock(&_mutex);
+  for (unsigned int n=0; n < files.size(); n++)
+  {
+    const string &name = files[n];
+
+    if ((name.length() > 3) && (name.compare(name.length()-3, 3, ".gz") == 0))
+      continue;
+    if ((name.length() > 7) && (name.compare(name.length()-7, 7, ".gz.tmp") == 0))
+      continue;
+    _queue.push_back(name); // (the one in use is skipped by compress(), as it's locked)
+  }
+  pthread_mutex_unlock(&_mutex);
+}
+
+int CLogCompressor::compress(const string &filename)
+/* Compress filename to filename.gz, then delete it. If filename.gz already exists (e.g. a "%b%d"
+ * name a year on), this is added to it as another gzip member, which zcat etc. read as one. */
+{
+  string gz_file = filename + ".gz";
+  string tmp_file = gz_file + ".tmp";
+  uint64_t start = clock_us(CLOCK_MONOTONIC);
+  uint64_t start_cpu = clock_us(CLOCK_THREAD_CPUTIME_ID);
+  uint64_t bytes_in = 0;
+  struct stat st;
+  char mode[8];
+  char buf[COMPRESS_CHUNK];
+  ssize_t len;
+  bool failed = false;
+
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  // Locked if it's still being written - by us, or another process using the same pattern
+  if (flock(fd, LOCK_EX | LOCK_NB))
+  {
+    close(fd);
+    return -1;
+  }
+
+  int out = open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (out < 0)
+  {
+    _log->dbg("LOG", "Failed to create [" + tmp_file + "]: " + strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  // gzclose() closes the fd it's given, and out is still needed for the fdatasync
+  snprintf(mode, sizeof(mode), "wb%d", _level);
+  gzFile gz = gzdopen(dup(out), mode);
+  if (gz == NULL)
+  {
+    close(out);
+    close(fd);
+    unlink(tmp_file.c_str());
+    return -1;
+  }
+  gzbuffer(gz, COMPRESS_CHUNK);
+
+  while ((len = read(fd, buf, sizeof(buf))) > 0)
+  {
+    if (gzwrite(gz, buf, len) != len)
+    {
+      failed = true;
+      break;
+    }
+
+    // Don't push things that are still needed out of the page cache
+    posix_fadvise(fd, bytes_in, len, POSIX_FADV_DONTNEED);
+    bytes_in += len;
+
+    if (exiting())
+    {
+      gzclose(gz);
+      close(out);
+      close(fd);
+      unlink(tmp_file.c_str());
+      return -1;
+    }
+  }
+
+  if ((gzclose(gz) != Z_OK) || (len < 0) || fdatasync(out) || fstat(out, &st))
+    failed = true;
+  close(out);
+
+  if (failed)
+  {
+    _log->dbg("LOG", "Failed to compress [" + filename + "]");
+    unlink(tmp_file.c_str());
+    close(fd);
+    return -1;
+  }
+
+  if (access(gz_file.c_str(), F_OK) == 0)
+  {
+    if (append_file(tmp_file, gz_file))
+    {
+      _log->dbg("LOG", "Failed to add to [" + gz_file + "]");
+      unlink(tmp_file.c_str());
+      close(fd);
+      return -1;
+    }
+    unlink(tmp_file.c_str());
+  }
+  else if (rename(tmp_file.c_str(), gz_file.c_str()))
+  {
+    _log->dbg("LOG", "Failed to rename [" + tmp_file + "]: " + strerror(errno));
+    unlink(tmp_file.c_str());
+    close(fd);
+    return -1;
+  }
+
+  unlink(filename.c_str());
+  close(fd);
+
+  uint64_t elapsed = clock_us(CLOCK_MONOTONIC) - start;
+  uint64_t cpu = clock_us(CLOCK_THREAD_CPUTIME_ID) - start_cpu;
+  uint64_t bytes_out = st.st_size;
+  char msg[128];
+
+  pthread_mutex_lock(&_mutex);
+  _compressed++;
+  pthread_mutex_unlock(&_mutex);
+
+  snprintf(msg, sizeof(msg), "] %llu -> %llu bytes (%.1f:1) in %.2fs (%.2fs CPU)",
+           (unsigned long long)bytes_in, (unsigned long long)bytes_out,
+           (bytes_out > 0) ? ((double)bytes_in / bytes_out) : 0.0, elapsed / 1000000.0, cpu / 1000000.0);
+  _log->dbg("LOG", "Compressed [" + filename + msg);
+
+  return 0;
+}
+
+int CLogCompressor::append_file(const string &from, const string &to)
+{
+  char buf[COMPRESS_CHUNK];
+  ssize_t len;
+  int ret = 0;
+
+  int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0)
+    return -1;
+
+  int out = open(to.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+  if (out < 0)
+  {
+    close(in);
+    return -1;
+  }
+
+  while ((len = read(in, buf, sizeof(buf))) > 0)
+    if (write(out, buf, len) != len)
+    {
+      ret = -1;
+      break;
+    }
+
+  if ((len < 0) || fdatasync(out))
+    ret = -1;
+
+  close(in);
+  close(out);
+  return ret;
+}
+
+void CLogCompressor::expire()
+/* Delete logfiles (compressed or not) last written more than _keep_days ago */
+{
+  vector<string> files;
+  time_t cutoff = time(NULL) - ((time_t)_keep_days * 86400);
+  struct stat st;
+
+  if (_keep_days == 0)
+    return;
+
+  glob_files(_glob, files);
+  glob_files(_glob + ".gz", files);
+
+  for (unsigned int n=0; n < files.size(); n++)
+  {
+    if (stat(files[n].c_str(), &st) || !S_ISREG(st.st_mode) || (st.st_mtime >= cutoff))
+      continue;
+
+    int fd = open(files[n].c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      continue;
+
+    // Never delete one that's in use
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+    {
+      if (unlink(files[n].c_str()) == 0)
+        _log->dbg("LOG", "Deleted old logfile [" + files[n] + "]");
+    }
+    close(fd);
+  }
+}
+
+void CLogCompressor::glob_files(const string &pattern, vector<string> &files)
+{
+  glob_t gl;
+
+  if (glob(pattern.c_str(), 0, NULL, &gl) == 0)
+    for (size_t n=0; n < gl.gl_pathc; n++)
+      files.push_back(gl.gl_pathv[n]);
+  globfree(&gl);
+}
+
+string CLogCompressor::pattern_glob(const string &pattern)
+/* e.g. "/var/log/nh-irc.%b%d.log" -> "/var/log/nh-irc.**.log" */
+{
+  string ret;
+
+  for (size_t n=0; n < pattern.length(); n++)
+  {
+    char c = pattern[n];
+
+    if ((c == '%') && (n+1 < pattern.length()))
+    {
+      n++;
+      if (pattern[n] == '%')
+      {
+        ret += '%';
+        continue;
+      }
+
+      // Skip any flags/width/modifier (e.g. "%-d", "%Ey") to the conversion itself
+      while ((n+1 < pattern.length()) && strchr("_-0^#EO123456789", pattern[n]))
+        n++;
+      ret += '*';
+    }
+    else
+    {
+      if (strchr("*?[\\", c))
+        ret += '\\';
+      ret += c;
+    }
+  }
+
+  return ret;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <string>
+#include <deque>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+
+class CLogging;
+
+/* Compresses (gzip) logfiles once CLogging has switched away from them, and deletes ones older than
+ * the retention period, on a background thread running at idle CPU and IO priority. Files still
+ * locked by a running process are left alone, so a pattern can't catch another daemon's live log. */
+class CLogCompressor
+{
+  public:
+    CLogCompressor(CLogging *log);
+    ~CLogCompressor();
+
+    // level 1-9, or 0 to only delete old files. keep_days 0 keeps them forever. Any files left
+    // uncompressed from before (e.g. the daemon wasn't running at midnight) are done first.
+    int start(std::string pattern, int level, unsigned int keep_days);
+    void stop();
+    void add(std::string filename); // a logfile that has just been closed
+
+    uint64_t compressed();          // files done since start()
+
+  private:
+    CLogging *_log;
+    std::string _glob;              // logfile pattern with each strftime conversion as a '*'
+    int _level;
+    unsigned int _keep_days;
+    uint64_t _compressed;
+
+    std::deque<std::string> _queue;
+    pthread_t _thread;
+    bool _running;
+    bool _exit;
+    pthread_mutex_t _mutex;
+    pthread_cond_t _cond;
+
+    static void *s_thread(void *arg);
+    void thread();
+    bool exiting();
+    void find_uncompressed();
+    int compress(const std::string &filename);
+    int append_file(const std::string &from, const std::string &to);
+    void expire();
+    static void glob_files(const std::string &pattern, std::vector<std::string> &files);
+    static std::string pattern_glob(const std::string &pattern);
+};
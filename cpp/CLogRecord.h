@@ -0,0 +1,186 @@
+#pragma once
+#include <string>
+#include <stdint.h>
+#include <string.h>
+
+// Layout of binary logfiles (log_format = binary), shared by CLogging and nh-logcat.
+//
+// A file is a sequence of records: a type byte, then a varint giving the length of the rest. Each
+// time the file is opened a LOG_REC_SESSION record is written, after which format strings and area
+// names are referred to by id: the first time an id is used in a session, a LOG_REC_DEFINE record
+// giving its text comes before it. A LOG_REC_LINE record is followed by nargs packed arguments for
+// its format string. Integers are varints (7 bits per byte, least significant first).
+//
+//   LOG_REC_SESSION  varint time_us, text: LOG_RECORD_MAGIC " <pid>"
+//   LOG_REC_DEFINE   varint id, text
+//   LOG_REC_LINE     level byte, varint area id (0 = none), varint format id, varint time_us,
+//                    varint nargs, args
+
+#define LOG_RECORD_MAGIC "NHLOG1"
+
+enum log_record_type
+{
+  LOG_REC_SESSION = 'S',
+  LOG_REC_DEFINE  = 'D',
+  LOG_REC_LINE    = 'L'
+};
+
+#define LOG_LEVEL_NONE 0xff // plain dbg() calls
+
+// Packed argument tags
+#define LOG_ARG_INT    'i' // zigzag varint
+#define LOG_ARG_UINT   'u' // varint
+#define LOG_ARG_DOUBLE 'f' // 8 bytes
+#define LOG_ARG_STRING 's' // varint length, then the bytes
+
+#define LOG_FORMAT_STRING_ID 1 // "%s", always id 1 - used for plain (pre-formatted) messages
+
+#define LOG_RECORD_MAX_HEADER 48 // enough for the type, length and all the LOG_REC_LINE fields
+
+// A record's header, decoded
+struct log_record
+{
+  uint8_t type;
+  uint8_t level;
+  uint32_t area;      // LOG_REC_LINE
+  uint32_t id;        // format id for LOG_REC_LINE, or the id being defined
+  uint64_t time_us;   // since the epoch
+  uint32_t nargs;
+  size_t header_len;  // bytes before the args/text
+  size_t length;      // of the whole record
+};
+
+static inline void log_put_varint(std::string &out, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    out += (char)((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out += (char)value;
+}
+
+static inline bool log_get_varint(const char *&p, const char *end, uint64_t &value)
+{
+  value = 0;
+  for (int shift = 0; (p < end) && (shift < 64); shift += 7)
+  {
+    uint8_t b = *p++;
+    value |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return true;
+  }
+  return false;
+}
+
+static inline void log_put_record(std::string &out, uint8_t type, uint8_t level, uint32_t area, uint32_t id,
+                                  uint64_t time_us, uint32_t nargs, const char *body, size_t body_len)
+{
+  std::string hdr;
+
+  if (type == LOG_REC_LINE)
+  {
+    hdr += (char)level;
+    log_put_varint(hdr, area);
+  }
+  if (type != LOG_REC_SESSION)
+    log_put_varint(hdr, id);
+  if (type != LOG_REC_DEFINE)
+    log_put_varint(hdr, time_us);
+  if (type == LOG_REC_LINE)
+    log_put_varint(hdr, nargs);
+
+  out += (char)type;
+  log_put_varint(out, hdr.length() + body_len);
+  out += hdr;
+  out.append(body, body_len);
+}
+
+// Decode the header of the record at p (the args/text needn't be there yet). Returns 1 if the
+// header is all there (up to end), 0 if more is needed, or -1 if it's not a valid record.
+static inline int log_get_record(const char *p, const char *end, log_record &rec)
+{
+  const char *start = p;
+  uint64_t len, value;
+  bool truncated;
+
+  if (p >= end)
+    return 0;
+
+  rec.type = *p++;
+  rec.level = 0;
+  rec.area = 0;
+  rec.id = 0;
+  rec.time_us = 0;
+  rec.nargs = 0;
+  if ((rec.type != LOG_REC_SESSION) && (rec.type != LOG_REC_DEFINE) && (rec.type != LOG_REC_LINE))
+    return -1;
+
+  if (!log_get_varint(p, end, len))
+    return ((end - start) > 11) ? -1 : 0;
+  if (len > (16 * 1048576))
+    return -1;
+  rec.length = (p - start) + len;
+  truncated = ((size_t)(end - start) < rec.length);
+  if (!truncated)
+    end = start + rec.length;
+
+  if (rec.type == LOG_REC_LINE)
+  {
+    if (p >= end)
+      return truncated ? 0 : -1;
+    rec.level = *p++;
+    if (!log_get_varint(p, end, value))
+      return truncated ? 0 : -1;
+    rec.area = value;
+  }
+  if (rec.type != LOG_REC_SESSION)
+  {
+    if (!log_get_varint(p, end, value))
+      return truncated ? 0 : -1;
+    rec.id = value;
+  }
+  if ((rec.type != LOG_REC_DEFINE) && !log_get_varint(p, end, rec.time_us))
+    return truncated ? 0 : -1;
+  if (rec.type == LOG_REC_LINE)
+  {
+    if (!log_get_varint(p, end, value))
+      return truncated ? 0 : -1;
+    rec.nargs = value;
+  }
+
+  rec.header_len = p - start;
+  return 1;
+}
+
+// Parse the printf conversion starting at fmt (which points at a '%'). Returns the length of the
+// whole spec, with the conversion character in conv and the length modifier in length ("", "h",
+// "hh", "l", "ll", "z", "j", "t" or "L"), or 0 for anything that can't be packed (e.g. '*' widths).
+static inline size_t log_parse_spec(const char *fmt, char &conv, std::string &length)
+{
+  const char *p = fmt + 1;
+
+  while (*p && strchr("-+ #0'", *p))
+    p++;
+  while ((*p >= '0') && (*p <= '9'))
+    p++;
+  if (*p == '.')
+  {
+    p++;
+    while ((*p >= '0') && (*p <= '9'))
+      p++;
+  }
+  if (*p == '*')
+    return 0;
+
+  const char *len_start = p;
+  while (*p && strchr("hlzjtL", *p))
+    p++;
+  length.assign(len_start, p - len_start);
+
+  conv = *p;
+  if (!conv || !strchr("diuxXocsfFeEgGaAp%", conv))
+    return 0;
+
+  return (p - fmt) + 1;
+}
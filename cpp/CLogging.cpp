@@ -28,43 +28,161 @@
  */
 
 #include "CLogging.h"
+#include "CLogCompressor.h"
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <deque>
 using namespace std;
 
 // Logging.
 // Not using ofstream becasue it can't open files in exclusive mode!
 // (a crude way to stop the process from being running more than once).
 
+#define LOG_RING_MIN 4096
+
 CLogging::CLogging()
 {
   logfile = -1;
   pthread_mutex_init (&logfile_mutex, NULL);
+
+  _next_check.store(0);
+  _compressor = NULL;
+  _binary = false;
+  pthread_mutex_init(&_intern_mutex, NULL);
+  _strings.push_back("%s"); // LOG_FORMAT_STRING_ID
+  _level = LOG_LEVEL_DEBUG;
+  _max_level = LOG_LEVEL_DEBUG;
+
+  _async.store(false);
+  _block_when_full = false;
+  _ring_size = 0;
+  _flush_ms = 100;
+  _seq.store(0);
+  _dropped_reported = 0;
+  _ring_key_created = false;
+  _flush_thread_running = false;
+  _flush_exit = false;
+  _flush_requested = false;
+  pthread_mutex_init(&_rings_mutex, NULL);
+  pthread_mutex_init(&_flush_mutex, NULL);
+  pthread_cond_init(&_flush_cond, NULL);
 }
 
 CLogging::~CLogging()
 {
+  // First, as it logs
+  if (_compressor != NULL)
+  {
+    delete _compressor;
+    _compressor = NULL;
+  }
+
+  stop_async();
+
+  if (_ring_key_created)
+    pthread_key_delete(_ring_key);
+
+  for (unsigned int n=0; n < _rings.size(); n++)
+  {
+    free(_rings[n]->buf);
+    delete _rings[n];
+  }
+  _rings.clear();
+
   if (logfile > 0)
   {
     // Relase lock on file then close
     flock(logfile, LOCK_UN | LOCK_NB);
     close(logfile);
   }
+
+  pthread_mutex_destroy(&_intern_mutex);
+  pthread_mutex_destroy(&_rings_mutex);
+  pthread_mutex_destroy(&_flush_mutex);
+  pthread_cond_destroy(&_flush_cond);
 }
 
-string CLogging::curLogfile()
+string CLogging::curLogfile(time_t now)
 {
-  time_t rawtime;
-  struct tm * timeinfo;
+  struct tm timeinfo;
   char buf[100];
-  string log_msg;
   
-  time (&rawtime);
-  timeinfo = localtime (&rawtime);
+  localtime_r (&now, &timeinfo);
 
-  strftime (buf,sizeof(buf),patLogfile.c_str(),timeinfo);  
+  strftime (buf,sizeof(buf),patLogfile.c_str(),&timeinfo);  
   
   return (string)buf;
 }
 
+time_t CLogging::next_rotation(time_t now)
+/* Work out the next time the logfile name could change from the smallest unit in the pattern - 
+ * normally the next midnight, for the usual "%b%d" daily logs */
+{
+  struct tm timeinfo;
+  int unit = 0; // 0 = day, 1 = hour, 2 = minute/second
+
+  for (size_t pos = patLogfile.find('%'); (pos != string::npos) && (pos+1 < patLogfile.length()); pos = patLogfile.find('%', pos+2))
+  {
+    switch (patLogfile[pos+1])
+    {
+      case 'H': case 'I': case 'k': case 'l': case 'p': case 'P':
+        if (unit < 1)
+          unit = 1;
+        break;
+
+      case 'M': case 'S': case 's': case 'T': case 'R': case 'r': case 'c': case 'X': case 'E': case 'O':
+        unit = 2;
+        break;
+    }
+  }
+
+  if (unit == 2)
+    return now + 1;
+
+  localtime_r(&now, &timeinfo);
+  timeinfo.tm_sec = 0;
+  timeinfo.tm_min = 0;
+  if (unit == 1)
+    timeinfo.tm_hour++;
+  else
+  {
+    timeinfo.tm_hour = 0;
+    timeinfo.tm_mday++;
+  }
+  timeinfo.tm_isdst = -1; // mktime works out DST for the new time
+
+  time_t next = mktime(&timeinfo);
+  return (next > now) ? next : now + 1;
+}
+
+size_t CLogging::timestamp(time_t now, char *buf, size_t len)
+/* Format the line prefix, e.g. "Jun  2 18:47:14: ". Only done once a second per thread. */
+{
+  static __thread time_t prefix_time = -1;
+  static __thread char prefix[32];
+  static __thread size_t prefix_len = 0;
+
+  if (now != prefix_time)
+  {
+    struct tm timeinfo;
+
+    localtime_r(&now, &timeinfo);
+    prefix_len = strftime(prefix, sizeof(prefix), "%b %d %H:%M:%S: ", &timeinfo);
+    prefix_time = now;
+  }
+
+  if (prefix_len >= len)
+    return 0;
+
+  memcpy(buf, prefix, prefix_len + 1);
+  return prefix_len;
+}
+
 bool CLogging::open_logfile(string log_file)
 {
   string filename;
@@ -76,7 +194,9 @@ bool CLogging::open_logfile(string log_file)
   }
   
   patLogfile = log_file;
-  filename = curLogfile();
+  time_t now = time(NULL);
+  filename = curLogfile(now);
+  _next_check.store(next_rotation(now));
 
   logfile = open (filename.c_str(), O_WRONLY | O_APPEND );
   
@@ -98,38 +218,490 @@ bool CLogging::open_logfile(string log_file)
   }
   
   opnLogfile = filename;
+  if (_binary)
+    start_session();
   return true;
 }
 
+int CLogging::set_format(string format)
+{
+  if (format == "text")
+    _binary = false;
+  else if (format == "binary")
+    _binary = true;
+  else
+    return -1;
+
+  return 0;
+}
+
+void CLogging::set_level(log_level level)
+{
+  _level = level;
+  _max_level = level;
+  for (unsigned int n=0; n < _area_levels.size(); n++)
+    if (_area_levels[n].second > _max_level)
+      _max_level = _area_levels[n].second;
+}
+
+void CLogging::set_area_level(string area, log_level level)
+{
+  unsigned int n;
+
+  for (n=0; n < _area_levels.size(); n++)
+    if (_area_levels[n].first == area)
+      break;
+
+  if (n == _area_levels.size())
+    _area_levels.push_back(make_pair(area, level));
+  else
+    _area_levels[n].second = level;
+
+  set_level(_level);
+}
+
+int CLogging::parse_level(string name, log_level &level)
+{
+  if (name == "error")
+    level = LOG_LEVEL_ERROR;
+  else if (name == "warn")
+    level = LOG_LEVEL_WARN;
+  else if (name == "info")
+    level = LOG_LEVEL_INFO;
+  else if (name == "debug")
+    level = LOG_LEVEL_DEBUG;
+  else
+    return -1;
+
+  return 0;
+}
+
+int CLogging::set_levels(string levels)
+/* Comma separated list of levels; "<area>:<level>" sets the level for one area, a plain level sets
+ * the default for everything else. Returns -1 if any were invalid (the rest are still applied). */
+{
+  size_t start = 0;
+  int ret = 0;
+
+  while (start < levels.length())
+  {
+    size_t end = levels.find(',', start);
+    if (end == string::npos)
+      end = levels.length();
+
+    string item = levels.substr(start, end - start);
+    item.erase(0, item.find_first_not_of(" \t"));
+    item.erase(item.find_last_not_of(" \t") + 1);
+    start = end + 1;
+
+    if (item == "")
+      continue;
+
+    log_level level;
+    size_t colon = item.find(':');
+    if (parse_level(item.substr(colon == string::npos ? 0 : colon + 1), level))
+      ret = -1;
+    else if (colon == string::npos)
+      set_level(level);
+    else
+      set_area_level(item.substr(0, colon), level);
+  }
+
+  return ret;
+}
+
+bool CLogging::area_enabled(log_level level, const char *area)
+{
+  for (unsigned int n=0; n < _area_levels.size(); n++)
+    if (!strcmp(_area_levels[n].first.c_str(), area))
+      return (level <= _area_levels[n].second);
+
+  return (level <= _level);
+}
+
 void CLogging::dbg(string area, string msg)
 {
  
   //if (area != "DB")
-    dbg("[" + area + "] " + msg); 
+    log_line(LOG_LEVEL_NONE, &area, msg); 
 }
 
 void CLogging::dbg(string msg)
 {
-  time_t rawtime;
-  struct tm * timeinfo;
-  char buf[100];
-  string log_msg;
+  log_line(LOG_LEVEL_NONE, NULL, msg);
+}
+
+void CLogging::dbg(log_level level, string area, string msg)
+{
+  log_line(level, &area, msg);
+}
+
+static uint64_t now_us(time_t &now)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  now = tv.tv_sec;
+  return ((uint64_t)tv.tv_sec * 1000000) + tv.tv_usec;
+}
+
+static void pack_string(string &out, const char *str, size_t len)
+{
+  out += (char)LOG_ARG_STRING;
+  log_put_varint(out, len);
+  out.append(str, len);
+}
+
+void CLogging::dbgf(log_level level, const char *area, const char *format, ...)
+{
+  va_list ap;
+  string area_str = (area != NULL) ? area : "";
+  char buf[512];
+  int len;
+
+  // Binary logs just get the arguments, unless the format has something that can't be packed
+  if (_binary && (logfile > 0))
+  {
+    string args;
+    time_t now;
+
+    va_start(ap, format);
+    int nargs = pack_args(args, format, ap);
+    va_end(ap);
+
+    if (nargs >= 0)
+    {
+      uint64_t time_us = now_us(now);
+      emit(bin_record(level, (area != NULL) ? &area_str : NULL, intern_format(format), nargs, args, time_us), now);
+      return;
+    }
+  }
+
+  va_start(ap, format);
+  len = vsnprintf(buf, sizeof(buf), format, ap);
+  va_end(ap);
+  if (len < 0)
+    return;
+
+  if ((size_t)len < sizeof(buf))
+  {
+    log_line(level, (area != NULL) ? &area_str : NULL, string(buf, len));
+    return;
+  }
+
+  string msg(len + 1, '\0');
+  va_start(ap, format);
+  vsnprintf(&msg[0], len + 1, format, ap);
+  va_end(ap);
+  msg.resize(len);
+  log_line(level, (area != NULL) ? &area_str : NULL, msg);
+}
+
+void CLogging::log_line(int level, const string *area, const string &msg)
+{
+  time_t now;
+  char buf[32];
+  size_t len;
+  string line;
+
+  if (_binary && (logfile > 0))
+  {
+    string args;
+    uint64_t time_us = now_us(now);
+
+    pack_string(args, msg.data(), msg.length());
+    emit(bin_record(level, area, LOG_FORMAT_STRING_ID, 1, args, time_us), now);
+    return;
+  }
+
+  now = time(NULL);
+
+  // format date, e.g. Jun  2 18:47:14 
+  len = timestamp(now, buf, sizeof(buf));
+
+  line.reserve(len + msg.length() + ((area != NULL) ? area->length() + 3 : 0) + 1);
+  line.append(buf, len);
+  if (area != NULL)
+  {
+    line += '[';
+    line += *area;
+    line += "] ";
+  }
+  line += msg;
+
+  // Write to log file if open, otherwise output to stdout
+  if (logfile > 0)
+  {
+    line += '\n';
+    emit(line, now);
+  }
+  else
+    cout << line << endl;
+}
+
+void CLogging::emit(const string &record, time_t now)
+/* Write a formatted line/record, or queue it to be written if in async mode */
+{
+  if (_async.load(memory_order_acquire))
+  {
+    log_ring *ring = thread_ring();
+    if (ring != NULL)
+    {
+      push(ring, record);
+      return;
+    }
+  }
   
+  // See if we should be changing logfiles (e.g. date change since last write)
+  check_logfile(now);
+  
+  write_line(record);
+}
+
+string CLogging::internal_line(const string &msg)
+/* A line about the logging itself, in the current format */
+{
+  time_t now;
+  uint64_t time_us = now_us(now);
+
+  if (_binary)
+  {
+    string args;
+
+    pack_string(args, msg.data(), msg.length());
+    return bin_record(LOG_LEVEL_NONE, NULL, LOG_FORMAT_STRING_ID, 1, args, time_us);
+  }
+
+  char buf[32];
+  timestamp(now, buf, sizeof(buf));
+  return buf + msg + "\n";
+}
+
+uint32_t CLogging::intern(const string &text)
+/* Call with _intern_mutex held */
+{
+  _strings.push_back(text);
+  return _strings.size();
+}
+
+uint32_t CLogging::intern_format(const char *format)
+{
+  uint32_t id;
+
+  pthread_mutex_lock(&_intern_mutex);
+  map<const char*, uint32_t>::iterator i = _format_ids.find(format);
+  if (i != _format_ids.end())
+    id = i->second;
+  else
+    id = _format_ids[format] = intern(format);
+  pthread_mutex_unlock(&_intern_mutex);
+
+  return id;
+}
+
+uint32_t CLogging::intern_area(const string &area)
+{
+  uint32_t id;
+
+  pthread_mutex_lock(&_intern_mutex);
+  map<string, uint32_t>::iterator i = _area_ids.find(area);
+  if (i != _area_ids.end())
+    id = i->second;
+  else
+    id = _area_ids[area] = intern(area);
+  pthread_mutex_unlock(&_intern_mutex);
+
+  return id;
+}
+
+string CLogging::bin_record(int level, const string *area, uint32_t format, int nargs, const string &args, uint64_t time_us)
+{
+  string record;
+
+  record.reserve(LOG_RECORD_MAX_HEADER + args.length());
+  log_put_record(record, LOG_REC_LINE, level, (area != NULL) ? intern_area(*area) : 0, format, time_us, nargs, args.data(), args.length());
+  return record;
+}
+
+int CLogging::pack_args(string &out, const char *format, va_list ap)
+/* Pack the arguments for format, as they'll be needed to format it later. Returns the number of
+ * arguments, or -1 if format has anything not supported (so should be logged as text). */
+{
+  int nargs = 0;
+
+  for (const char *p = format; *p; p++)
+  {
+    char conv;
+    string length;
+    size_t spec_len;
+    long long sval;
+    unsigned long long uval;
+
+    if (*p != '%')
+      continue;
+
+    spec_len = log_parse_spec(p, conv, length);
+    if (spec_len == 0)
+      return -1;
+    p += spec_len - 1;
+
+    switch (conv)
+    {
+      case '%':
+        continue;
+
+      case 'd':
+      case 'i':
+      case 'c':
+        if ((length == "l") && (conv != 'c'))
+          sval = va_arg(ap, long);
+        else if ((length == "ll") || (length == "j"))
+          sval = va_arg(ap, long long);
+        else if ((length == "z") || (length == "t"))
+          sval = va_arg(ap, ssize_t);
+        else if (length == "h")
+          sval = (short)va_arg(ap, int);
+        else if (length == "hh")
+          sval = (signed char)va_arg(ap, int);
+        else
+          sval = va_arg(ap, int);
+        out += (char)LOG_ARG_INT;
+        log_put_varint(out, ((uint64_t)sval << 1) ^ (uint64_t)(sval >> 63));
+        break;
+
+      case 'u':
+      case 'x':
+      case 'X':
+      case 'o':
+      case 'p':
+        if (conv == 'p')
+          uval = (uintptr_t)va_arg(ap, void*);
+        else if (length == "l")
+          uval = va_arg(ap, unsigned long);
+        else if ((length == "ll") || (length == "j"))
+          uval = va_arg(ap, unsigned long long);
+        else if ((length == "z") || (length == "t"))
+          uval = va_arg(ap, size_t);
+        else if (length == "h")
+          uval = (unsigned short)va_arg(ap, unsigned int);
+        else if (length == "hh")
+          uval = (unsigned char)va_arg(ap, unsigned int);
+        else
+          uval = va_arg(ap, unsigned int);
+        out += (char)LOG_ARG_UINT;
+        log_put_varint(out, uval);
+        break;
+
+      case 's':
+      {
+        if (length != "")
+          return -1; // wide strings
+        const char *str = va_arg(ap, const char*);
+        if (str == NULL)
+          str = "(null)";
+        pack_string(out, str, strlen(str));
+        break;
+      }
+
+      default: // floating point
+      {
+        if (length == "L")
+          return -1;
+        double d = va_arg(ap, double);
+        out += (char)LOG_ARG_DOUBLE;
+        out.append((const char*)&d, sizeof(d));
+        break;
+      }
+    }
+
+    if (++nargs > 0xffff)
+      return -1;
+  }
+
+  return nargs;
+}
+
+void CLogging::start_session()
+/* Start of a binary logfile, or of appending to one - ids need defining again after this */
+{
+  char text[32];
+  string record;
+  time_t now;
+
+  snprintf(text, sizeof(text), LOG_RECORD_MAGIC " %d", (int)getpid());
+  log_put_record(record, LOG_REC_SESSION, 0, 0, 0, now_us(now), 0, text, strlen(text));
+  write(logfile, record.data(), record.length());
+
+  _defined.clear();
+}
+
+void CLogging::definitions(const char *record, size_t len, string &out)
+/* Add define records for any ids the record uses that haven't been written to this file yet. Only 
+ * the header's needed. Call with logfile_mutex held. */
+{
+  log_record rec;
+
+  if ((log_get_record(record, record + len, rec) != 1) || (rec.type != LOG_REC_LINE))
+    return;
+
+  uint32_t ids[2] = { rec.area, rec.id };
+
+  for (int n=0; n < 2; n++)
+  {
+    uint32_t id = ids[n];
+
+    if ((id == 0) || ((id < _defined.size()) && _defined[id]))
+      continue;
+
+    pthread_mutex_lock(&_intern_mutex);
+    string text = (id <= _strings.size()) ? _strings[id-1] : "";
+    pthread_mutex_unlock(&_intern_mutex);
+
+    log_put_record(out, LOG_REC_DEFINE, 0, 0, id, 0, 0, text.data(), text.length());
+
+    if (id >= _defined.size())
+      _defined.resize(id + 1, false);
+    _defined[id] = true;
+  }
+}
+
+void CLogging::write_locked(const string &record)
+/* Call with logfile_mutex held */
+{
+  if (_binary)
+  {
+    string defs;
+
+    definitions(record.data(), record.length(), defs);
+    if (!defs.empty())
+      write(logfile, defs.data(), defs.length());
+  }
+
+  write(logfile, record.data(), record.length());
+}
+
+void CLogging::check_logfile(time_t now)
+/* Switch to a new logfile if the name has changed since it was opened (e.g. date change). Mostly
+ * just a comparison with the precomputed time the name could next change. */
+{
   int fdnewLogfile;
   string strnewLogfile;
-  
-  time ( &rawtime );
-  timeinfo = localtime ( &rawtime );  
-  
-  // See if we should be changing logfiles (e.g. date change since last write)
-  strnewLogfile = curLogfile();
+
+  if (now < _next_check.load(memory_order_relaxed))
+    return;
+
   pthread_mutex_lock(&logfile_mutex);
-  if ((opnLogfile != strnewLogfile) && (logfile > 0))
+  if ((now < _next_check.load(memory_order_relaxed)) || (logfile <= 0))
   {
-    strftime (buf,sizeof(buf),"%b %d %H:%M:%S: ",timeinfo);
-    log_msg = buf + (string)"Attempting to switch logfile to [" + curLogfile() + "]\n";
-    
-    write(logfile, log_msg.c_str(), log_msg.length() );
+    pthread_mutex_unlock(&logfile_mutex);
+    return;
+  }
+
+  strnewLogfile = curLogfile(now);
+  _next_check.store(next_rotation(now), memory_order_relaxed);
+  if (opnLogfile != strnewLogfile)
+  {
+    write_locked(internal_line("Attempting to switch logfile to [" + strnewLogfile + "]"));
     
     // Open new logfile
     fdnewLogfile = open (strnewLogfile.c_str(), O_WRONLY | O_APPEND );
@@ -137,35 +709,428 @@ void CLogging::dbg(string msg)
     if (fdnewLogfile==-1) // maybe the file doesn't exist yet. try creating it.
       fdnewLogfile = open (strnewLogfile.c_str(), O_WRONLY | O_CREAT, S_IREAD | S_IWRITE | S_IRGRP |S_IROTH);    
     
-    if (fdnewLogfile > 0)
+    // Try again in a minute if the switch failed
+    if (fdnewLogfile <= 0)
+      _next_check.store(now + 60, memory_order_relaxed);
+    else
     { 
       if (flock(fdnewLogfile, LOCK_EX | LOCK_NB))
       {
         close(fdnewLogfile);
+        _next_check.store(now + 60, memory_order_relaxed);
       } else
       {
         // new logfile open & locked - so close old log file 
         flock(logfile, LOCK_UN | LOCK_NB);
         close(logfile);
+        if (_compressor != NULL)
+          _compressor->add(opnLogfile);
         logfile = fdnewLogfile;
         opnLogfile = strnewLogfile;
-        
+        if (_binary)
+          start_session();
       }
     }    
   }
   pthread_mutex_unlock(&logfile_mutex); 
+}
 
-  // format date, e.g. Jun  2 18:47:14 
-  strftime (buf,sizeof(buf),"%b %d %H:%M:%S: ",timeinfo);
-  
-  // Write to log file if open, otherwise output to stdout
-  if (logfile > 0)
+void CLogging::write_line(const string &line)
+{
+  pthread_mutex_lock(&logfile_mutex);
+  write_locked(line);
+  pthread_mutex_unlock(&logfile_mutex);
+}
+
+int CLogging::start_async(unsigned int buffer_size, bool block_when_full, unsigned int flush_ms)
+{
+  if (_async.load())
+    return 0;
+
+  if (logfile <= 0)
+    return -1;
+
+  // Each thread's ring is a power of 2 in size, so positions can just be masked
+  _ring_size = LOG_RING_MIN;
+  while (_ring_size < buffer_size)
+    _ring_size <<= 1;
+  _block_when_full = block_when_full;
+  _flush_ms = (flush_ms > 0) ? flush_ms : 100;
+
+  if (!_ring_key_created)
   {
-    log_msg = buf + msg + "\n";
-    pthread_mutex_lock(&logfile_mutex);
-    write(logfile, log_msg.c_str(), log_msg.length() );
-    pthread_mutex_unlock(&logfile_mutex);
+    if (pthread_key_create(&_ring_key, CLogging::s_ring_release))
+      return -1;
+    _ring_key_created = true;
   }
-  else
-    cout << buf << msg << endl;
-}
\ No newline at end of file
+
+  _flush_exit = false;
+  if (pthread_create(&_flush_thread, NULL, CLogging::s_flush_thread, this))
+    return -1;
+  _flush_thread_running = true;
+
+  _async.store(true, memory_order_release);
+  return 0;
+}
+
+void CLogging::stop_async()
+/* Write out everything buffered, then go back to writing from the caller's thread */
+{
+  if (!_flush_thread_running)
+    return;
+
+  _async.store(false);
+
+  pthread_mutex_lock(&_flush_mutex);
+  _flush_exit = true;
+  pthread_cond_signal(&_flush_cond);
+  pthread_mutex_unlock(&_flush_mutex);
+
+  pthread_join(_flush_thread, NULL);
+  _flush_thread_running = false;
+
+  // Anything pushed while the flusher was exiting
+  while (flush())
+    ;
+}
+
+uint64_t CLogging::dropped()
+{
+  uint64_t total = 0;
+
+  pthread_mutex_lock(&_rings_mutex);
+  for (unsigned int n=0; n < _rings.size(); n++)
+    total += _rings[n]->dropped.load(memory_order_relaxed);
+  pthread_mutex_unlock(&_rings_mutex);
+
+  return total;
+}
+
+int CLogging::start_compression(int level, unsigned int keep_days)
+{
+  if (_compressor != NULL)
+    return 0;
+
+  if (logfile <= 0)
+    return -1;
+
+  CLogCompressor *compressor = new CLogCompressor(this);
+  if (compressor->start(patLogfile, level, keep_days))
+  {
+    delete compressor;
+    return -1;
+  }
+
+  // check_logfile() reads it with the mutex held
+  pthread_mutex_lock(&logfile_mutex);
+  _compressor = compressor;
+  pthread_mutex_unlock(&logfile_mutex);
+  return 0;
+}
+
+uint64_t CLogging::compressed()
+{
+  return (_compressor != NULL) ? _compressor->compressed() : 0;
+}
+
+CLogging::log_ring *CLogging::thread_ring()
+/* Get the calling thread's ring, reusing one left by a thread that has exited if possible */
+{
+  log_ring *ring = (log_ring*)pthread_getspecific(_ring_key);
+
+  if (ring != NULL)
+    return ring;
+
+  pthread_mutex_lock(&_rings_mutex);
+  for (unsigned int n=0; n < _rings.size(); n++)
+    if (!_rings[n]->in_use.load())
+    {
+      ring = _rings[n];
+      break;
+    }
+
+  if (ring == NULL)
+  {
+    char *buf = (char*)malloc(_ring_size);
+    if (buf != NULL)
+    {
+      ring = new log_ring;
+      ring->buf = buf;
+      ring->size = _ring_size;
+      ring->head.store(0);
+      ring->tail.store(0);
+      ring->dropped.store(0);
+      _rings.push_back(ring);
+    }
+  }
+
+  if (ring != NULL)
+  {
+    ring->in_use.store(true);
+    pthread_setspecific(_ring_key, ring);
+  }
+  pthread_mutex_unlock(&_rings_mutex);
+
+  return ring;
+}
+
+void CLogging::s_ring_release(void *arg)
+/* Thread exit - anything left in the ring still gets written by the flusher */
+{
+  ((log_ring*)arg)->in_use.store(false);
+}
+
+void CLogging::push(log_ring *ring, const string &line)
+{
+  static const string truncated_marker = " [truncated]\n";
+  uint64_t mask = ring->size - 1;
+  const string *text = &line;
+  string truncated;
+  uint32_t text_len = line.length();
+  uint64_t head = ring->head.load(memory_order_relaxed);
+  uint64_t tail = ring->tail.load(memory_order_acquire);
+
+  // Records are a multiple of the header size, so the header is never split by the end of the ring.
+  // Text lines that won't fit in half the ring are truncated (still ending in a newline, so the next
+  // line isn't joined on to it); binary records can't be.
+  if (text_len > (ring->size / 2) - sizeof(ring_record))
+  {
+    if (_binary)
+    {
+      ring->dropped.fetch_add(1, memory_order_relaxed);
+      return;
+    }
+    text_len = (ring->size / 2) - sizeof(ring_record);
+    truncated.reserve(text_len);
+    truncated.append(line, 0, text_len - truncated_marker.length());
+    truncated += truncated_marker;
+    text = &truncated;
+  }
+  uint32_t length = (sizeof(ring_record) + text_len + sizeof(ring_record) - 1) & ~(sizeof(ring_record) - 1);
+
+  while ((ring->size - (head - tail)) < length)
+  {
+    if (!_block_when_full || !_async.load())
+    {
+      ring->dropped.fetch_add(1, memory_order_relaxed);
+      return;
+    }
+
+    wake_flusher();
+    usleep(1000);
+    tail = ring->tail.load(memory_order_acquire);
+  }
+
+  ring_record *rec = (ring_record*)(ring->buf + (head & mask));
+  rec->length = length;
+  rec->text_len = text_len;
+  rec->seq = _seq.fetch_add(1, memory_order_relaxed);
+
+  uint64_t offset = (head + sizeof(ring_record)) & mask;
+  uint64_t first = min((uint64_t)text_len, ring->size - offset);
+  memcpy(ring->buf + offset, text->data(), first);
+  if (first < text_len)
+    memcpy(ring->buf, text->data() + first, text_len - first);
+
+  ring->head.store(head + length, memory_order_release);
+
+  // Don't wait for the next flush interval if it's filling up
+  if ((head + length - tail) > (ring->size / 2))
+    wake_flusher();
+}
+
+void CLogging::wake_flusher()
+{
+  pthread_mutex_lock(&_flush_mutex);
+  _flush_requested = true;
+  pthread_cond_signal(&_flush_cond);
+  pthread_mutex_unlock(&_flush_mutex);
+}
+
+struct flush_record
+{
+  uint64_t seq;
+  struct iovec text[2];
+  int parts;
+  char hdr[LOG_RECORD_MAX_HEADER]; // start of the record, for the binary format
+  size_t hdr_len;
+};
+
+static bool flush_record_order(const flush_record &a, const flush_record &b)
+{
+  return a.seq < b.seq;
+}
+
+static void write_iov(int fd, struct iovec *iov, int count)
+/* writev(), carrying on after a partial write */
+{
+  while (count > 0)
+  {
+    ssize_t written = writev(fd, iov, count);
+
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+
+    while ((count > 0) && ((size_t)written >= iov->iov_len))
+    {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+
+    if (count > 0)
+    {
+      iov->iov_base = (char*)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+}
+
+bool CLogging::flush()
+/* Write out everything currently in the rings in one go, in the order the lines were logged.
+ * Returns true if anything was written. */
+{
+  vector<log_ring*> rings;
+  vector<uint64_t> ends;
+  vector<flush_record> records;
+  uint64_t dropped = 0;
+
+  pthread_mutex_lock(&_rings_mutex);
+  rings = _rings;
+  pthread_mutex_unlock(&_rings_mutex);
+
+  ends.resize(rings.size());
+  for (unsigned int n=0; n < rings.size(); n++)
+  {
+    log_ring *ring = rings[n];
+    uint64_t mask = ring->size - 1;
+    uint64_t pos = ring->tail.load(memory_order_relaxed);
+    uint64_t head = ring->head.load(memory_order_acquire);
+
+    while (pos < head)
+    {
+      ring_record *rec = (ring_record*)(ring->buf + (pos & mask));
+      uint64_t offset = (pos + sizeof(ring_record)) & mask;
+      uint64_t first = min((uint64_t)rec->text_len, ring->size - offset);
+      flush_record fr;
+
+      fr.seq = rec->seq;
+      fr.text[0].iov_base = ring->buf + offset;
+      fr.text[0].iov_len = first;
+      fr.parts = 1;
+      if (first < rec->text_len)
+      {
+        fr.text[1].iov_base = ring->buf;
+        fr.text[1].iov_len = rec->text_len - first;
+        fr.parts = 2;
+      }
+      if (_binary)
+      {
+        fr.hdr_len = min((size_t)rec->text_len, sizeof(fr.hdr));
+        memcpy(fr.hdr, fr.text[0].iov_base, min(first, (uint64_t)fr.hdr_len));
+        if (first < fr.hdr_len)
+          memcpy(fr.hdr + first, ring->buf, fr.hdr_len - first);
+      }
+      records.push_back(fr);
+      pos += rec->length;
+    }
+    ends[n] = head;
+    dropped += ring->dropped.load(memory_order_relaxed);
+  }
+
+  if (records.empty() && (dropped == _dropped_reported))
+    return false;
+
+  check_logfile(time(NULL));
+
+  sort(records.begin(), records.end(), flush_record_order);
+
+  pthread_mutex_lock(&logfile_mutex);
+  struct iovec iov[IOV_MAX];
+  deque<string> defs; // must stay put until written
+  int count = 0;
+  for (unsigned int n=0; n < records.size(); n++)
+  {
+    if ((count + 3) > IOV_MAX)
+    {
+      write_iov(logfile, iov, count);
+      count = 0;
+      defs.clear();
+    }
+
+    // Binary records need their format & area defining the first time they're used in a file
+    if (_binary)
+    {
+      string def;
+      definitions(records[n].hdr, records[n].hdr_len, def);
+      if (!def.empty())
+      {
+        defs.push_back(def);
+        iov[count].iov_base = (void*)defs.back().data();
+        iov[count++].iov_len = defs.back().length();
+      }
+    }
+
+    for (int p=0; p < records[n].parts; p++)
+      iov[count++] = records[n].text[p];
+  }
+  if (count > 0)
+    write_iov(logfile, iov, count);
+  pthread_mutex_unlock(&logfile_mutex);
+
+  for (unsigned int n=0; n < rings.size(); n++)
+    rings[n]->tail.store(ends[n], memory_order_release);
+
+  if (dropped != _dropped_reported)
+  {
+    char msg[100];
+
+    snprintf(msg, sizeof(msg), "[LOG] %llu lines dropped (buffer full)", (unsigned long long)(dropped - _dropped_reported));
+    write_line(internal_line(msg));
+    _dropped_reported = dropped;
+  }
+
+  return true;
+}
+
+void *CLogging::s_flush_thread(void *arg)
+{
+  ((CLogging*)arg)->flush_thread();
+  return NULL;
+}
+
+void CLogging::flush_thread()
+{
+  pthread_mutex_lock(&_flush_mutex);
+  while (!_flush_exit)
+  {
+    if (!_flush_requested)
+    {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec  += _flush_ms / 1000;
+      ts.tv_nsec += (_flush_ms % 1000) * 1000000L;
+      if (ts.tv_nsec >= 1000000000L)
+      {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&_flush_cond, &_flush_mutex, &ts);
+    }
+    _flush_requested = false;
+    pthread_mutex_unlock(&_flush_mutex);
+
+    while (flush())
+      ;
+
+    pthread_mutex_lock(&_flush_mutex);
+  }
+  pthread_mutex_unlock(&_flush_mutex);
+
+  while (flush())
+    ;
+}
@@ -7,6 +7,45 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include <string.h>
+#include <stdarg.h>
+#include <map>
+#include "CLogRecord.h"
+
+class CLogCompressor;
+
+enum log_level
+{
+  LOG_LEVEL_ERROR = 0,
+  LOG_LEVEL_WARN,
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_DEBUG
+};
+
+// Log msg only if level is enabled for area - msg (e.g. "SQL = [" + query + "]") isn't even built 
+// otherwise. Building with -DNH_NO_DEBUG_LOG removes debug level calls altogether.
+#define NH_LOG(log, level, area, msg) do { if ((log)->enabled(level, area)) (log)->dbg(level, area, msg); } while (0)
+#define NH_LOG_ERROR(log, area, msg)  NH_LOG(log, LOG_LEVEL_ERROR, area, msg)
+#define NH_LOG_WARN(log, area, msg)   NH_LOG(log, LOG_LEVEL_WARN,  area, msg)
+#define NH_LOG_INFO(log, area, msg)   NH_LOG(log, LOG_LEVEL_INFO,  area, msg)
+
+// printf style versions, for messages that are a fixed template with a few fields. In binary logs
+// the format string is only written once, with just the arguments written for each line.
+#define NH_LOGF(log, level, area, ...) do { if ((log)->enabled(level, area)) (log)->dbgf(level, area, __VA_ARGS__); } while (0)
+#define NH_LOGF_ERROR(log, area, ...) NH_LOGF(log, LOG_LEVEL_ERROR, area, __VA_ARGS__)
+#define NH_LOGF_WARN(log, area, ...)  NH_LOGF(log, LOG_LEVEL_WARN,  area, __VA_ARGS__)
+#define NH_LOGF_INFO(log, area, ...)  NH_LOGF(log, LOG_LEVEL_INFO,  area, __VA_ARGS__)
+
+#ifdef NH_NO_DEBUG_LOG
+#define NH_LOG_DEBUG(log, area, msg)  do { } while (0)
+#define NH_LOGF_DEBUG(log, area, ...) do { } while (0)
+#else
+#define NH_LOG_DEBUG(log, area, msg)  NH_LOG(log, LOG_LEVEL_DEBUG, area, msg)
+#define NH_LOGF_DEBUG(log, area, ...) NH_LOGF(log, LOG_LEVEL_DEBUG, area, __VA_ARGS__)
+#endif
 
 
 class CLogging
@@ -17,15 +56,119 @@ class CLogging
     ~CLogging();
     void dbg(std::string msg);
     void dbg(std::string area, std::string msg);
+    void dbg(log_level level, std::string area, std::string msg);
+    void dbgf(log_level level, const char *area, const char *format, ...) __attribute__((format(printf, 4, 5)));
     bool open_logfile(std::string logfile);
+
+    // "text" (the default) or "binary" - see CLogRecord.h; read with nh-logcat. Set before opening.
+    int set_format(std::string format);
+
+    // Everything is logged unless a lower level is set (for all areas, or just one). Plain dbg() 
+    // calls are always logged; only the NH_LOG_xxx macros are filtered.
+    void set_level(log_level level);
+    void set_area_level(std::string area, log_level level);
+    int set_levels(std::string levels); // e.g. "info, DB:warn, IRC:debug"
+    static int parse_level(std::string name, log_level &level);
+    bool enabled(log_level level, const char *area)
+    {
+      if (level > _max_level)
+        return false;
+      return _area_levels.empty() ? (level <= _level) : area_enabled(level, area);
+    };
+    bool enabled(log_level level, const std::string &area) { return enabled(level, area.c_str()); };
+
+    // Async mode: dbg() only copies the line into a buffer for the calling thread, and a background
+    // thread writes them out every flush_ms (or sooner if a buffer is getting full). Must be started
+    // after daemonizing, as the thread doesn't survive a fork. Only used once a logfile is open.
+    int start_async(unsigned int buffer_size, bool block_when_full, unsigned int flush_ms);
+    void stop_async();
+    uint64_t dropped(); // lines lost because a buffer was full (if not blocking)
+
+    // Once the logfile name changes, gzip the old file (level 1-9, or 0 not to) and delete logfiles
+    // older than keep_days (0 = never), on a low priority background thread. Like start_async, must
+    // be called after daemonizing, and once the logfile is open.
+    int start_compression(int level, unsigned int keep_days);
+    uint64_t compressed(); // logfiles compressed since started
     
   private:
+    // Single producer (one thread), single consumer (the flusher thread) ring of log lines
+    struct log_ring
+    {
+      char *buf;
+      uint64_t size; // a power of 2
+      std::atomic<uint64_t> head; // written by the producer
+      std::atomic<uint64_t> tail; // written by the flusher
+      std::atomic<uint64_t> dropped;
+      std::atomic<bool> in_use;   // cleared when the thread exits, so the ring can be reused
+    };
+
+    struct ring_record
+    {
+      uint32_t length;   // including this header, rounded up to a multiple of its size
+      uint32_t text_len;
+      uint64_t seq;      // orders lines from different threads
+    };
+
     int logfile;
     pthread_mutex_t logfile_mutex;
     std::string sLogfile;
     
     std::string patLogfile;
     std::string opnLogfile;
-    std::string curLogfile();
-    
+    std::string curLogfile(time_t now);
+    std::atomic<time_t> _next_check; // when the logfile name might next change
+    time_t next_rotation(time_t now);
+    static size_t timestamp(time_t now, char *buf, size_t len);
+    CLogCompressor *_compressor;
+    void log_line(int level, const std::string *area, const std::string &msg);
+    void emit(const std::string &record, time_t now);
+
+    // Binary format
+    bool _binary;
+    pthread_mutex_t _intern_mutex;
+    std::vector<std::string> _strings;               // format strings & area names, by id-1
+    std::map<const char*, uint32_t> _format_ids;     // by address, as formats are literals
+    std::map<std::string, uint32_t> _area_ids;
+    std::vector<bool> _defined;                      // ids written to the current file
+    uint32_t intern(const std::string &text);
+    uint32_t intern_format(const char *format);
+    uint32_t intern_area(const std::string &area);
+    std::string bin_record(int level, const std::string *area, uint32_t format, int nargs, const std::string &args, uint64_t time_us);
+    std::string internal_line(const std::string &msg);
+    static int pack_args(std::string &out, const char *format, va_list ap);
+    void start_session();
+    void definitions(const char *record, size_t len, std::string &out);
+    void write_locked(const std::string &record);
+
+    log_level _level;
+    log_level _max_level; // highest of _level and any area's level
+    std::vector<std::pair<std::string, log_level> > _area_levels;
+    bool area_enabled(log_level level, const char *area);
+
+    std::atomic<bool> _async;
+    bool _block_when_full;
+    unsigned int _ring_size;
+    unsigned int _flush_ms;
+    std::atomic<uint64_t> _seq;
+    uint64_t _dropped_reported;
+    pthread_key_t _ring_key;
+    bool _ring_key_created;
+    std::vector<log_ring*> _rings;
+    pthread_mutex_t _rings_mutex;
+    pthread_t _flush_thread;
+    bool _flush_thread_running;
+    bool _flush_exit;
+    bool _flush_requested;
+    pthread_mutex_t _flush_mutex;
+    pthread_cond_t _flush_cond;
+
+    void check_logfile(time_t now);
+    void write_line(const std::string &line);
+    log_ring *thread_ring();
+    void push(log_ring *ring, const std::string &line);
+    void wake_flusher();
+    bool flush();
+    static void s_ring_release(void *arg);
+    static void *s_flush_thread(void *arg);
+    void flush_thread();
 };
@@ -0,0 +1,144 @@
+#include "CMetrics.h"
+#include <sstream>
+#include <stdio.h>
+#include <time.h>
+
+using namespace std;
+
+CLatencyHistogram::CLatencyHistogram()
+{
+  for (unsigned int n=0; n < HISTOGRAM_BUCKETS; n++)
+    _buckets[n].store(0);
+  _count.store(0);
+  _max.store(0);
+}
+
+unsigned int CLatencyHistogram::bucket(uint64_t us)
+{
+  if (us < HISTOGRAM_LINEAR)
+    return us;
+
+  unsigned int power = 63 - __builtin_clzll(us); // us is in [2^power, 2^(power+1))
+  if (power >= HISTOGRAM_MAX_POWER)
+    return HISTOGRAM_BUCKETS - 1;
+
+  return HISTOGRAM_LINEAR + ((power - 4) * HISTOGRAM_SUB_BUCKETS) + ((us >> (power - 3)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+uint64_t CLatencyHistogram::bucket_top(unsigned int idx)
+/* Highest value that would be recorded in bucket idx */
+{
+  if (idx < HISTOGRAM_LINEAR)
+    return idx;
+
+  unsigned int power = ((idx - HISTOGRAM_LINEAR) / HISTOGRAM_SUB_BUCKETS) + 4;
+  uint64_t sub = (idx - HISTOGRAM_LINEAR) % HISTOGRAM_SUB_BUCKETS;
+  uint64_t width = 1ULL << (power - 3);
+
+  return (1ULL << power) + ((sub + 1) * width) - 1;
+}
+
+void CLatencyHistogram::record(uint64_t us)
+{
+  _buckets[bucket(us)].fetch_add(1, memory_order_relaxed);
+  _count.fetch_add(1, memory_order_relaxed);
+
+  uint64_t prev = _max.load(memory_order_relaxed);
+  while ((us > prev) && !_max.compare_exchange_weak(prev, us, memory_order_relaxed))
+    ;
+}
+
+uint64_t CLatencyHistogram::percentile(double p)
+/* Returns the value at or below which p percent of recorded values fall (to within one bucket) */
+{
+  uint64_t total = count();
+  uint64_t seen = 0;
+
+  if (total == 0)
+    return 0;
+
+  uint64_t target = (uint64_t)((p / 100.0) * total + 0.5);
+  if (target < 1)
+    target = 1;
+
+  for (unsigned int n=0; n < HISTOGRAM_BUCKETS; n++)
+  {
+    seen += _buckets[n].load(memory_order_relaxed);
+    if (seen >= target)
+    {
+      uint64_t top = bucket_top(n);
+      return (top > max()) ? max() : top;
+    }
+  }
+
+  return max();
+}
+
+string CLatencyHistogram::json()
+{
+  stringstream ss;
+
+  ss << "{\"count\":" << count() << ",\"p50\":" << percentile(50) << ",\"p99\":" << percentile(99) << ",\"max\":" << max() << "}";
+  return ss.str();
+}
+
+string topic_metrics::json()
+{
+  stringstream ss;
+
+  ss << "{\"filter\":" << json_string(filter) 
+     << ",\"messages\":" << messages.load(memory_order_relaxed) 
+     << ",\"bytes\":" << bytes.load(memory_order_relaxed) 
+     << ",\"latency_us\":" << latency.json() << "}";
+  return ss.str();
+}
+
+string sp_metrics::json()
+{
+  stringstream ss;
+
+  ss << "{\"sp\":" << json_string(sp_name)
+     << ",\"calls\":" << calls.load(memory_order_relaxed)
+     << ",\"errors\":" << errors.load(memory_order_relaxed)
+     << ",\"rows\":" << rows.load(memory_order_relaxed)
+     << ",\"slow\":" << slow.load(memory_order_relaxed)
+     << ",\"prepare_us\":" << prepare.json()
+     << ",\"execute_us\":" << execute.json()
+     << ",\"fetch_us\":" << fetch.json() << "}";
+  return ss.str();
+}
+
+string json_string(const string &s)
+/* s as a quoted JSON string */
+{
+  string ret = "\"";
+  char buf[8];
+
+  for (size_t n=0; n < s.length(); n++)
+  {
+    unsigned char c = s[n];
+
+    if ((c == '"') || (c == '\\'))
+    {
+      ret += '\\';
+      ret += c;
+    }
+    else if (c < 0x20)
+    {
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      ret += buf;
+    }
+    else
+      ret += c;
+  }
+
+  return ret + "\"";
+}
+
+uint64_t monotonic_us()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
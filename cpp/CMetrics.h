@@ -0,0 +1,68 @@
+#pragma once
+#include <string>
+#include <atomic>
+#include <stdint.h>
+
+// Sub-buckets per power of two - values are recorded to within 1/8 (12.5%) of their true value
+#define HISTOGRAM_SUB_BUCKETS 8
+#define HISTOGRAM_LINEAR      16 // values below this are recorded exactly
+#define HISTOGRAM_MAX_POWER   36 // anything over 2^36us (~19 hours) goes in the last bucket
+#define HISTOGRAM_BUCKETS     (HISTOGRAM_LINEAR + ((HISTOGRAM_MAX_POWER - 4) * HISTOGRAM_SUB_BUCKETS))
+
+// Log-linear (HDR-style) histogram of latencies in microseconds, with a fixed number of 
+// buckets so recording is just an array increment. Safe to record() from any thread.
+class CLatencyHistogram
+{
+  public:
+    CLatencyHistogram();
+
+    void record(uint64_t us);
+    uint64_t percentile(double p);
+    uint64_t max() { return _max.load(std::memory_order_relaxed); };
+    uint64_t count() { return _count.load(std::memory_order_relaxed); };
+    std::string json();
+
+  private:
+    std::atomic<uint64_t> _buckets[HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> _count;
+    std::atomic<uint64_t> _max;
+
+    static unsigned int bucket(uint64_t us);
+    static uint64_t bucket_top(unsigned int idx);
+};
+
+// Counters kept for each subscribed topic filter
+struct topic_metrics
+{
+  std::string filter;
+  std::atomic<uint64_t> messages;
+  std::atomic<uint64_t> bytes;
+  CLatencyHistogram latency; // time spent in the handler(s) for the filter
+
+  topic_metrics(const std::string &f) : filter(f), messages(0), bytes(0) {};
+  void received(size_t len) 
+  {
+    messages.fetch_add(1, std::memory_order_relaxed); 
+    bytes.fetch_add(len, std::memory_order_relaxed); 
+  };
+  std::string json();
+};
+
+// Counters kept for each stored procedure called (by any connection in the process)
+struct sp_metrics
+{
+  std::string sp_name;
+  std::atomic<uint64_t> calls;
+  std::atomic<uint64_t> errors;
+  std::atomic<uint64_t> rows;
+  std::atomic<uint64_t> slow;  // calls logged as slow
+  CLatencyHistogram prepare;   // only when the statement had to be (re)prepared
+  CLatencyHistogram execute;
+  CLatencyHistogram fetch;     // reading the result sets, and OUT params
+
+  sp_metrics(const std::string &n) : sp_name(n), calls(0), errors(0), rows(0), slow(0) {};
+  std::string json();
+};
+
+std::string json_string(const std::string &s);
+uint64_t monotonic_us();
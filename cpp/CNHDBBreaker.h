@@ -0,0 +1 @@
+../db/lib/CNHDBBreaker.h
\ No newline at end of file
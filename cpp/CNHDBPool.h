@@ -0,0 +1 @@
+../db/lib/CNHDBPool.h
\ No newline at end of file
@@ -0,0 +1 @@
+../db/lib/CNHDBWriter.h
\ No newline at end of file
@@ -34,12 +34,21 @@
 #include <unistd.h>
 #include <libgen.h>
 #include <string.h>
+#include <ctype.h>
+
+#define SPOOL_MAX_INFLIGHT 20
+#define BUS_MAX_BATCH 256 // messages processed from the local bus before checking for anything else
+#define BUS_BRIDGE_MS 5000 // how long one copy of a local message waits to be matched with the other
+#define BUS_RECENT_MAX 1024
 
 using namespace std;
 
+CNHmqtt *CNHmqtt::_next_host = NULL;
+
 CNHmqtt::CNHmqtt(int argc, char *argv[]) 
 {
   log = NULL;
+  _host = _next_host;
   string config_file = "";
   _pid_file = "";
   _config_file_parsed = false;
@@ -48,14 +57,61 @@ CNHmqtt::CNHmqtt(int argc, char *argv[])
   std::stringstream out;
   _reader = NULL;
   _mosq_connected = false;
-  log = new CLogging();
+  log = (_host != NULL) ? _host->log : new CLogging();
   string logfile;
   _uid = 0;
   _no_staus_debug = false;
+  _stats_interval = 0;
+  _log_async = false;
+  _log_buffer = 0;
+  _log_block = false;
+  _log_flush_ms = 0;
+  _log_compress_level = 0;
+  _log_keep_days = 0;
+  _worker_threads = 0;
+  _workers = NULL;
+  _publish_queue = NULL;
+  _loop_running = false;
+  _disconnect_requested = false;
+  _queue_full = false;
+  _status_res_handle = NULL;
+  _mosq_fd = -1;
+  _loop_thread = pthread_self();
+  _persistent_session = false;
+  _sub_qos = 0;
+  _spool = NULL;
+  _bus = NULL;
+  _bus_bridge = false;
+  _value_cache = NULL;
+  _spool_send_pos = 0;
+  _spool_dropped = 0;
+  _replaying = false;
+  _replay_start = 0;
+  _replay_count = 0;
+  _last_replay_count = 0;
+  _last_replay_ms = 0;
+  _published.store(0);
+  _published_bytes.store(0);
+  _publish_failed.store(0);
+  _publish_dropped.store(0);
+  _start_time = time(NULL);
+  int publish_queue_limit = 0;
+  string qos1_topics = "";
+  string spool_file = "";
+  int spool_size = 0;
+  string local_bus = "";
+  string local_topics = "";
+  int local_bus_size = 0;
   string def_config="";
+  string log_levels = "";
+  string log_format = "text";
+  string log_compress = "none";
   char buf[256]="";
   
-  mosquitto_lib_init();
+  if (_host == NULL)
+    mosquitto_lib_init();
+  else
+    _host->_services.push_back(this);
   _mosq = NULL;
     
   debug_mode = false;
@@ -137,12 +193,43 @@ CNHmqtt::CNHmqtt(int argc, char *argv[])
     
     _status_req_topic = get_str_option("mqtt", "status_request", "nh/status/req");
     _status_res_topic = get_str_option("mqtt", "status_response", "nh/status/res");
+    _status_detail_topic = _status_res_topic + "/detail";
+    _stats_interval = get_int_option("mqtt", "stats_interval", 0);
     _status_name  = get_str_option("mqtt", "status_name", "");
     
     // No status/proces name set in config file, default to process id
     if (_status_name == "")
       _status_name = itos(getpid());
       
+    _worker_threads = get_int_option("mqtt", "worker_threads", 0);
+    publish_queue_limit = get_int_option("mqtt", "publish_queue_limit", 0);
+
+    // Persistent session: broker keeps our subscriptions (and queues QoS1 messages for us) while disconnected
+    _persistent_session = (get_str_option("mqtt", "persistent_session", "false") == "true");
+    _client_id    = get_str_option("mqtt", "client_id", "");
+    qos1_topics   = get_str_option("mqtt", "qos1_topics", "");
+    spool_file    = get_str_option("mqtt", "spool_file", "");
+    spool_size    = get_int_option("mqtt", "spool_size", 1048576);
+
+    // Shared memory bus for messages between daemons on this machine
+    local_bus     = get_str_option("mqtt", "local_bus", "");
+    local_bus_size = get_int_option("mqtt", "local_bus_size", 1048576);
+    local_topics  = get_str_option("mqtt", "local_topics", "");
+    _bus_bridge   = (get_str_option("mqtt", "local_bus_bridge", "false") == "true");
+
+    // Write the logfile from a background thread
+    _log_async    = (get_str_option("mqtt", "log_async", "false") == "true");
+    _log_buffer   = get_int_option("mqtt", "log_buffer", 65536);
+    _log_block    = (get_str_option("mqtt", "log_when_full", "drop") == "block");
+    _log_flush_ms = get_int_option("mqtt", "log_flush_ms", 100);
+    log_levels    = get_str_option("mqtt", "log_level", "");
+    log_format    = get_str_option("mqtt", "log_format", "text");
+
+    // Compress yesterday's logfile, and delete old ones
+    log_compress  = get_str_option("mqtt", "log_compress", "none");
+    _log_compress_level = get_int_option("mqtt", "log_compress_level", 6);
+    _log_keep_days = get_int_option("mqtt", "log_keep_days", 0);
+
     if (get_str_option("mqtt", "no_status_debug", "false") == "true")
       _no_staus_debug = true;
     else 
@@ -150,17 +237,79 @@ CNHmqtt::CNHmqtt(int argc, char *argv[])
   }
   
   // Switch to less privileged user if set
-  if (_uid)
+  if (_uid && (_host == NULL))
     if (setuid(_uid))
     {
       log->dbg("Failed to switch user!");
       exit(1);
     }
   
-  if (!debug_mode)
+  if ((_host == NULL) && log->set_format(log_format))
+    log->dbg("Invalid log_format [" + log_format + "] - using text");
+
+  if (!debug_mode && (_host == NULL))
     if(!log->open_logfile(logfile))
       exit(1);
+
+  if (log_compress == "none")
+    _log_compress_level = 0;
+  else if ((log_compress != "gzip") || (_log_compress_level < 1) || (_log_compress_level > 9))
+  {
+    log->dbg("Invalid log_compress [" + log_compress + "] / log_compress_level - not compressing logfiles");
+    _log_compress_level = 0;
+  }
+  if (_log_keep_days < 0)
+    _log_keep_days = 0;
+
+  // Hosted services share the host's log, so its level
+  if ((log_levels != "") && (_host == NULL) && log->set_levels(log_levels))
+    log->dbg("Invalid log_level [" + log_levels + "] - expected e.g. \"info, DB:debug\"");
   
+  _publish_queue = new CPublishQueue(publish_queue_limit > 0 ? publish_queue_limit : 0);
+
+  if (_persistent_session)
+    _sub_qos = 1;
+
+  // Topic filters to publish with QoS1 (and spool, if enabled)
+  split_list(qos1_topics, _qos1_topics);
+
+  if ((local_bus != "") && (_host == NULL))
+  {
+    _bus = new CShmBus();
+    if (_bus->open(local_bus, local_bus_size > 0 ? local_bus_size : 0))
+    {
+      log->dbg("Failed to open local bus [" + local_bus + "] - using mosquitto for everything");
+      delete _bus;
+      _bus = NULL;
+    }
+    else
+    {
+      split_list(local_topics, _local_topics);
+
+      // Bus users only look out for the bridge's copies while there is one
+      if (_bus_bridge && _bus->set_bridge())
+      {
+        log->dbg("Another process is already copying local bus messages to mosquitto - local_bus_bridge ignored");
+        _bus_bridge = false;
+      }
+    }
+  }
+
+  if ((spool_file != "") && (_host != NULL))
+    log->dbg("spool_file is ignored when running inside a host process - set it in the host's config instead");
+  else if (spool_file != "")
+  {
+    _spool = new CSpool();
+    if (_spool->open(spool_file, spool_size > 0 ? spool_size : 0))
+    {
+      log->dbg("Failed to open spool file [" + spool_file + "] - QoS1 messages will not be spooled");
+      delete _spool;
+      _spool = NULL;
+    }
+    else if (_spool->used())
+      log->dbg("Spool [" + spool_file + "] has " + itos(_spool->used()) + " bytes of messages from before, to be sent once connected");
+  }
+
   _mqtt_rx = _mqtt_topic + "/rx";
   _mqtt_tx = _mqtt_topic + "/tx";
   
@@ -173,13 +322,69 @@ CNHmqtt::CNHmqtt(int argc, char *argv[])
 
 CNHmqtt::~CNHmqtt()
 {
+  if (_workers != NULL)
+  {
+    delete _workers;
+    _workers = NULL;
+  }
+
   if (_mosq_connected && (_mosq != NULL))
     mosquitto_disconnect(_mosq);         
   
   if (_mosq != NULL)
     mosquitto_destroy(_mosq); 
+
+  if (_publish_queue != NULL)
+  {
+    delete _publish_queue;
+    _publish_queue = NULL;
+  }
+
+  if (_spool != NULL)
+  {
+    delete _spool;
+    _spool = NULL;
+  }
+
+  if (_bus != NULL)
+  {
+    delete _bus;
+    _bus = NULL;
+  }
+
+  if (_value_cache != NULL)
+  {
+    delete _value_cache;
+    _value_cache = NULL;
+  }
+
+  for (map<string, topic_metrics*>::iterator i = _topic_metrics.begin(); i != _topic_metrics.end(); ++i)
+    delete i->second;
+  _topic_metrics.clear();
+
+  for (map<string, mqtt_topic*>::iterator i = _topic_handles.begin(); i != _topic_handles.end(); ++i)
+  {
+    mqtt_topic *handle = i->second;
+    publish_msg *pending = handle->pending.load();
+    if (pending != NULL)
+      CPublishQueue::free_msg(pending);
+    CPublishQueue::free_msg(handle->marker);
+    delete handle;
+  }
+  _topic_handles.clear();
   
-  mosquitto_lib_cleanup();
+  if (_host != NULL)
+  {
+    for (vector<CNHmqtt*>::iterator i = _host->_services.begin(); i != _host->_services.end(); ++i)
+      if (*i == this)
+      {
+        _host->_services.erase(i);
+        break;
+      }
+    log = NULL; // belongs to the host
+  }
+  else
+    mosquitto_lib_cleanup();
   
   if (_reader!=NULL)
   {
@@ -228,6 +433,8 @@ int CNHmqtt::daemonize()
   else
   {
    retval = daemon(1, 0); // don't change dir, but do redirect stdio to /dev/null
+   if (!retval)
+     daemonized = true;
   }
 
   return retval;
@@ -255,14 +462,45 @@ int CNHmqtt::get_int_option(string section, string option, int def_value)
     return def_value;  
 }
 
+void CNHmqtt::set_host(CNHmqtt *host)
+/* Objects constructed after this is called (until it's called again with NULL) run as services inside 
+ * host: they share its mosquitto connection, event loop and logger instead of having their own, and 
+ * host passes on any messages received that match their subscriptions. Each still answers status 
+ * requests as itself. */
+{
+  _next_host = host;
+}
+
 int CNHmqtt::mosq_connect()
 {
   std::stringstream out;
+
+  if (_host != NULL)
+  {
+    log->dbg("[" + _status_name + "] using host connection");
+    _mosq_connected = true;
+
+    // Not coalesced, as the same handle is shared by all the host's services
+    _status_res_handle = topic_handle(_status_res_topic);
+    subscribe(_mqtt_rx, CNHmqtt::s_terminate_request, this);
+    subscribe(_status_req_topic, CNHmqtt::s_status_request, this);
+
+    message_send(_status_res_topic, "Restart: " + _status_name);
+    return 0;
+  }
+
   out << _mqtt_topic << "-" << getpid();
+
+  // A persistent session needs the same client id each time
+  if (_persistent_session)
+  {
+    out.str("");
+    out << ((_client_id != "") ? _client_id : _mqtt_topic);
+  }
   
-  log->dbg("Connecting to Mosquitto as [" + out.str() + "]");;
+  log->dbg("Connecting to Mosquitto as [" + out.str() + "]" + (_persistent_session ? " (persistent session)" : ""));
   
-  _mosq = mosquitto_new(out.str().c_str(), true, this);  
+  _mosq = mosquitto_new(out.str().c_str(), !_persistent_session, this);  
   if(!_mosq)
   {
     cout << "mosquitto_new() failed!";
@@ -271,6 +509,8 @@ int CNHmqtt::mosq_connect()
   
   mosquitto_message_callback_set(_mosq, CNHmqtt::message_callback);
   mosquitto_connect_callback_set(_mosq, CNHmqtt::connect_callback);
+  mosquitto_disconnect_callback_set(_mosq, CNHmqtt::disconnect_callback);
+  mosquitto_publish_callback_set(_mosq, CNHmqtt::publish_callback);
   
   if(mosquitto_connect(_mosq, _mosq_server.c_str(), _mosq_port, 300)) 
   {
@@ -280,8 +520,9 @@ int CNHmqtt::mosq_connect()
     return -1;
   }
 
-  subscribe(_mqtt_rx);
-  subscribe(_status_req_topic);
+  _status_res_handle = topic_handle(_status_res_topic, false, true);
+  subscribe(_mqtt_rx, CNHmqtt::s_terminate_request, this);
+  subscribe(_status_req_topic, CNHmqtt::s_status_request, this);
   
   message_send(_status_res_topic, "Restart: " + _status_name);
 
@@ -293,6 +534,27 @@ void CNHmqtt::connect_callback(struct mosquitto*, void *obj, int)
   ((CNHmqtt*)obj)->connected();
 }
 
+void CNHmqtt::disconnect_callback(struct mosquitto*, void *obj, int result)
+{
+  CNHmqtt *m = (CNHmqtt*)obj;
+
+  m->_mosq_connected = false;
+
+  // result is 0 if mosquitto_disconnect() was called (e.g. on terminate), so message_loop() should return
+  if (result == 0)
+  {
+    m->_disconnect_requested = true;
+    m->_reactor.wake();
+  }
+  else
+    m->log->dbg("Lost connection to mosquitto");
+}
+
+void CNHmqtt::publish_callback(struct mosquitto*, void *obj, int mid)
+{
+  ((CNHmqtt*)obj)->spool_acked(mid);
+}
+
 void CNHmqtt::connected()
 {
   list<string>::iterator i;
@@ -302,33 +564,253 @@ void CNHmqtt::connected()
   for(i=_topic_list.begin(); i != _topic_list.end(); ++i)
   {
     log->dbg("Subscribing to: [" + *i + "]");
-    mosquitto_subscribe(_mosq, NULL, (*i).c_str(), 0);
+    mosquitto_subscribe(_mosq, NULL, (*i).c_str(), _sub_qos);
+  }
+
+  // Anything sent from the spool but not acknowledged before the connection dropped gets sent again
+  if (_spool != NULL)
+  {
+    _spool_inflight.clear();
+    _spool_send_pos = _spool->head();
+
+    if (_spool->used() && !_replaying)
+    {
+      log->dbg("Replaying " + itos(_spool->used()) + " bytes of spooled messages");
+      _replaying = true;
+      _replay_start = now_ms();
+      _replay_count = 0;
+    }
   }
-  
 }
 
 void CNHmqtt::message_callback(struct mosquitto*, void *obj, const struct mosquitto_message *message)
+/* The topic and payload are only referenced (not copied) from here on, and are valid until this 
+ * returns. The payload isn't necessarily NUL terminated, and may be binary. */
 {
   CNHmqtt *m = (CNHmqtt*)obj;
-  string payload;
-  string topic;
- 
   
   if(message->payloadlen)
   { 
-    payload = ((char *)message->payload);
-    topic = ((char *)message->topic);
+    str_view payload((const char *)message->payload, message->payloadlen);
+    str_view topic(message->topic, strlen(message->topic));
+
+    // Local topics arrive over the bus - ignore the bridge's copy of those, but not messages to the 
+    // same topics from anything not using the bus
+    if ((m->_bus != NULL) && m->is_local(message->topic) && m->_bus->bridged() && m->bridged_copy(topic, payload, false))
+      return;
     
-    if (!m->_no_staus_debug)
-      m->log->dbg("Got mqtt message, topic=[" + topic + "], message=[" + payload + "]");
-    else // no_staus_debug is set - so only print out message to log if it's /not/ a status request
+    // no_staus_debug is set - so only print out message to log if it's /not/ a status request
+    if (!m->_no_staus_debug || (topic != m->_status_req_topic))
+      NH_LOGF_DEBUG(m->log, "MQTT", "Got mqtt message, topic=[%s], message=[%s]", message->topic, printable(payload).c_str());
+
+    m->deliver(topic, payload);
+  }
+}
+
+void CNHmqtt::deliver(const str_view &topic, const str_view &payload)
+{
+  // In worker pool mode, everything apart from terminate/status requests gets processed by a worker 
+  // thread, so a slow handler (e.g. waiting on the database) doesn't hold up anything else.
+  if ((_workers != NULL) && (topic != _mqtt_rx) && (topic != _status_req_topic))
+  {
+    string topic_str = topic.str();
+    _workers->add(partition_key(topic_str), topic_str, payload.str());
+  }
+  else
+    handle_message(topic, payload);
+}
+
+void CNHmqtt::poll_bus()
+/* Process messages from the local bus. Everyone gets every message, so most are just skipped. Called 
+ * from the network thread. */
+{
+  string topic;
+  string payload;
+
+  for (int n=0; (n < BUS_MAX_BATCH) && _bus->read(topic, payload); n++)
+  {
+    // Pass local messages on to mosquitto, for anything not using the bus
+    if (_bus_bridge && _mosq_connected)
+      publish(NULL, topic.c_str(), payload.data(), payload.length(), 0, false);
+
+    str_view t(topic);
+    str_view p(payload);
+
+    if (payload.empty() || !subscribed(t))
+      continue;
+
+    // Already had the bridge's copy from mosquitto
+    if (_bus->bridged() && bridged_copy(t, p, true))
+      continue;
+
+    if (!_no_staus_debug || (t != _status_req_topic))
+      NH_LOGF_DEBUG(log, "MQTT", "Got local message, topic=[%s], message=[%s]", topic.c_str(), printable(p).c_str());
+
+    deliver(t, p);
+  }
+}
+
+void CNHmqtt::s_bus_wake(void *obj)
+{
+  ((CNHmqtt*)obj)->_reactor.wake();
+}
+
+bool CNHmqtt::subscribed(const str_view &topic)
+{
+  if (_topic_trie.matches(topic))
+    return true;
+
+  for (unsigned int n=0; n < _services.size(); n++)
+    if (_services[n]->_topic_trie.matches(topic))
+      return true;
+
+  return false;
+}
+
+bool CNHmqtt::bridged_copy(const str_view &topic, const str_view &payload, bool from_bus)
+/* With a bridge running, local messages arrive twice: over the bus, and the copy the bridge passed on
+ * via mosquitto. Returns true if this is the second of those (the first is delivered, whichever it 
+ * was). Each copy only matches one of the other kind, so repeats from anything not using the bus 
+ * still get through. */
+{
+  long long now = now_ms();
+
+  while (!_bus_recent.empty() && ((now - _bus_recent.front().received_ms) > BUS_BRIDGE_MS))
+    _bus_recent.pop_front();
+
+  uint64_t hash = message_hash(topic, payload);
+  for (deque<bus_message>::iterator i = _bus_recent.begin(); i != _bus_recent.end(); ++i)
+    if ((i->hash == hash) && (i->from_bus != from_bus))
     {
-      if (topic != m->_status_req_topic)
-        m->log->dbg("Got mqtt message, topic=[" + topic + "], message=[" + payload + "]");
+      _bus_recent.erase(i);
+      return true;
     }
 
-    m->process_message(topic, payload);
+  bus_message recent;
+  recent.hash = hash;
+  recent.received_ms = now;
+  recent.from_bus = from_bus;
+  if (_bus_recent.size() >= BUS_RECENT_MAX)
+    _bus_recent.pop_front();
+  _bus_recent.push_back(recent);
+
+  return false;
+}
+
+uint64_t CNHmqtt::message_hash(const str_view &topic, const str_view &payload)
+// FNV-1a, of the topic then the payload (with a NUL between, which a topic can't contain)
+{
+  uint64_t h = 14695981039346656037ULL;
+
+  for (size_t n=0; n < topic.len; n++)
+  {
+    h ^= (unsigned char)topic.ptr[n];
+    h *= 1099511628211ULL;
+  }
+  h *= 1099511628211ULL;
+  for (size_t n=0; n < payload.len; n++)
+  {
+    h ^= (unsigned char)payload.ptr[n];
+    h *= 1099511628211ULL;
   }
+
+  return h;
+}
+
+bool CNHmqtt::is_local(const string &topic)
+/* True if messages to topic go over the local bus instead of via mosquitto */
+{
+  bool match;
+
+  for (unsigned int n=0; n < _local_topics.size(); n++)
+    if (!mosquitto_topic_matches_sub(_local_topics[n].c_str(), topic.c_str(), &match) && match)
+      return true;
+
+  return false;
+}
+
+int CNHmqtt::bus_send(const string &topic, const string &message)
+{
+  if (_bus->publish(topic.data(), topic.length(), message.data(), message.length()))
+  {
+    log->dbg("Message to [" + topic + "] too large for local bus - dropped");
+    return MOSQ_ERR_PAYLOAD_SIZE;
+  }
+
+  return MOSQ_ERR_SUCCESS;
+}
+
+void CNHmqtt::split_list(const string &list, vector<string> &items)
+/* Split comma separated list (e.g. of topic filters) into items, ignoring whitespace around each */
+{
+  size_t start = 0;
+
+  while (start < list.length())
+  {
+    size_t end = list.find(',', start);
+    if (end == string::npos)
+      end = list.length();
+
+    string item = list.substr(start, end - start);
+    item.erase(0, item.find_first_not_of(" \t"));
+    item.erase(item.find_last_not_of(" \t") + 1);
+    if (item != "")
+      items.push_back(item);
+    start = end + 1;
+  }
+}
+
+void CNHmqtt::handle_message(const str_view &topic, const str_view &message)
+/* Messages with a matching topic handler go to that, anything else to process_message_view() */
+{
+  topic_metrics *unhandled;
+
+  if (_value_cache != NULL)
+    _value_cache->update(topic, message);
+
+  // A hosted service is given every message the host receives, so ignores those that don't match 
+  // any of its own subscriptions (which all have metrics)
+  if (!_topic_trie.dispatch(topic, message, &unhandled) && ((unhandled != NULL) || (_host == NULL)))
+  {
+    uint64_t start = monotonic_us();
+    process_message_view(topic, message);
+    if (unhandled != NULL)
+      unhandled->latency.record(monotonic_us() - start);
+  }
+
+  for (unsigned int n=0; n < _services.size(); n++)
+    _services[n]->handle_message(topic, message);
+}
+
+void CNHmqtt::s_process_queued(void *obj, const string &topic, const string &message)
+{
+  ((CNHmqtt*)obj)->handle_message(topic, message);
+}
+
+void CNHmqtt::s_worker_thread_start(void *obj)
+{
+  CNHmqtt *m = (CNHmqtt*)obj;
+
+  m->worker_thread_start();
+  for (unsigned int n=0; n < m->_services.size(); n++)
+    m->_services[n]->worker_thread_start();
+}
+
+void CNHmqtt::s_worker_thread_end(void *obj)
+{
+  CNHmqtt *m = (CNHmqtt*)obj;
+
+  for (unsigned int n=0; n < m->_services.size(); n++)
+    m->_services[n]->worker_thread_end();
+  m->worker_thread_end();
+}
+
+string CNHmqtt::partition_key(const string &topic)
+/* When using worker threads, messages with the same partition key are guaranteed to be processed 
+ * in the order received. By default, this is only true for messages to the same topic - override 
+ * to group related topics, e.g. all messages for one door. */
+{
+  return topic;
 }
 
 int CNHmqtt::subscribe(string topic)
@@ -339,10 +821,27 @@ int CNHmqtt::subscribe(string topic)
     return -1;
   }
 
-  if (_mosq_connected)
+  // e.g. "a/#/b" or "a/b+" - which would otherwise never match anything, without any indication why
+  if (!CTopicTrie::valid_filter(topic))
+  {
+    log->dbg("Cannot subscribe to invalid topic filter [" + topic + "]");
+    return -1;
+  }
+
+  // Already subscribed (e.g. mosq_connect() being retried)
+  for (list<string>::iterator i = _topic_list.begin(); i != _topic_list.end(); ++i)
+    if (*i == topic)
+      return 0;
+
+  if (_host != NULL)
+  {
+    if (_host->subscribe(topic))
+      return -1;
+  }
+  else if (_mosq_connected)
   {
     log->dbg("Subscribing to topic [" + topic + "]");
-    if(mosquitto_subscribe(_mosq, NULL, topic.c_str(), 0))
+    if(mosquitto_subscribe(_mosq, NULL, topic.c_str(), _sub_qos))
     {
       log->dbg("Subscribe failed!");
       return -1;
@@ -351,38 +850,435 @@ int CNHmqtt::subscribe(string topic)
 
   _topic_list.push_back(topic);
 
+  // Messages received are counted & timed against each filter subscribed to, for STATUS DETAIL
+  if (_topic_metrics.find(topic) == _topic_metrics.end())
+  {
+    topic_metrics *metrics = new topic_metrics(topic);
+    _topic_metrics[topic] = metrics;
+    _topic_trie.set_metrics(topic, metrics);
+  }
+
   return 0;
 }
 
-void CNHmqtt::process_message(string topic, string message)
+int CNHmqtt::subscribe(string topic, topic_handler handler, void *obj)
+/* Subscribe to topic (which can include wildcards), and have handler called for each message 
+ * received that matches it. This should be done before message_loop() is entered (it's safe while
+ * messages are being handled, but not from a topic handler). */
 {
-  // Process any messages sent to our management topic (terminate or status)
-  if (topic == _mqtt_rx)
+  if (!CTopicTrie::valid_filter(topic))
+  {
+    log->dbg("Cannot subscribe to invalid topic filter [" + topic + "]");
+    return -1;
+  }
+
+  if (_topic_trie.add(topic, handler, obj))
   {
-    if (message == "TERMINATE")
+    log->dbg("Unable to add handler for topic filter [" + topic + "]");
+    return -1;
+  }
+
+  return subscribe(topic);
+}
+
+int CNHmqtt::cache_topic(string filter, unsigned int max_topics)
+/* Subscribe to filter, and keep the last message received on each matching topic (up to max_topics 
+ * of them), for cache_get()/cache_find(). Messages are still passed to handlers as normal. */
+{
+  if (_value_cache == NULL)
+    _value_cache = new CValueCache();
+
+  if (_value_cache->add_filter(filter, max_topics))
+    return -1;
+
+  return subscribe(filter);
+}
+
+bool CNHmqtt::cache_get(const string &topic, cached_value &value)
+{
+  return (_value_cache != NULL) && _value_cache->get(topic, value);
+}
+
+int CNHmqtt::cache_find(const string &filter, vector<cached_value> &values)
+/* Latest values of all cached topics matching filter, which can include wildcards */
+{
+  if (_value_cache == NULL)
+    return 0;
+
+  return _value_cache->find(filter, values);
+}
+
+void CNHmqtt::process_message_view(const str_view &topic, const str_view &message)
+/* Called for any message received that doesn't have a topic handler. The default just passes it on 
+ * to process_message(), for daemons still using that. */
+{
+  process_message(topic.str(), message.str());
+}
+
+void CNHmqtt::process_message(string, string)
+{
+  // Terminate & status requests are handled by s_terminate_request/s_status_request, so nothing to do 
+  // here. Kept so existing overrides calling CNHmqtt::process_message still work.
+}
+
+void CNHmqtt::s_terminate_request(void *obj, const topic_match&, const str_view &message)
+{
+  CNHmqtt *m = (CNHmqtt*)obj;
+
+  if (message == "TERMINATE")
+  {
+    if (m->_host != NULL)
     {
-      log->dbg("Terminate message received...");  
-      mosquitto_disconnect(_mosq);
+      m->log->dbg("Terminate message for [" + m->_status_name + "] ignored - running inside [" + m->_host->_status_name + "], so terminate that instead");
+      return;
     }
-  } else if (topic == _status_req_topic)
-  {
-    if (message == "STATUS")
-      message_send(_status_res_topic, "Running: " + _status_name, _no_staus_debug);
-  } 
+
+    m->log->dbg("Terminate message received...");  
+    mosquitto_disconnect(m->_mosq);
+  }
+}
+
+void CNHmqtt::s_status_request(void *obj, const topic_match&, const str_view &message)
+{
+  CNHmqtt *m = (CNHmqtt*)obj;
+
+  if (message == "STATUS")
+    m->message_send(m->_status_res_handle, "Running: " + m->_status_name, m->_no_staus_debug);
+  else if (message == "STATUS DETAIL")
+    m->message_send(m->_status_detail_topic, m->status_detail(), m->_no_staus_debug);
+  else if (message == "SPOOL")
+    m->message_send(m->_status_detail_topic, m->spool_status(), m->_no_staus_debug);
+}
+
+string CNHmqtt::printable(const str_view &message)
+/* Binary payloads are logged as just their length */
+{
+  for (size_t n=0; n < message.len; n++)
+    if (!isprint((unsigned char)message.ptr[n]) && !isspace((unsigned char)message.ptr[n]))
+      return "<" + itos(message.len) + " bytes binary>";
+
+  return message.str();
 }
 
 int CNHmqtt::message_send(string topic, string message, bool no_debug, bool retained)
+/* Once message_loop() is running, messages are queued to be sent by the network thread. Returns 
+ * PUBLISH_QUEUE_FULL if publish_queue_limit is set and that many messages are already waiting. */
 {
   int ret;
   
   if (!no_debug)
-    log->dbg("Sending message,  topic=[" + topic + "], message=[" + message + "]");
+    NH_LOGF_DEBUG(log, "MQTT", "Sending message,  topic=[%s], message=[%s]", topic.c_str(), message.c_str());
+
+  if (_host != NULL)
+    return _host->message_send(topic, message, true, retained);
+
+  // The bus has no concept of retained messages, so those always go via mosquitto
+  if ((_bus != NULL) && !retained && is_local(topic))
+    return bus_send(topic, message);
+
+  int qos = topic_qos(topic);
+
+  if (_loop_running)
+  {
+    // Spooled messages are kept until the connection's back
+    if (!_mosq_connected && ((qos == 0) || (_spool == NULL)))
+      return MOSQ_ERR_NO_CONN;
+    return queue_message(_publish_queue->add(topic, message, retained, qos));
+  }
+
   pthread_mutex_lock(&_mosq_mutex);
-  ret = mosquitto_publish(_mosq, NULL, topic.c_str(), message.length(), message.c_str(), 0, retained);
+  ret = publish(NULL, topic.c_str(), message.data(), message.length(), qos, retained);
   pthread_mutex_unlock(&_mosq_mutex);
   return ret;
 }
 
+int CNHmqtt::message_send(mqtt_topic *topic, string message, bool no_debug)
+{
+  int ret;
+
+  if (topic == NULL)
+    return MOSQ_ERR_INVAL;
+
+  if (!no_debug)
+    NH_LOGF_DEBUG(log, "MQTT", "Sending message,  topic=[%s], message=[%s]", topic->topic.c_str(), message.c_str());
+
+  if (_host != NULL)
+    return _host->message_send(topic, message, true);
+
+  if ((_bus != NULL) && topic->local)
+    return bus_send(topic->topic, message);
+
+  if (_loop_running)
+  {
+    if (!_mosq_connected && ((topic->qos == 0) || (_spool == NULL)))
+      return MOSQ_ERR_NO_CONN;
+    return queue_message(_publish_queue->add(topic, message));
+  }
+
+  pthread_mutex_lock(&_mosq_mutex);
+  ret = publish(NULL, topic->topic.c_str(), message.data(), message.length(), topic->qos, topic->retained);
+  pthread_mutex_unlock(&_mosq_mutex);
+  return ret;
+}
+
+int CNHmqtt::queue_message(int ret)
+{
+  // Only log when the queue first fills up, not for every message dropped
+  if (ret == PUBLISH_QUEUE_FULL)
+  {
+    _publish_dropped.fetch_add(1, memory_order_relaxed);
+    if (!_queue_full)
+      log->dbg("Publish queue full (" + itos(_publish_queue->limit()) + " messages) - dropping messages until the broker catches up");
+    _queue_full = true;
+  }
+  else
+  {
+    _queue_full = false;
+
+    // The queue is emptied each time round message_loop(), so only need to wake it if sending from another thread
+    if (!pthread_equal(pthread_self(), _loop_thread))
+      _reactor.wake();
+  }
+
+  return ret;
+}
+
+mqtt_topic *CNHmqtt::topic_handle(string topic, bool retained, bool coalesce)
+/* Get a handle for a frequently used topic, to pass to message_send() instead of the topic string. 
+ * If coalesce is set, only the latest message is sent if several are queued before the network 
+ * thread gets to them. Handles remain valid for the lifetime of this object. */
+{
+  mqtt_topic *handle;
+  string key = topic + (retained ? "\nR" : "\n") + (coalesce ? "C" : "");
+
+  if (_host != NULL)
+    return _host->topic_handle(topic, retained, coalesce);
+
+  pthread_mutex_lock(&_mosq_mutex);
+  map<string, mqtt_topic*>::iterator i = _topic_handles.find(key);
+  if (i != _topic_handles.end())
+    handle = i->second;
+  else
+  {
+    handle = new mqtt_topic();
+    handle->topic = topic;
+    handle->retained = retained;
+    handle->coalesce = coalesce;
+    handle->qos = topic_qos(topic);
+    handle->local = (_bus != NULL) && !retained && is_local(topic);
+    handle->pending.store(NULL);
+    handle->marker = new publish_msg();
+    handle->marker->handle = handle;
+    _topic_handles[key] = handle;
+  }
+  pthread_mutex_unlock(&_mosq_mutex);
+
+  return handle;
+}
+
+void CNHmqtt::send_queued()
+/* Publish everything waiting in the queue. Only called from the network thread. */
+{
+  publish_msg *msg;
+
+  while ((msg = _publish_queue->pop()) != NULL)
+  {
+    const string &topic = (msg->handle != NULL) ? msg->handle->topic : msg->topic;
+
+    if ((msg->qos > 0) && (_spool != NULL))
+      spool_message(msg, topic);
+    else if (publish(NULL, topic.c_str(), msg->message.data(), msg->message.length(), msg->qos, msg->retained))
+      log->dbg("Failed to publish message to [" + topic + "]");
+
+    CPublishQueue::free_msg(msg);
+  }
+
+  send_spooled();
+}
+
+int CNHmqtt::publish(int *mid, const char *topic, const char *payload, size_t len, int qos, bool retained)
+/* mosquitto_publish(), counting what's sent for STATUS DETAIL */
+{
+  int ret = mosquitto_publish(_mosq, mid, topic, len, payload, qos, retained);
+
+  if (ret == MOSQ_ERR_SUCCESS)
+  {
+    _published.fetch_add(1, memory_order_relaxed);
+    _published_bytes.fetch_add(len, memory_order_relaxed);
+  }
+  else
+    _publish_failed.fetch_add(1, memory_order_relaxed);
+
+  return ret;
+}
+
+int CNHmqtt::topic_qos(const string &topic)
+/* QoS to publish to topic with - 1 if it matches one of the qos1_topics filters, otherwise 0 */
+{
+  bool match;
+
+  for (unsigned int n=0; n < _qos1_topics.size(); n++)
+    if (!mosquitto_topic_matches_sub(_qos1_topics[n].c_str(), topic.c_str(), &match) && match)
+      return 1;
+
+  return 0;
+}
+
+void CNHmqtt::spool_message(publish_msg *msg, const string &topic)
+/* Add message to the end of the spool, to be sent by send_spooled() once everything before it has been */
+{
+  if (_spool->append(topic, msg->message.data(), msg->message.length(), msg->retained))
+  {
+    _spool_dropped++;
+    log->dbg("Spool full (" + itos(_spool->used()) + " bytes) - dropping message to [" + topic + "]");
+  }
+}
+
+void CNHmqtt::send_spooled()
+/* Publish spooled messages in order, keeping up to SPOOL_MAX_INFLIGHT waiting for a PUBACK. They stay 
+ * in the spool until acknowledged. */
+{
+  spool_record rec;
+  spool_inflight inflight;
+
+  if ((_spool == NULL) || !_mosq_connected)
+    return;
+
+  while ((_spool_inflight.size() < SPOOL_MAX_INFLIGHT) && (_spool_send_pos < _spool->tail()))
+  {
+    if (!_spool->read(_spool_send_pos, rec, inflight.next))
+    {
+      log->dbg("Invalid record in spool - discarding remainder");
+      _spool->ack(_spool->tail());
+      _spool_send_pos = _spool->tail();
+      _spool_inflight.clear();
+      break;
+    }
+
+    if (publish(&inflight.mid, rec.topic, rec.payload, rec.payload_len, 1, rec.retained) != MOSQ_ERR_SUCCESS)
+      break; // try again next time round
+
+    inflight.acked = false;
+    _spool_inflight.push_back(inflight);
+    _spool_send_pos = inflight.next;
+  }
+}
+
+void CNHmqtt::spool_acked(int mid)
+/* PUBACK received (or QoS0 message sent). Messages are removed from the spool once they, and 
+ * everything before them, have been acknowledged. */
+{
+  if (_spool == NULL)
+    return;
+
+  for (deque<spool_inflight>::iterator i = _spool_inflight.begin(); i != _spool_inflight.end(); ++i)
+    if (i->mid == mid)
+    {
+      i->acked = true;
+      break;
+    }
+
+  while (!_spool_inflight.empty() && _spool_inflight.front().acked)
+  {
+    _spool->ack(_spool_inflight.front().next);
+    _spool_inflight.pop_front();
+
+    if (_replaying)
+      _replay_count++;
+  }
+
+  if (_replaying && (_spool->used() == 0))
+  {
+    _replaying = false;
+    _last_replay_count = _replay_count;
+    _last_replay_ms = now_ms() - _replay_start;
+    log->dbg("Spool replay complete: " + spool_status());
+  }
+}
+
+string CNHmqtt::spool_status()
+{
+  stringstream ss;
+
+  if (_spool == NULL)
+    return "Spool: " + _status_name + " disabled";
+
+  ss << "Spool: " << _status_name 
+     << " used=" << _spool->used() << "/" << _spool->capacity() << " bytes"
+     << " inflight=" << _spool_inflight.size() 
+     << " dropped=" << _spool_dropped
+     << " last_replay=" << _last_replay_count << " messages in " << _last_replay_ms << "ms";
+
+  if (_last_replay_ms > 0)
+    ss << " (" << (_last_replay_count * 1000 / _last_replay_ms) << " messages/s)";
+
+  return ss.str();
+}
+
+string CNHmqtt::status_detail()
+/* Compact JSON document describing what this process has been doing, sent in reply to "STATUS DETAIL" */
+{
+  stringstream ss;
+  bool first = true;
+  CNHmqtt *conn = (_host != NULL) ? _host : this; // hosted services publish via the host
+
+  ss << "{\"name\":" << json_string(_status_name);
+  if (_host != NULL)
+    ss << ",\"host\":" << json_string(_host->_status_name);
+
+  ss << ",\"uptime\":" << (time(NULL) - _start_time)
+     << ",\"connected\":" << (conn->_mosq_connected ? "true" : "false")
+     << ",\"published\":{\"messages\":" << conn->_published.load() 
+     << ",\"bytes\":" << conn->_published_bytes.load() 
+     << ",\"failed\":" << conn->_publish_failed.load() 
+     << ",\"dropped\":" << conn->_publish_dropped.load() << "}"
+     << ",\"queues\":{\"publish\":" << ((conn->_publish_queue == NULL) ? 0 : conn->_publish_queue->depth())
+     << ",\"workers\":" << ((conn->_workers == NULL) ? 0 : conn->_workers->queue_depth());
+
+  if (conn->_spool != NULL)
+    ss << ",\"spool_bytes\":" << conn->_spool->used() << ",\"spool_inflight\":" << conn->_spool_inflight.size();
+
+  if (conn->_bus != NULL)
+    ss << "},\"local_bus\":{\"published\":" << conn->_bus->published() 
+       << ",\"received\":" << conn->_bus->received() 
+       << ",\"overruns\":" << conn->_bus->overruns();
+
+  ss << "}";
+
+  if (_value_cache != NULL)
+    ss << ",\"cached_topics\":" << _value_cache->size();
+
+  if (conn->_log_async)
+    ss << ",\"log_dropped\":" << log->dropped();
+
+  if (conn->_log_compress_level > 0)
+    ss << ",\"logs_compressed\":" << log->compressed();
+
+  string extra = status_detail_extra();
+  if (!extra.empty())
+    ss << "," << extra;
+
+  ss << ",\"topics\":[";
+  for (map<string, topic_metrics*>::iterator i = _topic_metrics.begin(); i != _topic_metrics.end(); ++i)
+  {
+    if (!first)
+      ss << ",";
+    ss << i->second->json();
+    first = false;
+  }
+  ss << "]}";
+
+  return ss.str();
+}
+
+long long CNHmqtt::now_ms()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
 int CNHmqtt::message_send(string topic, string message)
 {
   return message_send(topic, message, false);
@@ -396,14 +1292,85 @@ string CNHmqtt::get_topic()
 int CNHmqtt::message_loop(void)
 {
   string dbgmsg="";
-  int ret;
   
   if (_mosq==NULL)
     return -1;
+
+  if (!_reactor.valid())
+  {
+    log->dbg("Failed to create epoll instance");
+    return -1;
+  }
+
+  // Not before now, as the flusher thread wouldn't survive daemonize()
+  if (_log_async && (_host == NULL) && !debug_mode)
+    if (log->start_async(_log_buffer > 0 ? _log_buffer : 0, _log_block, _log_flush_ms > 0 ? _log_flush_ms : 0))
+      log->dbg("Failed to start async logging");
+
+  if (((_log_compress_level > 0) || (_log_keep_days > 0)) && (_host == NULL) && !debug_mode)
+    if (log->start_compression(_log_compress_level, _log_keep_days))
+      log->dbg("Failed to start logfile compression");
+
+  if ((_worker_threads > 0) && (_workers == NULL))
+  {
+    _workers = new CWorkerPool(_worker_threads, CNHmqtt::s_process_queued, this, log);
+    _workers->set_thread_callbacks(CNHmqtt::s_worker_thread_start, CNHmqtt::s_worker_thread_end);
+    if (_workers->start())
+    {
+      log->dbg("Failed to start worker threads - processing messages on the network thread");
+      delete _workers;
+      _workers = NULL;
+    }
+  }
   
-  ret = mosquitto_loop_forever(_mosq, 50, 999);
+  // Equivalent of mosquitto_loop_forever(), but on an epoll loop that subclasses can add their own fds/timers 
+  // to, and sending anything queued by message_send() each time round
+  int misc_timer = _reactor.add_timer(1000, CNHmqtt::s_mosq_misc, this);
+  int stats_timer = (_stats_interval > 0) ? _reactor.add_timer(_stats_interval * 1000, CNHmqtt::s_publish_stats, this) : -1;
+  _loop_thread = pthread_self();
+  _disconnect_requested = false;
+  _loop_running = true;
+  if ((_bus != NULL) && _bus->start_notify(CNHmqtt::s_bus_wake, this))
+    log->dbg("Failed to start local bus thread");
+
+  while (!_disconnect_requested)
+  {
+    send_queued();
+    if (_bus != NULL)
+      poll_bus();
+    update_mosq_socket();
+
+    // Don't wait if poll_bus() stopped part way through
+    if (_reactor.run_once(((_bus != NULL) && _bus->pending()) ? 0 : 1000) < 0)
+    {
+      log->dbg("epoll_wait failed");
+      break;
+    }
+  }
+  _reactor.remove_timer(misc_timer);
+  if (stats_timer != -1)
+    _reactor.remove_timer(stats_timer);
+  if (_bus != NULL)
+    _bus->stop_notify();
+  if (_mosq_fd != -1)
+  {
+    _reactor.remove_fd(_mosq_fd);
+    _mosq_fd = -1;
+  }
   
-  log->dbg("Exit. mosquitto_loop_forever ret = " + itos(ret));
+  log->dbg("Exit. message loop");
+
+  // Let the workers finish with anything already received before disconnecting
+  if (_workers != NULL)
+  {
+    _workers->stop();
+    delete _workers;
+    _workers = NULL;
+  }
+
+  _loop_running = false;
+  send_queued();
+
   _mosq_connected = false;
   mosquitto_disconnect(_mosq);
   mosquitto_destroy(_mosq);
@@ -412,6 +1379,120 @@ int CNHmqtt::message_loop(void)
   return 0;
 }
 
+void CNHmqtt::update_mosq_socket()
+/* Keep the epoll registration in step with the mosquitto socket, which changes on reconnect (and is -1 
+ * while disconnected), and only ask for EPOLLOUT when mosquitto has something waiting to be written. 
+ * (s_mosq_misc() drops the registration after a reconnect, in case the new socket has the same fd) */
+{
+  int fd = mosquitto_socket(_mosq);
+
+  if (fd != _mosq_fd)
+  {
+    if (_mosq_fd != -1)
+      _reactor.remove_fd(_mosq_fd);
+
+    _mosq_fd = -1;
+    if ((fd != -1) && !_reactor.add_fd(fd, EPOLLIN, CNHmqtt::s_mosq_event, this))
+      _mosq_fd = fd;
+  }
+
+  if (_mosq_fd != -1)
+    _reactor.modify_fd(_mosq_fd, mosquitto_want_write(_mosq) ? (EPOLLIN | EPOLLOUT) : EPOLLIN);
+}
+
+void CNHmqtt::s_mosq_event(void *obj, int, unsigned int events)
+{
+  CNHmqtt *m = (CNHmqtt*)obj;
+  int ret = MOSQ_ERR_SUCCESS;
+
+  if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+    ret = mosquitto_loop_read(m->_mosq, 1);
+
+  if ((ret == MOSQ_ERR_SUCCESS) && (events & EPOLLOUT))
+    ret = mosquitto_loop_write(m->_mosq, 1);
+
+  if ((ret != MOSQ_ERR_SUCCESS) && !m->_disconnect_requested)
+    m->log->dbg("mosquitto connection error (" + itos(ret) + "), will reconnect");
+}
+
+void CNHmqtt::s_publish_stats(void *obj)
+/* Called every stats_interval seconds from message_loop() - publish the STATUS DETAIL document for
+ * this process, and each service it's hosting, as if it'd been asked for */
+{
+  CNHmqtt *m = (CNHmqtt*)obj;
+
+  m->message_send(m->_status_detail_topic, m->status_detail(), m->_no_staus_debug);
+  for (unsigned int n=0; n < m->_services.size(); n++)
+    m->_services[n]->message_send(m->_services[n]->_status_detail_topic, m->_services[n]->status_detail(), m->_no_staus_debug);
+}
+
+void CNHmqtt::s_mosq_misc(void *obj)
+/* Called every second from message_loop() - keepalives, and reconnecting if the connection was lost */
+{
+  CNHmqtt *m = (CNHmqtt*)obj;
+
+  if (m->_disconnect_requested)
+    return;
+
+  if ((mosquitto_socket(m->_mosq) != -1) && (mosquitto_loop_misc(m->_mosq) != MOSQ_ERR_NO_CONN))
+    return;
+
+  if (mosquitto_reconnect(m->_mosq) == MOSQ_ERR_SUCCESS)
+  {
+    m->log->dbg("Reconnected to mosquitto");
+
+    // The new socket usually gets the old one's fd number back, but epoll's registration was for the
+    // old socket (and went when that was closed), so always register it again
+    if (m->_mosq_fd != -1)
+    {
+      m->_reactor.remove_fd(m->_mosq_fd);
+      m->_mosq_fd = -1;
+    }
+    m->update_mosq_socket();
+  }
+}
+
+int CNHmqtt::watch_fd(int fd, fd_callback callback, void *obj)
+/* Have callback called from message_loop() whenever fd is readable. Call from the message_loop() thread, 
+ * or before entering it. */
+{
+  if (_host != NULL)
+    return _host->watch_fd(fd, callback, obj);
+
+  if (_reactor.add_fd(fd, EPOLLIN, callback, obj))
+  {
+    log->dbg("Failed to add fd [" + itos(fd) + "] to event loop");
+    return -1;
+  }
+
+  return 0;
+}
+
+void CNHmqtt::unwatch_fd(int fd)
+{
+  if (_host != NULL)
+    _host->unwatch_fd(fd);
+  else
+    _reactor.remove_fd(fd);
+}
+
+int CNHmqtt::add_timer(int interval_ms, timer_callback callback, void *obj)
+/* Have callback called from message_loop() every interval_ms. Returns an id to pass to remove_timer() */
+{
+  if (_host != NULL)
+    return _host->add_timer(interval_ms, callback, obj);
+
+  return _reactor.add_timer(interval_ms, callback, obj);
+}
+
+void CNHmqtt::remove_timer(int id)
+{
+  if (_host != NULL)
+    _host->remove_timer(id);
+  else
+    _reactor.remove_timer(id);
+}
+
 string CNHmqtt::hex2legacy_rfid(string rfid_serial)
 {
   unsigned long lUid;
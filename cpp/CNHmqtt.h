@@ -2,8 +2,20 @@
 #include <string>
 #include <sstream>
 #include <list>
+#include <map>
+#include <deque>
+#include <vector>
+#include <atomic>
 #include "mosquitto.h"
 #include "CLogging.h"
+#include "CTopicTrie.h"
+#include "CWorkerPool.h"
+#include "CPublishQueue.h"
+#include "CReactor.h"
+#include "CSpool.h"
+#include "CShmBus.h"
+#include "CValueCache.h"
+#include "CMetrics.h"
 #include "inireader/INIReader.h"
 
 #define EXIT_TERMINATE 1 
@@ -19,11 +31,14 @@ class CNHmqtt
     void dbg(std::string msg);
     int message_loop(void);
     static int daemonize();
+    static void set_host(CNHmqtt *host);
          
     int  mosq_connect();
     virtual void process_message(std::string topic, std::string message);
+    virtual void process_message_view(const str_view &topic, const str_view &message);
    
     int subscribe(std::string topic);
+    int subscribe(std::string topic, topic_handler handler, void *obj);
     bool _mosq_connected;
     static bool debug_mode;
     static bool daemonized;
@@ -38,25 +53,142 @@ class CNHmqtt
     std::string _status_name; // process name to report in respose to status message
     std::string _status_req_topic; // topic status requests are sent to
     std::string _status_res_topic; // topic status responses are to be published to
+    std::string _status_detail_topic; // topic STATUS DETAIL (JSON) and SPOOL responses are published to
     std::string _mosq_server;
     int _mosq_port;
     CLogging *log;
 
     int message_send(std::string topic, std::string message);
     int message_send(std::string topic, std::string message, bool no_debug, bool retained = false);
+    int message_send(mqtt_topic *topic, std::string message, bool no_debug = false);
+    mqtt_topic *topic_handle(std::string topic, bool retained = false, bool coalesce = false);
+    virtual std::string partition_key(const std::string &topic);
+    virtual void worker_thread_start() {};
+    virtual void worker_thread_end() {};
+    virtual std::string status_detail_extra() { return ""; }; // extra "name":value members for STATUS DETAIL
     int get_int_option(std::string section, std::string option, int def_value);
+
+    // Last value cache
+    int cache_topic(std::string filter, unsigned int max_topics = 64);
+    bool cache_get(const std::string &topic, cached_value &value);
+    int cache_find(const std::string &filter, std::vector<cached_value> &values);
+
+    // Extra fds/timers for message_loop() to handle, so they're processed on the same thread as MQTT messages
+    int watch_fd(int fd, fd_callback callback, void *obj);
+    void unwatch_fd(int fd);
+    int add_timer(int interval_ms, timer_callback callback, void *obj);
+    void remove_timer(int id);
     std::string get_str_option(std::string section, std::string option, std::string def_value);
         
   private:
     static void message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message);
     static void connect_callback(struct mosquitto *mosq, void *obj, int result);
+    static void disconnect_callback(struct mosquitto *mosq, void *obj, int result);
+    static void publish_callback(struct mosquitto *mosq, void *obj, int mid);
+    static void s_mosq_event(void *obj, int fd, unsigned int events);
+    static void s_mosq_misc(void *obj);
+    static void s_publish_stats(void *obj);
+    static void s_process_queued(void *obj, const std::string &topic, const std::string &message);
+    static void s_terminate_request(void *obj, const topic_match &match, const str_view &message);
+    static void s_status_request(void *obj, const topic_match &match, const str_view &message);
+    static std::string printable(const str_view &message);
+    static void s_worker_thread_start(void *obj);
+    static void s_worker_thread_end(void *obj);
+    void handle_message(const str_view &topic, const str_view &message);
+    void deliver(const str_view &topic, const str_view &payload);
+    void poll_bus();
+    static void s_bus_wake(void *obj);
+    bool subscribed(const str_view &topic);
+    bool is_local(const std::string &topic);
+    bool bridged_copy(const str_view &topic, const str_view &payload, bool from_bus);
+    static uint64_t message_hash(const str_view &topic, const str_view &payload);
+    int bus_send(const std::string &topic, const std::string &message);
+    static void split_list(const std::string &list, std::vector<std::string> &items);
     void connected();
+    int queue_message(int ret);
+    void send_queued();
+    void update_mosq_socket();
+    int topic_qos(const std::string &topic);
+    void spool_message(publish_msg *msg, const std::string &topic);
+    void send_spooled();
+    void spool_acked(int mid);
+    std::string spool_status();
+    std::string status_detail();
+    int publish(int *mid, const char *topic, const char *payload, size_t len, int qos, bool retained);
+    static long long now_ms();
     bool _config_file_parsed;
     bool _config_file_default_parsed;
     bool _no_staus_debug;
+    int _stats_interval;     // seconds between unprompted STATUS DETAIL documents (0 = only when asked)
+    bool _log_async;
+    int _log_buffer;
+    bool _log_block;
+    int _log_flush_ms;
+    int _log_compress_level; // 0 = don't compress old logfiles
+    int _log_keep_days;
     INIReader *_reader;
     INIReader *_reader_default;
     uid_t _uid;
     pthread_mutex_t _mosq_mutex;
     std::list<std::string> _topic_list;
+    CTopicTrie _topic_trie;
+    int _worker_threads;
+    CWorkerPool *_workers;
+    CPublishQueue *_publish_queue;
+    bool _loop_running;
+    bool _disconnect_requested;
+    bool _queue_full;
+    mqtt_topic *_status_res_handle;
+    std::map<std::string, mqtt_topic*> _topic_handles;
+    CReactor _reactor;
+    int _mosq_fd;
+    pthread_t _loop_thread;
+
+    // Persistent session / QoS1 spool
+    struct spool_inflight
+    {
+      int mid;
+      uint64_t next; // spool position following this message
+      bool acked;
+    };
+    bool _persistent_session;
+    std::string _client_id;
+    int _sub_qos;
+    std::vector<std::string> _qos1_topics;
+    CSpool *_spool;
+    uint64_t _spool_send_pos;
+    std::deque<spool_inflight> _spool_inflight;
+    unsigned int _spool_dropped;
+    bool _replaying;
+    long long _replay_start;
+    unsigned int _replay_count;
+    unsigned int _last_replay_count;
+    long long _last_replay_ms;
+
+    // Local (shared memory) bus
+    CShmBus *_bus;
+    std::vector<std::string> _local_topics;
+    bool _bus_bridge; // copy local messages to mosquitto
+    struct bus_message
+    {
+      uint64_t hash;
+      long long received_ms;
+      bool from_bus; // else from mosquitto
+    };
+    std::deque<bus_message> _bus_recent; // local messages received one way, the other copy still to come
+
+    CValueCache *_value_cache; // NULL unless cache_topic() has been called
+
+    // Metrics for STATUS DETAIL
+    std::map<std::string, topic_metrics*> _topic_metrics; // by filter subscribed to
+    std::atomic<uint64_t> _published;
+    std::atomic<uint64_t> _published_bytes;
+    std::atomic<uint64_t> _publish_failed;
+    std::atomic<uint64_t> _publish_dropped; // publish queue full
+    time_t _start_time;
+
+    // Running several services in one process (nh-host)
+    static CNHmqtt *_next_host;
+    CNHmqtt *_host;                  // set if this is a service running inside another process
+    std::vector<CNHmqtt*> _services; // services this process is hosting
 };
@@ -24,28 +24,34 @@ bool CNHmqtt_irc::init()
   if (mosq_connect())
     return false;
   
-  subscribe(irc_in + "/#");
-  subscribe(slack_in + "/#");
+  subscribe(irc_in + "/#", s_irc_message, this);
+  subscribe(slack_in + "/#", s_slack_message, this);
   daemonize();
   return true;
 }
 
-void CNHmqtt_irc::process_message(string topic, string message)
+void CNHmqtt_irc::s_irc_message(void *obj, const topic_match &m, const str_view &message)
+{
+  ((CNHmqtt_irc*)obj)->irc_message(m, message, irc_msg::MSGTYPE_IRC);
+}
+
+void CNHmqtt_irc::s_slack_message(void *obj, const topic_match &m, const str_view &message)
+{
+  ((CNHmqtt_irc*)obj)->irc_message(m, message, irc_msg::MSGTYPE_SLACK);
+}
+
+void CNHmqtt_irc::irc_message(const topic_match &m, const str_view &message, irc_msg::msg_type msgtype)
 { 
   string nick;
   string channel;
 
-  bool is_from_irc   = is_irc_msg  (topic);
-  bool is_from_slack = is_slack_msg(topic);
-
-  if (is_from_irc || is_from_slack)
-  {
-    decode_irc_topic((is_from_irc ? irc_in: slack_in), topic, nick, channel);
-    irc_msg msg = irc_msg(message, channel, nick, this, (is_from_irc ? irc_msg::MSGTYPE_IRC : irc_msg::MSGTYPE_SLACK));
-    process_irc_message(msg);
-  }
+  // Ignore anything sent to the base topic itself
+  if (m.wildcard[0].len == 0)
+    return;
 
-  CNHmqtt::process_message(topic, message);
+  decode_irc_topic((msgtype == irc_msg::MSGTYPE_IRC ? irc_in : slack_in), m.topic.str(), nick, channel);
+  irc_msg msg = irc_msg(message.str(), channel, nick, this, msgtype);
+  process_irc_message(msg);
 }
 
 // irc_in = base topic, e.g. "nh/irc/rx"
@@ -103,19 +103,31 @@ class CNHmqtt_irc : CNHmqtt
     int slack_send_channel (std::string message, std::string channel);
     bool is_irc_msg(std::string topic);
     bool is_slack_msg(std::string topic);
-    void process_message(std::string topic, std::string message);
+    static void s_irc_message(void *obj, const topic_match &m, const str_view &message);
+    static void s_slack_message(void *obj, const topic_match &m, const str_view &message);
+    void irc_message(const topic_match &m, const str_view &message, irc_msg::msg_type msgtype);
     virtual void process_irc_message(irc_msg msg) = 0;
     bool init();
+    CNHmqtt *service() { return this; }; // for running inside nh-host
 
+    using CNHmqtt::process_message;
     using CNHmqtt::get_str_option;
     using CNHmqtt::get_int_option;
     using CNHmqtt::message_send;
+    using CNHmqtt::topic_handle;
     using CNHmqtt::log;
     using CNHmqtt::subscribe;
     using CNHmqtt::message_loop;
     using CNHmqtt::itos;
     using CNHmqtt::debug_mode;
     using CNHmqtt::hex2legacy_rfid;
+    using CNHmqtt::watch_fd;
+    using CNHmqtt::unwatch_fd;
+    using CNHmqtt::add_timer;
+    using CNHmqtt::remove_timer;
+    using CNHmqtt::cache_topic;
+    using CNHmqtt::cache_get;
+    using CNHmqtt::cache_find;
 
         
 //  private:
@@ -0,0 +1,143 @@
+#include "CPublishQueue.h"
+#include <stddef.h>
+
+using namespace std;
+
+CPublishQueue::CPublishQueue(unsigned int limit)
+{
+  _limit = limit;
+  _depth.store(0);
+  _stub.next.store(NULL);
+  _stub.handle = NULL;
+  _head.store(&_stub);
+  _tail = &_stub;
+}
+
+CPublishQueue::~CPublishQueue()
+{
+  publish_msg *msg;
+
+  while ((msg = pop()) != NULL)
+    free_msg(msg);
+}
+
+void CPublishQueue::free_msg(publish_msg *msg)
+{
+  delete msg;
+}
+
+bool CPublishQueue::reserve()
+/* Make room for one more message, or return false if the queue is already at its limit */
+{
+  unsigned int depth = _depth.fetch_add(1);
+
+  if (_limit && (depth >= _limit))
+  {
+    _depth.fetch_sub(1);
+    return false;
+  }
+
+  return true;
+}
+
+void CPublishQueue::push(publish_msg *msg)
+{
+  msg->next.store(NULL, memory_order_relaxed);
+  publish_msg *prev = _head.exchange(msg, memory_order_acq_rel);
+  prev->next.store(msg, memory_order_release);
+}
+
+int CPublishQueue::add(const string &topic, string &message, bool retained, int qos)
+/* Queue message for sending. message is swapped out rather than copied, so is left empty */
+{
+  if (!reserve())
+    return PUBLISH_QUEUE_FULL;
+
+  publish_msg *msg = new publish_msg();
+  msg->handle = NULL;
+  msg->topic = topic;
+  msg->message.swap(message);
+  msg->retained = retained;
+  msg->qos = qos;
+  push(msg);
+
+  return 0;
+}
+
+int CPublishQueue::add(mqtt_topic *handle, string &message)
+{
+  publish_msg *msg;
+
+  if (!handle->coalesce)
+  {
+    if (!reserve())
+      return PUBLISH_QUEUE_FULL;
+
+    msg = new publish_msg();
+    msg->handle = handle;
+    msg->message.swap(message);
+    msg->retained = handle->retained;
+    msg->qos = handle->qos;
+    push(msg);
+    return 0;
+  }
+
+  // Coalescing - replace whatever is waiting to be sent. Only queue the handle's marker if nothing
+  // was, otherwise it's already queued. As there's at most one marker per handle in the queue,
+  // these don't count towards the limit.
+  msg = new publish_msg();
+  msg->handle = handle;
+  msg->message.swap(message);
+  msg->retained = handle->retained;
+  msg->qos = handle->qos;
+
+  publish_msg *old = handle->pending.exchange(msg, memory_order_acq_rel);
+  if (old != NULL)
+    free_msg(old);
+  else
+  {
+    _depth.fetch_add(1);
+    push(handle->marker);
+  }
+
+  return 0;
+}
+
+publish_msg *CPublishQueue::pop()
+/* Returns the next message to send (which the caller must free_msg()), or NULL if there isn't one.
+ * Must only be called from one thread. */
+{
+  publish_msg *tail = _tail;
+  publish_msg *next = tail->next.load(memory_order_acquire);
+
+  if (tail == &_stub)
+  {
+    if (next == NULL)
+      return NULL;
+    _tail = next;
+    tail = next;
+    next = next->next.load(memory_order_acquire);
+  }
+
+  if (next == NULL)
+  {
+    // tail is the last message - unless a producer is part way through adding another, put the
+    // stub back behind it so it can be removed.
+    if (tail != _head.load(memory_order_acquire))
+      return NULL;
+
+    push(&_stub);
+    next = tail->next.load(memory_order_acquire);
+    if (next == NULL)
+      return NULL;
+  }
+
+  _tail = next;
+  _depth.fetch_sub(1);
+
+  // Marker for a coalesced topic - send the newest message given for it
+  if ((tail->handle != NULL) && (tail == tail->handle->marker))
+    return tail->handle->pending.exchange(NULL, memory_order_acq_rel);
+
+  return tail;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <string>
+#include <atomic>
+
+#define PUBLISH_QUEUE_FULL (-100) // returned by message_send() when a bounded queue has no room
+
+struct publish_msg;
+
+// Precomputed handle for a topic that is published to often, so the topic string doesn't
+// have to be rebuilt for each message. Created by CNHmqtt::topic_handle().
+// If coalesce is set, only the newest message is kept while one is still waiting to be
+// sent - useful for retained/status topics, where any older value is already stale.
+struct mqtt_topic
+{
+  std::string topic;
+  bool retained;
+  bool coalesce;
+  int qos;
+  bool local; // sent over the local bus instead of mosquitto
+  std::atomic<publish_msg*> pending; // coalesced message waiting to be sent
+  publish_msg *marker;               // queued in place of the message when coalescing
+};
+
+struct publish_msg
+{
+  std::atomic<publish_msg*> next;
+  mqtt_topic *handle; // NULL if topic is set instead
+  std::string topic;
+  std::string message;
+  bool retained;
+  int qos;
+};
+
+// Multiple-producer, single-consumer queue of messages waiting to be published. Any thread
+// can add() without taking a lock; only one thread (the network thread) may call pop().
+// Based on Dmitry Vyukov's intrusive MPSC node-based queue.
+class CPublishQueue
+{
+  public:
+    CPublishQueue(unsigned int limit);
+    ~CPublishQueue();
+
+    int add(const std::string &topic, std::string &message, bool retained, int qos = 0);
+    int add(mqtt_topic *handle, std::string &message);
+    publish_msg *pop();
+    unsigned int depth() { return _depth.load(std::memory_order_relaxed); };
+    unsigned int limit() { return _limit; };
+
+    static void free_msg(publish_msg *msg);
+
+  private:
+    std::atomic<publish_msg*> _head;
+    publish_msg *_tail;
+    publish_msg _stub;
+    std::atomic<unsigned int> _depth;
+    unsigned int _limit; // 0 = unbounded
+
+    bool reserve();
+    void push(publish_msg *msg);
+};
@@ -0,0 +1,219 @@
+#include "CReactor.h"
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+
+#define MAX_EVENTS 32
+
+using namespace std;
+
+CReactor::CReactor()
+{
+  struct epoll_event ev;
+
+  _next_timer_id = 1;
+  _epfd = epoll_create1(EPOLL_CLOEXEC);
+  _wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if ((_epfd == -1) || (_wakefd == -1))
+  {
+    if (_epfd != -1)
+      close(_epfd);
+    _epfd = -1;
+    return;
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.fd = _wakefd;
+  epoll_ctl(_epfd, EPOLL_CTL_ADD, _wakefd, &ev);
+}
+
+CReactor::~CReactor()
+{
+  if (_epfd != -1)
+    close(_epfd);
+
+  if (_wakefd != -1)
+    close(_wakefd);
+}
+
+int CReactor::add_fd(int fd, unsigned int events, fd_callback callback, void *obj)
+{
+  struct epoll_event ev;
+  fd_entry entry;
+
+  if ((_epfd == -1) || (fd < 0) || (callback == NULL))
+    return -1;
+
+  ev.events = events;
+  ev.data.fd = fd;
+  if (epoll_ctl(_epfd, _fds.count(fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev))
+    return -1;
+
+  entry.events = events;
+  entry.callback = callback;
+  entry.obj = obj;
+  _fds[fd] = entry;
+
+  return 0;
+}
+
+int CReactor::modify_fd(int fd, unsigned int events)
+{
+  struct epoll_event ev;
+  map<int, fd_entry>::iterator i = _fds.find(fd);
+
+  if (i == _fds.end())
+    return -1;
+
+  if (i->second.events == events)
+    return 0;
+
+  ev.events = events;
+  ev.data.fd = fd;
+  if (epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &ev))
+    return -1;
+
+  i->second.events = events;
+  return 0;
+}
+
+void CReactor::remove_fd(int fd)
+{
+  struct epoll_event ev; // ignored, but must be non-NULL for older kernels
+
+  if (!_fds.erase(fd))
+    return;
+
+  // Fails if fd has already been closed - which is fine, as that removes it anyway
+  epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+int CReactor::add_timer(int interval_ms, timer_callback callback, void *obj)
+/* Call callback every interval_ms (first call is interval_ms from now). Returns an id for remove_timer() */
+{
+  timer t;
+
+  if ((interval_ms <= 0) || (callback == NULL))
+    return -1;
+
+  t.id = _next_timer_id++;
+  t.interval = interval_ms;
+  t.next = now_ms() + interval_ms;
+  t.callback = callback;
+  t.obj = obj;
+  _timers.push_back(t);
+
+  return t.id;
+}
+
+void CReactor::remove_timer(int id)
+{
+  // Only marked as removed here, as this may be called from a timer callback
+  for (unsigned int n=0; n < _timers.size(); n++)
+    if (_timers[n].id == id)
+      _timers[n].callback = NULL;
+}
+
+void CReactor::wake()
+/* Make run_once() return early. Safe to call from any thread. */
+{
+  uint64_t val = 1;
+
+  if (_wakefd != -1)
+    if (write(_wakefd, &val, sizeof(val))) {};
+}
+
+long long CReactor::now_ms()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+int CReactor::next_timeout(int max_wait_ms)
+{
+  long long now = now_ms();
+  long long timeout = max_wait_ms;
+
+  for (unsigned int n=0; n < _timers.size(); n++)
+  {
+    if (_timers[n].callback == NULL)
+      continue;
+
+    if (_timers[n].next - now < timeout)
+      timeout = _timers[n].next - now;
+  }
+
+  return (timeout < 0) ? 0 : (int)timeout;
+}
+
+void CReactor::run_timers()
+{
+  long long now = now_ms();
+
+  // Index based, as callbacks may add timers
+  for (unsigned int n=0; n < _timers.size(); n++)
+  {
+    if ((_timers[n].callback == NULL) || (_timers[n].next > now))
+      continue;
+
+    // If we've fallen behind, don't try to catch up with a burst of calls
+    _timers[n].next += _timers[n].interval;
+    if (_timers[n].next <= now)
+      _timers[n].next = now + _timers[n].interval;
+
+    _timers[n].callback(_timers[n].obj);
+  }
+
+  for (unsigned int n=0; n < _timers.size(); )
+  {
+    if (_timers[n].callback == NULL)
+      _timers.erase(_timers.begin() + n);
+    else
+      n++;
+  }
+}
+
+int CReactor::run_once(int max_wait_ms)
+/* Wait for up to max_wait_ms for an fd event or timer, and process whatever's due. Returns the number
+ * of fd events processed, or -1 on error. */
+{
+  struct epoll_event events[MAX_EVENTS];
+  int count;
+  int processed = 0;
+
+  if (_epfd == -1)
+    return -1;
+
+  count = epoll_wait(_epfd, events, MAX_EVENTS, next_timeout(max_wait_ms));
+  if ((count == -1) && (errno != EINTR))
+    return -1;
+
+  for (int n=0; n < count; n++)
+  {
+    int fd = events[n].data.fd;
+
+    if (fd == _wakefd)
+    {
+      uint64_t val;
+      if (read(_wakefd, &val, sizeof(val))) {};
+      continue;
+    }
+
+    // Look up each time, as an earlier callback might have removed it
+    map<int, fd_entry>::iterator i = _fds.find(fd);
+    if (i == _fds.end())
+      continue;
+
+    i->second.callback(i->second.obj, fd, events[n].events);
+    processed++;
+  }
+
+  run_timers();
+
+  return processed;
+}
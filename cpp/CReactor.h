@@ -0,0 +1,54 @@
+#pragma once
+#include <map>
+#include <vector>
+#include <sys/epoll.h>
+
+typedef void (*fd_callback)(void *obj, int fd, unsigned int events);
+typedef void (*timer_callback)(void *obj);
+
+// Single threaded epoll event loop. Calls fd_callback when a watched fd has any of the
+// requested events (EPOLLIN, EPOLLOUT, ...) pending, and timer_callback every interval_ms.
+// Other than wake(), methods must only be called from the thread running run_once() (or
+// before it's first called).
+class CReactor
+{
+  public:
+    CReactor();
+    ~CReactor();
+
+    bool valid() { return (_epfd != -1); };
+    int add_fd(int fd, unsigned int events, fd_callback callback, void *obj);
+    int modify_fd(int fd, unsigned int events);
+    void remove_fd(int fd);
+    int add_timer(int interval_ms, timer_callback callback, void *obj);
+    void remove_timer(int id);
+    void wake();
+    int run_once(int max_wait_ms);
+
+  private:
+    struct fd_entry
+    {
+      unsigned int events;
+      fd_callback callback;
+      void *obj;
+    };
+
+    struct timer
+    {
+      int id;
+      long long interval;
+      long long next;
+      timer_callback callback; // NULL once removed
+      void *obj;
+    };
+
+    int _epfd;
+    int _wakefd;
+    int _next_timer_id;
+    std::map<int, fd_entry> _fds;
+    std::vector<timer> _timers;
+
+    static long long now_ms();
+    int next_timeout(int max_wait_ms);
+    void run_timers();
+};
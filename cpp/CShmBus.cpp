@@ -0,0 +1,376 @@
+#include "CShmBus.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+
+#define SHM_BUS_MAGIC   0x5355424E // "NBUS"
+#define SHM_BUS_VERSION 1
+#define SHM_BUS_HEADER  4096 // ring starts on the page after the header
+#define SHM_BUS_PAD     0x1  // record flag: padding up to the end of the ring, skip it
+#define SHM_BUS_STUCK_MS 1000
+
+using namespace std;
+
+static long long now_ms()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static int futex(std::atomic<uint32_t> *addr, int op, uint32_t val, const struct timespec *timeout)
+{
+  // Not FUTEX_PRIVATE_FLAG - the word is shared with other processes
+  return syscall(SYS_futex, (uint32_t*)addr, op, val, timeout, NULL, 0);
+}
+
+CShmBus::CShmBus()
+{
+  _fd = -1;
+  _map = NULL;
+  _map_size = 0;
+  _hdr = NULL;
+  _base = NULL;
+  _mask = 0;
+  _cursor = 0;
+  _overruns = 0;
+  _stuck_since = 0;
+  _received = 0;
+  _published.store(0);
+  _bridge = false;
+  _thread_running = false;
+  _thread_exit.store(false);
+  _wake_callback = NULL;
+  _wake_obj = NULL;
+}
+
+CShmBus::~CShmBus()
+{
+  close();
+}
+
+int CShmBus::open(string filename, size_t size)
+/* Open the bus, creating it if this is the first process to use it. size is rounded up to a power 
+ * of 2, and is ignored if the bus already exists. */
+{
+  struct stat st;
+  uint64_t ring = 4096;
+
+  close();
+
+  while (ring < size)
+    ring <<= 1;
+
+  _fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0660);
+  if (_fd == -1)
+    return -1;
+
+  // Stop two processes initialising it at once
+  flock(_fd, LOCK_EX);
+
+  if (fstat(_fd, &st))
+  {
+    close();
+    return -1;
+  }
+
+  bool valid = false;
+  if ((size_t)st.st_size > SHM_BUS_HEADER)
+  {
+    uint32_t magic, version;
+    uint64_t existing;
+    if ((pread(_fd, &magic, sizeof(magic), 0) == sizeof(magic)) && (magic == SHM_BUS_MAGIC) &&
+        (pread(_fd, &version, sizeof(version), sizeof(magic)) == sizeof(version)) && (version == SHM_BUS_VERSION) &&
+        (pread(_fd, &existing, sizeof(existing), offsetof(header, size)) == sizeof(existing)) &&
+        (existing + SHM_BUS_HEADER == (uint64_t)st.st_size) && !(existing & (existing - 1)))
+    {
+      valid = true;
+      ring = existing;
+    }
+  }
+
+  if (!valid && ftruncate(_fd, SHM_BUS_HEADER + ring))
+  {
+    close();
+    return -1;
+  }
+
+  void *p = mmap(NULL, SHM_BUS_HEADER + ring, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+  if (p == MAP_FAILED)
+  {
+    close();
+    return -1;
+  }
+
+  _map = (char*)p;
+  _map_size = SHM_BUS_HEADER + ring;
+  _hdr = (header*)_map;
+  _base = _map + SHM_BUS_HEADER;
+  _mask = ring - 1;
+
+  if (!valid)
+  {
+    memset(_map, 0, _map_size);
+    _hdr->size = ring;
+    _hdr->reserve.store(0);
+    _hdr->seq.store(0);
+    _hdr->waiters.store(0);
+    _hdr->bridge.store(0);
+    _hdr->version = SHM_BUS_VERSION;
+    _hdr->magic = SHM_BUS_MAGIC;
+  }
+
+  flock(_fd, LOCK_UN);
+
+  // Only interested in messages published from now on
+  _cursor = _hdr->reserve.load(memory_order_acquire);
+
+  return 0;
+}
+
+void CShmBus::close()
+{
+  stop_notify();
+
+  if (_bridge)
+  {
+    uint32_t pid = getpid();
+    _hdr->bridge.compare_exchange_strong(pid, 0);
+    _bridge = false;
+  }
+
+  if (_map != NULL)
+    munmap(_map, _map_size);
+  _map = NULL;
+  _hdr = NULL;
+  _base = NULL;
+  _map_size = 0;
+
+  if (_fd != -1)
+    ::close(_fd);
+  _fd = -1;
+}
+
+int CShmBus::set_bridge()
+/* Returns -1 if another process that's still running already is the bridge */
+{
+  uint32_t pid;
+
+  if (_hdr == NULL)
+    return -1;
+
+  pid = _hdr->bridge.load(memory_order_relaxed);
+  while (true)
+  {
+    if ((pid != 0) && (pid != (uint32_t)getpid()) && ((kill(pid, 0) == 0) || (errno == EPERM)))
+      return -1;
+
+    if (_hdr->bridge.compare_exchange_weak(pid, getpid()))
+      break;
+  }
+
+  _bridge = true;
+  return 0;
+}
+
+bool CShmBus::bridged()
+{
+  uint32_t pid;
+
+  if (_hdr == NULL)
+    return false;
+
+  // (a bridge that crashed doesn't get to clear it)
+  pid = _hdr->bridge.load(memory_order_relaxed);
+  return ((pid != 0) && ((kill(pid, 0) == 0) || (errno == EPERM)));
+}
+
+int CShmBus::publish(const char *topic, size_t topic_len, const char *payload, size_t payload_len)
+/* Safe to call from any thread (or process). Returns -1 if the message is too big for the bus. */
+{
+  uint64_t len = (sizeof(record) + topic_len + payload_len + sizeof(record) - 1) & ~((uint64_t)sizeof(record) - 1);
+  uint64_t pos, room, need;
+
+  if ((_hdr == NULL) || (topic_len > SHM_BUS_MAX_TOPIC) || (len > (_hdr->size / 4)))
+    return -1;
+
+  // Reserve space. A record can't wrap round the end of the ring, so if it won't fit, the remaining 
+  // space is taken as well, and filled with padding.
+  pos = _hdr->reserve.load(memory_order_relaxed);
+  do
+  {
+    room = _hdr->size - (pos & _mask);
+    need = (room < len) ? room + len : len;
+  } while (!_hdr->reserve.compare_exchange_weak(pos, pos + need, memory_order_acq_rel, memory_order_relaxed));
+
+  if (room < len)
+  {
+    record *pad = rec(pos);
+    pad->length = room;
+    pad->flags = SHM_BUS_PAD;
+    pad->stamp.store(pos, memory_order_release);
+    pos += room;
+  }
+
+  record *r = rec(pos);
+  r->length = len;
+  r->topic_len = topic_len;
+  r->flags = 0;
+  r->payload_len = payload_len;
+  r->sender = getpid();
+  memcpy((char*)r + sizeof(record), topic, topic_len);
+  memcpy((char*)r + sizeof(record) + topic_len, payload, payload_len);
+  r->stamp.store(pos, memory_order_release);
+
+  _published.fetch_add(1, memory_order_relaxed);
+
+  // Only make the system call if someone's actually waiting
+  _hdr->seq.fetch_add(1);
+  if (_hdr->waiters.load())
+    futex(&_hdr->seq, FUTEX_WAKE, INT_MAX, NULL);
+
+  return 0;
+}
+
+bool CShmBus::pending()
+{
+  return (_hdr != NULL) && (_hdr->reserve.load(memory_order_acquire) != _cursor);
+}
+
+bool CShmBus::read(string &topic, string &payload)
+/* Get the next message. Returns false if there isn't one (yet). Only one thread should read. */
+{
+  if (_hdr == NULL)
+    return false;
+
+  while (true)
+  {
+    uint64_t reserve = _hdr->reserve.load(memory_order_acquire);
+
+    if (_cursor == reserve)
+      return false;
+
+    if (reserve - _cursor > _hdr->size)
+    {
+      // Writers have lapped us - anything before reserve may have been overwritten, and there's no
+      // way to find the next record boundary apart from jumping to the end
+      _overruns++;
+      _cursor = reserve;
+      return false;
+    }
+
+    record *r = rec(_cursor);
+    if (r->stamp.load(memory_order_acquire) != _cursor)
+    {
+      // Reserved but not written yet. Normally it will be very soon, but if the writer died part way 
+      // through, it never will be.
+      if (_stuck_since == 0)
+        _stuck_since = now_ms();
+      else if (now_ms() - _stuck_since > SHM_BUS_STUCK_MS)
+      {
+        _overruns++;
+        _cursor = reserve;
+        _stuck_since = 0;
+      }
+      return false;
+    }
+    _stuck_since = 0;
+
+    uint32_t length = r->length;
+    uint16_t flags = r->flags;
+    uint32_t topic_len = r->topic_len;
+    uint32_t payload_len = r->payload_len;
+
+    if ((length < sizeof(record)) || (length > _hdr->size) || (length & (sizeof(record) - 1)) ||
+        (!(flags & SHM_BUS_PAD) && (sizeof(record) + topic_len + payload_len > length)))
+    {
+      _overruns++;
+      _cursor = reserve;
+      return false;
+    }
+
+    if (!(flags & SHM_BUS_PAD))
+    {
+      topic.assign((char*)r + sizeof(record), topic_len);
+      payload.assign((char*)r + sizeof(record) + topic_len, payload_len);
+    }
+
+    // Make sure it wasn't overwritten while being copied
+    if (_hdr->reserve.load(memory_order_acquire) - _cursor > _hdr->size)
+      continue;
+
+    _cursor += length;
+
+    if (!(flags & SHM_BUS_PAD))
+    {
+      _received++;
+      return true;
+    }
+  }
+}
+
+int CShmBus::start_notify(bus_wake_callback callback, void *obj)
+{
+  if ((_hdr == NULL) || _thread_running)
+    return -1;
+
+  _wake_callback = callback;
+  _wake_obj = obj;
+  _thread_exit.store(false);
+
+  if (pthread_create(&_thread, NULL, &CShmBus::s_notify_thread, this))
+    return -1;
+
+  _thread_running = true;
+  return 0;
+}
+
+void CShmBus::stop_notify()
+{
+  if (!_thread_running)
+    return;
+
+  _thread_exit.store(true);
+  futex(&_hdr->seq, FUTEX_WAKE, INT_MAX, NULL);
+  pthread_join(_thread, NULL);
+  _thread_running = false;
+}
+
+void *CShmBus::s_notify_thread(void *arg)
+{
+  ((CShmBus*)arg)->notify_thread();
+  return NULL;
+}
+
+void CShmBus::notify_thread()
+{
+  struct timespec timeout;
+  uint32_t seen = _hdr->seq.load();
+
+  timeout.tv_sec = 1; // to check _thread_exit
+  timeout.tv_nsec = 0;
+
+  while (!_thread_exit.load())
+  {
+    _hdr->waiters.fetch_add(1);
+    futex(&_hdr->seq, FUTEX_WAIT, seen, &timeout);
+    _hdr->waiters.fetch_sub(1);
+
+    uint32_t seq = _hdr->seq.load();
+    if (seq != seen)
+    {
+      seen = seq;
+      _wake_callback(_wake_obj);
+    }
+  }
+}
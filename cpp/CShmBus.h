@@ -0,0 +1,91 @@
+#pragma once
+#include <string>
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define SHM_BUS_MAX_TOPIC 1024
+
+typedef void (*bus_wake_callback)(void *obj);
+
+// Message bus between processes on the same machine: a ring buffer in a shared memory file
+// (e.g. /dev/shm/nh-bus) that any number of processes can publish to, and that every process
+// reads all messages from (subscribers do their own topic filtering). Publishing is lock free
+// and normally needs no system calls; a reader that's waiting is woken with a futex.
+//
+// Messages are never blocked on readers - a reader that falls more than a ring's worth behind
+// loses everything not yet read (counted in overruns()).
+class CShmBus
+{
+  public:
+    CShmBus();
+    ~CShmBus();
+
+    int open(std::string filename, size_t size);
+    void close();
+    bool is_open() { return (_base != NULL); };
+
+    int publish(const char *topic, size_t topic_len, const char *payload, size_t payload_len);
+    bool read(std::string &topic, std::string &payload);
+    bool pending();
+
+    // Start a thread that calls callback whenever something new is published (from that thread)
+    int start_notify(bus_wake_callback callback, void *obj);
+    void stop_notify();
+
+    // Mark this process as the one copying messages on to mosquitto (until close()), and whether 
+    // any (still running) process is
+    int set_bridge();
+    bool bridged();
+
+    uint64_t overruns() { return _overruns; }; // times this reader fell too far behind and lost messages
+    uint64_t received() { return _received; };
+    uint64_t published() { return _published.load(std::memory_order_relaxed); };
+
+  private:
+    struct header
+    {
+      uint32_t magic;
+      uint32_t version;
+      uint64_t size;                 // of the ring, a power of 2
+      std::atomic<uint64_t> reserve; // logical position the next record will be written to
+      std::atomic<uint32_t> seq;     // incremented after each publish - the futex readers wait on
+      std::atomic<uint32_t> waiters;
+      std::atomic<uint32_t> bridge;  // pid of the process copying messages to mosquitto, 0 if none
+    };
+
+    struct record
+    {
+      std::atomic<uint64_t> stamp; // logical position of this record once it's complete
+      uint32_t length;             // including this header and padding
+      uint16_t topic_len;
+      uint16_t flags;
+      uint32_t payload_len;
+      uint32_t sender;   // pid
+      uint64_t reserved; // pads the header to the record alignment, so padding always has room for one
+    };
+
+    int _fd;
+    char *_map;
+    size_t _map_size;
+    header *_hdr;
+    char *_base; // start of the ring
+    uint64_t _mask;
+    uint64_t _cursor; // next position this process will read from
+    uint64_t _overruns;
+    long long _stuck_since; // ms, if waiting on a record that's been reserved but not written
+    uint64_t _received;
+    std::atomic<uint64_t> _published;
+    bool _bridge; // this process set _hdr->bridge
+
+    pthread_t _thread;
+    bool _thread_running;
+    std::atomic<bool> _thread_exit;
+    bus_wake_callback _wake_callback;
+    void *_wake_obj;
+
+    record *rec(uint64_t pos) { return (record*)(_base + (pos & _mask)); };
+    static void *s_notify_thread(void *arg);
+    void notify_thread();
+};
@@ -0,0 +1,215 @@
+#include "CSpool.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#define SPOOL_MAGIC   0x4C4F4F53 // "SPOL"
+#define SPOOL_VERSION 2
+#define SPOOL_ALIGN(n) (((n) + 7) & ~((size_t)7))
+
+using namespace std;
+
+CSpool::CSpool()
+{
+  _fd = -1;
+  _base = NULL;
+  _size = 0;
+  _hdr = NULL;
+}
+
+CSpool::~CSpool()
+{
+  close();
+}
+
+int CSpool::open(string filename, size_t size)
+/* Open (or create) the spool file. An existing spool keeps its original size, and anything in it
+ * is kept for replay. */
+{
+  struct stat st;
+  header existing;
+  bool valid = false;
+
+  close();
+
+  if (size < sizeof(header) + 4096)
+    size = sizeof(header) + 4096;
+
+  _fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (_fd == -1)
+    return -1;
+
+  if (fstat(_fd, &st))
+  {
+    close();
+    return -1;
+  }
+
+  if ((size_t)st.st_size >= sizeof(header))
+  {
+    if ((pread(_fd, &existing, sizeof(existing), 0) == sizeof(existing)) &&
+        (existing.magic == SPOOL_MAGIC) && (existing.version == SPOOL_VERSION) &&
+        (existing.size == (uint64_t)st.st_size) && (existing.head <= existing.tail) &&
+        (existing.tail - existing.head <= ((existing.size - sizeof(header)) & ~((size_t)7))))
+    {
+      valid = true;
+      size = existing.size;
+    }
+  }
+
+  if (!valid && ftruncate(_fd, size))
+  {
+    close();
+    return -1;
+  }
+
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+  if (p == MAP_FAILED)
+  {
+    close();
+    return -1;
+  }
+
+  _base = (char*)p;
+  _size = size;
+  _hdr = (header*)_base;
+
+  if (!valid)
+  {
+    _hdr->magic   = SPOOL_MAGIC;
+    _hdr->version = SPOOL_VERSION;
+    _hdr->size    = size;
+    _hdr->head    = 0;
+    _hdr->tail    = 0;
+  }
+
+  return 0;
+}
+
+void CSpool::close()
+{
+  if (_base != NULL)
+  {
+    msync(_base, _size, MS_SYNC);
+    munmap(_base, _size);
+  }
+  _base = NULL;
+  _hdr = NULL;
+  _size = 0;
+
+  if (_fd != -1)
+    ::close(_fd);
+  _fd = -1;
+}
+
+uint64_t CSpool::head()
+{
+  return (_hdr == NULL) ? 0 : _hdr->head;
+}
+
+uint64_t CSpool::tail()
+{
+  return (_hdr == NULL) ? 0 : _hdr->tail;
+}
+
+uint64_t CSpool::skip_padding(uint64_t pos)
+/* If pos is at the padding before the end of the file, the position of the start of the file */
+{
+  size_t left = capacity() - offset(pos);
+  record r;
+
+  if (left < sizeof(record))
+    return pos + left;
+
+  memcpy(&r, addr(pos), sizeof(r));
+  if (r.padding && (r.length == left))
+    return pos + left;
+
+  return pos;
+}
+
+int CSpool::append(const string &topic, const char *payload, size_t payload_len, bool retained)
+/* Returns 0 on success, -1 if there isn't room */
+{
+  record rec;
+  size_t len = SPOOL_ALIGN(sizeof(record) + topic.length() + 1 + payload_len);
+  size_t pad = 0;
+
+  if ((_base == NULL) || (topic.length() > 0xFFFF) || (len > capacity()))
+    return -1;
+
+  // Records aren't split over the end of the file, so one that doesn't fit before it goes at the start
+  if (capacity() - offset(_hdr->tail) < len)
+    pad = capacity() - offset(_hdr->tail);
+
+  if (used() + pad + len > capacity())
+    return -1;
+
+  if (pad >= sizeof(record))
+  {
+    rec.length = pad;
+    rec.topic_len = 0;
+    rec.retained = 0;
+    rec.padding = 1;
+    rec.payload_len = 0;
+    memcpy(addr(_hdr->tail), &rec, sizeof(rec));
+  }
+
+  char *p = addr(_hdr->tail + pad);
+  rec.length = len;
+  rec.topic_len = topic.length();
+  rec.retained = retained ? 1 : 0;
+  rec.padding = 0;
+  rec.payload_len = payload_len;
+
+  memcpy(p, &rec, sizeof(rec));
+  memcpy(p + sizeof(rec), topic.c_str(), topic.length() + 1);
+  memcpy(p + sizeof(rec) + topic.length() + 1, payload, payload_len);
+
+  // Only move the tail once the record is complete. Nothing already in the spool is touched, so a
+  // crash before this leaves the spool as it was.
+  _hdr->tail += pad + len;
+  msync(_base, _size, MS_ASYNC);
+
+  return 0;
+}
+
+bool CSpool::read(uint64_t pos, spool_record &rec, uint64_t &next)
+/* Read the record at pos (which must be between head() and tail()). Returns false if there's no
+ * (valid) record there. */
+{
+  record r;
+
+  if ((_base == NULL) || (pos < _hdr->head) || (pos >= _hdr->tail))
+    return false;
+
+  pos = skip_padding(pos);
+  if (pos + sizeof(record) > _hdr->tail)
+    return false;
+
+  char *p = addr(pos);
+  memcpy(&r, p, sizeof(r));
+
+  if (r.padding || (r.length < sizeof(record) + r.topic_len + 1 + r.payload_len) ||
+      (pos + r.length > _hdr->tail) || (offset(pos) + r.length > capacity()))
+    return false;
+
+  rec.topic = p + sizeof(record);
+  rec.payload = p + sizeof(record) + r.topic_len + 1;
+  rec.payload_len = r.payload_len;
+  rec.retained = r.retained;
+  next = pos + r.length;
+
+  return true;
+}
+
+void CSpool::ack(uint64_t pos)
+/* Discard everything before pos */
+{
+  if ((_hdr == NULL) || (pos <= _hdr->head) || (pos > _hdr->tail))
+    return;
+
+  _hdr->head = pos;
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+
+// A record read back from the spool. topic/payload point into the mapped file, so are only
+// valid until the record is acknowledged (after which append() can overwrite it).
+struct spool_record
+{
+  const char *topic;   // NUL terminated
+  const char *payload;
+  size_t payload_len;
+  bool retained;
+};
+
+// Memory mapped ring of messages waiting to be published, so they survive a broker or process
+// restart. Records are appended at the tail, and discarded from the head once acknowledged.
+// Positions are logical (they keep increasing); a record's place in the file is its position
+// modulo capacity(). Records are never moved once written, and never split across the end of
+// the file - one that won't fit before the end goes at the start, after a padding record.
+// Not thread safe - only used from the network thread.
+class CSpool
+{
+  public:
+    CSpool();
+    ~CSpool();
+
+    int open(std::string filename, size_t size);
+    void close();
+    bool is_open() { return (_base != NULL); };
+
+    int append(const std::string &topic, const char *payload, size_t payload_len, bool retained);
+    bool read(uint64_t pos, spool_record &rec, uint64_t &next);
+    void ack(uint64_t pos);
+
+    uint64_t head();
+    uint64_t tail();
+    size_t used()     { return tail() - head(); };
+    size_t capacity() { return (_size - sizeof(header)) & ~((size_t)7); };
+
+  private:
+    struct header
+    {
+      uint32_t magic;
+      uint32_t version;
+      uint64_t size;
+      uint64_t head;   // logical position of the oldest record not yet acknowledged
+      uint64_t tail;   // logical position the next record will be written to
+    };
+
+    struct record
+    {
+      uint32_t length; // of the whole record, including this header and padding
+      uint16_t topic_len;
+      uint8_t  retained;
+      uint8_t  padding;  // 1 if it just fills the space up to the end of the file
+      uint32_t payload_len;
+    };
+
+    int _fd;
+    char *_base;
+    size_t _size;
+    header *_hdr;
+
+    size_t offset(uint64_t pos) { return pos % capacity(); };
+    char *addr(uint64_t pos) { return _base + sizeof(header) + offset(pos); };
+    uint64_t skip_padding(uint64_t pos);
+};
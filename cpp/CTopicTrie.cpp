@@ -0,0 +1,366 @@
+#include "CTopicTrie.h"
+#include <ctype.h>
+#include <algorithm>
+
+using namespace std;
+
+// The trie the current thread is calling handlers for, if any
+static __thread const CTopicTrie *s_dispatching = NULL;
+
+bool str_view::is_numeric() const
+{
+  if (len == 0)
+    return false;
+
+  for (size_t n=0; n < len; n++)
+    if (!isdigit(ptr[n]))
+      return false;
+
+  return true;
+}
+
+int str_view::to_int() const
+{
+  int val = 0;
+
+  for (size_t n=0; (n < len) && isdigit(ptr[n]); n++)
+    val = (val * 10) + (ptr[n] - '0');
+
+  return val;
+}
+
+CTopicTrie::CTopicTrie()
+{
+  _root = new node();
+  pthread_rwlock_init(&_lock, NULL);
+}
+
+CTopicTrie::~CTopicTrie()
+{
+  free_node(_root);
+  _root = NULL;
+  pthread_rwlock_destroy(&_lock);
+}
+
+void CTopicTrie::free_node(node *n)
+{
+  if (n == NULL)
+    return;
+
+  for (unsigned int i=0; i < n->children.size(); i++)
+    free_node(n->children[i].second);
+
+  free_node(n->plus);
+  free_node(n->hash);
+  delete n;
+}
+
+bool CTopicTrie::valid_filter(string filter)
+/* "+" and "#" must occupy an entire level, and "#" must be the last level */
+{
+  size_t start = 0;
+  size_t end;
+  string level;
+
+  if (filter == "")
+    return false;
+
+  do
+  {
+    end = filter.find_first_of('/', start);
+    level = filter.substr(start, (end == string::npos) ? string::npos : end-start);
+
+    if ((level.find_first_of("+#") != string::npos) && (level.length() != 1))
+      return false;
+
+    if ((level == "#") && (end != string::npos))
+      return false;
+
+    start = end + 1;
+  } while (end != string::npos);
+
+  return true;
+}
+
+bool CTopicTrie::filter_matches(const string &filter, const str_view &topic)
+/* Same as mosquitto_topic_matches_sub() for a valid filter, but without needing a NUL terminated topic */
+{
+  size_t f = 0;
+  size_t t = 0;
+
+  // Wildcards at the start don't match $SYS etc.
+  if ((topic.len > 0) && (topic.ptr[0] == '$') && (filter != "") && ((filter[0] == '+') || (filter[0] == '#')))
+    return false;
+
+  while (true)
+  {
+    size_t f_end = filter.find('/', f);
+    if (f_end == string::npos)
+      f_end = filter.length();
+
+    if ((f_end - f == 1) && (filter[f] == '#'))
+      return true;
+
+    const char *slash = (const char*)memchr(topic.ptr + t, '/', topic.len - t);
+    size_t t_end = (slash == NULL) ? topic.len : (slash - topic.ptr);
+
+    if (!((f_end - f == 1) && (filter[f] == '+')) &&
+        ((f_end - f != t_end - t) || memcmp(filter.data() + f, topic.ptr + t, t_end - t)))
+      return false;
+
+    if (t_end == topic.len)
+      return (f_end == filter.length()) || (filter.compare(f_end, string::npos, "/#") == 0); // ("a/#" matches "a")
+
+    if (f_end == filter.length())
+      return false;
+
+    f = f_end + 1;
+    t = t_end + 1;
+  }
+}
+
+CTopicTrie::node *CTopicTrie::get_child(node *n, const char *level, size_t len, bool create)
+// Binary search of the (sorted) literal children of n
+{
+  int lo = 0;
+  int hi = n->children.size() - 1;
+  int cmp;
+
+  while (lo <= hi)
+  {
+    int mid = (lo + hi) / 2;
+    const string &key = n->children[mid].first;
+
+    cmp = memcmp(key.data(), level, (key.length() < len) ? key.length() : len);
+    if (cmp == 0)
+      cmp = (key.length() < len) ? -1 : ((key.length() > len) ? 1 : 0);
+
+    if (cmp == 0)
+      return n->children[mid].second;
+    else if (cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+
+  if (!create)
+    return NULL;
+
+  node *child = new node();
+  n->children.insert(n->children.begin() + lo, make_pair(string(level, len), child));
+  return child;
+}
+
+CTopicTrie::node *CTopicTrie::find_node(string filter)
+/* Returns the node for filter, creating it (and any parents) if needed. NULL if filter isn't valid */
+{
+  node *n = _root;
+  size_t start = 0;
+  size_t end;
+
+  // Checked before any nodes are added, so a filter that's refused doesn't leave some behind. (valid
+  // filters only have "+" and "#" as whole levels, so counting them counts the wildcard levels)
+  if (!valid_filter(filter) || ((count(filter.begin(), filter.end(), '+') + count(filter.begin(), filter.end(), '#')) > TOPIC_MAX_WILDCARDS))
+    return NULL;
+
+  do
+  {
+    end = filter.find_first_of('/', start);
+    size_t len = ((end == string::npos) ? filter.length() : end) - start;
+
+    if ((len == 1) && (filter[start] == '+'))
+    {
+      if (n->plus == NULL)
+        n->plus = new node();
+      n = n->plus;
+    }
+    else if ((len == 1) && (filter[start] == '#'))
+    {
+      if (n->hash == NULL)
+        n->hash = new node();
+      n = n->hash;
+    }
+    else
+      n = get_child(n, filter.data() + start, len, true);
+
+    start = end + 1;
+  } while (end != string::npos);
+
+  return n;
+}
+
+int CTopicTrie::add(string filter, topic_handler handler, void *obj)
+{
+  node *n;
+  handler_entry entry;
+
+  if ((handler == NULL) || (s_dispatching == this))
+    return -1;
+
+  pthread_rwlock_wrlock(&_lock);
+
+  if ((n = find_node(filter)) == NULL)
+  {
+    pthread_rwlock_unlock(&_lock);
+    return -1;
+  }
+
+  // Adding the same handler twice (e.g. mosq_connect() being retried) shouldn't get it called twice
+  for (unsigned int i=0; i < n->handlers.size(); i++)
+    if ((n->handlers[i].handler == handler) && (n->handlers[i].obj == obj))
+    {
+      pthread_rwlock_unlock(&_lock);
+      return 0;
+    }
+
+  entry.handler = handler;
+  entry.obj = obj;
+  n->handlers.push_back(entry);
+
+  pthread_rwlock_unlock(&_lock);
+  return 0;
+}
+
+int CTopicTrie::set_metrics(string filter, topic_metrics *metrics)
+/* Count messages matching filter, and time its handlers, in metrics. Filters without any handlers can 
+ * also be given metrics, so the caller can time whatever it does when dispatch() doesn't call anything. */
+{
+  node *n;
+
+  if (s_dispatching == this)
+    return -1;
+
+  pthread_rwlock_wrlock(&_lock);
+  n = find_node(filter);
+  if (n != NULL)
+    n->metrics = metrics;
+  pthread_rwlock_unlock(&_lock);
+
+  return (n == NULL) ? -1 : 0;
+}
+
+int CTopicTrie::dispatch(const str_view &topic, const str_view &message, topic_metrics **unhandled)
+/* Call every handler with a filter matching topic. Returns the number of handlers called. If unhandled 
+ * is given, it's set to the metrics of a matching filter that has no handlers (or NULL if none). */
+{
+  topic_match m;
+  topic_metrics *no_handler = NULL;
+
+  m.topic = topic;
+  m.count = 0;
+
+  pthread_rwlock_rdlock(&_lock);
+  const CTopicTrie *was_dispatching = s_dispatching;
+  s_dispatching = this;
+  int called = match(_root, topic.ptr, topic.ptr + topic.len, true, m, message, no_handler);
+  s_dispatching = was_dispatching;
+  pthread_rwlock_unlock(&_lock);
+
+  if (unhandled != NULL)
+    *unhandled = no_handler;
+
+  return called;
+}
+
+int CTopicTrie::call_handlers(node *n, topic_match &m, const str_view &message, topic_metrics *&no_handler)
+{
+  uint64_t start = 0;
+
+  if (n->metrics != NULL)
+  {
+    n->metrics->received(message.len);
+
+    if (n->handlers.empty())
+    {
+      if (no_handler == NULL)
+        no_handler = n->metrics;
+      return 0;
+    }
+
+    start = monotonic_us();
+  }
+
+  for (unsigned int i=0; i < n->handlers.size(); i++)
+    n->handlers[i].handler(n->handlers[i].obj, m, message);
+
+  if (n->metrics != NULL)
+    n->metrics->latency.record(monotonic_us() - start);
+
+  return n->handlers.size();
+}
+
+int CTopicTrie::match(node *n, const char *level, const char *end, bool first_level, topic_match &m, const str_view &message, topic_metrics *&no_handler)
+/* level points to the start of the current topic level, or is NULL once every level has been consumed */
+{
+  int called = 0;
+
+  // Topics starting with "$" (e.g. $SYS) are not matched by a leading wildcard
+  bool wildcard_ok = (level == NULL) || !(first_level && (level < end) && (*level == '$'));
+
+  // "#" matches the remainder of the topic, including the parent level (i.e. "a/#" matches "a")
+  if (n->hash && wildcard_ok && (m.count < TOPIC_MAX_WILDCARDS))
+  {
+    m.wildcard[m.count].ptr = (level == NULL) ? end : level;
+    m.wildcard[m.count].len = (level == NULL) ? 0 : end - level;
+    m.count++;
+    called += call_handlers(n->hash, m, message, no_handler);
+    m.count--;
+  }
+
+  if (level == NULL)
+    return called + call_handlers(n, m, message, no_handler);
+
+  const char *level_end = (const char*)memchr(level, '/', end - level);
+  if (level_end == NULL)
+    level_end = end;
+  const char *next_level = (level_end == end) ? NULL : level_end + 1;
+
+  node *child = get_child(n, level, level_end - level, false);
+  if (child)
+    called += match(child, next_level, end, false, m, message, no_handler);
+
+  if (n->plus && wildcard_ok && (m.count < TOPIC_MAX_WILDCARDS))
+  {
+    m.wildcard[m.count].ptr = level;
+    m.wildcard[m.count].len = level_end - level;
+    m.count++;
+    called += match(n->plus, next_level, end, false, m, message, no_handler);
+    m.count--;
+  }
+
+  return called;
+}
+
+bool CTopicTrie::matches(const str_view &topic)
+/* True if topic matches any filter with handlers or metrics, without calling anything */
+{
+  bool match;
+
+  pthread_rwlock_rdlock(&_lock);
+  match = any_match(_root, topic.ptr, topic.ptr + topic.len, true);
+  pthread_rwlock_unlock(&_lock);
+
+  return match;
+}
+
+bool CTopicTrie::any_match(node *n, const char *level, const char *end, bool first_level)
+{
+  bool wildcard_ok = (level == NULL) || !(first_level && (level < end) && (*level == '$'));
+
+  if (n->hash && wildcard_ok && (!n->hash->handlers.empty() || n->hash->metrics))
+    return true;
+
+  if (level == NULL)
+    return !n->handlers.empty() || n->metrics;
+
+  const char *level_end = (const char*)memchr(level, '/', end - level);
+  if (level_end == NULL)
+    level_end = end;
+  const char *next_level = (level_end == end) ? NULL : level_end + 1;
+
+  node *child = get_child(n, level, level_end - level, false);
+  if (child && any_match(child, next_level, end, false))
+    return true;
+
+  return n->plus && wildcard_ok && any_match(n->plus, next_level, end, false);
+}
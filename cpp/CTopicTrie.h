@@ -0,0 +1,86 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "CMetrics.h"
+
+#define TOPIC_MAX_WILDCARDS 8
+
+// Non-owning reference to a run of bytes, e.g. one level of an MQTT topic or a
+// message payload. Not NUL terminated, and may contain embedded NULs. Only valid
+// for as long as the buffer it points into.
+struct str_view
+{
+  const char *ptr;
+  size_t len;
+
+  str_view() : ptr(""), len(0) {};
+  str_view(const char *p, size_t l) : ptr(p), len(l) {};
+  str_view(const std::string &s) : ptr(s.data()), len(s.length()) {};
+
+  std::string str() const { return std::string(ptr, len); }
+  bool operator==(const std::string &s) const { return (s.length() == len) && !memcmp(s.data(), ptr, len); }
+  bool operator!=(const std::string &s) const { return !(*this == s); }
+  bool is_numeric() const;
+  int to_int() const;
+};
+
+// Passed to topic handlers. wildcard[] holds the topic levels matched by each "+"
+// in the filter (in order), followed by whatever was matched by a trailing "#".
+struct topic_match
+{
+  str_view topic;
+  int count;
+  str_view wildcard[TOPIC_MAX_WILDCARDS];
+};
+
+typedef void (*topic_handler)(void *obj, const topic_match &match, const str_view &message);
+
+// Routes messages to the handlers registered against MQTT topic filters (which may
+// contain "+" and "#" wildcards). Matching a topic costs O(topic depth), regardless
+// of how many filters have been added.
+// Filters can be added while other threads (e.g. CNHmqtt's message handler workers) are dispatching;
+// dispatch() holds a read lock while handlers run, so a handler can't add a filter to the trie that's
+// calling it (add() refuses, rather than deadlocking).
+class CTopicTrie
+{
+  public:
+    CTopicTrie();
+    ~CTopicTrie();
+
+    int add(std::string filter, topic_handler handler, void *obj);
+    int dispatch(const str_view &topic, const str_view &message, topic_metrics **unhandled = NULL);
+    int set_metrics(std::string filter, topic_metrics *metrics);
+    bool matches(const str_view &topic);
+    static bool valid_filter(std::string filter);
+    static bool filter_matches(const std::string &filter, const str_view &topic);
+
+  private:
+    struct handler_entry
+    {
+      topic_handler handler;
+      void *obj;
+    };
+
+    struct node
+    {
+      std::vector<std::pair<std::string, node*> > children; // sorted by level name
+      node *plus;
+      node *hash;
+      std::vector<handler_entry> handlers;
+      topic_metrics *metrics; // not owned
+      node() : plus(NULL), hash(NULL), metrics(NULL) {};
+    };
+
+    node *_root;
+    pthread_rwlock_t _lock;
+
+    node *get_child(node *n, const char *level, size_t len, bool create);
+    node *find_node(std::string filter);
+    int match(node *n, const char *level, const char *end, bool first_level, topic_match &m, const str_view &message, topic_metrics *&no_handler);
+    bool any_match(node *n, const char *level, const char *end, bool first_level);
+    int call_handlers(node *n, topic_match &m, const str_view &message, topic_metrics *&no_handler);
+    void free_node(node *n);
+};
@@ -0,0 +1,173 @@
+#include "CValueCache.h"
+#include "mosquitto.h"
+
+using namespace std;
+
+CValueCache::CValueCache()
+{
+  pthread_rwlock_init(&_lock, NULL);
+  _seq = 0;
+}
+
+CValueCache::~CValueCache()
+{
+  for (unsigned int n=0; n < _filters.size(); n++)
+  {
+    pthread_mutex_destroy(&_filters[n]->mutex);
+    delete _filters[n];
+  }
+  _filters.clear();
+
+  pthread_rwlock_destroy(&_lock);
+}
+
+int CValueCache::add_filter(const string &filter, unsigned int max_topics)
+/* Start caching messages to topics matching filter. Adding the same filter again just updates max_topics */
+{
+  filter_cache *fc = NULL;
+
+  if ((filter == "") || (max_topics == 0))
+    return -1;
+
+  pthread_rwlock_wrlock(&_lock);
+
+  for (unsigned int n=0; n < _filters.size(); n++)
+    if (_filters[n]->filter == filter)
+      fc = _filters[n];
+
+  if (fc == NULL)
+  {
+    fc = new filter_cache();
+    fc->filter = filter;
+    pthread_mutex_init(&fc->mutex, NULL);
+    _filters.push_back(fc);
+  }
+  fc->max_topics = max_topics;
+
+  pthread_rwlock_unlock(&_lock);
+  return 0;
+}
+
+void CValueCache::update(const str_view &topic_view, const str_view &payload)
+/* Called for every message received. Each topic is only cached against the first filter it matches. 
+ * Most messages either match nothing (so nothing's copied) or update a topic that's already cached, 
+ * which only needs the read lock - the write lock is only taken to add a topic. */
+{
+  filter_cache *fc = NULL;
+
+  pthread_rwlock_rdlock(&_lock);
+
+  for (unsigned int n=0; (n < _filters.size()) && (fc == NULL); n++)
+    if (CTopicTrie::filter_matches(_filters[n]->filter, topic_view))
+      fc = _filters[n];
+
+  if (fc == NULL)
+  {
+    pthread_rwlock_unlock(&_lock);
+    return;
+  }
+
+  string topic = topic_view.str();
+
+  pthread_mutex_lock(&fc->mutex);
+  map<string, cached_value>::iterator i = fc->values.find(topic);
+  if (i != fc->values.end())
+  {
+    set_value(i->second, payload);
+    pthread_mutex_unlock(&fc->mutex);
+    pthread_rwlock_unlock(&_lock);
+    return;
+  }
+  pthread_mutex_unlock(&fc->mutex);
+  pthread_rwlock_unlock(&_lock);
+
+  // New topic (filters are never removed, so fc's still valid)
+  pthread_rwlock_wrlock(&_lock);
+
+  i = fc->values.find(topic); // (unless another thread's just added it)
+  if (i == fc->values.end())
+  {
+    // Full - make room by dropping whichever topic was updated longest ago
+    if (fc->values.size() >= fc->max_topics)
+    {
+      map<string, cached_value>::iterator oldest = fc->values.begin();
+      for (map<string, cached_value>::iterator j = fc->values.begin(); j != fc->values.end(); ++j)
+        if (j->second.seq < oldest->second.seq)
+          oldest = j;
+      fc->values.erase(oldest);
+    }
+
+    i = fc->values.insert(make_pair(topic, cached_value())).first;
+    i->second.topic = topic;
+  }
+  set_value(i->second, payload);
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+void CValueCache::set_value(cached_value &value, const str_view &payload)
+{
+  value.payload.assign(payload.ptr, payload.len);
+  value.timestamp = time(NULL);
+  value.seq = ++_seq;
+}
+
+bool CValueCache::get(const string &topic, cached_value &value)
+/* Latest value for one topic. Returns false if nothing's cached for it. */
+{
+  bool found = false;
+
+  pthread_rwlock_rdlock(&_lock);
+
+  for (unsigned int n=0; (n < _filters.size()) && !found; n++)
+  {
+    pthread_mutex_lock(&_filters[n]->mutex);
+    map<string, cached_value>::iterator i = _filters[n]->values.find(topic);
+    if (i != _filters[n]->values.end())
+    {
+      value = i->second;
+      found = true;
+    }
+    pthread_mutex_unlock(&_filters[n]->mutex);
+  }
+
+  pthread_rwlock_unlock(&_lock);
+  return found;
+}
+
+int CValueCache::find(const string &filter, vector<cached_value> &values)
+/* Append the latest value of every cached topic matching filter (which can include wildcards) to 
+ * values, in topic order within each cache filter. Returns the number added. */
+{
+  bool match;
+  int count = 0;
+
+  pthread_rwlock_rdlock(&_lock);
+
+  for (unsigned int n=0; n < _filters.size(); n++)
+  {
+    pthread_mutex_lock(&_filters[n]->mutex);
+    for (map<string, cached_value>::iterator i = _filters[n]->values.begin(); i != _filters[n]->values.end(); ++i)
+      if (!mosquitto_topic_matches_sub(filter.c_str(), i->first.c_str(), &match) && match)
+      {
+        values.push_back(i->second);
+        count++;
+      }
+    pthread_mutex_unlock(&_filters[n]->mutex);
+  }
+
+  pthread_rwlock_unlock(&_lock);
+  return count;
+}
+
+unsigned int CValueCache::size()
+{
+  unsigned int count = 0;
+
+  pthread_rwlock_rdlock(&_lock);
+  for (unsigned int n=0; n < _filters.size(); n++)
+    count += _filters[n]->values.size();
+  pthread_rwlock_unlock(&_lock);
+
+  return count;
+}
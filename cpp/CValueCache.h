@@ -0,0 +1,49 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include "CTopicTrie.h"
+
+struct cached_value
+{
+  std::string topic;
+  std::string payload;
+  time_t timestamp; // when received
+  uint64_t seq;     // increases with each message cached, so can be used to spot changes
+};
+
+// Last message received on each topic matching the filters added, so handlers can look up
+// current state (e.g. the latest temperatures) without asking the database. Each filter keeps
+// at most max_topics topics, dropping the least recently updated when full.
+// Safe to use from any thread.
+class CValueCache
+{
+  public:
+    CValueCache();
+    ~CValueCache();
+
+    int add_filter(const std::string &filter, unsigned int max_topics);
+    void update(const str_view &topic, const str_view &payload);
+    bool get(const std::string &topic, cached_value &value);
+    int find(const std::string &filter, std::vector<cached_value> &values);
+    unsigned int size();
+
+  private:
+    struct filter_cache
+    {
+      std::string filter;
+      unsigned int max_topics;
+      std::map<std::string, cached_value> values; // by topic
+      pthread_mutex_t mutex; // for updating values already in the map, while _lock is only held for reading
+    };
+
+    void set_value(cached_value &value, const str_view &payload);
+
+    std::vector<filter_cache*> _filters;
+    pthread_rwlock_t _lock; // written when filters or topics are added/dropped
+    std::atomic<uint64_t> _seq;
+};
@@ -0,0 +1,178 @@
+#include "CWorkerPool.h"
+
+using namespace std;
+
+CWorkerPool::CWorkerPool(int thread_count, work_callback callback, void *obj, CLogging *log)
+{
+  _thread_count = thread_count;
+  _callback     = callback;
+  _obj          = obj;
+  _log          = log;
+  _running      = false;
+  _thread_start = NULL;
+  _thread_end   = NULL;
+
+  for (int n=0; n < _thread_count; n++)
+  {
+    worker *w = new worker();
+    w->pool = this;
+    w->exit = false;
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    _workers.push_back(w);
+  }
+}
+
+CWorkerPool::~CWorkerPool()
+{
+  stop();
+
+  for (unsigned int n=0; n < _workers.size(); n++)
+  {
+    pthread_mutex_destroy(&_workers[n]->mutex);
+    pthread_cond_destroy(&_workers[n]->cond);
+    delete _workers[n];
+  }
+  _workers.clear();
+}
+
+void CWorkerPool::set_thread_callbacks(thread_callback thread_start, thread_callback thread_end)
+/* Optional functions to be called by each worker thread when it starts/finishes, e.g. for mysql_thread_init() */
+{
+  _thread_start = thread_start;
+  _thread_end   = thread_end;
+}
+
+int CWorkerPool::start()
+{
+  if (_running)
+    return 0;
+
+  for (unsigned int n=0; n < _workers.size(); n++)
+  {
+    _workers[n]->exit = false;
+    if (pthread_create(&_workers[n]->thread, NULL, &CWorkerPool::s_worker_thread, _workers[n]))
+    {
+      _log->dbg("CWorkerPool", "Failed to create worker thread");
+
+      // Stop any threads already started
+      for (unsigned int i=0; i < n; i++)
+      {
+        pthread_mutex_lock(&_workers[i]->mutex);
+        _workers[i]->exit = true;
+        pthread_cond_signal(&_workers[i]->cond);
+        pthread_mutex_unlock(&_workers[i]->mutex);
+        pthread_join(_workers[i]->thread, NULL);
+      }
+      return -1;
+    }
+  }
+
+  char buf[50];
+  snprintf(buf, sizeof(buf), "Started %d worker thread(s)", _thread_count);
+  _log->dbg("CWorkerPool", buf);
+  _running = true;
+  return 0;
+}
+
+void CWorkerPool::stop()
+{
+  if (!_running)
+    return;
+
+  for (unsigned int n=0; n < _workers.size(); n++)
+  {
+    pthread_mutex_lock(&_workers[n]->mutex);
+    _workers[n]->exit = true;
+    pthread_cond_signal(&_workers[n]->cond);
+    pthread_mutex_unlock(&_workers[n]->mutex);
+  }
+
+  for (unsigned int n=0; n < _workers.size(); n++)
+    pthread_join(_workers[n]->thread, NULL);
+
+  _running = false;
+  _log->dbg("CWorkerPool", "Worker threads stopped");
+}
+
+void CWorkerPool::add(const string &key, const string &topic, const string &message)
+{
+  worker *w = _workers[hash(key) % _workers.size()];
+  work_item item;
+
+  item.topic = topic;
+  item.message = message;
+
+  pthread_mutex_lock(&w->mutex);
+  w->queue.push_back(item);
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+}
+
+unsigned int CWorkerPool::queue_depth()
+/* Total number of messages waiting to be processed */
+{
+  unsigned int depth = 0;
+
+  for (unsigned int n=0; n < _workers.size(); n++)
+  {
+    pthread_mutex_lock(&_workers[n]->mutex);
+    depth += _workers[n]->queue.size();
+    pthread_mutex_unlock(&_workers[n]->mutex);
+  }
+
+  return depth;
+}
+
+void *CWorkerPool::s_worker_thread(void *arg)
+{
+  worker *w = (worker*)arg;
+
+  if (w->pool->_thread_start)
+    w->pool->_thread_start(w->pool->_obj);
+
+  w->pool->worker_thread(w);
+
+  if (w->pool->_thread_end)
+    w->pool->_thread_end(w->pool->_obj);
+
+  return NULL;
+}
+
+void CWorkerPool::worker_thread(worker *w)
+{
+  work_item item;
+
+  pthread_mutex_lock(&w->mutex);
+  while (true)
+  {
+    while (w->queue.empty() && !w->exit)
+      pthread_cond_wait(&w->cond, &w->mutex);
+
+    // Only exit once everything queued has been processed
+    if (w->queue.empty())
+      break;
+
+    item = w->queue.front();
+    w->queue.pop_front();
+
+    pthread_mutex_unlock(&w->mutex);
+    _callback(_obj, item.topic, item.message);
+    pthread_mutex_lock(&w->mutex);
+  }
+  pthread_mutex_unlock(&w->mutex);
+}
+
+unsigned int CWorkerPool::hash(const string &key)
+// FNV-1a
+{
+  unsigned int h = 2166136261u;
+
+  for (unsigned int n=0; n < key.length(); n++)
+  {
+    h ^= (unsigned char)key[n];
+    h *= 16777619u;
+  }
+
+  return h;
+}
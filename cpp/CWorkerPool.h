@@ -0,0 +1,56 @@
+#pragma once
+#include <string>
+#include <deque>
+#include <vector>
+#include <pthread.h>
+#include "CLogging.h"
+
+typedef void (*work_callback)(void *obj, const std::string &topic, const std::string &message);
+typedef void (*thread_callback)(void *obj);
+
+// Hands messages off to a fixed set of worker threads. Messages added with the same
+// key always go to the same worker, so are processed in the order they were added;
+// messages with different keys may be processed concurrently.
+class CWorkerPool
+{
+  public:
+    CWorkerPool(int thread_count, work_callback callback, void *obj, CLogging *log);
+    ~CWorkerPool();
+
+    void set_thread_callbacks(thread_callback thread_start, thread_callback thread_end);
+    int start();
+    void stop(); // Processes anything still queued, then joins the worker threads
+    void add(const std::string &key, const std::string &topic, const std::string &message);
+    unsigned int queue_depth();
+    int thread_count() { return _thread_count; };
+
+  private:
+    struct work_item
+    {
+      std::string topic;
+      std::string message;
+    };
+
+    struct worker
+    {
+      CWorkerPool *pool;
+      pthread_t thread;
+      pthread_mutex_t mutex;
+      pthread_cond_t cond;
+      std::deque<work_item> queue;
+      bool exit;
+    };
+
+    int _thread_count;
+    bool _running;
+    work_callback _callback;
+    thread_callback _thread_start;
+    thread_callback _thread_end;
+    void *_obj;
+    CLogging *_log;
+    std::vector<worker*> _workers;
+
+    static void *s_worker_thread(void *arg);
+    void worker_thread(worker *w);
+    static unsigned int hash(const std::string &key);
+};
@@ -28,7 +28,7 @@
  */
 
 #include "CNHmqtt_irc.h"
-#include "CNHDBAccess.h"
+#include "CNHDBPool.h"
 #include "CGatekeeper_door.h"
 #include "CGatekeeper_door_original.h"
 #include "CGatekeeper_door_hs25.h"
@@ -60,7 +60,7 @@ public:
     string default_message_a;
     string default_message_b;
     string exit_message;
-    CNHDBAccess *db;
+    CNHDBPool *db_pool;
 
     int read_timeout;
 
@@ -78,122 +78,129 @@ public:
       default_message_b = get_str_option("gatekeeper", "default_message_b", "Scan RFID to exit");
       exit_message = get_str_option("gatekeeper", "exit_message", "Goodbye");
       read_timeout = get_int_option("gatekeeper", "read_timeout", 4);
-      db = new CNHDBAccess(get_str_option("mysql", "server", "localhost"), get_str_option("mysql", "username", "gatekeeper"), get_str_option("mysql", "password", "gk"), get_str_option("mysql", "database", "gk"), log);   
+      db_pool = CNHDBPool::get_pool(get_str_option("mysql", "server", "localhost"), get_str_option("mysql", "username", "gatekeeper"), get_str_option("mysql", "password", "gk"), get_str_option("mysql", "database", "gk"), log, get_int_option("mysql", "pool_size", DB_POOL_DEFAULT_SIZE), get_int_option("mysql", "write_behind_ms", DB_WRITE_BEHIND_MS));
+      CNHDBAccess::set_slow_call_ms(get_int_option("mysql", "slow_call_ms", DB_SLOW_CALL_MS));
+      CNHDBAccess::set_deadlines(get_int_option("mysql", "timeout", DB_TIMEOUT_SECS), get_int_option("mysql", "breaker_failures", DB_BREAKER_FAILURES), get_int_option("mysql", "breaker_cooldown", DB_BREAKER_COOLDOWN_SECS));
     }
 
     ~GateKeeper()
     {
-      delete db;
-
       for (std::map<int,CGatekeeper_door*>::iterator it = _doors.begin(); it != _doors.end(); ++it) 
         delete it->second;
+
+      CNHDBPool::put_pool(db_pool);
     }
 
-    void process_message(string topic, string message)
+    std::string status_detail_extra()
     {
-      int door_id;
-      string command;
+      return "\"db\":" + db_pool->json();
+    }
 
-      if (!get_door_id_cmd(topic, door_id, command))
-      {
-        // Message does relate to a specific door
-        if (_doors.count(door_id))
-        {
-          _doors[door_id]->process_door_event(command, message);
-        }
-        else
-        {
-          log->dbg("Received message from unknown door! ([" + itos(door_id) + "])");
-        }
-      }
+    static void s_door_event(void *obj, const topic_match &m, const str_view &message)
+    // Called for door-specific messages, e.g. "nh/gk/1/RFID" or "nh/gk/1/A/RFID". wildcard[0]
+    // is the door id, and the command is everything that follows it (e.g. "RFID" or "A/RFID").
+    {
+      GateKeeper *gk = (GateKeeper*)obj;
+      const char *cmd_start = m.wildcard[0].ptr + m.wildcard[0].len + 1;
 
-      else if (topic==lastman)
-      { 
-        // LWK adding time stamp to tweets
-        time_t rawtime;
-        struct tm * timeinfo;
-        time ( &rawtime );
-        timeinfo = localtime ( &rawtime );
-
-        string tweet;
-        char tweet_time [32];
-        strftime(tweet_time, 80, " %d/%m %H:%M", timeinfo);
-
-        if (message=="Last Out") 
-        {
-          tweet = lastman_close + tweet_time;
-          message_send(twitter_out, tweet);
-          message_send(irc_out, lastman_close);
-          message_send(slack_out, lastman_close);
-          db->sp_log_event("LAST_OUT", "");
-        } else if (message=="First In")
-        {
-          tweet = lastman_open + tweet_time;
-          message_send(twitter_out, tweet);
-          message_send(irc_out, lastman_open);
-          message_send(slack_out, lastman_open);
-          db->sp_log_event("FIRST_IN", "");
-        }
-      }
+      if (!m.wildcard[0].is_numeric())
+        return;
 
-      CNHmqtt_irc::process_message(topic, message);
-  }
+      int door_id = m.wildcard[0].to_int();
+      if (gk->_doors.count(door_id))
+        gk->_doors[door_id]->process_door_event(string(cmd_start, (m.topic.ptr + m.topic.len) - cmd_start), message.str());
+      else
+        gk->log->dbg("Received message from unknown door! ([" + itos(door_id) + "])");
+    }
+
+    static void s_lastman(void *obj, const topic_match &, const str_view &message)
+    {
+      ((GateKeeper*)obj)->lastman_state(message.str());
+    }
+
+    void lastman_state(string message)
+    {
+      // LWK adding time stamp to tweets
+      time_t rawtime;
+      struct tm * timeinfo;
+      time ( &rawtime );
+      timeinfo = localtime ( &rawtime );
+
+      string tweet;
+      char tweet_time [32];
+      strftime(tweet_time, 80, " %d/%m %H:%M", timeinfo);
+
+      if (message=="Last Out") 
+      {
+        tweet = lastman_close + tweet_time;
+        message_send(twitter_out, tweet);
+        message_send(irc_out, lastman_close);
+        message_send(slack_out, lastman_close);
+        CNHDBPool::conn db(db_pool);
+        db->sp_log_event("LAST_OUT", "");
+      } else if (message=="First In")
+      {
+        tweet = lastman_open + tweet_time;
+        message_send(twitter_out, tweet);
+        message_send(irc_out, lastman_open);
+        message_send(slack_out, lastman_open);
+        CNHDBPool::conn db(db_pool);
+        db->sp_log_event("FIRST_IN", "");
+      }
+    }
 
   void process_irc_message(irc_msg msg)
   {
     log->dbg("Got IRC message: " + (string)msg);
   }
   
-  int get_door_id_cmd(string topic, int &door_id, string &command)
-  // If the topic relates to a door-specific messages, returns 0, with door_id and command set.
-  // E.g for "nh/gk/1/RFID", returns 0 with door_id=1, command="RFID"
+  string partition_key(const string &topic)
+  // Process all messages for the same door in order (e.g. a DoorState message must 
+  // not overtake an earlier RFID read)
   {
-    if (topic.length() > base_topic.length() + 2)
+    if ((topic.length() > base_topic.length() + 2) && !topic.compare(0, base_topic.length() + 1, base_topic + "/"))
     {
-      // If the message relates to a specific door, the part of the topic just after the base_topic 
-      // should be the door number; e.g. the topic for an RFID read from door 1 would be:
-      //   "nh/gk/1/RFID"
-      // We're assuming that if that value is numeric, it relates to a specific door
-
-      unsigned int id_start = base_topic.length() + 1;
-      unsigned int id_end   = topic.find_first_of("/", base_topic.length()+1);
-      string id_str = topic.substr(id_start, id_end-id_start);
-
-      // Check there's a number where we're looking for door_id
-      const char *id_char = id_str.c_str();
-      while (*(id_char))
-        if (!isdigit(*id_char++))
-          return -1; 
-
-      door_id = atoi(id_str.c_str());
-
-      // Sanity check remaining string length, to make sure there is actually a command there
-      if (topic.length() < id_end+3)
-        return -1;
+      size_t id_end = topic.find_first_of('/', base_topic.length() + 1);
+      if (id_end != string::npos)
+        return topic.substr(0, id_end);
+    }
 
-      command = topic.substr(id_end+1, string::npos);
+    return topic;
+  }
 
-      return 0;
-    }
-    return -1;
+  void worker_thread_start()
+  {
+    mysql_thread_init();
   }
 
+  void worker_thread_end()
+  {
+    mysql_thread_end();
+  }
 
   int db_connect()
+  // Makes the first pooled connection, so a bad config is found at startup
   {
-    return db->dbConnect();
+    CNHDBPool::conn db(db_pool);
+    return db->is_connected() ? 0 : -1;
   }
 
   void setup()
   {
     // Get a list of all doors
-    dbrows doors;
-    db->sp_gatekeeper_get_doors(-1, &doors);
+    CDBResult doors;
+    {
+      CNHDBPool::conn db(db_pool);
+      db->sp_gatekeeper_get_doors(-1, &doors);
+    }
 
-    for (dbrows::const_iterator iterator = doors.begin(), end = doors.end(); iterator != end; ++iterator) 
+    int col_door_id    = doors.column("door_id");
+    int col_short_name = doors.column("door_short_name");
+    int col_door_state = doors.column("door_state");
+    for (unsigned int n=0; n < doors.size(); n++)
     {
-      dbrow row = *iterator;
-      int door_id = row["door_id"].asInt();
+      CDBResult::row row = doors[n];
+      int door_id = row.asInt(col_door_id);
 
       // Nasty, nasty, bodge.
       if (door_id == 1)
@@ -201,23 +208,23 @@ public:
       else
         _doors[door_id] = new CGatekeeper_door_hs25();
 
-      _doors[door_id]->door_short_name = row["door_short_name"].asStr();
-      _doors[door_id]->set_opts(door_id, base_topic, log, db, this, entry_announce, read_timeout, row["door_state"].asStr(), exit_message);
+      _doors[door_id]->door_short_name = row.asStr(col_short_name);
+      _doors[door_id]->set_opts(door_id, base_topic, log, db_pool, this, entry_announce, read_timeout, row.asStr(col_door_state), exit_message);
     }
 
     // Subscribe to wildcard MQTT topics for door events
     string subscribe_base = base_topic + "/+/";
-    subscribe(subscribe_base + "DoorState");
-    subscribe(subscribe_base + "DoorButton");
-    subscribe(subscribe_base + "RFID");
-    subscribe(subscribe_base + "Keypad");
+    subscribe(subscribe_base + "DoorState" , s_door_event, this);
+    subscribe(subscribe_base + "DoorButton", s_door_event, this);
+    subscribe(subscribe_base + "RFID"      , s_door_event, this);
+    subscribe(subscribe_base + "Keypad"    , s_door_event, this);
 
     // Door side specific messages
     subscribe_base = base_topic + "/+/+/";
-    subscribe(subscribe_base + "DoorButton");
-    subscribe(subscribe_base + "RFID");
+    subscribe(subscribe_base + "DoorButton", s_door_event, this);
+    subscribe(subscribe_base + "RFID"      , s_door_event, this);
 
-    subscribe(lastman);
+    subscribe(lastman, s_lastman, this);
 
     // Set default message on both sides of the doors (retained message)
     message_send("nh/gk/DefaultMessage/A", default_message_a, 0, 1);
@@ -230,6 +237,18 @@ public:
 
     return 0;
   }
+
+  int cbiSendMessage(mqtt_topic *topic, string message)
+  {
+    message_send(topic, message);
+
+    return 0;
+  }
+
+  mqtt_topic *cbiTopicHandle(string topic, bool retained, bool coalesce)
+  {
+    return topic_handle(topic, retained, coalesce);
+  }
 };
 
 int main(int argc, char *argv[])
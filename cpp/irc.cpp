@@ -43,6 +43,7 @@ irc::irc(string address, int port, string nick, string nickserv_password, CLoggi
     log = l;
     rThread = -1;
     aThread = -1;
+    threaded = true;
     last_rx = -1;
     ping_sent = -1;
     pthread_mutex_init (&socket_mutex, NULL);
@@ -74,8 +75,9 @@ irc::~irc()
 }
     
 
-// Blocks until connected (or errors trying)
-int irc::ircConnect()
+// Blocks until connected (or errors trying). If start_threads is false, the caller must call readSocket() 
+// whenever skt is readable, and checkActivity() every 30 seconds or so, e.g. from an event loop.
+int irc::ircConnect(bool start_threads)
 {
     string tx;
     string buffer;
@@ -137,13 +139,17 @@ int irc::ircConnect()
       buffer = buffer + ch;
       if (ch == '\n')
       {
-        log->dbg(" < " + buffer.substr(0, buffer.length()-1));  
+        NH_LOG_DEBUG(log, "IRC", " < " + buffer.substr(0, buffer.length()-1));  
         processMessage(buffer);
         buffer = "";
       }
     }
     if (state == CONNECTED)
     {
+      threaded = start_threads;
+      if (!threaded)
+        return 0;
+
       // Now conencted. Start thread to process incoming messages, then return
       pthread_create(&rThread, NULL, &irc::readThread, this);
       
@@ -168,7 +174,7 @@ void irc::readThread()
       buffer = buffer + ch;
       if (ch == '\n')
       {
-        log->dbg(" < " + buffer.substr(0, buffer.length()-1));  
+        NH_LOG_DEBUG(log, "IRC", " < " + buffer.substr(0, buffer.length()-1));  
         processMessage(buffer);
         buffer = "";
         last_rx = time(NULL);
@@ -179,6 +185,37 @@ void irc::readThread()
     processMessage("");  
 }
 
+void irc::readSocket()
+/* Process whatever's available to read from skt, without blocking (assuming skt is readable) */
+{
+    char buf[512];
+    int len;
+    size_t pos;
+
+    if (state != CONNECTED)
+      return;
+
+    len = read(skt, buf, sizeof(buf));
+    if (len <= 0)
+    {
+      if (state != UNLOADING)
+        state = DISCONNECTED;
+      processMessage("");
+      return;
+    }
+
+    rx_buffer.append(buf, len);
+    while ((pos = rx_buffer.find('\n')) != string::npos)
+    {
+      string line = rx_buffer.substr(0, pos+1);
+      rx_buffer.erase(0, pos+1);
+
+      NH_LOG_DEBUG(log, "IRC", " < " + line.substr(0, line.length()-1));  
+      processMessage(line);
+      last_rx = time(NULL);
+    }
+}
+
 void *irc::readThread(void *arg)
 {
     irc *Irc;
@@ -193,30 +230,42 @@ void irc::activityThread()
 {
   while (state == CONNECTED)
   {
-    // We've received something since the last ping sent, so connection is good
-    if (last_rx >= ping_sent)
-      ping_sent = -1;
-    
-    if (((time(NULL) - last_rx) > (4 * 60)) && (last_rx != -1) && (ping_sent==-1))
-    {
-      // Nothing received within last 4 minutes... send a ping
-      write ("PING NH\r\n"); // In all likleyhood, this will trigger a disconnection
-      ping_sent = time(NULL);
-    }
-    
-    if (((time(NULL) - last_rx) > (5 * 60)) && (last_rx != -1) && (ping_sent!=-1))
-    {
-      // Nothing received within 5 minutes despite sending a ping... give up.
-      shutdown(skt, SHUT_RDWR);
-      close(skt);
-      
-      state = DISCONNECTED;
-      log->dbg("Ping timout...");
-    }
+    checkActivity();
     sleep (30);
   }
 }
 
+void irc::checkActivity()
+{
+  if (state != CONNECTED)
+    return;
+
+  // We've received something since the last ping sent, so connection is good
+  if (last_rx >= ping_sent)
+    ping_sent = -1;
+  
+  if (((time(NULL) - last_rx) > (4 * 60)) && (last_rx != -1) && (ping_sent==-1))
+  {
+    // Nothing received within last 4 minutes... send a ping
+    write ("PING NH\r\n"); // In all likleyhood, this will trigger a disconnection
+    ping_sent = time(NULL);
+  }
+  
+  if (((time(NULL) - last_rx) > (5 * 60)) && (last_rx != -1) && (ping_sent!=-1))
+  {
+    // Nothing received within 5 minutes despite sending a ping... give up.
+    shutdown(skt, SHUT_RDWR);
+    close(skt);
+    
+    state = DISCONNECTED;
+    log->dbg("Ping timout...");
+
+    // Without a read thread, nothing else will notice the socket has gone
+    if (!threaded)
+      processMessage("");
+  }
+}
+
 void *irc::activityThread(void *arg)
 {
     irc *Irc;
@@ -227,6 +276,9 @@ void *irc::activityThread(void *arg)
 
 void irc::wait()
 {
+  if (!threaded)
+    return;
+
   log->dbg("Waiting.");
   pthread_join(rThread, NULL);
   pthread_join(aThread, NULL);
@@ -432,13 +484,10 @@ int irc::join(string room)
 
 int irc::write(string msg)
 {
-  string d;
   int ret;
 
-  d = msg;
-  d.erase(d.find_last_not_of("\r\n")+1);
-
-  log->dbg(" > " + d);
+  // (only built if it's going to be logged)
+  NH_LOG_DEBUG(log, "IRC", " > " + msg.substr(0, msg.find_last_not_of("\r\n")+1));
   ret=0;
   pthread_mutex_lock(&socket_mutex);
   if (::write(skt,msg.c_str(),msg.length()) < msg.length())
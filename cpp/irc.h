@@ -24,7 +24,7 @@ class irc
   public:
     irc (string address, int port, string nick, string nickserv_password, CLogging *l);
     ~irc();
-    int ircConnect();
+    int ircConnect(bool start_threads = true);
     string lastError;
     void processMessage(string message);
     int join(string room);
@@ -38,6 +38,8 @@ class irc
     int skt;
     void readThread();
     void activityThread();
+    void readSocket();
+    void checkActivity();
     enum {CLOSED, ERROR, CONNECTED, DISCONNECTED, UNLOADING};
 
   private:
@@ -55,6 +57,8 @@ class irc
     bool pw_sent;
     bool alt_nick; // connected using alternative name as nick in use
     int write(string msg);
+    bool threaded;
+    string rx_buffer;
     time_t last_rx;
     time_t ping_sent;
     pthread_mutex_t socket_mutex;
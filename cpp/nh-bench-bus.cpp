@@ -0,0 +1,258 @@
+#include "CShmBus.h"
+#include "CReactor.h"
+#include "CMetrics.h"
+#include "mosquitto.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <string>
+
+using namespace std;
+
+/* Compares round trip times between two processes over the local shared memory bus and via
+ * mosquitto. A child process echoes each "ping" back as a "pong", and the parent times how long
+ * each takes to come back. Both sides wait on an epoll loop, as the daemons do.
+ *
+ * Usage: nh-bench-bus [-n count] [-s payload bytes] [-b bus file] [-h mqtt host] [-p mqtt port] */
+
+#define PING_TOPIC "nh/bench/ping"
+#define PONG_TOPIC "nh/bench/pong"
+#define QUIT_MSG   "quit"
+
+static int count = 10000;
+static int payload_size = 64;
+static string bus_file = "/dev/shm/nh-bench-bus";
+static string mqtt_host = "localhost";
+static int mqtt_port = 1883;
+
+static void s_wake(void *obj)
+{
+  ((CReactor*)obj)->wake();
+}
+
+static void report(const char *name, CLatencyHistogram &latency, uint64_t elapsed_us)
+{
+  printf("%-10s %8llu msgs  p50 %6llu us  p99 %6llu us  max %7llu us  %8.0f round trips/s\n", name,
+         (unsigned long long)latency.count(), (unsigned long long)latency.percentile(50),
+         (unsigned long long)latency.percentile(99), (unsigned long long)latency.max(),
+         (elapsed_us > 0) ? (latency.count() * 1000000.0 / elapsed_us) : 0.0);
+}
+
+/* Local bus */
+
+static bool bus_wait(CShmBus &bus, CReactor &reactor, const char *want, string &payload)
+{
+  string topic;
+  uint64_t timeout = monotonic_us() + 5000000;
+
+  while (monotonic_us() < timeout)
+  {
+    while (bus.read(topic, payload))
+      if (topic == want)
+        return true;
+
+    if (reactor.run_once(1000) < 0)
+      return false;
+  }
+
+  return false;
+}
+
+static int bus_echo()
+{
+  CShmBus bus;
+  CReactor reactor;
+  string payload;
+
+  if (bus.open(bus_file, 1048576) || bus.start_notify(s_wake, &reactor))
+    return 1;
+
+  while (bus_wait(bus, reactor, PING_TOPIC, payload) && (payload != QUIT_MSG))
+    bus.publish(PONG_TOPIC, strlen(PONG_TOPIC), payload.data(), payload.length());
+
+  return 0;
+}
+
+static int bus_bench()
+{
+  CShmBus bus;
+  CReactor reactor;
+  CLatencyHistogram latency;
+  string message(payload_size, 'x');
+  string payload;
+
+  if (bus.open(bus_file, 1048576) || bus.start_notify(s_wake, &reactor))
+  {
+    printf("Failed to open bus [%s]\n", bus_file.c_str());
+    return -1;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0)
+    exit(bus_echo());
+
+  usleep(200000); // let the child open the bus
+
+  uint64_t start = monotonic_us();
+  for (int n=0; n < count; n++)
+  {
+    uint64_t sent = monotonic_us();
+    bus.publish(PING_TOPIC, strlen(PING_TOPIC), message.data(), message.length());
+    if (!bus_wait(bus, reactor, PONG_TOPIC, payload))
+    {
+      printf("bus: timed out waiting for reply\n");
+      break;
+    }
+    latency.record(monotonic_us() - sent);
+  }
+  uint64_t elapsed = monotonic_us() - start;
+
+  bus.publish(PING_TOPIC, strlen(PING_TOPIC), QUIT_MSG, strlen(QUIT_MSG));
+  waitpid(pid, NULL, 0);
+
+  report("local bus", latency, elapsed);
+  fflush(stdout);
+  return 0;
+}
+
+/* mosquitto */
+
+struct mqtt_state
+{
+  bool echo;
+  bool got_reply;
+  bool quit;
+};
+
+static void s_mqtt_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message)
+{
+  mqtt_state *state = (mqtt_state*)obj;
+
+  if (!state->echo)
+  {
+    state->got_reply = true;
+    return;
+  }
+
+  if ((message->payloadlen == (int)strlen(QUIT_MSG)) && !memcmp(message->payload, QUIT_MSG, strlen(QUIT_MSG)))
+    state->quit = true;
+  else
+    mosquitto_publish(mosq, NULL, PONG_TOPIC, message->payloadlen, message->payload, 0, false);
+}
+
+static struct mosquitto *mqtt_connect(mqtt_state *state, const char *subscribe)
+{
+  struct mosquitto *mosq = mosquitto_new(NULL, true, state);
+
+  if (mosq == NULL)
+    return NULL;
+
+  mosquitto_message_callback_set(mosq, s_mqtt_message);
+  if (mosquitto_connect(mosq, mqtt_host.c_str(), mqtt_port, 60) != MOSQ_ERR_SUCCESS)
+  {
+    mosquitto_destroy(mosq);
+    return NULL;
+  }
+
+  mosquitto_subscribe(mosq, NULL, subscribe, 0);
+  return mosq;
+}
+
+static int mqtt_echo()
+{
+  mqtt_state state = { true, false, false };
+  struct mosquitto *mosq = mqtt_connect(&state, PING_TOPIC);
+
+  if (mosq == NULL)
+    return 1;
+
+  while (!state.quit && (mosquitto_loop(mosq, 5000, 1) == MOSQ_ERR_SUCCESS))
+    ;
+
+  mosquitto_destroy(mosq);
+  return 0;
+}
+
+static int mqtt_bench()
+{
+  mqtt_state state = { false, false, false };
+  CLatencyHistogram latency;
+  string message(payload_size, 'x');
+
+  pid_t pid = fork();
+  if (pid == 0)
+    exit(mqtt_echo());
+
+  struct mosquitto *mosq = mqtt_connect(&state, PONG_TOPIC);
+  if (mosq == NULL)
+  {
+    printf("Failed to connect to mosquitto at %s:%d\n", mqtt_host.c_str(), mqtt_port);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return -1;
+  }
+
+  // Wait for both subscriptions to be in place
+  for (int n=0; n < 20; n++)
+    mosquitto_loop(mosq, 10, 1);
+
+  uint64_t start = monotonic_us();
+  for (int n=0; n < count; n++)
+  {
+    uint64_t sent = monotonic_us();
+    state.got_reply = false;
+    mosquitto_publish(mosq, NULL, PING_TOPIC, message.length(), message.data(), 0, false);
+    while (!state.got_reply)
+      if (mosquitto_loop(mosq, 5000, 1) != MOSQ_ERR_SUCCESS)
+        break;
+
+    if (!state.got_reply)
+    {
+      printf("mosquitto: lost connection\n");
+      break;
+    }
+    latency.record(monotonic_us() - sent);
+  }
+  uint64_t elapsed = monotonic_us() - start;
+
+  mosquitto_publish(mosq, NULL, PING_TOPIC, strlen(QUIT_MSG), QUIT_MSG, 0, false);
+  mosquitto_loop(mosq, 100, 1);
+  waitpid(pid, NULL, 0);
+  mosquitto_destroy(mosq);
+
+  report("mosquitto", latency, elapsed);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  int c;
+
+  while ((c = getopt(argc, argv, "n:s:b:h:p:")) != -1)
+    switch (c)
+    {
+      case 'n': count = atoi(optarg);        break;
+      case 's': payload_size = atoi(optarg); break;
+      case 'b': bus_file = optarg;           break;
+      case 'h': mqtt_host = optarg;          break;
+      case 'p': mqtt_port = atoi(optarg);    break;
+      default:
+        printf("Usage: %s [-n count] [-s payload bytes] [-b bus file] [-h mqtt host] [-p mqtt port]\n", argv[0]);
+        return 1;
+    }
+
+  printf("%d round trips, %d byte payload\n", count, payload_size);
+  fflush(stdout); // before forking
+
+  mosquitto_lib_init();
+  bus_bench();
+  mqtt_bench();
+  mosquitto_lib_cleanup();
+
+  unlink(bus_file.c_str());
+  return 0;
+}
@@ -0,0 +1,96 @@
+#include "CNHDBAccess.h"
+#include "CLogging.h"
+#include "CMetrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+
+using namespace std;
+
+/* Time taken by a stored procedure call with OUT params, with them returned along with the CALL's
+ * results (one round trip), and read afterwards with "select @n,..." (two). Uses the read only
+ * sp_get_details_from_rfid, so is safe to run against the live database.
+ *
+ * Usage: nh-bench-db [-n calls] [-h server] [-u username] [-p password] [-d database] [-r rfid] */
+
+static int count = 5000;
+static string server = "localhost";
+static string username = "gatekeeper";
+static string password = "";
+static string database = "instrumentation";
+static string rfid = "0";
+
+static void report(const char *name, CLatencyHistogram &latency, uint64_t elapsed_us)
+{
+  printf("%-10s %8llu calls  p50 %6llu us  p99 %6llu us  max %7llu us  %8.0f calls/s\n", name,
+         (unsigned long long)latency.count(), (unsigned long long)latency.percentile(50),
+         (unsigned long long)latency.percentile(99), (unsigned long long)latency.max(),
+         (elapsed_us > 0) ? (latency.count() * 1000000.0 / elapsed_us) : 0.0);
+}
+
+static int run(CNHDBAccess &db, const char *name, bool out_params)
+{
+  CLatencyHistogram latency;
+  string handle, err;
+  int balance;
+  uint64_t start, call_start;
+
+  db.set_out_params(out_params);
+
+  // The first call prepares the statements
+  if (db.sp_get_details_from_rfid(rfid, handle, balance, err))
+  {
+    printf("%s: sp_get_details_from_rfid failed\n", name);
+    return -1;
+  }
+
+  start = monotonic_us();
+  for (int n=0; n < count; n++)
+  {
+    call_start = monotonic_us();
+    if (db.sp_get_details_from_rfid(rfid, handle, balance, err))
+    {
+      printf("%s: sp_get_details_from_rfid failed\n", name);
+      return -1;
+    }
+    latency.record(monotonic_us() - call_start);
+  }
+
+  report(name, latency, monotonic_us() - start);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  int c;
+
+  while ((c = getopt(argc, argv, "n:h:u:p:d:r:")) != -1)
+    switch (c)
+    {
+      case 'n': count = atoi(optarg); break;
+      case 'h': server = optarg;      break;
+      case 'u': username = optarg;    break;
+      case 'p': password = optarg;    break;
+      case 'd': database = optarg;    break;
+      case 'r': rfid = optarg;        break;
+      default:
+        printf("Usage: %s [-n calls] [-h server] [-u username] [-p password] [-d database] [-r rfid]\n", argv[0]);
+        return 1;
+    }
+
+  CLogging log;
+  log.set_level(LOG_LEVEL_WARN);
+
+  CNHDBAccess db(server, username, password, database, &log);
+  if (db.dbConnect())
+    return 1;
+
+  printf("%d calls of sp_get_details_from_rfid on %s\n", count, server.c_str());
+
+  if (run(db, "one trip", true) || run(db, "two trips", false))
+    return 1;
+
+  return 0;
+}
@@ -0,0 +1,203 @@
+#include "CLogging.h"
+#include "CMetrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+
+using namespace std;
+
+/* Per-line cost of CLogging::dbg(), compared with how it used to work (strftime of the timestamp
+ * and the logfile name for every line, with the mutex taken twice). Each run writes to its own file
+ * in the directory given, which is deleted afterwards.
+ *
+ * Usage: nh-bench-log [-n lines] [-t threads] [-d directory] */
+
+static int count = 200000;
+static int threads = 1;
+static string dir = "/tmp";
+
+static string dated_name(const string &pattern)
+{
+  time_t now = time(NULL);
+  struct tm timeinfo;
+  char buf[256];
+
+  localtime_r(&now, &timeinfo);
+  strftime(buf, sizeof(buf), pattern.c_str(), &timeinfo);
+  return buf;
+}
+
+/* The logging code before the timestamp & logfile name were cached */
+class legacy_log
+{
+  public:
+    legacy_log(string pattern)
+    {
+      pthread_mutex_init(&_mutex, NULL);
+      _pattern = pattern;
+      _opened = cur_logfile();
+      _fd = open(_opened.c_str(), O_WRONLY | O_CREAT | O_APPEND, S_IREAD | S_IWRITE);
+    }
+
+    ~legacy_log()
+    {
+      if (_fd > 0)
+        close(_fd);
+      pthread_mutex_destroy(&_mutex);
+    }
+
+    string cur_logfile()
+    {
+      return dated_name(_pattern);
+    }
+
+    void dbg(string area, string msg)
+    {
+      dbg("[" + area + "] " + msg);
+    }
+
+    void dbg(string msg)
+    {
+      time_t rawtime;
+      struct tm timeinfo;
+      char buf[100];
+      string log_msg;
+
+      time(&rawtime);
+      localtime_r(&rawtime, &timeinfo);
+
+      string new_logfile = cur_logfile();
+      pthread_mutex_lock(&_mutex);
+      if (_opened != new_logfile)
+        _opened = new_logfile; // (never happens during the benchmark)
+      pthread_mutex_unlock(&_mutex);
+
+      strftime(buf, sizeof(buf), "%b %d %H:%M:%S: ", &timeinfo);
+      log_msg = buf + msg + "\n";
+      pthread_mutex_lock(&_mutex);
+      if (write(_fd, log_msg.c_str(), log_msg.length()) < 0)
+        perror("write");
+      pthread_mutex_unlock(&_mutex);
+    }
+
+  private:
+    pthread_mutex_t _mutex;
+    string _pattern;
+    string _opened;
+    int _fd;
+};
+
+struct bench_run
+{
+  legacy_log *legacy;
+  CLogging *log;
+};
+
+static void *s_log_thread(void *arg)
+{
+  bench_run *run = (bench_run*)arg;
+  string topic = "nh/gk/Comfy Area/RFID";
+  string payload = "1234567890";
+
+  for (int n=0; n < count; n++)
+  {
+    if (run->legacy != NULL)
+      run->legacy->dbg("MQTT", "Got mqtt message, topic=[" + topic + "], message=[" + payload + "]");
+    else
+      run->log->dbg("MQTT", "Got mqtt message, topic=[" + topic + "], message=[" + payload + "]");
+  }
+
+  return NULL;
+}
+
+static void run_threads(bench_run *run)
+{
+  pthread_t *tids = new pthread_t[threads];
+
+  for (int n=0; n < threads; n++)
+    pthread_create(&tids[n], NULL, s_log_thread, run);
+  for (int n=0; n < threads; n++)
+    pthread_join(tids[n], NULL);
+
+  delete[] tids;
+}
+
+static void report(const char *name, uint64_t elapsed_us)
+{
+  double lines = (double)count * threads;
+
+  printf("%-16s %10.0f lines  %8.1f ns/line  %10.0f lines/s\n", name, lines,
+         (elapsed_us * 1000.0) / lines, (elapsed_us > 0) ? (lines * 1000000.0 / elapsed_us) : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+  int c;
+
+  while ((c = getopt(argc, argv, "n:t:d:")) != -1)
+    switch (c)
+    {
+      case 'n': count = atoi(optarg);   break;
+      case 't': threads = atoi(optarg); break;
+      case 'd': dir = optarg;           break;
+      default:
+        printf("Usage: %s [-n lines] [-t threads] [-d directory]\n", argv[0]);
+        return 1;
+    }
+
+  if (threads < 1)
+    threads = 1;
+
+  printf("%d lines from each of %d thread(s)\n", count, threads);
+
+  string legacy_file = dir + "/nh-bench-log-legacy.%b%d.log";
+  string sync_file   = dir + "/nh-bench-log-sync.%b%d.log";
+  string async_file  = dir + "/nh-bench-log-async.%b%d.log";
+  uint64_t start;
+  bench_run run;
+
+  // Before
+  {
+    legacy_log legacy(legacy_file);
+    run.legacy = &legacy;
+    run.log = NULL;
+    start = monotonic_us();
+    run_threads(&run);
+    report("before", monotonic_us() - start);
+  }
+  unlink(dated_name(legacy_file).c_str());
+
+  // Now, writing from the caller's thread
+  {
+    CLogging log;
+    if (!log.open_logfile(sync_file))
+      return 1;
+    run.legacy = NULL;
+    run.log = &log;
+    start = monotonic_us();
+    run_threads(&run);
+    report("sync", monotonic_us() - start);
+  }
+  unlink(dated_name(sync_file).c_str());
+
+  // Now, async. Timed to when the last line is queued, and again to when it's all been written.
+  {
+    CLogging log;
+    if (!log.open_logfile(async_file))
+      return 1;
+    log.start_async(1048576, true, 100);
+    run.log = &log;
+    start = monotonic_us();
+    run_threads(&run);
+    report("async (queued)", monotonic_us() - start);
+    log.stop_async();
+    report("async (written)", monotonic_us() - start);
+  }
+  unlink(dated_name(async_file).c_str());
+
+  return 0;
+}
@@ -1,7 +1,11 @@
 #pragma once
 
+struct mqtt_topic;
+
 class InstCBI
 {
   public:
     virtual int cbiSendMessage(std::string, std::string) = 0;
+    virtual int cbiSendMessage(mqtt_topic *, std::string) = 0;
+    virtual mqtt_topic *cbiTopicHandle(std::string topic, bool retained, bool coalesce) = 0;
 };
@@ -0,0 +1,157 @@
+#include "CNHmqtt.h"
+
+#include <string.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <vector>
+
+bool CNHmqtt::debug_mode = false;
+bool CNHmqtt::daemonized = false;
+std::string CNHmqtt::_pid_file = "";
+
+using namespace std;
+
+/* Runs several of the (mostly idle) daemons as services inside one process, sharing a single
+ * mosquitto connection, event loop and logfile. Which ones is set by "services" in the [host]
+ * section of the config file; each service reads its own config file (<name>.conf in the same
+ * directory, unless conf_dir is set) as it would if run standalone, and still answers status
+ * requests under its own name.
+ *
+ * The service factories are only compiled when the daemon's source is built with -DNH_HOST. */
+
+typedef CNHmqtt *(*service_factory)(int argc, char *argv[]);
+
+CNHmqtt *nh_temperature_service(int argc, char *argv[]);
+CNHmqtt *nh_irc_misc_service(int argc, char *argv[]);
+CNHmqtt *nh_trustee_service(int argc, char *argv[]);
+CNHmqtt *nh_monitor_service(int argc, char *argv[]);
+
+struct hosted_service
+{
+  const char *name;
+  service_factory create;
+};
+
+static hosted_service service_list[] =
+{
+  { "nh-temperature", nh_temperature_service },
+  { "nh-irc-misc",    nh_irc_misc_service    },
+  { "nh-trustee",     nh_trustee_service     },
+  { "nh-monitor",     nh_monitor_service     },
+  { NULL, NULL }
+};
+
+class nh_host : public CNHmqtt
+{
+  public:
+    string config_dir;
+    vector<CNHmqtt*> services;
+
+    nh_host(int argc, char *argv[]) : CNHmqtt(argc, argv)
+    {
+      char buf[256] = "";
+      string config_file = "";
+
+      for (int n=1; n < argc-1; n++)
+        if (!strcmp(argv[n], "-c"))
+          config_file = argv[n+1];
+
+      strncpy(buf, config_file.c_str(), sizeof(buf)-1);
+      config_dir = get_str_option("host", "conf_dir", (config_file == "") ? "." : dirname(buf));
+    }
+
+    ~nh_host()
+    {
+      // Services go first, as they use the host's connection & logger
+      for (unsigned int n=0; n < services.size(); n++)
+        delete services[n];
+      services.clear();
+    }
+
+    int start_service(string name)
+    {
+      string config_file = config_dir + "/" + name + ".conf";
+      const char *svc_argv[5];
+      int svc_argc = 0;
+
+      for (int n=0; service_list[n].name != NULL; n++)
+        if (name == service_list[n].name)
+        {
+          svc_argv[svc_argc++] = service_list[n].name;
+          svc_argv[svc_argc++] = "-c";
+          svc_argv[svc_argc++] = config_file.c_str();
+          if (debug_mode)
+            svc_argv[svc_argc++] = "-d";
+          svc_argv[svc_argc] = NULL;
+
+          log->dbg("Starting service [" + name + "] using [" + config_file + "]");
+
+          CNHmqtt::set_host(this);
+          CNHmqtt *svc = service_list[n].create(svc_argc, (char**)svc_argv);
+          CNHmqtt::set_host(NULL);
+
+          if (svc == NULL)
+          {
+            log->dbg("Failed to start service [" + name + "]");
+            return -1;
+          }
+
+          services.push_back(svc);
+          return 0;
+        }
+
+      log->dbg("Unknown service [" + name + "]");
+      return -1;
+    }
+
+    int setup()
+    {
+      string service_names = get_str_option("host", "services", "");
+      size_t start = 0;
+
+      while (start < service_names.length())
+      {
+        size_t end = service_names.find(',', start);
+        if (end == string::npos)
+          end = service_names.length();
+
+        string name = service_names.substr(start, end - start);
+        name.erase(0, name.find_first_not_of(" \t"));
+        name.erase(name.find_last_not_of(" \t") + 1);
+        if (name != "")
+          start_service(name);
+        start = end + 1;
+      }
+
+      if (services.empty())
+      {
+        log->dbg("No services started");
+        return -1;
+      }
+
+      return 0;
+    }
+};
+
+int main(int argc, char *argv[])
+{
+  nh_host *nh = new nh_host(argc, argv);
+
+  // run with "-d" flag to avoid daemonizing
+  nh_host::daemonize();
+
+  while (nh->mosq_connect())
+    sleep(10);
+
+  if (nh->setup())
+  {
+    delete nh;
+    return 1;
+  }
+
+  nh->message_loop();
+
+  delete nh;
+
+  return 0;
+}
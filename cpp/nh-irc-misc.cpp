@@ -28,7 +28,7 @@
  */
 
 #include "CNHmqtt_irc.h"
-#include "CNHDBAccess.h"
+#include "CNHDBPool.h"
 #include "nh-irc-misc.h"
 
 using namespace std;
@@ -36,16 +36,52 @@ using namespace std;
 class nh_irc_misc : public CNHmqtt_irc
 {
   public:
-    CNHDBAccess *db;
+    CNHDBPool *db_pool;
     string entry_announce;
     string door_button;
+    string temperature_topic_out;
 
     
     nh_irc_misc(int argc, char *argv[]) : CNHmqtt_irc(argc, argv)
     {
-      db = new CNHDBAccess(get_str_option("mysql", "server", "localhost"), get_str_option("mysql", "username", "gatekeeper"), get_str_option("mysql", "password", "gk"), get_str_option("mysql", "database", "gk"), log);   ;   
+      db_pool = CNHDBPool::get_pool(get_str_option("mysql", "server", "localhost"), get_str_option("mysql", "username", "gatekeeper"), get_str_option("mysql", "password", "gk"), get_str_option("mysql", "database", "gk"), log, get_int_option("mysql", "pool_size", DB_POOL_DEFAULT_SIZE));
+      CNHDBAccess::set_slow_call_ms(get_int_option("mysql", "slow_call_ms", DB_SLOW_CALL_MS));
+      CNHDBAccess::set_deadlines(get_int_option("mysql", "timeout", DB_TIMEOUT_SECS), get_int_option("mysql", "breaker_failures", DB_BREAKER_FAILURES), get_int_option("mysql", "breaker_cooldown", DB_BREAKER_COOLDOWN_SECS));
       entry_announce = get_str_option("gatekeeper", "entry_announce", "nh/gk/entry_announce");
       door_button = get_str_option("gatekeeper", "door_button", "nh/gk/DoorButton");
+      temperature_topic_out = get_str_option("temperature", "temperature_topic_out", "nh/temperature");
+    }
+
+    ~nh_irc_misc()
+    {
+      CNHDBPool::put_pool(db_pool);
+    }
+
+    string status_detail_extra()
+    {
+      return "\"db\":" + db_pool->json();
+    }
+
+    bool cached_temperatures(string &temperature)
+    /* Build the !temp reply from the readings nh-temperature has published in the last hour.
+     * Returns false if there aren't any, e.g. just after startup. */
+    {
+      vector<cached_value> values;
+      time_t now = time(NULL);
+
+      temperature = "";
+      cache_find(temperature_topic_out + "/#", values);
+      for (unsigned int n=0; n < values.size(); n++)
+      {
+        if ((now - values[n].timestamp) > 3600)
+          continue;
+
+        if (temperature != "")
+          temperature += ", ";
+        temperature += values[n].topic.substr(temperature_topic_out.length() + 1) + ": " + values[n].payload + "C";
+      }
+
+      return (temperature != "");
     }
 
     void process_message(string topic, string message)
@@ -101,40 +137,54 @@ class nh_irc_misc : public CNHmqtt_irc
 
      if (msg=="!status")
      {
+        CNHDBPool::conn db(db_pool);
         db->sp_space_net_activity(activity);
         msg.reply(activity);
      }
 
      if (msg=="!temp")
      {
-        db->sp_temperature_check(temperature);
+        if (!cached_temperatures(temperature))
+        {
+          CNHDBPool::conn db(db_pool);
+          db->sp_temperature_check(temperature);
+        }
         msg.reply(temperature);
      }
 
      if (msg=="!tools")
      {
-       dbrows tool_list;
+       CDBResult tool_list;
        string tools_msg;
 
-       db->sp_tool_get_status(-1, &tool_list);
-       for (dbrows::const_iterator iterator = tool_list.begin(), end = tool_list.end(); iterator != end; ++iterator)
        {
-         dbrow row = *iterator;
-         tools_msg = row["tool_name"].asStr() + " - ";
+         CNHDBPool::conn db(db_pool);
+         db->sp_tool_get_status(-1, &tool_list);
+       }
+       int col_name        = tool_list.column("tool_name");
+       int col_status      = tool_list.column("tool_status");
+       int col_status_text = tool_list.column("tool_status_text");
+       int col_usage_start = tool_list.column("usage_start");
+       int col_usage_end   = tool_list.column("usage_end");
+       for (unsigned int n=0; n < tool_list.size(); n++)
+       {
+         CDBResult::row row = tool_list[n];
+         string status = row.asStr(col_status);
+         tools_msg = row.asStr(col_name) + " - ";
 
-         if (row["tool_status"].asStr() == "FREE")
+         if (status == "FREE")
          {
-           tools_msg += "Available; last used: " + row["usage_end"].asStr();
+           tools_msg += "Available; last used: " + row.asStr(col_usage_end);
          }
-         else if (row["tool_status"].asStr() == "IN_USE")
+         else if (status == "IN_USE")
          {
-           tools_msg += "In use since: " + row["usage_start"].asStr();
+           tools_msg += "In use since: " + row.asStr(col_usage_start);
          }
-         else if (row["tool_status"].asStr() == "DISABLED")
+         else if (status == "DISABLED")
          {
            tools_msg += "Out of service";
-           if (!(row["tool_status_text"].isNull()))
-             tools_msg += ": " + row["tool_status_text"].asStr();
+           if (!(row.isNull(col_status_text)))
+             tools_msg += ": " + row.asStr(col_status_text);
          }
          else
          {
@@ -151,11 +201,16 @@ class nh_irc_misc : public CNHmqtt_irc
      if (!init()) // connect to mosquitto, daemonize, etc
       return false;
      
-     if (db->dbConnect())
-       return false;
+     // Make the first connection now, so a bad config is found at startup
+     {
+       CNHDBPool::conn db(db_pool);
+       if (!db->is_connected())
+         return false;
+     }
      
      subscribe(entry_announce + "/#");
      subscribe(door_button);
+     cache_topic(temperature_topic_out + "/#", 32);
      
      return true;
    }
@@ -163,6 +218,21 @@ class nh_irc_misc : public CNHmqtt_irc
 };
 
 
+#ifdef NH_HOST
+CNHmqtt *nh_irc_misc_service(int argc, char *argv[])
+/* Create nh-irc-misc as a service running inside nh-host */
+{
+  nh_irc_misc *nh = new nh_irc_misc(argc, argv);
+
+  if (!nh->setup())
+  {
+    delete nh;
+    return NULL;
+  }
+
+  return nh->service();
+}
+#else
 int main(int argc, char *argv[])
 {
  // run with "-d" flag to avoid daemonizing
@@ -177,3 +247,4 @@ int main(int argc, char *argv[])
     return 1;
   
 }
+#endif
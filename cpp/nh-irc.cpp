@@ -82,7 +82,7 @@ class nh_irc : public CNHmqtt
       log->dbg("Connecting to irc...");
       irccon = new irc(irc_server, irc_port, irc_nick, irc_nickserv_password, log);
       
-      if (irccon->ircConnect())
+      if (irccon->ircConnect(false))
       {
         log->dbg("Failed to connect to IRC server");
         return -1;
@@ -90,6 +90,10 @@ class nh_irc : public CNHmqtt
   
       irccon->join(irc_channel); 
       irccon->addCallback("", &irc_callback, this);
+
+      // IRC messages are read by message_loop(), on the same thread as MQTT messages
+      watch_fd(irccon->skt, &nh_irc::s_irc_read, this);
+      add_timer(30 * 1000, &nh_irc::s_irc_activity, this);
       log->dbg("Connected to irc.");
       subscribe(ircmsg_mqtt_tx);
       subscribe(irc_mqtt_tx);
@@ -97,6 +101,25 @@ class nh_irc : public CNHmqtt
       return 0;
     }
 
+  static void s_irc_read(void *obj, int fd, unsigned int)
+  {
+    nh_irc *m = (nh_irc*)obj;
+
+    m->irccon->readSocket();
+    if (m->irccon->state != irc::CONNECTED)
+      m->unwatch_fd(fd);
+  }
+
+  static void s_irc_activity(void *obj)
+  {
+    nh_irc *m = (nh_irc*)obj;
+    int fd = m->irccon->skt;
+
+    m->irccon->checkActivity();
+    if (m->irccon->state != irc::CONNECTED)
+      m->unwatch_fd(fd);
+  }
+
   static int irc_callback(string user, string channel, string message, void *obj)
   {
     nh_irc *m;
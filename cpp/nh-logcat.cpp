@@ -0,0 +1,478 @@
+#include "CLogging.h"
+#include "CLogRecord.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+using namespace std;
+
+/* Prints binary logfiles (log_format = binary) in the same form as the text logs. Files compressed
+ * by log_compress (.gz) are read directly.
+ *
+ * Usage: nh-logcat [-a area,...] [-l level] [-s start] [-e end] [-g text] [-f] file...
+ *   -a  only lines from these areas (e.g. DB,MQTT)
+ *   -l  skip lines logged at a less important level than this (error, warn, info or debug).
+ *       Lines logged with plain dbg() have no level, so are always shown.
+ *   -s  only lines from this time on, "YYYY-MM-DD [HH:MM[:SS]]" or "HH:MM[:SS]" (today)
+ *   -e  only lines before this time
+ *   -g  only lines containing this text
+ *   -f  once at the end of the last file, wait for more to be written (like tail -f) */
+
+static set<string> areas;
+static int max_level = -1;
+static uint64_t start_us = 0;
+static uint64_t end_us = 0;
+static string grep_text = "";
+static bool follow = false;
+
+static bool parse_time(const char *str, uint64_t &time_us)
+{
+  const char *formats[] = { "%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d", "%H:%M:%S", "%H:%M", NULL };
+  time_t now = time(NULL);
+
+  for (int n=0; formats[n] != NULL; n++)
+  {
+    struct tm tm;
+
+    localtime_r(&now, &tm); // date defaults to today
+    tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+    const char *end = strptime(str, formats[n], &tm);
+    if ((end != NULL) && (*end == '\0'))
+    {
+      tm.tm_isdst = -1;
+      time_us = (uint64_t)mktime(&tm) * 1000000;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static char arg_tag(char conv)
+/* The tag CLogging packs an argument for conversion conv with */
+{
+  if (strchr("dic", conv))
+    return LOG_ARG_INT;
+  if (strchr("uxXop", conv))
+    return LOG_ARG_UINT;
+  if (conv == 's')
+    return LOG_ARG_STRING;
+  return LOG_ARG_DOUBLE;
+}
+
+static string format_arg(const string &spec, const char *&p, const char *end)
+/* Format one packed argument using its printf spec. An argument that isn't the type the spec 
+ * expects (i.e. the file's corrupt) is skipped, and shown as "<?>". */
+{
+  char conv = spec[spec.length()-1];
+  string plain; // spec without any length modifier
+  char buf[64];
+  uint64_t value;
+  char tag;
+
+  for (size_t n=0; n < spec.length(); n++)
+    if (!strchr("hlzjtL", spec[n]))
+      plain += spec[n];
+
+  if (p >= end)
+    return "<?>";
+
+  tag = *p++;
+  switch (tag)
+  {
+    case LOG_ARG_INT:
+    {
+      if (!log_get_varint(p, end, value) || (tag != arg_tag(conv)))
+        return "<?>";
+      long long sval = (long long)(value >> 1) ^ -(long long)(value & 1);
+      if (conv == 'c')
+        snprintf(buf, sizeof(buf), plain.c_str(), (int)sval);
+      else
+        snprintf(buf, sizeof(buf), plain.insert(plain.length()-1, "ll").c_str(), sval);
+      return buf;
+    }
+
+    case LOG_ARG_UINT:
+      if (!log_get_varint(p, end, value) || (tag != arg_tag(conv)))
+        return "<?>";
+      if (conv == 'p')
+        snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)value);
+      else
+        snprintf(buf, sizeof(buf), plain.insert(plain.length()-1, "ll").c_str(), (unsigned long long)value);
+      return buf;
+
+    case LOG_ARG_DOUBLE:
+    {
+      double d;
+      if ((end - p) < (long)sizeof(d))
+        return "<?>";
+      memcpy(&d, p, sizeof(d));
+      p += sizeof(d);
+      if (tag != arg_tag(conv))
+        return "<?>";
+      snprintf(buf, sizeof(buf), plain.c_str(), d);
+      return buf;
+    }
+
+    case LOG_ARG_STRING:
+    {
+      if (!log_get_varint(p, end, value) || ((uint64_t)(end - p) < value))
+        return "<?>";
+      string str(p, value);
+      p += value;
+      if (tag != arg_tag(conv))
+        return "<?>";
+      if (plain == "%s")
+        return str;
+      int len = snprintf(NULL, 0, plain.c_str(), str.c_str());
+      string out(len + 1, '\0');
+      snprintf(&out[0], len + 1, plain.c_str(), str.c_str());
+      out.resize(len);
+      return out;
+    }
+  }
+
+  return "<?>";
+}
+
+static string format_message(const string &format, const char *args, const char *end)
+{
+  string msg;
+  const char *p = args;
+
+  for (size_t n=0; n < format.length(); n++)
+  {
+    char conv;
+    string length;
+    size_t spec_len;
+
+    if (format[n] != '%')
+    {
+      msg += format[n];
+      continue;
+    }
+
+    spec_len = log_parse_spec(format.c_str() + n, conv, length);
+    if (spec_len == 0)
+    {
+      msg += format.substr(n);
+      break;
+    }
+
+    if (conv == '%')
+      msg += '%';
+    else
+      msg += format_arg(format.substr(n, spec_len), p, end);
+    n += spec_len - 1;
+  }
+
+  return msg;
+}
+
+class log_reader
+{
+  public:
+    string filename;
+    gzFile gz;
+    string buf;
+    size_t pos;
+    uint64_t offset; // in the (uncompressed) file, of the start of buf
+    bool started;
+    bool resyncing;  // looking for the next session after an invalid record
+    uint64_t session_us; // when the current session started
+    map<uint32_t, string> strings; // ids defined in the current session
+
+    log_reader(string file)
+    {
+      filename = file;
+      gz = NULL;
+      pos = 0;
+      offset = 0;
+      started = false;
+      resyncing = false;
+      session_us = 0;
+    }
+
+    ~log_reader()
+    {
+      if (gz != NULL)
+        gzclose(gz);
+    }
+
+    int read_more()
+    /* Returns the number of bytes read; 0 at the end of the file */
+    {
+      char chunk[65536];
+
+      if (pos > 0)
+      {
+        buf.erase(0, pos);
+        offset += pos;
+        pos = 0;
+      }
+
+      int len = gzread(gz, chunk, sizeof(chunk));
+      if (len > 0)
+        buf.append(chunk, len);
+      else
+        gzclearerr(gz); // so a file still being written can be read again
+      return (len > 0) ? len : 0;
+    }
+
+    void line(const log_record &rec, const char *args, const char *end)
+    {
+      string area = (rec.area != 0) ? strings[rec.area] : "";
+
+      if ((start_us != 0) && (rec.time_us < start_us))
+        return;
+      if ((end_us != 0) && (rec.time_us >= end_us))
+        return;
+      if (!areas.empty() && !areas.count(area))
+        return;
+      if ((max_level >= 0) && (rec.level != LOG_LEVEL_NONE) && (rec.level > max_level))
+        return;
+
+      string msg = format_message(strings[rec.id], args, end);
+      if ((grep_text != "") && (msg.find(grep_text) == string::npos) && (area.find(grep_text) == string::npos))
+        return;
+
+      time_t secs = rec.time_us / 1000000;
+      struct tm tm;
+      char prefix[32];
+
+      localtime_r(&secs, &tm);
+      strftime(prefix, sizeof(prefix), "%b %d %H:%M:%S: ", &tm);
+      if (rec.area != 0)
+        printf("%s[%s] %s\n", prefix, area.c_str(), msg.c_str());
+      else
+        printf("%s%s\n", prefix, msg.c_str());
+    }
+
+    size_t find_session(size_t from, size_t before)
+    /* Position of the first session record starting between from and before, or string::npos. A 
+     * session started since the current one is where CLogging started writing again after a restart. */
+    {
+      size_t magic_len = strlen(LOG_RECORD_MAGIC);
+      size_t limit = buf.length();
+      log_record rec;
+
+      if ((before != string::npos) && (before + LOG_RECORD_MAX_HEADER + magic_len < limit))
+        limit = before + LOG_RECORD_MAX_HEADER + magic_len;
+
+      for (size_t m = from; m < limit; m++)
+      {
+        const char *found = (const char*)memmem(buf.data() + m, limit - m, LOG_RECORD_MAGIC, magic_len);
+        if (found == NULL)
+          break;
+        m = found - buf.data();
+
+        for (size_t s = m; (s > from) && (s + LOG_RECORD_MAX_HEADER > m); s--)
+          if ((s-1 < before) && (buf[s-1] == LOG_REC_SESSION) &&
+              (log_get_record(buf.data() + s-1, buf.data() + buf.length(), rec) == 1) &&
+              (s-1 + rec.header_len == m) && (rec.length >= rec.header_len + magic_len) && (rec.time_us >= session_us))
+            return s-1;
+      }
+
+      return string::npos;
+    }
+
+    bool resync()
+    /* Move pos on to the next session record. Returns false if there isn't one in what's been read 
+     * so far. */
+    {
+      size_t magic_len = strlen(LOG_RECORD_MAGIC);
+      size_t next = find_session(pos, string::npos);
+
+      if (next != string::npos)
+      {
+        pos = next;
+        return true;
+      }
+
+      // Keep enough to spot a session record that's only partly been read
+      if (buf.length() > pos + LOG_RECORD_MAX_HEADER + magic_len)
+        pos = buf.length() - (LOG_RECORD_MAX_HEADER + magic_len);
+      return false;
+    }
+
+    int process()
+    /* Decode all complete records read so far. Returns -1 if the file isn't a binary log. */
+    {
+      log_record rec;
+
+      while (pos < buf.length())
+      {
+        if (resyncing)
+        {
+          if (!resync())
+            break;
+          resyncing = false;
+        }
+
+        const char *start = buf.data() + pos;
+        int ret = log_get_record(start, buf.data() + buf.length(), rec);
+
+        if ((ret < 0) && !started)
+        {
+          fprintf(stderr, "%s: not a binary logfile\n", filename.c_str());
+          return -1;
+        }
+
+        // e.g. half written when the process crashed - carry on from when it was restarted
+        if (ret < 0)
+        {
+          fprintf(stderr, "%s: invalid record at offset %llu - skipping to the next session\n", filename.c_str(), (unsigned long long)(offset + pos));
+          pos++;
+          resyncing = true;
+          continue;
+        }
+
+        if ((ret == 0) || ((buf.length() - pos) < rec.length))
+          break; // rest not written yet
+
+        const char *body = start + rec.header_len;
+        const char *end = start + rec.length;
+
+        if (!started && ((rec.type != LOG_REC_SESSION) || ((size_t)(end - body) < strlen(LOG_RECORD_MAGIC)) || strncmp(body, LOG_RECORD_MAGIC, strlen(LOG_RECORD_MAGIC))))
+        {
+          fprintf(stderr, "%s: not a binary logfile\n", filename.c_str());
+          return -1;
+        }
+        started = true;
+
+        // A record cut short when the process died runs on into the session written after a restart
+        size_t next = find_session(pos + 1, pos + rec.length);
+        if (next != string::npos)
+        {
+          fprintf(stderr, "%s: record at offset %llu cut short - skipping to the next session\n", filename.c_str(), (unsigned long long)(offset + pos));
+          pos = next;
+          continue;
+        }
+
+        switch (rec.type)
+        {
+          case LOG_REC_SESSION:
+            session_us = rec.time_us;
+            strings.clear();
+            strings[LOG_FORMAT_STRING_ID] = "%s";
+            break;
+
+          case LOG_REC_DEFINE:
+            strings[rec.id] = string(body, end - body);
+            break;
+
+          case LOG_REC_LINE:
+            line(rec, body, end);
+            break;
+        }
+        pos += rec.length;
+      }
+
+      return 0;
+    }
+
+    int cat(bool tail)
+    {
+      gz = gzopen(filename.c_str(), "rb"); // (uncompressed files are read as they are)
+      if (gz == NULL)
+      {
+        perror(filename.c_str());
+        return -1;
+      }
+
+      for (;;)
+      {
+        if (read_more() > 0)
+        {
+          if (process())
+            return -1;
+          continue;
+        }
+
+        if (!tail)
+          break;
+
+        fflush(stdout);
+        usleep(250000);
+      }
+
+      return 0;
+    }
+};
+
+int main(int argc, char *argv[])
+{
+  int c;
+  int ret = 0;
+
+  while ((c = getopt(argc, argv, "a:l:s:e:g:f")) != -1)
+    switch (c)
+    {
+      case 'a':
+      {
+        string list = optarg;
+        size_t start = 0;
+        while (start <= list.length())
+        {
+          size_t end = list.find(',', start);
+          if (end == string::npos)
+            end = list.length();
+          if (end > start)
+            areas.insert(list.substr(start, end - start));
+          start = end + 1;
+        }
+        break;
+      }
+
+      case 'l':
+      {
+        log_level level;
+        if (CLogging::parse_level(optarg, level))
+        {
+          fprintf(stderr, "Invalid level [%s] - expected error, warn, info or debug\n", optarg);
+          return 1;
+        }
+        max_level = level;
+        break;
+      }
+
+      case 's':
+      case 'e':
+        if (!parse_time(optarg, (c == 's') ? start_us : end_us))
+        {
+          fprintf(stderr, "Invalid time [%s] - expected \"YYYY-MM-DD [HH:MM[:SS]]\" or \"HH:MM[:SS]\"\n", optarg);
+          return 1;
+        }
+        break;
+
+      case 'g': grep_text = optarg; break;
+      case 'f': follow = true;      break;
+
+      default:
+        fprintf(stderr, "Usage: %s [-a area,...] [-l level] [-s start] [-e end] [-g text] [-f] file...\n", argv[0]);
+        return 1;
+    }
+
+  if (optind >= argc)
+  {
+    fprintf(stderr, "No logfiles given\n");
+    return 1;
+  }
+
+  for (int n=optind; n < argc; n++)
+  {
+    log_reader reader(argv[n]);
+    if (reader.cat(follow && (n == argc-1)))
+      ret = 1;
+  }
+
+  return ret;
+}
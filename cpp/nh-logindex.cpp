@@ -0,0 +1,1103 @@
+#include "CLogRecord.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <zlib.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+
+using namespace std;
+
+/* Index of (text) logfiles, so the lines mentioning an RFID serial, member, door or vend
+ * transaction - or from a time range - can be found without reading weeks of logs. Each update
+ * only reads what has been written since the last one, so can be run from cron over all the
+ * logfiles (including ones still being written). A file compressed by log_compress keeps its
+ * entries, as offsets are into the uncompressed text.
+ *
+ * Usage: nh-logindex [-d index dir] -u logfile...     add anything new in these files
+ *        nh-logindex [-d index dir] [-s start] [-e end] [term...]
+ *
+ * Terms are rfid=<serial>, member=<id>, door=<id or name>, vend=<transaction id> or handle=<handle>
+ * (quoted if it has spaces), or just a value to match any of them. Lines matching all the terms are
+ * printed, prefixed by the file they're in. -s / -e ("YYYY-MM-DD [HH:MM[:SS]]" or "HH:MM[:SS]") limit
+ * them to a time range, or on their own print everything logged in it.
+ *
+ * The index directory has a "files" table (what's been indexed, and how far), and segments of
+ * postings - sorted terms, each with a list of (file id, line offset) - one per update, merged
+ * into one when there are more than INDEX_MAX_SEGMENTS. Binary logs (log_format = binary) aren't
+ * indexed. */
+
+#define INDEX_MAGIC        "NHLIX1\n"
+#define INDEX_MAX_SEGMENTS 8
+#define INDEX_MAX_VALUE    64
+#define TIME_BUCKET        3600  // seconds - "t:<n>" gives the first line of each hour
+
+struct posting
+{
+  uint32_t file;
+  uint64_t offset;
+
+  bool operator<(const posting &other) const
+  {
+    return (file != other.file) ? (file < other.file) : (offset < other.offset);
+  }
+
+  bool operator==(const posting &other) const
+  {
+    return (file == other.file) && (offset == other.offset);
+  }
+};
+
+typedef map<string, vector<posting> > term_map;
+
+struct file_record
+{
+  uint32_t id;
+  string path;
+  uint64_t disk_size;   // size & mtime when last read, to skip unchanged files
+  time_t mtime;
+  uint64_t indexed;     // bytes of (uncompressed) text indexed - always up to the end of a line
+  uint64_t hash;        // of the first line, to spot a file being replaced or compressed
+  uint64_t last_bucket;
+};
+
+/* Terms are found in these fields, "type:value". Values end at any of the end characters. The text
+ * before is matched ignoring case (e.g. the original doors log "Door opened by: "). */
+struct term_rule
+{
+  const char *type;
+  const char *before;
+  const char *end;
+};
+
+static const term_rule term_rules[] =
+{
+  { "rfid",   "Serial = [",                 "]"   }, // nh-vend
+  { "vend",   "transaction id = [",         "]"   },
+  { "member", "for member [",               "]"   }, // GateKeeper zone updates
+  { "door",   "unknown door! ([",           "]"   },
+  { "door",   "CGatekeeper_door_hs25(",     ")"   },
+  { "door",   "CGatekeeper_door_original(", ")"   },
+  { "handle", "door opened by: ",           "(]"  }, // handles can have spaces - up to " (last seen", or the end
+  { NULL,     NULL,                         NULL  }
+};
+
+static const char *any_types[] = { "rfid", "member", "door", "vend", "handle", NULL };
+
+static string index_dir = ".nh-logindex";
+
+static uint64_t hash_text(const char *text, size_t len)
+/* FNV-1a */
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (size_t n=0; n < len; n++)
+  {
+    hash ^= (uint8_t)text[n];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash ? hash : 1; // 0 = not known yet
+}
+
+static string term_key(const char *type, const char *value, size_t len)
+{
+  string key = type;
+
+  key += ':';
+  for (size_t n=0; (n < len) && (n < INDEX_MAX_VALUE); n++)
+    key += tolower(value[n]);
+
+  return key;
+}
+
+static void add_field(vector<string> &terms, const char *type, const char *start, const char *line_end, const char *end_chars)
+{
+  const char *end = start;
+
+  while ((end < line_end) && !strchr(end_chars, *end))
+    end++;
+
+  while ((start < end) && (*start == ' '))
+    start++;
+
+  while ((end > start) && (end[-1] == ' '))
+    end--;
+
+  if (end > start)
+    terms.push_back(term_key(type, start, end - start));
+}
+
+static const char *find_text(const char *start, const char *end, const char *text)
+{
+  size_t len = strlen(text);
+
+  for (const char *p = start; (p + len) <= end; p++)
+  {
+    p = (const char*)memchr(p, text[0], (end - p) - len + 1);
+    if (p == NULL)
+      return NULL;
+    if (!memcmp(p, text, len))
+      return p;
+  }
+
+  return NULL;
+}
+
+static const char *find_text_nocase(const char *start, const char *end, const char *text)
+/* The rules' text isn't always capitalised the same way in the logs */
+{
+  size_t len = strlen(text);
+  char lower = tolower(text[0]);
+  char upper = toupper(text[0]);
+
+  for (const char *p = start; (p + len) <= end; p++)
+    if (((*p == lower) || (*p == upper)) && !strncasecmp(p, text, len))
+      return p;
+
+  return NULL;
+}
+
+static void line_terms(const char *line, size_t len, vector<string> &terms)
+/* The terms a line should be found by */
+{
+  const char *end = line + len;
+  const char *p;
+
+  for (int n=0; term_rules[n].type != NULL; n++)
+    if ((p = find_text_nocase(line, end, term_rules[n].before)) != NULL)
+      add_field(terms, term_rules[n].type, p + strlen(term_rules[n].before), end, term_rules[n].end);
+
+  // MQTT messages. Door events are "<base topic>/<door id>/...", usually nh/gk, and a card read on
+  // a door (or a side of one) ends "/RFID" with the serial as the message.
+  if ((p = find_text(line, end, "topic=[")) != NULL)
+  {
+    const char *topic = p + strlen("topic=[");
+    const char *topic_end = (const char*)memchr(topic, ']', end - topic);
+    if (topic_end == NULL)
+      return;
+
+    const char *gk = find_text(topic, topic_end, "/gk/");
+    if (gk != NULL)
+    {
+      const char *door = gk + strlen("/gk/");
+      const char *door_end = door;
+      while ((door_end < topic_end) && isdigit(*door_end))
+        door_end++;
+      if ((door_end > door) && ((door_end == topic_end) || (*door_end == '/')))
+        terms.push_back(term_key("door", door, door_end - door));
+    }
+
+    if (((topic_end - topic) > 5) && !memcmp(topic_end - 5, "/RFID", 5) && ((p = find_text(topic_end, end, "message=[")) != NULL))
+      add_field(terms, "rfid", p + strlen("message=["), end, "]");
+  }
+}
+
+static time_t line_time(const char *line, size_t len, const struct tm &file_tm)
+/* The time from a line's "Mon DD HH:MM:SS: " prefix (or -1 if it hasn't got one). Logs don't have
+ * the year, so it's assumed the line is from the year the file was last written to, or the one
+ * before if its month is later. */
+{
+  static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  static __thread char cached_prefix[9];
+  static __thread int cached_year = -1;
+  static __thread int cached_mon = -1;
+  static __thread time_t cached_hour = -1;
+
+  if ((len < 16) || (line[3] != ' ') || (line[6] != ' ') || (line[9] != ':') || (line[12] != ':') || (line[15] != ':'))
+    return -1;
+
+  for (int n = 5; n < 15; n++)
+    if ((n != 6) && (n != 9) && (n != 12) && !isdigit(line[n]))
+      return -1;
+
+  int min = ((line[10] - '0') * 10) + (line[11] - '0');
+  int sec = ((line[13] - '0') * 10) + (line[14] - '0');
+
+  // mktime is only needed once an hour
+  if ((cached_hour < 0) || (cached_year != file_tm.tm_year) || (cached_mon != file_tm.tm_mon) || memcmp(cached_prefix, line, 9))
+  {
+    char month[4] = { line[0], line[1], line[2], '\0' };
+    const char *m = strstr(months, month);
+    if ((m == NULL) || ((m - months) % 3))
+      return -1;
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_mon = (m - months) / 3;
+    tm.tm_year = (tm.tm_mon > file_tm.tm_mon) ? file_tm.tm_year - 1 : file_tm.tm_year;
+    tm.tm_mday = ((line[4] == ' ') ? 0 : (line[4] - '0') * 10) + (line[5] - '0');
+    tm.tm_hour = ((line[7] - '0') * 10) + (line[8] - '0');
+    tm.tm_isdst = -1;
+
+    cached_hour = mktime(&tm);
+    cached_year = file_tm.tm_year;
+    cached_mon = file_tm.tm_mon;
+    memcpy(cached_prefix, line, 9);
+  }
+
+  return cached_hour + (min * 60) + sec;
+}
+
+static bool parse_time(const char *str, time_t &when)
+{
+  const char *formats[] = { "%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d", "%H:%M:%S", "%H:%M", NULL };
+  time_t now = time(NULL);
+
+  for (int n=0; formats[n] != NULL; n++)
+  {
+    struct tm tm;
+
+    localtime_r(&now, &tm); // date defaults to today
+    tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+    const char *end = strptime(str, formats[n], &tm);
+    if ((end != NULL) && (*end == '\0'))
+    {
+      tm.tm_isdst = -1;
+      when = mktime(&tm);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static bool read_file(const string &filename, string &out)
+{
+  char buf[65536];
+  ssize_t len;
+
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  out.clear();
+  while ((len = read(fd, buf, sizeof(buf))) > 0)
+    out.append(buf, len);
+  close(fd);
+
+  return (len == 0);
+}
+
+static bool write_file(const string &filename, const string &data)
+/* Replace filename with data, so readers see either all the old or all the new */
+{
+  string tmp = filename + ".tmp";
+
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd < 0)
+    return false;
+
+  if ((write(fd, data.data(), data.length()) != (ssize_t)data.length()) || fdatasync(fd))
+  {
+    close(fd);
+    unlink(tmp.c_str());
+    return false;
+  }
+  close(fd);
+
+  return (rename(tmp.c_str(), filename.c_str()) == 0);
+}
+
+static uint64_t first_line_hash(gzFile gz)
+/* Hash of the first line (or 0 if there isn't a whole one yet). Leaves gz at the start. */
+{
+  char buf[256];
+  uint64_t hash = 0;
+
+  gzrewind(gz);
+  int len = gzread(gz, buf, sizeof(buf));
+  if (len > 0)
+  {
+    char *nl = (char*)memchr(buf, '\n', len);
+    if (nl != NULL)
+      hash = hash_text(buf, nl - buf);
+    else if (len == (int)sizeof(buf))
+      hash = hash_text(buf, len);
+  }
+  gzclearerr(gz);
+  gzrewind(gz);
+
+  return hash;
+}
+
+/* Segments */
+
+static void put_postings(string &out, const vector<posting> &postings)
+/* File ids are deltas, and so are offsets within the same file */
+{
+  uint32_t file = 0;
+  uint64_t offset = 0;
+
+  log_put_varint(out, postings.size());
+  for (size_t n=0; n < postings.size(); n++)
+  {
+    log_put_varint(out, postings[n].file - file);
+    log_put_varint(out, (postings[n].file == file) ? postings[n].offset - offset : postings[n].offset);
+    file = postings[n].file;
+    offset = postings[n].offset;
+  }
+}
+
+static bool get_postings(const char *p, const char *end, vector<posting> &out)
+{
+  uint64_t count, file_delta, offset_delta;
+  posting post = { 0, 0 };
+
+  if (!log_get_varint(p, end, count))
+    return false;
+
+  for (uint64_t n=0; n < count; n++)
+  {
+    if (!log_get_varint(p, end, file_delta) || !log_get_varint(p, end, offset_delta))
+      return false;
+    post.offset = (file_delta == 0) ? post.offset + offset_delta : offset_delta;
+    post.file += file_delta;
+    out.push_back(post);
+  }
+
+  return true;
+}
+
+static bool write_segment(const string &filename, term_map &terms)
+{
+  string out = INDEX_MAGIC;
+  string postings;
+
+  log_put_varint(out, terms.size());
+  for (term_map::iterator i = terms.begin(); i != terms.end(); ++i)
+  {
+    sort(i->second.begin(), i->second.end());
+    i->second.erase(unique(i->second.begin(), i->second.end()), i->second.end());
+
+    postings.clear();
+    put_postings(postings, i->second);
+
+    log_put_varint(out, i->first.length());
+    out += i->first;
+    log_put_varint(out, postings.length());
+    out += postings;
+  }
+
+  return write_file(filename, out);
+}
+
+class segment_reader
+/* Steps through the terms of a segment, only decoding the postings of the ones wanted */
+{
+  public:
+    string data;
+    const char *p;
+    const char *end;
+    uint64_t remaining;
+
+    bool open(const string &filename)
+    {
+      if (!read_file(filename, data) || (data.compare(0, strlen(INDEX_MAGIC), INDEX_MAGIC) != 0))
+        return false;
+
+      p = data.data() + strlen(INDEX_MAGIC);
+      end = data.data() + data.length();
+      return log_get_varint(p, end, remaining);
+    }
+
+    // term is set to the next term, and postings/postings_end to its encoded postings
+    bool next(string &term, const char *&postings, const char *&postings_end)
+    {
+      uint64_t len;
+
+      if (remaining == 0)
+        return false;
+      remaining--;
+
+      if (!log_get_varint(p, end, len) || ((uint64_t)(end - p) < len))
+        return false;
+      term.assign(p, len);
+      p += len;
+
+      if (!log_get_varint(p, end, len) || ((uint64_t)(end - p) < len))
+        return false;
+      postings = p;
+      postings_end = p + len;
+      p += len;
+      return true;
+    }
+};
+
+/* The index */
+
+class log_index
+{
+  public:
+    log_index(string dir)
+    {
+      _dir = dir;
+      _lock_fd = -1;
+      _next_id = 1;
+    }
+
+    ~log_index()
+    {
+      if (_lock_fd >= 0)
+        close(_lock_fd);
+    }
+
+    int lock(bool exclusive)
+    {
+      if (exclusive && (mkdir(_dir.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0) && (errno != EEXIST))
+      {
+        fprintf(stderr, "Failed to create index directory [%s]: %s\n", _dir.c_str(), strerror(errno));
+        return -1;
+      }
+
+      _lock_fd = open((_dir + "/lock").c_str(), exclusive ? (O_RDWR | O_CREAT) : O_RDONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+      if (_lock_fd < 0)
+      {
+        fprintf(stderr, "No index in [%s] - build one with -u\n", _dir.c_str());
+        return -1;
+      }
+
+      return flock(_lock_fd, exclusive ? LOCK_EX : LOCK_SH);
+    }
+
+    int load()
+    {
+      string data;
+      size_t pos = 0;
+
+      _files.clear();
+      if (!read_file(_dir + "/files", data))
+        return 0; // new index
+
+      while (pos < data.length())
+      {
+        size_t eol = data.find('\n', pos);
+        if (eol == string::npos)
+          eol = data.length();
+        string line = data.substr(pos, eol - pos);
+        pos = eol + 1;
+
+        file_record rec;
+        unsigned long long disk_size, mtime, indexed, hash, last_bucket;
+        unsigned int id;
+        int path_start = 0;
+
+        if (sscanf(line.c_str(), "next %u", &id) == 1)
+          _next_id = id;
+        else if (sscanf(line.c_str(), "%u %llu %llu %llu %llx %llu %n", &id, &disk_size, &mtime, &indexed, &hash, &last_bucket, &path_start) >= 6 && (path_start > 0))
+        {
+          rec.id = id;
+          rec.disk_size = disk_size;
+          rec.mtime = mtime;
+          rec.indexed = indexed;
+          rec.hash = hash;
+          rec.last_bucket = last_bucket;
+          rec.path = line.substr(path_start);
+          _files[rec.id] = rec;
+        }
+      }
+
+      return 0;
+    }
+
+    int save()
+    {
+      string data = "# id, size, mtime, bytes indexed, first line hash, last time bucket, path\n";
+      char buf[128];
+
+      snprintf(buf, sizeof(buf), "next %u\n", _next_id);
+      data += buf;
+      for (map<uint32_t, file_record>::iterator i = _files.begin(); i != _files.end(); ++i)
+      {
+        snprintf(buf, sizeof(buf), "%u %llu %llu %llu %llx %llu ", i->second.id, (unsigned long long)i->second.disk_size,
+                 (unsigned long long)i->second.mtime, (unsigned long long)i->second.indexed,
+                 (unsigned long long)i->second.hash, (unsigned long long)i->second.last_bucket);
+        data += buf + i->second.path + "\n";
+      }
+
+      if (!write_file(_dir + "/files", data))
+      {
+        fprintf(stderr, "Failed to write [%s/files]: %s\n", _dir.c_str(), strerror(errno));
+        return -1;
+      }
+
+      return 0;
+    }
+
+    int update(const vector<string> &paths)
+    {
+      term_map terms;
+      uint64_t lines = 0;
+      int ret = 0;
+
+      if (lock(true) || load())
+        return -1;
+
+      follow_renames();
+
+      for (size_t n=0; n < paths.size(); n++)
+        if (index_file(paths[n], terms, lines))
+          ret = 1;
+
+      vector<string> segments;
+      list_segments(segments);
+
+      if (!terms.empty())
+      {
+        string seg_name = segment_name(segments);
+        if (!write_segment(seg_name, terms))
+        {
+          fprintf(stderr, "Failed to write [%s]: %s\n", seg_name.c_str(), strerror(errno));
+          return -1;
+        }
+        segments.push_back(seg_name);
+      }
+
+      // The files table is written after the segment, so a crash in between only means some lines
+      // are indexed twice (and duplicates are ignored)
+      if (save())
+        return -1;
+
+      if (segments.size() > INDEX_MAX_SEGMENTS)
+        merge(segments);
+
+      printf("Indexed %llu new lines, %u terms\n", (unsigned long long)lines, (unsigned int)terms.size());
+      return ret;
+    }
+
+    int query(const vector<string> &query_terms, time_t start, time_t end)
+    {
+      vector<posting> results;
+
+      if (lock(false) || load())
+        return -1;
+
+      vector<string> segments;
+      list_segments(segments);
+
+      if (query_terms.empty())
+        return print_range(segments, start, end);
+
+      for (size_t n=0; n < query_terms.size(); n++)
+      {
+        set<string> keys;
+        vector<posting> found;
+        size_t eq = query_terms[n].find('=');
+
+        if (eq != string::npos)
+        {
+          string type = query_terms[n].substr(0, eq);
+          string value = query_terms[n].substr(eq + 1);
+          keys.insert(term_key(type.c_str(), value.data(), value.length()));
+        }
+        else
+          for (int t=0; any_types[t] != NULL; t++)
+            keys.insert(term_key(any_types[t], query_terms[n].data(), query_terms[n].length()));
+
+        lookup(segments, keys, found);
+
+        if (n == 0)
+          results.swap(found);
+        else
+        {
+          vector<posting> both;
+          set_intersection(results.begin(), results.end(), found.begin(), found.end(), back_inserter(both));
+          results.swap(both);
+        }
+      }
+
+      print_lines(results, start, end);
+      return 0;
+    }
+
+  private:
+    string _dir;
+    int _lock_fd;
+    uint32_t _next_id;
+    map<uint32_t, file_record> _files;
+
+    file_record *find_path(const string &path)
+    {
+      for (map<uint32_t, file_record>::iterator i = _files.begin(); i != _files.end(); ++i)
+        if (i->second.path == path)
+          return &i->second;
+      return NULL;
+    }
+
+    void follow_renames()
+    /* Files that have gone are forgotten, unless they've been compressed (by CLogCompressor) - then
+     * the index carries on with the .gz, as offsets are into the uncompressed text */
+    {
+      struct stat st;
+
+      for (map<uint32_t, file_record>::iterator i = _files.begin(); i != _files.end(); )
+      {
+        file_record &rec = i->second;
+        string gz_path = rec.path + ".gz";
+
+        if (stat(rec.path.c_str(), &st) == 0)
+        {
+          ++i;
+          continue;
+        }
+
+        bool renamed = false;
+        if ((stat(gz_path.c_str(), &st) == 0) && (find_path(gz_path) == NULL))
+        {
+          gzFile gz = gzopen(gz_path.c_str(), "rb");
+          if (gz != NULL)
+          {
+            renamed = (first_line_hash(gz) == rec.hash);
+            gzclose(gz);
+          }
+        }
+
+        if (renamed)
+        {
+          rec.path = gz_path;
+          rec.disk_size = 0; // so the end of it (written after the last update) is read
+          ++i;
+        }
+        else
+          _files.erase(i++);
+      }
+    }
+
+    int index_file(const string &path, term_map &terms, uint64_t &lines)
+    {
+      struct stat st;
+      struct tm file_tm;
+
+      if (stat(path.c_str(), &st))
+      {
+        fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+        return -1;
+      }
+
+      if (!S_ISREG(st.st_mode))
+      {
+        fprintf(stderr, "%s: not a file\n", path.c_str());
+        return -1;
+      }
+
+      file_record *rec = find_path(path);
+      if ((rec != NULL) && (rec->disk_size == (uint64_t)st.st_size) && (rec->mtime == st.st_mtime))
+        return 0; // unchanged
+
+      gzFile gz = gzopen(path.c_str(), "rb");
+      if (gz == NULL)
+      {
+        fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+        return -1;
+      }
+      gzbuffer(gz, 65536);
+
+      // Check it's still the same file (and hasn't been truncated)
+      uint64_t hash = first_line_hash(gz);
+      if ((rec != NULL) && (((rec->hash != 0) && (hash != rec->hash)) || (gzdirect(gz) && (rec->indexed > (uint64_t)st.st_size))))
+      {
+        _files.erase(rec->id);
+        rec = NULL;
+      }
+
+      if (rec == NULL)
+      {
+        file_record new_rec;
+        new_rec.id = _next_id++;
+        new_rec.path = path;
+        new_rec.indexed = 0;
+        new_rec.last_bucket = 0;
+        _files[new_rec.id] = new_rec;
+        rec = &_files[new_rec.id];
+      }
+
+      if (first_is_binary(gz))
+      {
+        fprintf(stderr, "%s: binary logs can't be indexed\n", path.c_str());
+        gzclose(gz);
+        _files.erase(rec->id);
+        return -1;
+      }
+
+      rec->hash = hash;
+      rec->disk_size = st.st_size;
+      rec->mtime = st.st_mtime;
+      localtime_r(&st.st_mtime, &file_tm);
+
+      if ((rec->indexed > 0) && (gzseek(gz, rec->indexed, SEEK_SET) < 0))
+      {
+        fprintf(stderr, "%s: failed to seek to %llu\n", path.c_str(), (unsigned long long)rec->indexed);
+        gzclose(gz);
+        return -1;
+      }
+
+      // Only whole lines are indexed - the rest is done next time
+      string buf;
+      char chunk[65536];
+      int len;
+      vector<string> line_keys;
+
+      while ((len = gzread(gz, chunk, sizeof(chunk))) > 0)
+      {
+        size_t pos = 0;
+
+        buf.append(chunk, len);
+        for (;;)
+        {
+          size_t eol = buf.find('\n', pos);
+          if (eol == string::npos)
+            break;
+
+          const char *line = buf.data() + pos;
+          size_t line_len = eol - pos;
+          posting post = { rec->id, rec->indexed };
+
+          line_keys.clear();
+          line_terms(line, line_len, line_keys);
+          for (size_t k=0; k < line_keys.size(); k++)
+            terms[line_keys[k]].push_back(post);
+
+          time_t when = line_time(line, line_len, file_tm);
+          if ((when >= 0) && ((uint64_t)(when / TIME_BUCKET) > rec->last_bucket))
+          {
+            char key[32];
+            rec->last_bucket = when / TIME_BUCKET;
+            snprintf(key, sizeof(key), "t:%llu", (unsigned long long)rec->last_bucket);
+            terms[key].push_back(post);
+          }
+
+          rec->indexed += line_len + 1;
+          pos = eol + 1;
+          lines++;
+        }
+        buf.erase(0, pos);
+      }
+
+      gzclose(gz);
+      return 0;
+    }
+
+    static bool first_is_binary(gzFile gz)
+    {
+      char buf[16];
+      log_record rec;
+
+      int len = gzread(gz, buf, sizeof(buf));
+      gzclearerr(gz);
+      gzrewind(gz);
+      if (len <= 0)
+        return false;
+      return (log_get_record(buf, buf + len, rec) == 1) && (rec.type == LOG_REC_SESSION);
+    }
+
+    void list_segments(vector<string> &segments)
+    {
+      DIR *dir = opendir(_dir.c_str());
+      struct dirent *ent;
+
+      if (dir == NULL)
+        return;
+
+      while ((ent = readdir(dir)) != NULL)
+        if (!strncmp(ent->d_name, "seg.", 4) && (strlen(ent->d_name) == 10))
+          segments.push_back(_dir + "/" + ent->d_name);
+      closedir(dir);
+
+      sort(segments.begin(), segments.end());
+    }
+
+    string segment_name(const vector<string> &segments)
+    {
+      unsigned int seq = 0;
+      char buf[16];
+
+      if (!segments.empty())
+        seq = atoi(segments.back().c_str() + segments.back().length() - 6) + 1;
+
+      snprintf(buf, sizeof(buf), "/seg.%06u", seq);
+      return _dir + buf;
+    }
+
+    void merge(vector<string> &segments)
+    /* Combine all the segments into one, dropping entries for files no longer indexed */
+    {
+      term_map terms;
+      string term;
+      const char *p, *end;
+
+      for (size_t n=0; n < segments.size(); n++)
+      {
+        segment_reader seg;
+        if (!seg.open(segments[n]))
+          continue;
+
+        while (seg.next(term, p, end))
+        {
+          vector<posting> postings;
+          get_postings(p, end, postings);
+
+          vector<posting> &out = terms[term];
+          for (size_t i=0; i < postings.size(); i++)
+            if (_files.count(postings[i].file))
+              out.push_back(postings[i]);
+          if (out.empty())
+            terms.erase(term);
+        }
+      }
+
+      string merged = segment_name(segments);
+      if (!write_segment(merged, terms))
+      {
+        fprintf(stderr, "Failed to write [%s]: %s\n", merged.c_str(), strerror(errno));
+        return;
+      }
+
+      for (size_t n=0; n < segments.size(); n++)
+        unlink(segments[n].c_str());
+      segments.clear();
+      segments.push_back(merged);
+    }
+
+    void lookup(const vector<string> &segments, const set<string> &keys, vector<posting> &found)
+    {
+      string term;
+      const char *p, *end;
+
+      for (size_t n=0; n < segments.size(); n++)
+      {
+        segment_reader seg;
+        if (!seg.open(segments[n]))
+        {
+          fprintf(stderr, "Skipping invalid segment [%s]\n", segments[n].c_str());
+          continue;
+        }
+
+        while (seg.next(term, p, end))
+          if (keys.count(term))
+            get_postings(p, end, found);
+      }
+
+      live_only(found);
+    }
+
+    void live_only(vector<posting> &postings)
+    {
+      vector<posting> live;
+
+      sort(postings.begin(), postings.end());
+      postings.erase(unique(postings.begin(), postings.end()), postings.end());
+      for (size_t n=0; n < postings.size(); n++)
+        if (_files.count(postings[n].file) && (postings[n].offset < _files[postings[n].file].indexed))
+          live.push_back(postings[n]);
+      postings.swap(live);
+    }
+
+    vector<uint32_t> files_by_time()
+    {
+      vector<pair<time_t, uint32_t> > by_time;
+      vector<uint32_t> ids;
+
+      for (map<uint32_t, file_record>::iterator i = _files.begin(); i != _files.end(); ++i)
+        by_time.push_back(make_pair(i->second.mtime, i->first));
+      sort(by_time.begin(), by_time.end());
+
+      for (size_t n=0; n < by_time.size(); n++)
+        ids.push_back(by_time[n].second);
+      return ids;
+    }
+
+    void print_lines(const vector<posting> &postings, time_t start, time_t end)
+    /* Print the lines at postings (sorted by file then offset), oldest file first */
+    {
+      vector<uint32_t> ids = files_by_time();
+
+      for (size_t f=0; f < ids.size(); f++)
+      {
+        posting file_start = { ids[f], 0 };
+        vector<posting>::const_iterator first = lower_bound(postings.begin(), postings.end(), file_start);
+        if ((first == postings.end()) || (first->file != ids[f]))
+          continue;
+
+        file_reader reader(_files[ids[f]]);
+        for (vector<posting>::const_iterator i = first; (i != postings.end()) && (i->file == ids[f]); ++i)
+        {
+          string line;
+          if (!reader.line_at(i->offset, line))
+            break;
+
+          time_t when = line_time(line.data(), line.length(), reader.file_tm);
+          if ((when >= 0) && (((start > 0) && (when < start)) || ((end > 0) && (when >= end))))
+            continue;
+          printf("%s:%s\n", reader.path.c_str(), line.c_str());
+        }
+      }
+    }
+
+    int print_range(const vector<string> &segments, time_t start, time_t end)
+    /* Everything logged between start and end - read from the first line of the hour start is in */
+    {
+      map<uint32_t, uint64_t> start_offset;
+      uint64_t first_bucket = (start > 0) ? start / TIME_BUCKET : 0;
+      uint64_t last_bucket = (end > 0) ? (end - 1) / TIME_BUCKET : UINT64_MAX;
+      string term;
+      const char *p, *seg_end;
+
+      if ((start <= 0) && (end <= 0))
+      {
+        fprintf(stderr, "Nothing to look for - give some terms, or a time range\n");
+        return -1;
+      }
+
+      for (size_t n=0; n < segments.size(); n++)
+      {
+        segment_reader seg;
+        if (!seg.open(segments[n]))
+          continue;
+
+        while (seg.next(term, p, seg_end))
+        {
+          if (term.compare(0, 2, "t:") != 0)
+            continue;
+          uint64_t bucket = strtoull(term.c_str() + 2, NULL, 10);
+          if ((bucket < first_bucket) || (bucket > last_bucket))
+            continue;
+
+          vector<posting> postings;
+          get_postings(p, seg_end, postings);
+          for (size_t i=0; i < postings.size(); i++)
+            if (!start_offset.count(postings[i].file) || (postings[i].offset < start_offset[postings[i].file]))
+              start_offset[postings[i].file] = postings[i].offset;
+        }
+      }
+
+      vector<uint32_t> ids = files_by_time();
+      for (size_t f=0; f < ids.size(); f++)
+      {
+        if (!start_offset.count(ids[f]))
+          continue;
+
+        file_reader reader(_files[ids[f]]);
+        string line;
+        uint64_t offset = start_offset[ids[f]];
+
+        while ((offset < _files[ids[f]].indexed) && reader.line_at(offset, line))
+        {
+          offset += line.length() + 1;
+
+          time_t when = line_time(line.data(), line.length(), reader.file_tm);
+          if ((when >= 0) && (end > 0) && (when >= end))
+            break;
+          if ((when >= 0) && (start > 0) && (when < start))
+            continue;
+          printf("%s:%s\n", reader.path.c_str(), line.c_str());
+        }
+      }
+
+      return 0;
+    }
+
+    class file_reader
+    /* Reads lines at increasing offsets from a (possibly compressed) logfile */
+    {
+      public:
+        string path;
+        struct tm file_tm;
+
+        file_reader(const file_record &rec)
+        {
+          path = rec.path;
+          _gz = gzopen(path.c_str(), "rb");
+          if (_gz != NULL)
+            gzbuffer(_gz, 65536);
+          localtime_r(&rec.mtime, &file_tm);
+        }
+
+        ~file_reader()
+        {
+          if (_gz != NULL)
+            gzclose(_gz);
+        }
+
+        bool line_at(uint64_t offset, string &line)
+        {
+          char buf[4096];
+
+          if ((_gz == NULL) || (gzseek(_gz, offset, SEEK_SET) < 0))
+            return false;
+
+          line.clear();
+          while (gzgets(_gz, buf, sizeof(buf)) != NULL)
+          {
+            size_t len = strlen(buf);
+            if ((len > 0) && (buf[len-1] == '\n'))
+            {
+              line.append(buf, len - 1);
+              return true;
+            }
+            line.append(buf, len);
+          }
+
+          return !line.empty();
+        }
+
+      private:
+        gzFile _gz;
+    };
+};
+
+int main(int argc, char *argv[])
+{
+  int c;
+  bool update = false;
+  time_t start = 0;
+  time_t end = 0;
+
+  while ((c = getopt(argc, argv, "d:us:e:")) != -1)
+    switch (c)
+    {
+      case 'd': index_dir = optarg; break;
+      case 'u': update = true;      break;
+
+      case 's':
+      case 'e':
+        if (!parse_time(optarg, (c == 's') ? start : end))
+        {
+          fprintf(stderr, "Invalid time [%s] - expected \"YYYY-MM-DD [HH:MM[:SS]]\" or \"HH:MM[:SS]\"\n", optarg);
+          return 1;
+        }
+        break;
+
+      default:
+        fprintf(stderr, "Usage: %s [-d index dir] -u logfile...\n", argv[0]);
+        fprintf(stderr, "       %s [-d index dir] [-s start] [-e end] [rfid=|member=|door=|vend=|handle=]value...\n", argv[0]);
+        return 1;
+    }
+
+  vector<string> args(argv + optind, argv + argc);
+  log_index index(index_dir);
+
+  if (update)
+  {
+    if (args.empty())
+    {
+      fprintf(stderr, "No logfiles given\n");
+      return 1;
+    }
+    return index.update(args) ? 1 : 0;
+  }
+
+  return index.query(args, start, end) ? 1 : 0;
+}
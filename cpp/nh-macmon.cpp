@@ -1,7 +1,7 @@
 #include "CNHmqtt.h"
 #include "nh-macmon.h"
 #include "CMacmon.h"
-#include "CNHDBAccess.h"
+#include "CNHDBPool.h"
 
 using namespace std;
 
@@ -9,7 +9,7 @@ class nh_macmon : public CNHmqtt
 {
   string _interface;
   int _update_freq;
-  CNHDBAccess *_db;
+  CNHDBPool *_db_pool;
   pthread_t _mon_thread;
   string _topic_known, _topic_unknown;
   
@@ -20,7 +20,19 @@ class nh_macmon : public CNHmqtt
       _topic_known   = get_str_option("macmon", "topic_known"  , "nh/addrcount/known"  );
       _topic_unknown = get_str_option("macmon", "topic_unknown", "nh/addrcount/unknown");
       _update_freq = get_int_option("macmon", "update_freq", 30);
-      _db = new CNHDBAccess(get_str_option("mysql", "server", "localhost"), get_str_option("mysql", "username", "gatekeeper"), get_str_option("mysql", "password", "gk"), get_str_option("mysql", "database", "gk"), log);
+      _db_pool = CNHDBPool::get_pool(get_str_option("mysql", "server", "localhost"), get_str_option("mysql", "username", "gatekeeper"), get_str_option("mysql", "password", "gk"), get_str_option("mysql", "database", "gk"), log, get_int_option("mysql", "pool_size", DB_POOL_DEFAULT_SIZE), get_int_option("mysql", "write_behind_ms", DB_WRITE_BEHIND_MS));
+      CNHDBAccess::set_slow_call_ms(get_int_option("mysql", "slow_call_ms", DB_SLOW_CALL_MS));
+      CNHDBAccess::set_deadlines(get_int_option("mysql", "timeout", DB_TIMEOUT_SECS), get_int_option("mysql", "breaker_failures", DB_BREAKER_FAILURES), get_int_option("mysql", "breaker_cooldown", DB_BREAKER_COOLDOWN_SECS));
+    }
+
+    ~nh_macmon()
+    {
+      CNHDBPool::put_pool(_db_pool);
+    }
+
+    string status_detail_extra()
+    {
+      return "\"db\":" + _db_pool->json();
     }
 
     void process_message(string topic, string message)
@@ -33,16 +45,17 @@ class nh_macmon : public CNHmqtt
     {
       map<string, time_t>::iterator itr;
       int addr_known, addr_unknown;
+      CNHDBPool::conn db(_db_pool);
 
       /* Record address seen */
       for (itr = addresses.begin(); itr != addresses.end(); ++itr) 
       {
-        log->dbg("itr->first = [" + itr->first + "]");
-        _db->sp_update_address(itr->first, &itr->second);
+        NH_LOG_DEBUG(log, "MACMON", "itr->first = [" + itr->first + "]");
+        db->sp_update_address(itr->first, &itr->second);
       }
 
       /* Publish stats */
-      _db->sp_get_address_stats(_update_freq, addr_known, addr_unknown);
+      db->sp_get_address_stats(_update_freq, addr_known, addr_unknown);
       message_send(_topic_known  , itos(addr_known  ));
       message_send(_topic_unknown, itos(addr_unknown));
 
@@ -77,8 +90,12 @@ class nh_macmon : public CNHmqtt
 
     int start()
     {
-      if(_db->dbConnect())
-        return -1;
+      // Make the first connection now, so a bad config is found at startup
+      {
+        CNHDBPool::conn db(_db_pool);
+        if (!db->is_connected())
+          return -1;
+      }
 
       pthread_create(&_mon_thread, NULL, &nh_macmon::s_mon_thread, this);
       return 0;
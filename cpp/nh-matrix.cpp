@@ -279,11 +279,10 @@ class nh_mini_matrix : public CNHmqtt_irc
       }
       
       
-      // Start receive thread
-      pthread_create(&rcvThread, NULL, &nh_mini_matrix::s_receive_thread, this);    
-      
-      // Start msg-display thread
-      pthread_create(&msgThread, NULL, &nh_mini_matrix::s_msg_thread, this);
+      // Have message_loop() process datagrams from the display, and cycle the messages shown once a second
+      if (watch_fd(sck_rx, &nh_mini_matrix::s_udp_receive, this))
+        return -1;
+      add_timer(1000, &nh_mini_matrix::s_msg_tick, this);
       
       // Subscribe to mail, twitter & gatekeeper topics
       subscribe(topic_mail + "/#");
@@ -310,81 +309,71 @@ class nh_mini_matrix : public CNHmqtt_irc
     }
     
       
-    static void *s_receive_thread(void *arg)
+    static void s_udp_receive(void *obj, int, unsigned int)
     {      
-      ((nh_mini_matrix*)arg)->receive_thread();
-      return NULL;
+      ((nh_mini_matrix*)obj)->udp_receive();
     }
     
-    static void *s_msg_thread(void *arg)
+    static void s_msg_tick(void *obj)
     {      
-      ((nh_mini_matrix*)arg)->msg_thread();
-      return NULL;
+      ((nh_mini_matrix*)obj)->msg_tick();
     }   
     
-    void msg_thread()
+    void msg_tick()
     {
       int buf, nxtmsg;
       string opts;
       
-      while(1)
+      if (alert_active)
       {
-        
-        if (alert_active)
-        {
-          if (msg_details[MSG_ALERT].display_time++ > alert_display_duration)
-            cancel_alert();
-        } else
+        if (msg_details[MSG_ALERT].display_time++ > alert_display_duration)
+          cancel_alert();
+      } else
+      {
+
+        // Timeout expired - switch to next message
+        if (msg_details[current_msg].display_time++ > msg_display_duration)
         {
-  
-          // Timeout expired - switch to next message
-          if (msg_details[current_msg].display_time++ > msg_display_duration)
+          // Get the next non-empty message
+          nxtmsg = current_msg;
+          do
           {
-            // Get the next non-empty message
-            nxtmsg = current_msg;
-            do
-            {
+            nxtmsg++;
+            nxtmsg = nxtmsg % MSG_MAX;
+            if (nxtmsg==0)
               nxtmsg++;
-              nxtmsg = nxtmsg % MSG_MAX;
-              if (nxtmsg==0)
-                nxtmsg++;
+            
+            // If either top or bottom of the next message is set, then display it.
+            if ((msg_details[nxtmsg].top_line.length()) || (msg_details[nxtmsg].bottom_line.length()))           
+              break;
+          }  while (nxtmsg != current_msg);
+          
+          if ((nxtmsg != current_msg) || (msg_details[current_msg].sent==0))
+          {
+            // If either top or bottom of the next message is set, then display it.
+            msg_details[nxtmsg].display_time = 0; 
+          
+            if (active_disp_buf)
+              buf = 0;
+            else
+              buf = 1;
               
-              // If either top or bottom of the next message is set, then display it.
-              if ((msg_details[nxtmsg].top_line.length()) || (msg_details[nxtmsg].bottom_line.length()))           
-                break;
-            }  while (nxtmsg != current_msg);
+            opts = get_option_str(true,false,false,false);
+            udp_send("B" + itos(dispbuf[buf].top)    + opts + msg_details[nxtmsg].top_line   );
             
-            if ((nxtmsg != current_msg) || (msg_details[current_msg].sent==0))
-            {
-              // If either top or bottom of the next message is set, then display it.
-              msg_details[nxtmsg].display_time = 0; 
+            opts = get_option_str(true,true,false,false);
+            udp_send("B" + itos(dispbuf[buf].bottom) + opts + msg_details[nxtmsg].bottom_line);             
             
-              if (active_disp_buf)
-                buf = 0;
-              else
-                buf = 1;
-                
-              opts = get_option_str(true,false,false,false);
-              udp_send("B" + itos(dispbuf[buf].top)    + opts + msg_details[nxtmsg].top_line   );
-              
-              opts = get_option_str(true,true,false,false);
-              udp_send("B" + itos(dispbuf[buf].bottom) + opts + msg_details[nxtmsg].bottom_line);             
-              
-              active_disp_buf = buf;
-              current_msg = nxtmsg;
-              udp_send("S" + itos(dispbuf[active_disp_buf].top) + itos(dispbuf[active_disp_buf].bottom)); 
-              msg_details[current_msg].sent=1;
-            }
+            active_disp_buf = buf;
+            current_msg = nxtmsg;
+            udp_send("S" + itos(dispbuf[active_disp_buf].top) + itos(dispbuf[active_disp_buf].bottom)); 
+            msg_details[current_msg].sent=1;
           }
         }
-        
-        sleep(1);
       }
-      
-      
     }
       
-    void receive_thread()
+    void udp_receive()
     {
       char buf[BUFLEN];
       char response[BUFLEN];
@@ -393,36 +382,31 @@ class nh_mini_matrix : public CNHmqtt_irc
       socklen_t addrlen;
       int len;
 
-      memset(buf, 0, sizeof(buf));
-
-      log->dbg("entered receive_thread()");
-
       memset(buf, 0, sizeof(buf));
       addrlen = sizeof(addr);
-      while ((len=recvfrom(sck_rx, buf, sizeof(buf)-1, 0, (struct sockaddr *)&addr, &addrlen)) != -1)
+      if ((len=recvfrom(sck_rx, buf, sizeof(buf)-1, 0, (struct sockaddr *)&addr, &addrlen)) == -1)
       {
-        if (buf[strlen(buf)-1] == '\n') // If the last character is a newline, remove it.
-          buf[strlen(buf)-1] = 0;
+        log->dbg("recvfrom failed");
+        return;
+      }
 
-        sprintf(dbgbuf, "%s:%d < %s", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), buf);
-        log->dbg(dbgbuf);
-        if (strcmp(inet_ntoa(addr.sin_addr), ip.c_str()))
-        {
-          log->dbg("Message not from mini-matrix display! Ignoring..."); 
-        } else
+      if ((strlen(buf) > 0) && (buf[strlen(buf)-1] == '\n')) // If the last character is a newline, remove it.
+        buf[strlen(buf)-1] = 0;
+
+      sprintf(dbgbuf, "%s:%d < %s", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), buf);
+      log->dbg(dbgbuf);
+      if (strcmp(inet_ntoa(addr.sin_addr), ip.c_str()))
+      {
+        log->dbg("Message not from mini-matrix display! Ignoring..."); 
+      } else
+      {
+        memset(response, 0, sizeof(response));
+        process_message(buf, len, response);
+        if (strlen(response) > 0)
         {
-          memset(response, 0, sizeof(response));
-          process_message(buf, len, response);
-          if (strlen(response) > 0)
-          {
-            udp_send(response);
-          }
+          udp_send(response);
         }
-        memset(buf, 0, sizeof(buf));
       }
-
-      perror("Done.");
-      return;
     }
       
     void process_message(char *msgbuf, unsigned int len, char *response)
@@ -483,8 +467,6 @@ class nh_mini_matrix : public CNHmqtt_irc
     int current_msg;
     string ip;
     struct sockaddr_in addr_tx;
-    pthread_t rcvThread; 
-    pthread_t msgThread;
     int alert_active;
     int active_disp_buf;
     
@@ -28,8 +28,9 @@
  */
 
 #include "CNHmqtt_irc.h"
-#include "CNHDBAccess.h"
+#include "CNHDBPool.h"
 
+#include <json-c/json.h>     // libjson-c-dev
 #include <stdio.h>
 #include <dirent.h>
 #include <errno.h>
@@ -37,9 +38,11 @@
 
 using namespace std;
 
+#ifndef NH_HOST
 bool CNHmqtt::debug_mode = false;
 bool CNHmqtt::daemonized = false; 
 std::string CNHmqtt::_pid_file = "";
+#endif
 
 #define RUNNING_FALSE 0
 #define RUNNING_TRUE 1
@@ -49,31 +52,87 @@ class nh_monitor : public CNHmqtt
 {
   
   public:
-    CNHDBAccess *_db;
+    CNHDBPool *_db_pool;
     int _timeout_period;
     int _query_interval;
     bool _query_thread_exit;
     pthread_t _qThread;
+    bool _query_thread_running;
 
     nh_monitor(int argc, char *argv[]) : CNHmqtt(argc, argv)
     {
-      _db = new CNHDBAccess(get_str_option("mysql", "server", "localhost"), get_str_option("mysql", "username", "gatekeeper"), get_str_option("mysql", "password", "gk"), get_str_option("mysql", "database", "gk"), log);
+      _db_pool = CNHDBPool::get_pool(get_str_option("mysql", "server", "localhost"), get_str_option("mysql", "username", "gatekeeper"), get_str_option("mysql", "password", "gk"), get_str_option("mysql", "database", "gk"), log, get_int_option("mysql", "pool_size", DB_POOL_DEFAULT_SIZE), get_int_option("mysql", "write_behind_ms", DB_WRITE_BEHIND_MS));
+      CNHDBAccess::set_slow_call_ms(get_int_option("mysql", "slow_call_ms", DB_SLOW_CALL_MS));
+      CNHDBAccess::set_deadlines(get_int_option("mysql", "timeout", DB_TIMEOUT_SECS), get_int_option("mysql", "breaker_failures", DB_BREAKER_FAILURES), get_int_option("mysql", "breaker_cooldown", DB_BREAKER_COOLDOWN_SECS));
       _timeout_period = get_int_option("monitor", "timeout", 5);
       _query_interval = get_int_option("monitor", "query_interval", 30);
       _qThread = -1;
+      _query_thread_running = false;
     }
     
     ~nh_monitor()
     {
-      delete _db;
+      stop();
+      CNHDBPool::put_pool(_db_pool);
     }
 
-  // Subscribe to the status MQTT topc 
+    string status_detail_extra()
+    {
+      return "\"db\":" + _db_pool->json();
+    }
+
+  // Subscribe to the status MQTT topc, and the STATUS DETAIL documents (for the per-SP stats)
   int subscribe_service()
   {
     subscribe(_status_res_topic);
+    subscribe(_status_detail_topic);
     return 0;
   }
+
+  static int json_int(json_object *obj, const char *key)
+  {
+    json_object *value;
+
+    if ((obj == NULL) || !json_object_object_get_ex(obj, key, &value))
+      return 0;
+
+    return json_object_get_int(value);
+  }
+
+  void record_sp_stats(string message)
+  /* Save the per-SP call stats ("db" -> "sps") from a STATUS DETAIL document, for daemons that use 
+   * the database. Sent when asked, and every stats_interval seconds. */
+  {
+    json_object *root = json_tokener_parse(message.c_str());
+    json_object *name, *db, *sps;
+
+    if (root == NULL)
+      return; // (e.g. a SPOOL reply)
+
+    if (json_object_object_get_ex(root, "name", &name) && json_object_object_get_ex(root, "db", &db) &&
+        json_object_object_get_ex(db, "sps", &sps) && json_object_is_type(sps, json_type_array))
+    {
+      string sname = json_object_get_string(name);
+      CNHDBPool::conn conn(_db_pool);
+
+      for (size_t n=0; n < json_object_array_length(sps); n++)
+      {
+        json_object *sp = json_object_array_get_idx(sps, n);
+        json_object *sp_name, *execute = NULL, *fetch = NULL;
+
+        if (!json_object_object_get_ex(sp, "sp", &sp_name))
+          continue;
+        json_object_object_get_ex(sp, "execute_us", &execute);
+        json_object_object_get_ex(sp, "fetch_us", &fetch);
+
+        conn->sp_record_sp_stats(sname, json_object_get_string(sp_name), json_int(sp, "calls"), json_int(sp, "errors"),
+                                 json_int(sp, "rows"), json_int(sp, "slow"), json_int(execute, "p50"),
+                                 json_int(execute, "p99"), json_int(execute, "max"), json_int(fetch, "p99"));
+      }
+    }
+
+    json_object_put(root);
+  }
   
 
   void process_message(string topic, string message)
@@ -83,6 +142,12 @@ class nh_monitor : public CNHmqtt
   {
     string sname, state;
     size_t pos;
+
+    if (topic == _status_detail_topic)
+    {
+      record_sp_stats(message);
+      return;
+    }
     
     if ((topic != _status_res_topic) || (message == "STATUS"))
       return;
@@ -99,55 +164,59 @@ class nh_monitor : public CNHmqtt
     // if (state != "Running" && state != "Terminated" && state != "Restart")
     //  return;
     
+    CNHDBPool::conn db(_db_pool);
     if (state == "Restart")
     {
-      _db->sp_record_service_restart(sname);
-      _db->sp_log_event("PROCESS_RESTART", sname);
+      db->sp_record_service_restart(sname);
+      db->sp_log_event("PROCESS_RESTART", sname);
     }
     
     // Record the reply
-    _db->sp_record_service_status(sname, (state=="Running" ? RUNNING_TRUE : RUNNING_FALSE), state);
+    db->sp_record_service_status(sname, (state=="Running" ? RUNNING_TRUE : RUNNING_FALSE), state);
     
     CNHmqtt::process_message(topic, message);
   }
     
   int query_all()
   {
-    _db->sp_service_status_update(_timeout_period);
-    _db->sp_record_service_status_request("N/A");
+    CNHDBPool::conn db(_db_pool);
+
+    db->sp_service_status_update(_timeout_period);
+    db->sp_record_service_status_request("N/A");
 
     switch(message_send(_status_req_topic, "STATUS"))
     {
       case MOSQ_ERR_SUCCESS:
-        _db->sp_record_service_status("Mosquitto", RUNNING_TRUE, "Connected");
+        db->sp_record_service_status("Mosquitto", RUNNING_TRUE, "Connected");
         break;
         
       case MOSQ_ERR_NO_CONN:
-        _db->sp_record_service_status("Mosquitto", RUNNING_FALSE, "Not connected!");
+        db->sp_record_service_status("Mosquitto", RUNNING_FALSE, "Not connected!");
         break;
         
       default:
-        _db->sp_record_service_status("Mosquitto", RUNNING_FALSE, "ERROR");
+        db->sp_record_service_status("Mosquitto", RUNNING_FALSE, "ERROR");
     }
     return 0;
   }
   
   int init()
   {
-    if (_db->dbConnect())
+    CNHDBPool::conn db(_db_pool);
+    if (!db->is_connected())
       return -1; // With access to MySQL, results can't be saved, so exit
 
-    _db->sp_record_service_status_request("Mosquitto");
+    db->sp_record_service_status_request("Mosquitto");
     if (mosq_connect())
     {
-      _db->sp_record_service_status("Mosquitto", RUNNING_FALSE, "Connection error");
+      db->sp_record_service_status("Mosquitto", RUNNING_FALSE, "Connection error");
       return -1;
     } else
     {
-      _db->sp_record_service_status("Mosquitto", RUNNING_TRUE, "Connected");
+      db->sp_record_service_status("Mosquitto", RUNNING_TRUE, "Connected");
     }
 
-    _db->sp_service_status_update(_timeout_period);
+    db->sp_service_status_update(_timeout_period);
     return 0; 
   }
 
@@ -172,10 +241,8 @@ class nh_monitor : public CNHmqtt
   }
   
   
-  int go()
+  int start()
   {
-    int retval;
-    
     if (init())
       return -1;
     
@@ -185,21 +252,39 @@ class nh_monitor : public CNHmqtt
     
     // Start thread that will regularly query services
     _query_thread_exit = false;
-    pthread_create(&_qThread, NULL, &nh_monitor::query_thread, this);
-    
-    // Enter mosquitto message loop
-    retval = message_loop();
+    if (!pthread_create(&_qThread, NULL, &nh_monitor::query_thread, this))
+      _query_thread_running = true;
+
+    return 0;
+  }
+
+  void stop()
+  {
     _query_thread_exit = true;
-    
-    log->dbg("returned from message_loop() - retval = " + itos(retval));
-   
+
     // Interupt & join query thread    
-    if (_qThread > 0)
+    if (_query_thread_running)
     {
       pthread_kill(_qThread, SIGUSR1);
       pthread_join(_qThread, NULL);
       _qThread = -1;      
+      _query_thread_running = false;
     }
+  }
+  
+  int go()
+  {
+    int retval;
+    
+    if (start())
+      return -1;
+    
+    // Enter mosquitto message loop
+    retval = message_loop();
+    
+    log->dbg("returned from message_loop() - retval = " + itos(retval));
+   
+    stop();
     
     return retval;
   }
@@ -211,6 +296,21 @@ class nh_monitor : public CNHmqtt
 
 };
 
+#ifdef NH_HOST
+CNHmqtt *nh_monitor_service(int argc, char *argv[])
+/* Create nh-monitor as a service running inside nh-host */
+{
+  nh_monitor *nh = new nh_monitor(argc, argv);
+
+  if (nh->start())
+  {
+    delete nh;
+    return NULL;
+  }
+
+  return nh;
+}
+#else
 int main(int argc, char *argv[])
 {
   bool terminate;
@@ -235,3 +335,4 @@ int main(int argc, char *argv[])
   }
   
 }
+#endif
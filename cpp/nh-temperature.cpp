@@ -28,7 +28,7 @@
  */
 
 #include "CNHmqtt.h"
-#include "CNHDBAccess.h"
+#include "CNHDBPool.h"
 #include "nh-temperature.h"
 #include <string>
 #include <sstream>
@@ -41,7 +41,7 @@ using namespace std;
 class nh_temperature : public CNHmqtt
 {
 public:
-  CNHDBAccess *db;
+  CNHDBPool *db_pool;
   string temperature_topic;
   string temperature_topic_out;
   string light_level_topic;
@@ -58,96 +58,127 @@ public:
     barometric_pressure_topic = get_str_option("barometric_pressure", "barometric_pressure_topic", "nh/barometric-pressure");
     sensor_battery_topic      = get_str_option("sensor_battery", "sensor_battery_topic", "nh/sensor-battery");
 
-    db = new CNHDBAccess(get_str_option("mysql", "server", "localhost"), get_str_option("mysql", "username", "gatekeeper"), get_str_option("mysql", "password", "gk"), get_str_option("mysql", "database", "gk"), log);   ;
+    db_pool = CNHDBPool::get_pool(get_str_option("mysql", "server", "localhost"), get_str_option("mysql", "username", "gatekeeper"), get_str_option("mysql", "password", "gk"), get_str_option("mysql", "database", "gk"), log, get_int_option("mysql", "pool_size", DB_POOL_DEFAULT_SIZE), get_int_option("mysql", "write_behind_ms", DB_WRITE_BEHIND_MS));
+    CNHDBAccess::set_slow_call_ms(get_int_option("mysql", "slow_call_ms", DB_SLOW_CALL_MS));
+    CNHDBAccess::set_deadlines(get_int_option("mysql", "timeout", DB_TIMEOUT_SECS), get_int_option("mysql", "breaker_failures", DB_BREAKER_FAILURES), get_int_option("mysql", "breaker_cooldown", DB_BREAKER_COOLDOWN_SECS));
   }
 
   ~nh_temperature()
   {
-    delete db;
+    CNHDBPool::put_pool(db_pool);
   }
 
-  void process_message(string topic, string message)
+  string status_detail_extra()
   {
-    if (topic==temperature_topic)
-    {
-      char buf[50];
-      string address;
-      float temp;
-      string desc;
-      ostringstream ssTemp;
+    return "\"db\":" + db_pool->json();
+  }
 
-      if (message.length() < 17)
-      {
-        log->dbg("invalid message");
-        return;
-      }
+  static void s_temperature(void *obj, const topic_match &, const str_view &message)
+  {
+    ((nh_temperature*)obj)->temperature(message.str());
+  }
 
-      // break apart message into addres and temp
-      address = message.substr(0,16);
+  static void s_light_level(void *obj, const topic_match &m, const str_view &message)
+  {
+    if (m.wildcard[0].len == 0) // no room given
+      return;
 
-      std::istringstream b( message.substr(17, message.length() - 17) );
-      b >> temp;
+    CNHDBPool::conn db(((nh_temperature*)obj)->db_pool);
+    db->sp_light_level_update(m.wildcard[0].str(), atoi(message.str().c_str()));
+  }
 
-      snprintf(buf, sizeof(buf), "temp: [%f]", temp);
-      log->dbg(buf);
-      
-      // Sanity check the temperature
-      if ((temp > MAX_TEMP) || (temp < MIN_TEMP))
-      {
-        snprintf(buf, sizeof(buf), "Ignoring excessive temperature: [%f]", temp);
-        log->dbg(buf);
-        return;
-      }
-      
-      db->sp_temperature_update(address, temp);
-      
-      // publish room name / temperature to mqtt
-      if (!db->sp_temperature_get_desc(address, desc))
-        if (desc != "")
-        {
-          ssTemp << temp;
-          string strTemp(ssTemp.str());
-          message_send(temperature_topic_out + "/" + desc, strTemp);
-        }
-    }
-    else if ((topic.length() > light_level_topic.length()+1) && topic.substr(0, light_level_topic.length()) == light_level_topic)
+  static void s_humidity(void *obj, const topic_match &m, const str_view &message)
+  {
+    if (m.wildcard[0].len == 0) // no room given
+      return;
+
+    CNHDBPool::conn db(((nh_temperature*)obj)->db_pool);
+    db->sp_humidity_update(m.wildcard[0].str(), std::stof(message.str()));
+  }
+
+  static void s_barometric_pressure(void *obj, const topic_match &m, const str_view &message)
+  {
+    if (m.wildcard[0].len == 0) // no room given
+      return;
+
+    CNHDBPool::conn db(((nh_temperature*)obj)->db_pool);
+    db->sp_barometric_pressure_update(m.wildcard[0].str(), std::stof(message.str()));
+  }
+
+  static void s_sensor_battery(void *obj, const topic_match &m, const str_view &message)
+  {
+    if (m.wildcard[0].len == 0) // no room given
+      return;
+
+    CNHDBPool::conn db(((nh_temperature*)obj)->db_pool);
+    db->sp_sensor_battery_update(m.wildcard[0].str(), std::stof(message.str()));
+  }
+
+  void temperature(string message)
+  {
+    char buf[50];
+    string address;
+    float temp;
+    string desc;
+    ostringstream ssTemp;
+
+    if (message.length() < 17)
     {
-      string room = topic.substr(light_level_topic.length()+1, string::npos);
-      
-      db->sp_light_level_update(room, atoi(message.c_str()));
+      log->dbg("invalid message");
+      return;
     }
-    else if ((topic.length() > humidity_topic.length()+1) && topic.substr(0, humidity_topic.length()) == humidity_topic)
-    {
-      string room = topic.substr(humidity_topic.length()+1, string::npos);
 
-      db->sp_humidity_update(room, std::stof(message));
-    }
-    else if ((topic.length() > barometric_pressure_topic.length()+1) && topic.substr(0, barometric_pressure_topic.length()) == barometric_pressure_topic)
-    {
-      string room = topic.substr(barometric_pressure_topic.length()+1, string::npos);
+    // break apart message into addres and temp
+    address = message.substr(0,16);
 
-      db->sp_barometric_pressure_update(room, std::stof(message));
-    }
-    else if ((topic.length() > sensor_battery_topic.length()+1) && topic.substr(0, sensor_battery_topic.length()) == sensor_battery_topic)
-    {
-      string room = topic.substr(sensor_battery_topic.length()+1, string::npos);
+    std::istringstream b( message.substr(17, message.length() - 17) );
+    b >> temp;
 
-      db->sp_sensor_battery_update(room, std::stof(message));
+    snprintf(buf, sizeof(buf), "temp: [%f]", temp);
+    log->dbg(buf);
+    
+    // Sanity check the temperature
+    if ((temp > MAX_TEMP) || (temp < MIN_TEMP))
+    {
+      snprintf(buf, sizeof(buf), "Ignoring excessive temperature: [%f]", temp);
+      log->dbg(buf);
+      return;
     }
     
+    CNHDBPool::conn db(db_pool);
+    db->sp_temperature_update(address, temp);
+    
+    // publish room name / temperature to mqtt
+    if (!db->sp_temperature_get_desc(address, desc))
+      if (desc != "")
+      {
+        ssTemp << temp;
+        string strTemp(ssTemp.str());
+        message_send(temperature_topic_out + "/" + desc, strTemp);
+      }
+  }
+
+  void worker_thread_start()
+  {
+    mysql_thread_init();
+  }
 
-    CNHmqtt::process_message(topic, message);
+  void worker_thread_end()
+  {
+    mysql_thread_end();
   }
 
   bool setup()
   {
-    subscribe(temperature_topic);
-    subscribe(light_level_topic + "/#");
-    subscribe(humidity_topic + "/#");
-    subscribe(barometric_pressure_topic + "/#");
-    subscribe(sensor_battery_topic + "/#");
+    subscribe(temperature_topic, s_temperature, this);
+    subscribe(light_level_topic + "/#", s_light_level, this);
+    subscribe(humidity_topic + "/#", s_humidity, this);
+    subscribe(barometric_pressure_topic + "/#", s_barometric_pressure, this);
+    subscribe(sensor_battery_topic + "/#", s_sensor_battery, this);
     
-    if (db->dbConnect())
+    // Make the first connection now, so a bad config is found at startup
+    CNHDBPool::conn db(db_pool);
+    if (!db->is_connected())
       return false;
     
     return true;
@@ -156,6 +187,21 @@ public:
 };
 
 
+#ifdef NH_HOST
+CNHmqtt *nh_temperature_service(int argc, char *argv[])
+/* Create nh-temperature as a service running inside nh-host */
+{
+  nh_temperature *nh = new nh_temperature(argc, argv);
+
+  if (nh->mosq_connect() || !nh->setup())
+  {
+    delete nh;
+    return NULL;
+  }
+
+  return nh;
+}
+#else
 int main(int argc, char *argv[])
 {
   
@@ -173,3 +219,4 @@ int main(int argc, char *argv[])
   return 0;
   
 }
+#endif
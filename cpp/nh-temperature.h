@@ -1,3 +1,5 @@
+#ifndef NH_HOST
 bool CNHmqtt::debug_mode = false;
 bool CNHmqtt::daemonized = false;
 std::string CNHmqtt::_pid_file = "";
+#endif
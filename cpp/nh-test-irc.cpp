@@ -20,9 +20,8 @@ class nh_test_irc : public CNHmqtt_irc
     }
    
     /* Optional function which, if present, can be used to process any 
-    * MQTT message receiced.
-    * nb. must call CNHmqtt_irc::process_message so process_irc_message will 
-    * be called or IRC messages. 
+    * MQTT message receiced that doesn't have a topic handler. For binary
+    * payloads, override process_message_view instead.
 
     void process_message(string topic, string message)
     {
@@ -38,8 +38,7 @@
 
 using namespace std;
 
-nh_tools_bookings::nh_tools_bookings(CLogging *log, string db_server, string db_username, string db_password, string db_name,
-                                     string bookings_topic, InstCBI *cb)
+nh_tools_bookings::nh_tools_bookings(CLogging *log, CNHDBPool *db_pool, string bookings_topic, InstCBI *cb)
 {
   _log            = log;
   _cb             = cb;
@@ -47,8 +46,10 @@ nh_tools_bookings::nh_tools_bookings(CLogging *log, string db_server, string db_
   _bookings_topic = bookings_topic;
   _setup_done     = false;
   _got_valid_booking_data = false;
+  _nownext_topic  = NULL;
+  _booking_col.found = false;
 
-  _db = new CNHDBAccess(db_server, db_username, db_password, db_name, log);
+  _db_pool        = db_pool;
 
   pthread_mutex_init(&_cal_mutex, NULL);
   pthread_cond_init(&_cal_condition_var, NULL);
@@ -58,8 +59,6 @@ nh_tools_bookings::nh_tools_bookings(CLogging *log, string db_server, string db_
 
 nh_tools_bookings::~nh_tools_bookings()
 {
-  delete _db;
-
   if (_setup_done)
   {
     // Signal calThread to stop
@@ -76,15 +75,12 @@ nh_tools_bookings::~nh_tools_bookings()
 }
 
 void nh_tools_bookings::setup(int tool_id)
-/* Connect to database, start the threads that will poll for new bookings and maintain
- * the push notification channel (renewing when nessesary), then return */
+/* Start the threads that will poll for new bookings and maintain the push notification
+ * channel (renewing when nessesary), then return */
 {
   if (_setup_done)
     return;
 
-  if (_db->dbConnect())
-    return;
-
   _tool_id = tool_id;
   _cal_thread_msg = CAL_MSG_POLL; // Want the calendar thread to poll for an update as soon as it starts
 
@@ -198,63 +194,70 @@ void nh_tools_bookings::cal_thread()
 void nh_tools_bookings::get_cal_data()
 /* Get calandar from database, then process */
 {
-  dbrows tool_list;
+  CDBResult tool_list;
+  CNHDBPool::conn db(_db_pool);
 
   dbg("Entered get_cal_data");
   _got_valid_booking_data = false;
 
   // Get tool details - only expecting one row
-  _db->sp_tool_get_calendars(_tool_id, &tool_list);
+  db->sp_tool_get_calendars(_tool_id, &tool_list);
   if (tool_list.size() != 1)
   {
     dbg("Unexpected number of tools returned: " + CNHmqtt_irc::itos(tool_list.size()));
     return;
   }
 
-  dbrows::const_iterator iterator = tool_list.begin();
-  dbrow row = *iterator;
-
   dbg("Processing tool: " +
-      row["tool_id"].asStr() + "\t" +
-      row["tool_name"].asStr());
+      tool_list[0].asStr(tool_list.column("tool_id")) + "\t" +
+      tool_list[0].asStr(tool_list.column("tool_name")));
+
+  _tool_name = tool_list[0].asStr(tool_list.column("tool_name"));
 
-  _tool_name = row["tool_name"].asStr();
+  // Only the latest now/next info matters, so if an update is still queued, replace it
+  _nownext_topic = _cb->cbiTopicHandle(_bookings_topic + _tool_name + "/nownext", true, true); // retained, like cbiSendMessage()
 
-  // Get bookings
-  dbrows db_bookings;
-  if(_db->sp_tool_get_bookings(_tool_id, &db_bookings))
+  // Get bookings, each added to _bookings as it's fetched
+  _bookings.clear();
+  _booking_col.found = false;
+  if(db->sp_tool_get_bookings(_tool_id, &nh_tools_bookings::s_booking_row, this))
   {
     dbg("Failed to get bookings from DB");
   } else
   {
     dbg("Got calendar data");
 
-    // Extract the booking information from the returned calendar data
-    _bookings.clear();
-    if (process_bookings_data(db_bookings) == 0)
-      _got_valid_booking_data = true;
+    // Sort events in descening order by start datetime
+    sort (_bookings.begin(), _bookings.end(), event_by_start_time_sorter);
+    _got_valid_booking_data = true;
   }
 
   return;
 }
 
-int nh_tools_bookings::process_bookings_data(dbrows rows)
+int nh_tools_bookings::s_booking_row(void *obj, const CDBResult::row &row)
 {
-  for (dbrows::const_iterator iterator = rows.begin(), end = rows.end(); iterator != end; ++iterator) 
-  {
-    dbrow row = *iterator;
-    evtdata current_event;
+  return ((nh_tools_bookings*)obj)->booking_row(row);
+}
 
-    current_event.full_name  = row["username"].asStr();
-    current_event.start_time = row["start"].asTime();
-    current_event.end_time   = row["end"].asTime();
+int nh_tools_bookings::booking_row(const CDBResult::row &row)
+{
+  evtdata current_event;
 
-    // Add to buffer
-    _bookings.push_back(current_event);
+  if (!_booking_col.found)
+  {
+    _booking_col.username = row.column("username");
+    _booking_col.start    = row.column("start");
+    _booking_col.end      = row.column("end");
+    _booking_col.found    = true;
   }
 
-  // Sort events in descening order by start datetime
-  sort (_bookings.begin(), _bookings.end(), event_by_start_time_sorter);
+  current_event.full_name  = row.asStr(_booking_col.username);
+  current_event.start_time = row.asTime(_booking_col.start);
+  current_event.end_time   = row.asTime(_booking_col.end);
+
+  // Add to buffer
+  _bookings.push_back(current_event);
 
   return 0;
 }
@@ -287,7 +290,10 @@ int nh_tools_bookings::publish_now_next_bookings()
 
   // Use the callback function passes in when consturcted to send the now/next
   // booking data over MQTT.
-  _cb->cbiSendMessage(_bookings_topic + _tool_name + "/nownext", booking_info);
+  if (_nownext_topic != NULL)
+    _cb->cbiSendMessage(_nownext_topic, booking_info);
+  else
+    _cb->cbiSendMessage(_bookings_topic + _tool_name + "/nownext", booking_info);
 
   return 0;
 }
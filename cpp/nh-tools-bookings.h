@@ -61,7 +61,7 @@
 
 
 #include "CNHmqtt_irc.h"
-#include "CNHDBAccess.h"
+#include "CNHDBPool.h"
 #include "nh-cbi.h"
 
 #include <stdio.h>
@@ -75,8 +75,7 @@
 class nh_tools_bookings
 {
   public:
-    nh_tools_bookings(CLogging *log, std::string db_server, std::string db_username, std::string db_password, std::string db_name,
-                      std::string bookings_topic, InstCBI *cb);
+    nh_tools_bookings(CLogging *log, CNHDBPool *db_pool, std::string bookings_topic, InstCBI *cb);
     ~nh_tools_bookings();
 
     void setup(int tool_id);  // Call once with the tool_id id to publish bookings for
@@ -110,13 +109,14 @@ class nh_tools_bookings
     std::string _bookings_topic;
     bool _setup_done;
     std::string _tool_name;
+    mqtt_topic *_nownext_topic;
     bool _got_valid_booking_data;
 
     void dbg(std::string msg);
 
     static void *s_cal_thread(void *arg);
 
-    CNHDBAccess *_db;
+    CNHDBPool *_db_pool; // nh_tools' - shared by all the tools
     void cal_thread();
     InstCBI *_cb;
     std::vector<evtdata> _bookings;
@@ -128,6 +128,14 @@ class nh_tools_bookings
     int publish_now_next_bookings();
     static bool event_by_start_time_sorter(evtdata const& i, evtdata const& j);
     
-    int process_bookings_data(dbrows rows);
+    static int s_booking_row(void *obj, const CDBResult::row &row);
+    int booking_row(const CDBResult::row &row);
+    struct
+    {
+      bool found;  // looked up from the first row of each fetch
+      int username;
+      int start;
+      int end;
+    } _booking_col;
     
 };
@@ -42,12 +42,14 @@ nh_tools::nh_tools(int argc, char *argv[]) : CNHmqtt_irc(argc, argv)
   _bookings_topic = get_str_option("tools", "bookings_topic","nh/bookings/");
   _status_topic   = get_str_option("tools", "status_topic" , "nh/status/tool/");
 
-  _db_server   = get_str_option("mysql", "server"  , "localhost");
-  _db_username = get_str_option("mysql", "username", "gatekeeper");
-  _db_password = get_str_option("mysql", "password", "gk");
-  _db_name     = get_str_option("mysql", "database", "gk");
-
-  _db = new CNHDBAccess(_db_server, _db_username, _db_password, _db_name, log);
+  // One pool for the tool messages and all the bookings threads, rather than a connection each
+  _db_pool = CNHDBPool::get_pool(get_str_option("mysql", "server"  , "localhost"),
+                                 get_str_option("mysql", "username", "gatekeeper"),
+                                 get_str_option("mysql", "password", "gk"),
+                                 get_str_option("mysql", "database", "gk"), log,
+                                 get_int_option("mysql", "pool_size", DB_POOL_DEFAULT_SIZE));
+  CNHDBAccess::set_slow_call_ms(get_int_option("mysql", "slow_call_ms", DB_SLOW_CALL_MS));
+  CNHDBAccess::set_deadlines(get_int_option("mysql", "timeout", DB_TIMEOUT_SECS), get_int_option("mysql", "breaker_failures", DB_BREAKER_FAILURES), get_int_option("mysql", "breaker_cooldown", DB_BREAKER_COOLDOWN_SECS));
 
   _setup_done = false;
    _bookings_log = NULL;
@@ -55,148 +57,146 @@ nh_tools::nh_tools(int argc, char *argv[]) : CNHmqtt_irc(argc, argv)
 
 nh_tools::~nh_tools()
 {
-  delete _db;
-
   for (std::map<string,nh_tools_bookings*>::iterator it = _bookings.begin(); it != _bookings.end(); ++it)
     delete it->second;
   _bookings.clear();
+
+  CNHDBPool::put_pool(_db_pool);
   
   if (_bookings_log)
     delete _bookings_log;
 }
 
-void nh_tools::process_message(string topic, string message)
+string nh_tools::status_detail_extra()
+{
+  return "\"db\":" + _db_pool->json();
+}
+
+void nh_tools::s_tool_message(void *obj, const topic_match &m, const str_view &message)
+{
+  // E.g. "nh/tools/laser/RFID" - wildcard[0] = tool name, wildcard[1] = tool message
+  ((nh_tools*)obj)->tool_message(m.wildcard[0].str(), m.wildcard[1].str(), message.str());
+}
+
+void nh_tools::s_bookings_poll(void *obj, const topic_match &, const str_view &message)
+{
+  ((nh_tools*)obj)->bookings_poll(message.str());
+}
+
+void nh_tools::tool_message(string tool_name, string tool_message, string message)
 {
-  std::vector<string> split_topic;
   int member_id = 0;
   string disp_msg;
   string dbg_msg="";
+  string msg;
+  int access_result = 0;
+  CNHDBPool::conn db(_db_pool);
 
-  // E.g. "nh/tools/laser/RFID"
-
-  // Look for a message to the _tool_topic
-  if (topic.substr(0, _tool_topic.length()) == _tool_topic)
+  if (tool_message == "AUTH")
   {
-    string tool_name, tool_message, msg;
-    int access_result = 0;
-    split(split_topic, topic.substr(_tool_topic.length(), string::npos), '/');
-    if (split_topic.size() != 2)
-    {
-      log->dbg("invalid topic");
-      return;
-    }
+    db->sp_rfid_update(message, CNHmqtt_irc::hex2legacy_rfid(message), dbg_msg);
+    log->dbg(dbg_msg);
 
-    tool_name    = split_topic[0];
-    tool_message = split_topic[1];
-
-    if (tool_message == "AUTH")
+    if (db->sp_tool_sign_on(tool_name, message, access_result, msg, member_id))
     {
-      _db->sp_rfid_update(message, CNHmqtt_irc::hex2legacy_rfid(message), dbg_msg);
-      log->dbg(dbg_msg);
-
-      if (_db->sp_tool_sign_on(tool_name, message, access_result, msg, member_id))
+      message_send(_tool_topic + tool_name + "/DENY", "Failure.");
+    } else
+    {
+      if (access_result)
       {
-        message_send(_tool_topic + tool_name + "/DENY", "Failure.");
-      } else
+        // Access granted
+        db->sp_tool_pledged_remain(tool_name, member_id, disp_msg);
+        message_send(_tool_topic + tool_name + "/GRANT", msg + disp_msg);
+        message_send(_status_topic + tool_name, "IN_USE", false, true);
+      }
+      else
       {
-        if (access_result)
-        {
-          // Access granted
-          _db->sp_tool_pledged_remain(tool_name, member_id, disp_msg);
-          message_send(_tool_topic + tool_name + "/GRANT", msg + disp_msg);
-          message_send(_status_topic + tool_name, "IN_USE", false, true);
-        }
-        else
-        {
-          message_send(_tool_topic + tool_name + "/DENY", msg);
-        }
+        message_send(_tool_topic + tool_name + "/DENY", msg);
       }
-    } else if (tool_message == "COMPLETE")
+    }
+  } else if (tool_message == "COMPLETE")
+  {
+    message_send(_status_topic + tool_name, "SIGNED_OFF", false, true);
+
+    if (db->sp_tool_sign_off(tool_name, atoi(tool_message.c_str()), msg))
+    {
+      log->dbg("sp_tool_sign_off failed...");
+    } else if (msg.length() > 0)
+    {
+      log->dbg("sp_tool_sign_off: " + msg);
+    }
+  } else if (tool_message == "RESET")
+  {
+    // Device has either just been powered up, or has reconnected and isn't in use - so make sure it's signed off
+    if ((message == "BOOT") || (message == "IDLE"))
     {
       message_send(_status_topic + tool_name, "SIGNED_OFF", false, true);
-
-      if (_db->sp_tool_sign_off(tool_name, atoi(tool_message.c_str()), msg))
+      if (db->sp_tool_sign_off(tool_name, atoi(tool_message.c_str()), msg))
       {
         log->dbg("sp_tool_sign_off failed...");
       } else if (msg.length() > 0)
       {
         log->dbg("sp_tool_sign_off: " + msg);
       }
-    } else if (tool_message == "RESET")
-    {
-      // Device has either just been powered up, or has reconnected and isn't in use - so make sure it's signed off
-      if ((message == "BOOT") || (message == "IDLE"))
-      {
-        message_send(_status_topic + tool_name, "SIGNED_OFF", false, true);
-        if (_db->sp_tool_sign_off(tool_name, atoi(tool_message.c_str()), msg))
-        {
-          log->dbg("sp_tool_sign_off failed...");
-        } else if (msg.length() > 0)
-        {
-          log->dbg("sp_tool_sign_off: " + msg);
-        }
-      }
     }
-    else if (tool_message == "INDUCT")
+  }
+  else if (tool_message == "INDUCT")
+  {
+    // Induct button has been pushed, and a new card presented
+    string card_inductor;
+    string card_inductee;
+    string err;
+    size_t pos;
+    int ret=1;
+    
+    pos = message.find_first_of(":");
+    if (pos == string::npos)
+    {
+      log->dbg("Invalid induct message");
+    } else
     {
-      // Induct button has been pushed, and a new card presented
-      string card_inductor;
-      string card_inductee;
-      string err;
-      size_t pos;
-      int ret=1;
-      
-      pos = message.find_first_of(":");
-      if (pos == string::npos)
+      card_inductor = message.substr(0, pos);
+      card_inductee = message.substr(pos+1, string::npos);
+
+      log->dbg("card_inductor=" + card_inductor + ", card_inductee=" + card_inductee);
+      db->sp_rfid_update(card_inductee, CNHmqtt_irc::hex2legacy_rfid(card_inductee), dbg_msg);
+      log->dbg(dbg_msg);
+
+      if (db->sp_tool_induct(tool_name, card_inductor, card_inductee, ret, err))
       {
-        log->dbg("Invalid induct message");
-      } else
+        log->dbg("sp_tool_induct failed...");
+        ret = 1;
+      } else if (msg.length() > 0)
       {
-        card_inductor = message.substr(0, pos);
-        card_inductee = message.substr(pos+1, string::npos);
-
-        log->dbg("card_inductor=" + card_inductor + ", card_inductee=" + card_inductee);
-        _db->sp_rfid_update(card_inductee, CNHmqtt_irc::hex2legacy_rfid(card_inductee), dbg_msg);
-        log->dbg(dbg_msg);
-
-        if (_db->sp_tool_induct(tool_name, card_inductor, card_inductee, ret, err))
-        {
-          log->dbg("sp_tool_induct failed...");
-          ret = 1;
-        } else if (msg.length() > 0)
-        {
-          log->dbg("sp_tool_induct: " + msg);
-        }
-
-        if (ret)
-          message_send(_tool_topic + tool_name + "/IFAL", err); // Induct FAiLed
-        else
-          message_send(_tool_topic + tool_name + "/ISUC", err); // Induct SUCcess
+        log->dbg("sp_tool_induct: " + msg);
       }
 
-    }
-    else if (tool_message == "BOOKINGS")
-    {
-      if (message == "POLL")
-        if (_bookings.count(tool_name) == 1)
-          _bookings[tool_name]->poll();
-    }
-  } // End of _tools_topic processing
-  
-  else if (topic == _bookings_topic + "poll")
-  {
-    // Message to the tools booking/poll topic. Get the tool name from the message
-    // payload, then send update now/next booking data for that tool
-    if (message.length() > 0)
-    {
-      if (_bookings.count(message) == 1)
-        _bookings[message]->poll();
+      if (ret)
+        message_send(_tool_topic + tool_name + "/IFAL", err); // Induct FAiLed
       else
-        log->dbg("Unknown tool: " + message);
+        message_send(_tool_topic + tool_name + "/ISUC", err); // Induct SUCcess
     }
+
   }
+  else if (tool_message == "BOOKINGS")
+  {
+    if (message == "POLL")
+      if (_bookings.count(tool_name) == 1)
+        _bookings[tool_name]->poll();
+  }
+}
 
-  CNHmqtt_irc::process_message(topic, message);
+void nh_tools::bookings_poll(string message)
+{
+  // Message to the tools booking/poll topic. Get the tool name from the message
+  // payload, then send update now/next booking data for that tool
+  if (message.length() > 0)
+  {
+    if (_bookings.count(message) == 1)
+      _bookings[message]->poll();
+    else
+      log->dbg("Unknown tool: " + message);
+  }
 }
 
 
@@ -205,10 +205,30 @@ void nh_tools::process_irc_message(irc_msg msg)
   log->dbg("Got IRC message: " + (string)msg);
 }
 
+string nh_tools::partition_key(const string &topic)
+/* Keep messages for the same tool in order when using worker threads */
+{
+  if ((topic.length() > _tool_topic.length()) && !topic.compare(0, _tool_topic.length(), _tool_topic))
+    return topic.substr(0, topic.find_first_of('/', _tool_topic.length()));
+
+  return topic;
+}
+
+void nh_tools::worker_thread_start()
+{
+  mysql_thread_init();
+}
+
+void nh_tools::worker_thread_end()
+{
+  mysql_thread_end();
+}
+
 int nh_tools::db_connect()
+/* Make the first pooled connection. Failing isn't fatal - another is tried when it's next needed. */
 {
-  _db->dbConnect();
-  return 0;
+  CNHDBPool::conn db(_db_pool);
+  return db->is_connected() ? 0 : -1;
 }
 
 int nh_tools::cbiSendMessage(string topic, string message)
@@ -218,6 +238,18 @@ int nh_tools::cbiSendMessage(string topic, string message)
   return 0;
 }
 
+int nh_tools::cbiSendMessage(mqtt_topic *topic, string message)
+{
+  message_send(topic, message);
+
+  return 0;
+}
+
+mqtt_topic *nh_tools::cbiTopicHandle(string topic, bool retained, bool coalesce)
+{
+  return topic_handle(topic, retained, coalesce);
+}
+
 void nh_tools::setup()
 {
   if (_setup_done)
@@ -225,8 +257,8 @@ void nh_tools::setup()
   
   string bookings_logfile = get_str_option("mqtt", "bookings_logfile", "");
 
-  subscribe(_tool_topic + "#");
-  subscribe(_bookings_topic + "poll");
+  subscribe(_tool_topic + "+/+", s_tool_message, this);
+  subscribe(_bookings_topic + "poll", s_bookings_poll, this);
   
   // The bookings logic writes a fair bit to the log file. Put this in a different 
   // file to seperate it out from the normal tools signon/signoff stuff.
@@ -243,14 +275,19 @@ void nh_tools::setup()
 
   // For each tool that has booking notifications enabled, create an nh_tools_bookings object
   // to manage the sending of booking info periodically over MQTT.
-  dbrows tool_list;
-  _db->sp_tool_get_calendars(-1, &tool_list); 
-  for (dbrows::const_iterator iterator = tool_list.begin(), end = tool_list.end(); iterator != end; ++iterator)
+  CDBResult tool_list;
+  {
+    CNHDBPool::conn db(_db_pool);
+    db->sp_tool_get_calendars(-1, &tool_list);
+  }
+  int col_tool_name = tool_list.column("tool_name");
+  int col_tool_id   = tool_list.column("tool_id");
+  for (unsigned int n=0; n < tool_list.size(); n++)
   {
-    dbrow row = *iterator;
-    log->dbg("Creating booking object for tool [" + row["tool_name"].asStr() + "], id = [" +  row["tool_id"].asStr() + "]");
-    _bookings[row["tool_name"].asStr()] = new nh_tools_bookings((_bookings_log ? _bookings_log : log), _db_server, _db_username, _db_password, _db_name, _bookings_topic, this);
-    _bookings[row["tool_name"].asStr()]->setup(row["tool_id"].asInt());
+    string tool_name = tool_list[n].asStr(col_tool_name);
+    log->dbg("Creating booking object for tool [" + tool_name + "], id = [" +  tool_list[n].asStr(col_tool_id) + "]");
+    _bookings[tool_name] = new nh_tools_bookings((_bookings_log ? _bookings_log : log), _db_pool, _bookings_topic, this);
+    _bookings[tool_name]->setup(tool_list[n].asInt(col_tool_id));
   }
 
   _setup_done = true;
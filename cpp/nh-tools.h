@@ -33,7 +33,7 @@
 
 
 #include "CNHmqtt_irc.h"
-#include "CNHDBAccess.h"
+#include "CNHDBPool.h"
 #include "nh-cbi.h"
 #include "nh-tools-bookings.h"
 
@@ -52,10 +52,19 @@ class nh_tools : public CNHmqtt_irc, public InstCBI
   public:
     nh_tools(int argc, char *argv[]);
     ~nh_tools();
+    std::string status_detail_extra();
 
-    void process_message(std::string topic, std::string message);
+    static void s_tool_message(void *obj, const topic_match &m, const str_view &message);
+    static void s_bookings_poll(void *obj, const topic_match &m, const str_view &message);
+    void tool_message(std::string tool_name, std::string tool_message, std::string message);
+    void bookings_poll(std::string message);
     void process_irc_message(irc_msg msg);
     int cbiSendMessage(std::string topic, std::string message);
+    int cbiSendMessage(mqtt_topic *topic, std::string message);
+    mqtt_topic *cbiTopicHandle(std::string topic, bool retained, bool coalesce);
+    std::string partition_key(const std::string &topic);
+    void worker_thread_start();
+    void worker_thread_end();
     int db_connect();
     void setup();
 
@@ -63,14 +72,10 @@ class nh_tools : public CNHmqtt_irc, public InstCBI
     void split(std::vector<std::string> &tokens, const std::string &text, char sep);
 
   private:
-    CNHDBAccess *_db;
+    CNHDBPool *_db_pool;
 
     std::string _tool_topic;
     std::string _bookings_topic;
-    std::string _db_server;
-    std::string _db_username;
-    std::string _db_password;
-    std::string _db_name;
     std::string _status_topic;
     bool _setup_done;
     CLogging *_bookings_log;
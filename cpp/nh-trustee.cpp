@@ -35,9 +35,11 @@
 #include <json-c/json.h>     // libjson-c-dev
 #include <curl/curl.h>       // libcurl4-gnutls-dev
 
+#ifndef NH_HOST
 bool CNHmqtt::debug_mode = false;
 bool CNHmqtt::daemonized = false;
 std::string CNHmqtt::_pid_file = "";
+#endif
 
 using namespace std;
 
@@ -236,6 +238,21 @@ class nh_trustee : public CNHmqtt
     }
 };
 
+#ifdef NH_HOST
+CNHmqtt *nh_trustee_service(int argc, char *argv[])
+/* Create nh-trustee as a service running inside nh-host */
+{
+  nh_trustee *nh = new nh_trustee(argc, argv);
+
+  if (nh->mosq_connect() || !nh->setup())
+  {
+    delete nh;
+    return NULL;
+  }
+
+  return nh;
+}
+#else
 nh_trustee *nh;
 
 int main(int argc, char *argv[])
@@ -256,3 +273,4 @@ int main(int argc, char *argv[])
 
   return 0;
 }
+#endif
@@ -46,24 +46,31 @@ nh_vend::nh_vend(int argc, char *argv[]) : CNHmqtt(argc, argv)
   jammed_notification_topic = get_str_option("vend", "jammed_notification_topic", "nh/slack/tx/networking");
   opened_notification_topic = get_str_option("vend", "opened_notification_topic", "nh/slack/tx/networking");
   opened_trustee_notification_topic = get_str_option("vend", "opened_trustee_notification_topic", "nh/trustee/slack/tx/banking");
-  db = new CNHDBAccess(get_str_option("mysql", "server", "localhost"), get_str_option("mysql", "username", "gatekeeper"), get_str_option("mysql", "password", "gk"), get_str_option("mysql", "database", "gk"), log);
+  db_pool = CNHDBPool::get_pool(get_str_option("mysql", "server", "localhost"), get_str_option("mysql", "username", "gatekeeper"), get_str_option("mysql", "password", "gk"), get_str_option("mysql", "database", "gk"), log, get_int_option("mysql", "pool_size", DB_POOL_DEFAULT_SIZE), get_int_option("mysql", "write_behind_ms", DB_WRITE_BEHIND_MS));
+  CNHDBAccess::set_slow_call_ms(get_int_option("mysql", "slow_call_ms", DB_SLOW_CALL_MS));
+  CNHDBAccess::set_deadlines(get_int_option("mysql", "timeout", DB_TIMEOUT_SECS), get_int_option("mysql", "breaker_failures", DB_BREAKER_FAILURES), get_int_option("mysql", "breaker_cooldown", DB_BREAKER_COOLDOWN_SECS));
 }
 
 nh_vend::~nh_vend()
 {
-  delete db;
+  CNHDBPool::put_pool(db_pool);
+}
+
+string nh_vend::status_detail_extra()
+{
+  return "\"db\":" + db_pool->json();
 }
 
 void nh_vend::process_message(string topic, string message)
 {
   // Identify vending machine, and process message
-  for (dbrows::const_iterator iterator = vm_list.begin(), end = vm_list.end(); iterator != end; ++iterator)
+  for (unsigned int n=0; n < vm_list.size(); n++)
   {
-    dbrow row = *iterator;
+    CDBResult::row vm = vm_list[n];
 
-    if ((row["vmc_connection"].asStr() == "MQTT") && (row["vmc_address"].asStr()+"rx") == topic)
+    if ((vm.asStr(vm_col.connection) == "MQTT") && (vm.asStr(vm_col.address)+"rx") == topic)
     {
-      vm_msg_mqtt vmmsg = vm_msg_mqtt(this, row, message);
+      vm_msg_mqtt vmmsg = vm_msg_mqtt(this, vm, vm_col, message);
       process_message(&vmmsg);
       break;
     }
@@ -76,24 +83,33 @@ int nh_vend::setup()
 {
   struct sockaddr_in addr;
 
-  if(db->dbConnect())
-    return -1;
+  {
+    CNHDBPool::conn db(db_pool);
+    if (!db->is_connected())
+      return -1;
+
+    db->sp_vend_get_machines(-1, &vm_list);
+  }
 
-  db->sp_vend_get_machines(-1, &vm_list);
+  vm_col.id          = vm_list.column("vmc_id");
+  vm_col.type        = vm_list.column("vmc_type");
+  vm_col.connection  = vm_list.column("vmc_connection");
+  vm_col.address     = vm_list.column("vmc_address");
+  vm_col.description = vm_list.column("vmc_description");
 
   log->dbg("Known vending machines:");
-  for (dbrows::const_iterator iterator = vm_list.begin(), end = vm_list.end(); iterator != end; ++iterator)
+  for (unsigned int n=0; n < vm_list.size(); n++)
   {
-    dbrow row = *iterator;
+    CDBResult::row vm = vm_list[n];
 
-    log->dbg(row["vmc_id"].asStr() + "\t" +
-             row["vmc_type"].asStr() + "\t" +
-             row["vmc_connection"].asStr() + "\t" +
-             row["vmc_address"].asStr() + "\t" +
-             row["vmc_description"].asStr());
+    log->dbg(vm.asStr(vm_col.id) + "\t" +
+             vm.asStr(vm_col.type) + "\t" +
+             vm.asStr(vm_col.connection) + "\t" +
+             vm.asStr(vm_col.address) + "\t" +
+             vm.asStr(vm_col.description));
 
-    if (row["vmc_connection"].asStr() == "MQTT")
-      subscribe(row["vmc_address"].asStr() + "rx");
+    if (vm.asStr(vm_col.connection) == "MQTT")
+      subscribe(vm.asStr(vm_col.address) + "rx");
   }
 
   // Create socket
@@ -115,21 +131,20 @@ int nh_vend::setup()
   } else
     log->dbg("Listening on port " + itos(port) + ".");
 
-  // Start receive thread
-  pthread_create(&rThread, NULL, &nh_vend::s_receive_thread, this);
+  // Datagrams get processed by message_loop(), on the same thread as MQTT messages
+  if (watch_fd(sck, &nh_vend::s_udp_receive, this))
+    return -1;
 
   return 0;
 }
 
-void *nh_vend::s_receive_thread(void *arg)
+void nh_vend::s_udp_receive(void *obj, int, unsigned int)
 {
-  mysql_thread_init();
-  ((nh_vend*)arg)->receive_thread();
-  mysql_thread_end();
-  return NULL;
+  ((nh_vend*)obj)->udp_receive();
 }
 
-void nh_vend::receive_thread()
+void nh_vend::udp_receive()
+/* Called by message_loop() when there's a datagram waiting */
 {
   char buf[BUFLEN];
   char dbgbuf[BUFLEN+256];
@@ -137,35 +152,32 @@ void nh_vend::receive_thread()
   socklen_t addrlen;
   int len;
 
-  log->dbg("entered receive_thread()");
-
   memset(buf, 0, sizeof(buf));
   addrlen = sizeof(addr);
-  while ((len=recvfrom(sck, buf, sizeof(buf)-1, 0, (struct sockaddr *)&addr, &addrlen)) != -1)
+  if ((len=recvfrom(sck, buf, sizeof(buf)-1, 0, (struct sockaddr *)&addr, &addrlen)) == -1)
   {
-    if (buf[strlen(buf)-1] == '\n') // If the last character is a newline, remove it.
-      buf[strlen(buf)-1] = 0;
+    log->dbg("recvfrom failed: " + (string)strerror(errno));
+    return;
+  }
 
-    sprintf(dbgbuf, "%s:%d < [%s]", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), buf);
-    log->dbg(dbgbuf);
+  if ((strlen(buf) > 0) && (buf[strlen(buf)-1] == '\n')) // If the last character is a newline, remove it.
+    buf[strlen(buf)-1] = 0;
 
-    // Identify vending machine, and process message
-    for (dbrows::const_iterator iterator = vm_list.begin(), end = vm_list.end(); iterator != end; ++iterator)
-    {
-      dbrow row = *iterator;
+  sprintf(dbgbuf, "%s:%d < [%s]", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), buf);
+  log->dbg(dbgbuf);
 
-      if ((row["vmc_connection"].asStr() == "UDP") && (row["vmc_address"].asStr() == (string)inet_ntoa(addr.sin_addr)))
-      {
-        vm_msg_udp vmmsg = vm_msg_udp(this, row, buf, sck, addr);
-        process_message(&vmmsg);
-        break;
-      }
+  // Identify vending machine, and process message
+  for (unsigned int n=0; n < vm_list.size(); n++)
+  {
+    CDBResult::row vm = vm_list[n];
+
+    if ((vm.asStr(vm_col.connection) == "UDP") && (vm.asStr(vm_col.address) == (string)inet_ntoa(addr.sin_addr)))
+    {
+      vm_msg_udp vmmsg = vm_msg_udp(this, vm, vm_col, buf, sck, addr);
+      process_message(&vmmsg);
+      break;
     }
-    memset(buf, 0, sizeof(buf));
   }
-
-  perror("Done.");
-  return;
 }
 
 void nh_vend::process_message(vm_msg* vmmsg)
@@ -216,6 +228,8 @@ void nh_vend::process_message(vm_msg* vmmsg)
     return;
   }
 
+  CNHDBPool::conn db(db_pool);
+
   if (!strncmp(msgbuf, "AUTH", 4))
   {
     memset(rfid_serial, 0, sizeof(rfid_serial));
@@ -450,14 +464,14 @@ void nh_vend::test()
   tran_id = "10";
   amount_scaled = 60;
 
-
+  CNHDBPool::conn db(db_pool);
   db->sp_vend_request (rfid_serial, tran_id, amount_scaled, err, vend_ok);
 }
 
 
-vm_msg_mqtt::vm_msg_mqtt(nh_vend *nhv, dbrow row, std::string msg) : vm_msg(nhv, row, msg)
+vm_msg_mqtt::vm_msg_mqtt(nh_vend *nhv, const CDBResult::row &vm, const vm_columns &col, std::string msg) : vm_msg(nhv, vm, col, msg)
 {
-  topic = row["vmc_address"].asStr();
+  topic = vm.asStr(col.address);
 
 }
 
@@ -466,7 +480,7 @@ void vm_msg_mqtt::send(string msg)
   nhvend->mqtt_send(topic+"tx", msg);
 }
 
-vm_msg_udp::vm_msg_udp(nh_vend *nhv, dbrow row, std::string msg, int sck, struct sockaddr_in addr) : vm_msg(nhv, row, msg)
+vm_msg_udp::vm_msg_udp(nh_vend *nhv, const CDBResult::row &vm, const vm_columns &col, std::string msg, int sck, struct sockaddr_in addr) : vm_msg(nhv, vm, col, msg)
 {
   sock = sck;
   remote_addr = addr;
@@ -2,7 +2,7 @@ bool CNHmqtt::debug_mode = false;
 bool CNHmqtt::daemonized = false;
 std::string CNHmqtt::_pid_file = "";
 
-#include "CNHDBAccess.h"
+#include "CNHDBPool.h"
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/types.h>
@@ -15,6 +15,15 @@ std::string CNHmqtt::_pid_file = "";
 
 class nh_vend;
 
+    // Where each column is in the list of vending machines from sp_vend_get_machines
+    struct vm_columns
+    {
+      int id;
+      int type;
+      int connection;
+      int address;
+      int description;
+    };
 
     class vm_msg
     {
@@ -24,11 +33,11 @@ class nh_vend;
       std::string vm_desc;
       int vm_id;
       nh_vend *nhvend;
-      vm_msg(nh_vend *nhv, dbrow row, std::string m)
+      vm_msg(nh_vend *nhv, const CDBResult::row &vm, const vm_columns &col, std::string m)
       {
-        vm_type = row["vmc_type"].asStr();
-        vm_desc = row["vmc_description"].asStr();
-        vm_id   = row["vmc_id"].asInt();
+        vm_type = vm.asStr(col.type);
+        vm_desc = vm.asStr(col.description);
+        vm_id   = vm.asInt(col.id);
         nhvend  = nhv;
         msg = m;
       }
@@ -39,7 +48,7 @@ class nh_vend;
     class vm_msg_mqtt : public vm_msg
     {
     public:
-      vm_msg_mqtt(nh_vend *nhv, dbrow row, std::string msg);
+      vm_msg_mqtt(nh_vend *nhv, const CDBResult::row &vm, const vm_columns &col, std::string msg);
       void send(std::string msg);
       std::string topic;
     };
@@ -48,7 +57,7 @@ class nh_vend;
     class vm_msg_udp : public vm_msg
     {
     public:
-      vm_msg_udp(nh_vend *nhv, dbrow row, std::string msg, int sck, struct sockaddr_in remote_addr);
+      vm_msg_udp(nh_vend *nhv, const CDBResult::row &vm, const vm_columns &col, std::string msg, int sck, struct sockaddr_in remote_addr);
       void send(std::string);
       std::string ipaddr;
       int port;
@@ -61,14 +70,14 @@ class nh_vend : public CNHmqtt
   private:
     int sck;
     int port;
-    pthread_t rThread;
-    dbrows vm_list;
+    CDBResult vm_list;
+    vm_columns vm_col;
   //  std::list<CVMC*> _VMs;
   //  static int s_process_vm_msg_cb(CVMC* cvmc, void* obj, std::string msg);
  //   int process_vm_msg_cb(CVMC* cvmc, std::string msg);
 
   public:
-    CNHDBAccess *db;
+    CNHDBPool *db_pool;
     std::string temperature_topic;
     std::string twitter;
     std::string jammed_notification_topic;
@@ -78,10 +87,11 @@ class nh_vend : public CNHmqtt
 
     nh_vend(int argc, char *argv[]);
     ~nh_vend();
+    std::string status_detail_extra();
     void process_message(std::string topic, std::string message);
     int setup();
-    static void *s_receive_thread(void *arg);
-    void receive_thread();
+    static void s_udp_receive(void *obj, int fd, unsigned int events);
+    void udp_receive();
     int vend_message_send(std::string msg, struct sockaddr_in *addr);
     void process_message(vm_msg* vmmsg);
     void test();
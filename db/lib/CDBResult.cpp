@@ -0,0 +1,209 @@
+#include <string.h>
+
+#include "CDBResult.h"
+
+using namespace std;
+
+CDBResult::CDBResult()
+{
+  _rows = 0;
+}
+
+CDBResult::~CDBResult()
+{
+}
+
+void CDBResult::clear()
+{
+  _names.clear();
+  _cells.clear();
+  _text.clear();
+  _rows = 0;
+}
+
+void CDBResult::clear_rows()
+{
+  _cells.clear();
+  _text.clear();
+  _rows = 0;
+}
+
+int CDBResult::column(const string &name) const
+{
+  for (unsigned int col=0; col < _names.size(); col++)
+    if (_names[col] == name)
+      return col;
+
+  return -1;
+}
+
+string CDBResult::column_name(int col) const
+{
+  if ((col < 0) || ((unsigned int)col >= _names.size()))
+    return "";
+
+  return _names[col];
+}
+
+void CDBResult::set_columns(MYSQL_FIELD *fields, int field_count)
+{
+  clear();
+  for (int i=0; i < field_count; i++)
+    _names.push_back(fields[i].name);
+}
+
+void CDBResult::add_row(MYSQL_BIND *bind)
+{
+  for (unsigned int i=0; i < _names.size(); i++)
+  {
+    cell c;
+    const char *buf = (const char *)bind[i].buffer;
+
+    memset(&c, 0, sizeof(c));
+    c.null = *bind[i].is_null;
+    switch (bind[i].buffer_type)
+    {
+      case MYSQL_TYPE_VAR_STRING:
+      case MYSQL_TYPE_STRING:
+        c.type = VAL_TYPE_VARCHAR;
+        if (c.null)
+          break;
+        c.len = (bind[i].length != NULL) ? *bind[i].length : strlen(buf);
+        if (c.len > bind[i].buffer_length) // truncated
+          c.len = strnlen(buf, bind[i].buffer_length);
+        c.str = _text.size();
+        _text.insert(_text.end(), buf, buf + c.len);
+        break;
+
+      case MYSQL_TYPE_LONG:
+        c.type = VAL_TYPE_INT;
+        if (!c.null)
+          c.i = *((int*)buf); /* MySQL long = C++ int */
+        break;
+
+      case MYSQL_TYPE_FLOAT:
+        c.type = VAL_TYPE_FLOAT;
+        if (!c.null)
+          c.f = *((float*)buf);
+        break;
+
+      case MYSQL_TYPE_DATETIME:
+        c.type = VAL_TYPE_DATETIME;
+        if (!c.null)
+          CDBValue::mysql_time2timet((MYSQL_TIME*)buf, &c.t);
+        break;
+
+      default:
+        break;
+    }
+    _cells.push_back(c);
+  }
+  _rows++;
+}
+
+const CDBResult::cell *CDBResult::get(unsigned int n, int col) const
+{
+  if ((n >= _rows) || (col < 0) || ((unsigned int)col >= _names.size()))
+    return NULL;
+
+  return &_cells[(n * _names.size()) + col];
+}
+
+CDBValue CDBResult::value(unsigned int n, int col) const
+{
+  CDBValue val;
+  const cell *c = get(n, col);
+
+  if (c == NULL)
+    return val;
+
+  val._val_set = (c->type != 0);
+  val._null = c->null;
+  val._val_type = c->type;
+  switch (c->type)
+  {
+    case VAL_TYPE_VARCHAR:
+      val._strVal.assign(&_text[c->str], c->len);
+      break;
+
+    case VAL_TYPE_INT:
+      val._intVal = c->i;
+      break;
+
+    case VAL_TYPE_FLOAT:
+      val._fltVal = c->f;
+      break;
+
+    case VAL_TYPE_DATETIME:
+      val._timVal = c->t;
+      break;
+  }
+
+  return val;
+}
+
+/* The usual cases are read straight from the cell; anything needing a conversion goes through
+ * CDBValue, so it comes out just as it would from a dbrow */
+
+string CDBResult::asStr(unsigned int n, int col) const
+{
+  const cell *c = get(n, col);
+
+  if ((c != NULL) && !c->null && (c->type == VAL_TYPE_VARCHAR))
+    return (c->len > 0) ? string(&_text[c->str], c->len) : string();
+
+  return value(n, col).asStr();
+}
+
+int CDBResult::asInt(unsigned int n, int col) const
+{
+  const cell *c = get(n, col);
+
+  if ((c != NULL) && !c->null && (c->type == VAL_TYPE_INT))
+    return c->i;
+
+  return value(n, col).asInt();
+}
+
+float CDBResult::asFloat(unsigned int n, int col) const
+{
+  const cell *c = get(n, col);
+
+  if ((c != NULL) && !c->null && (c->type == VAL_TYPE_FLOAT))
+    return c->f;
+
+  return value(n, col).asFloat();
+}
+
+time_t CDBResult::asTime(unsigned int n, int col) const
+{
+  const cell *c = get(n, col);
+
+  if ((c == NULL) || c->null || (c->type != VAL_TYPE_DATETIME))
+    return 0;
+
+  return c->t;
+}
+
+bool CDBResult::isNull(unsigned int n, int col) const
+{
+  const cell *c = get(n, col);
+
+  return ((c == NULL) || c->null || (c->type == 0));
+}
+
+dbrow CDBResult::to_dbrow(unsigned int n) const
+{
+  dbrow row;
+
+  for (unsigned int col=0; col < _names.size(); col++)
+    row[_names[col]] = value(n, col);
+
+  return row;
+}
+
+void CDBResult::to_dbrows(dbrows *rs) const
+{
+  for (unsigned int n=0; n < _rows; n++)
+    rs->push_back(to_dbrow(n));
+}
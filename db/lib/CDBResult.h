@@ -0,0 +1,101 @@
+#pragma once
+#include <mysql/mysql.h>
+#include <time.h>
+#include <map>
+#include <list>
+#include <vector>
+#include <string>
+#include "CDBValue.h"
+
+typedef std::map<std::string, CDBValue>  dbrow;
+typedef std::list<dbrow> dbrows;
+
+/* A result set from a stored procedure. The column names are kept once, and the values for every
+ * row in one array (row by row), with string values packed into a single buffer alongside - rather
+ * than a map, a node and a key string per value as with dbrow. Values are looked up by column
+ * index, so get the index for a name once, outside the loop:
+ *
+ *   CDBResult machines;
+ *   db->sp_vend_get_machines(-1, &machines);
+ *   int col_address = machines.column("vmc_address");
+ *   for (unsigned int n=0; n < machines.size(); n++)
+ *     subscribe(machines[n].asStr(col_address) + "rx");
+ *
+ * An unknown column name gives -1, and any value read with that is "<NOVAL>" / 0, the same as a name
+ * that's not in a dbrow. to_dbrows() converts the lot for code that still wants dbrows.
+ *
+ * For a result too big to want in memory all at once, the generated sp_ functions also take a
+ * row_callback instead, called with each row as it's fetched (see CNHDBAccess::exec_sp). */
+class CDBResult
+{
+  public:
+    // One row of the result, as returned by operator[] - only valid while the CDBResult is unchanged
+    class row
+    {
+      public:
+        row(const CDBResult *rs, unsigned int n) { _rs = rs; _n = n; };
+        std::string asStr(int col) const { return _rs->asStr(_n, col); };
+        int asInt(int col) const         { return _rs->asInt(_n, col); };
+        float asFloat(int col) const     { return _rs->asFloat(_n, col); };
+        time_t asTime(int col) const     { return _rs->asTime(_n, col); };
+        bool isNull(int col) const       { return _rs->isNull(_n, col); };
+        CDBValue value(int col) const    { return _rs->value(_n, col); };
+        int column(const std::string &name) const { return _rs->column(name); };
+
+      private:
+        const CDBResult *_rs;
+        unsigned int _n;
+    };
+
+    CDBResult();
+    ~CDBResult();
+
+    unsigned int size() const    { return _rows; };
+    bool empty() const           { return (_rows == 0); };
+    unsigned int columns() const { return _names.size(); };
+    int column(const std::string &name) const;
+    std::string column_name(int col) const;
+    row operator[](unsigned int n) const { return row(this, n); };
+    void clear();
+
+    std::string asStr(unsigned int n, int col) const;
+    int asInt(unsigned int n, int col) const;
+    float asFloat(unsigned int n, int col) const;
+    time_t asTime(unsigned int n, int col) const;
+    bool isNull(unsigned int n, int col) const;
+    CDBValue value(unsigned int n, int col) const;
+
+    dbrow to_dbrow(unsigned int n) const;
+    void to_dbrows(dbrows *rs) const;
+
+    // For CNHDBAccess to fill it in: set_columns() (which drops any rows already there), then an
+    // add_row() for each row fetched into the bind buffers
+    void set_columns(MYSQL_FIELD *fields, int field_count);
+    void add_row(MYSQL_BIND *bind);
+    void clear_rows(); // keeps the columns (and the memory), ready for the next row
+
+  private:
+    struct cell
+    {
+      union
+      {
+        int          i;
+        float        f;
+        time_t       t;
+        unsigned int str;   // offset into _text
+      };
+      unsigned int len;     // of the string
+      short        type;    // VAL_TYPE_*, or 0 if it's not a type CDBValue knows
+      bool         null;
+    };
+
+    std::vector<std::string> _names;
+    std::vector<cell> _cells;       // _rows x _names.size()
+    std::vector<char> _text;
+    unsigned int _rows;
+
+    const cell *get(unsigned int n, int col) const; // NULL if out of range
+};
+
+// Called for each row of a streamed result; return non-zero to skip the rest of the rows
+typedef int (*row_callback)(void *obj, const CDBResult::row &row);
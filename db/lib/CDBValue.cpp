@@ -20,14 +20,12 @@ CDBValue::CDBValue()
 
 CDBValue::CDBValue(MYSQL_BIND *bind)
 {
-  char *buf      =   (char* )bind->buffer;
-  int lng        = *((int*  )bind->buffer); /* MySQL long = C++ int */
-  int flt        = *((float*)bind->buffer);
-  MYSQL_TIME tim = *((MYSQL_TIME*)bind->buffer);
+  char *buf = (char*)bind->buffer; /* only as big as its type needs, so read it as that type */
 
   if (*bind->is_null)
   {
     _null = true;
+    _val_set = true;
   } else
   {
     _null = false;
@@ -42,17 +40,17 @@ CDBValue::CDBValue(MYSQL_BIND *bind)
 
       case MYSQL_TYPE_LONG:
         _val_type = VAL_TYPE_INT;
-        _intVal = lng;
+        _intVal = *((int*)buf); /* MySQL long = C++ int */
         break;
 
       case MYSQL_TYPE_FLOAT:
         _val_type = VAL_TYPE_FLOAT;
-        _fltVal = flt;
+        _fltVal = *((float*)buf);
         break;
 
       case MYSQL_TYPE_DATETIME:
         _val_type = VAL_TYPE_DATETIME;
-        mysql_time2timet(&tim, &_timVal);
+        mysql_time2timet((MYSQL_TIME*)buf, &_timVal);
         break;
 
       default:
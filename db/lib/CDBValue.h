@@ -31,7 +31,8 @@ class CDBValue
     operator time_t       () {return asTime();};
 
   private:
-    MYSQL_BIND  _bind;
+    friend class CDBResult; // fills the members in directly from its compact copy
+
     bool        _val_set;
     bool        _null;
     short       _val_type;
@@ -42,5 +43,5 @@ class CDBValue
     time_t      _timVal;
 
     std::string itos(long n);
-    void mysql_time2timet(MYSQL_TIME *my_time, time_t *c_time);
+    static void mysql_time2timet(MYSQL_TIME *my_time, time_t *c_time);
 };
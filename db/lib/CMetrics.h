@@ -0,0 +1 @@
+../../cpp/CMetrics.h
\ No newline at end of file
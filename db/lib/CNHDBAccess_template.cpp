@@ -28,16 +28,62 @@
  */
 
 #include "CNHDBAccess.h"
+#include "CNHDBWriter.h"
+#include "CMetrics.h"
 #include <string.h>
 #include <iostream>
 #include <cstdio>
 #include <string>
 #include <stdlib.h>
 #include <sstream>
+#include <tuple>
 
 /* TODO: Add support for P_TYPE_TEXT (MySQL "TEXT" field type) */
 
+// Errors meaning a prepared statement can no longer be used (from mysqld_error.h / errmsg.h)
+#ifndef ER_UNKNOWN_STMT_HANDLER
+#define ER_UNKNOWN_STMT_HANDLER 1243
+#endif
+#ifndef CR_SERVER_GONE_ERROR
+#define CR_SERVER_GONE_ERROR 2006
+#endif
+#ifndef CR_NO_PREPARE_STMT
+#define CR_NO_PREPARE_STMT 2030
+#endif
+
+// Errors meaning the server couldn't be reached, or stopped answering (errmsg.h)
+#ifndef CR_CONNECTION_ERROR
+#define CR_CONNECTION_ERROR 2002
+#endif
+#ifndef CR_CONN_HOST_ERROR
+#define CR_CONN_HOST_ERROR 2003
+#endif
+#ifndef CR_SERVER_LOST
+#define CR_SERVER_LOST 2013
+#endif
+
+// Servers from 5.5.3 can return OUT params as a result set after a prepared CALL (mysql_com.h)
+#define OUT_PARAMS_MIN_VERSION 50503
+#ifndef SERVER_PS_OUT_PARAMS
+#define SERVER_PS_OUT_PARAMS 4096
+#endif
+#ifndef CLIENT_PS_MULTI_RESULTS
+#define CLIENT_PS_MULTI_RESULTS (1UL << 18)
+#endif
+
+// Result set string columns are bound to buffers sized for the longest value in the result, up to
+// RESULT_BUF_MAX; anything longer is read with mysql_stmt_fetch_column, RESULT_CHUNK bytes at a time
+#define RESULT_BUF_MAX    8192
+#define RESULT_CHUNK      65536
+#define RESULT_ARENA_KEEP 262144 // result buffers that had to grow past this are freed after the query
+
 using namespace std;
+
+pthread_mutex_t CNHDBAccess::s_metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+map<string, sp_metrics> CNHDBAccess::s_metrics;
+uint64_t CNHDBAccess::s_slow_call_us = (uint64_t)DB_SLOW_CALL_MS * 1000;
+unsigned int CNHDBAccess::s_timeout_secs = DB_TIMEOUT_SECS;
+
 string itos(int n);
 
 CNHDBAccess::CNHDBAccess(string server, string username, string password, string database, CLogging *log)
@@ -48,6 +94,11 @@ CNHDBAccess::CNHDBAccess(string server, string username, string password, string
   CNHDBAccess::server   = server; 
   CNHDBAccess::log      = log; 
   connected = false;
+  stmt_cache_thread_id = 0;
+  out_params_enabled = true;
+  server_out_params = false;
+  writer = NULL;
+  breaker = CNHDBBreaker::get(server, username, password, database);
   pthread_mutex_init (&mysql_mutex, NULL);
 }
 
@@ -55,315 +106,600 @@ CNHDBAccess::~CNHDBAccess()
 {
   if (connected)
     dbDisconnect();
+  clear_statements();
+  CNHDBBreaker::put(breaker);
 }
     
 int CNHDBAccess::dbConnect()
 {
-  log->dbg("DB", "Connecting to MySQL");
+  if (!breaker->available())
+  {
+    NH_LOG_WARN(log, "DB", "Not connecting to MySQL - server unavailable");
+    return DB_ERR_UNAVAILABLE;
+  }
+
+  NH_LOG_INFO(log, "DB", "Connecting to MySQL");
   
+  // (not while another thread - e.g. a message handler worker - is part way through an SP call)
+  pthread_mutex_lock(&mysql_mutex);
+  clear_statements();
   if (mysql_init(&mysql) != NULL)
     connected = true;
   
   my_bool reconnect = 1; 
   mysql_options(&mysql, MYSQL_OPT_RECONNECT, &reconnect);
+
+  // Without these, a server that's stopped answering blocks the caller indefinitely
+  if (s_timeout_secs > 0)
+  {
+    mysql_options(&mysql, MYSQL_OPT_CONNECT_TIMEOUT, &s_timeout_secs);
+    mysql_options(&mysql, MYSQL_OPT_READ_TIMEOUT, &s_timeout_secs);
+    mysql_options(&mysql, MYSQL_OPT_WRITE_TIMEOUT, &s_timeout_secs);
+  }
   
-  
-  if (!mysql_real_connect(&mysql,server.c_str(),username.c_str(),password.c_str(),database.c_str(),0,0,CLIENT_MULTI_RESULTS))
+  if (!mysql_real_connect(&mysql,server.c_str(),username.c_str(),password.c_str(),database.c_str(),0,0,CLIENT_MULTI_RESULTS | CLIENT_PS_MULTI_RESULTS))
   {
-    log->dbg("DB", "Error connecting to MySQL:" + (string)mysql_error(&mysql));
+    unsigned int err = mysql_errno(&mysql);
+
+    NH_LOG_ERROR(log, "DB", "Error connecting to MySQL:" + (string)mysql_error(&mysql));
+    mysql_close(&mysql); // (so it can be tried again)
     connected = false;
+    pthread_mutex_unlock(&mysql_mutex);
+    if (lost_connection(err))
+    {
+      breaker->failed(log);
+      return DB_ERR_UNAVAILABLE;
+    }
     return -1;
   }
   
+  pthread_mutex_unlock(&mysql_mutex);
+  breaker->succeeded(log);
   return 0;
 }
 
 void CNHDBAccess::dbDisconnect()
 {
+  pthread_mutex_lock(&mysql_mutex);
+  clear_statements();
   mysql_close(&mysql);
   connected = false;
+  pthread_mutex_unlock(&mysql_mutex);
   return;
 }
 
+int CNHDBAccess::ping()
+{
+  int ret;
+
+  if (!connected)
+    return -1;
+
+  pthread_mutex_lock(&mysql_mutex);
+  ret = mysql_ping(&mysql);
+  pthread_mutex_unlock(&mysql_mutex);
+
+  return ret ? -1 : 0;
+}
+
+void CNHDBAccess::set_out_params(bool enable)
+{
+  pthread_mutex_lock(&mysql_mutex);
+  out_params_enabled = enable;
+  clear_statements(); // prepared for the other way
+  pthread_mutex_unlock(&mysql_mutex);
+}
+
+int CNHDBAccess::begin_transaction()
+/* Until commit() or rollback(), SP calls are all or nothing (if it's the same connection throughout -
+ * a reconnect ends the transaction, so check thread_id() before committing) */
+{
+  int ret = 0;
+
+  pthread_mutex_lock(&mysql_mutex);
+  if (!connected || mysql_autocommit(&mysql, 0))
+  {
+    NH_LOG_ERROR(log, "DB", "Failed to start transaction: " + (string)mysql_error(&mysql));
+    ret = -1;
+  }
+  pthread_mutex_unlock(&mysql_mutex);
+
+  return ret;
+}
+
+int CNHDBAccess::commit()
+{
+  int ret = 0;
+
+  pthread_mutex_lock(&mysql_mutex);
+  if (!connected || mysql_commit(&mysql))
+  {
+    NH_LOG_ERROR(log, "DB", "Commit failed: " + (string)mysql_error(&mysql));
+    ret = -1;
+  }
+  if (connected)
+    mysql_autocommit(&mysql, 1);
+  pthread_mutex_unlock(&mysql_mutex);
+
+  return ret;
+}
+
+int CNHDBAccess::rollback()
+{
+  int ret = 0;
+
+  pthread_mutex_lock(&mysql_mutex);
+  if (!connected || mysql_rollback(&mysql))
+    ret = -1;
+  if (connected)
+    mysql_autocommit(&mysql, 1);
+  pthread_mutex_unlock(&mysql_mutex);
+
+  return ret;
+}
+
+unsigned long CNHDBAccess::thread_id()
+{
+  unsigned long id;
+
+  pthread_mutex_lock(&mysql_mutex);
+  id = connected ? mysql_thread_id(&mysql) : 0;
+  pthread_mutex_unlock(&mysql_mutex);
+
+  return id;
+}
+
 // {AUTOGENERATED-SP-CALLS}
  
-int CNHDBAccess::exec_sp (string sp_name, int param_dir[], int param_type[], void **param_value, int param_length[], int param_count, dbrows *rs)
+int CNHDBAccess::exec_sp (string sp_name, const int param_dir[], const int param_type[], void **param_value, const int param_length[], int param_count, CDBResult *rs,
+                          row_callback row_cb, void *cb_obj, bool unbuffered)
+/* run_sp(), timed */
 {
+  uint64_t start_us = monotonic_us();
+  uint64_t total_us;
+  sp_metrics *metrics;
+  int ret;
+
+  memset(&call_timing, 0, sizeof(call_timing));
+
+  // Don't wait on a server that's known to be down
+  if (!breaker->available())
+  {
+    if (rs != NULL)
+      rs->clear();
+    metrics = metrics_for(sp_name);
+    metrics->calls.fetch_add(1, memory_order_relaxed);
+    metrics->errors.fetch_add(1, memory_order_relaxed);
+    NH_LOG_DEBUG(log, "DB", "exec " + sp_name + "> server unavailable");
+    return DB_ERR_UNAVAILABLE;
+  }
+
+  ret = run_sp(sp_name, param_dir, param_type, param_value, param_length, param_count, rs, row_cb, cb_obj, unbuffered);
+  total_us = monotonic_us() - start_us;
+
+  if (ret == 0)
+    breaker->succeeded(log);
+  else if ((ret == -1) && lost_connection(call_timing.err ? call_timing.err : (connected ? mysql_errno(&mysql) : 0)))
+  {
+    breaker->failed(log);
+    ret = DB_ERR_UNAVAILABLE;
+  }
+
+  // (the statement's metrics, unless it failed before getting that far)
+  metrics = (call_timing.metrics != NULL) ? call_timing.metrics : metrics_for(sp_name);
+  metrics->calls.fetch_add(1, memory_order_relaxed);
+  metrics->rows.fetch_add(call_timing.rows, memory_order_relaxed);
+  if (ret)
+    metrics->errors.fetch_add(1, memory_order_relaxed);
+  metrics->execute.record(call_timing.execute_us);
+  metrics->fetch.record(total_us - call_timing.prepare_us - call_timing.execute_us);
+
+  if ((s_slow_call_us > 0) && (total_us >= s_slow_call_us))
+  {
+    metrics->slow.fetch_add(1, memory_order_relaxed);
+    NH_LOGF_WARN(log, "DB", "Slow call: {\"sp\":\"%s\",\"params\":%d,\"rows\":%u,\"ret\":%d,\"total_us\":%llu,\"prepare_us\":%llu,\"execute_us\":%llu,\"fetch_us\":%llu}",
+                 sp_name.c_str(), param_count, call_timing.rows, ret, (unsigned long long)total_us, (unsigned long long)call_timing.prepare_us,
+                 (unsigned long long)call_timing.execute_us, (unsigned long long)(total_us - call_timing.prepare_us - call_timing.execute_us));
+  }
+
+  return ret;
+}
+
+int CNHDBAccess::run_sp (string sp_name, const int param_dir[], const int param_type[], void **param_value, const int param_length[], int param_count, CDBResult *rs,
+                         row_callback row_cb, void *cb_obj, bool unbuffered)
+{
+  sp_statement  *sps;
   MYSQL_STMT    *stmt;
-  string        myQuery;
-  
-  MYSQL_BIND    *bind;
-  my_bool       *is_null;
-  my_bool       *error;
-  unsigned long *length; 
-  
-  void          *buf[param_count];
-  
+  CDBResult      row_rs; // holds just the current row, with row_cb
   int count;
+  int status;
+  bool retried = false;
+  bool got_rs;
+  uint64_t exec_us;
   
   if (!connected)
   {
-    log->dbg("DB", "exec " + sp_name + "> Not connected to MySQL!");
-    return -1;
+    NH_LOG_ERROR(log, "DB", "exec " + sp_name + "> Not connected to MySQL!");
+    return DB_ERR_UNAVAILABLE;
   }
-  bind    = (MYSQL_BIND*) malloc(sizeof(MYSQL_BIND) * param_count);
-  is_null = (my_bool*) malloc(sizeof(my_bool) * param_count);
-  error   = (my_bool*) malloc(sizeof(my_bool) * param_count);
-  length  = (unsigned long*) malloc(sizeof(unsigned long) * param_count);
-  
-  memset(bind, 0,sizeof(MYSQL_BIND) * param_count);
-  memset(is_null, 0,sizeof(my_bool) * param_count);
-  memset(error, 0,sizeof(my_bool) * param_count);
-  memset(length, 0,sizeof(unsigned long) * param_count);
-  memset(buf, 0, sizeof(buf));
+
+  if (row_cb != NULL)
+    rs = &row_rs;
+  else
+    unbuffered = false;
+
+  if (rs != NULL)
+    rs->clear();
+
+  // MYSQL_OPT_RECONNECT may have reconnected since the statements were prepared (possibly to a
+  // different server)
+  if (mysql_thread_id(&mysql) != stmt_cache_thread_id)
+  {
+    clear_statements();
+    server_out_params = (mysql_get_server_version(&mysql) >= OUT_PARAMS_MIN_VERSION);
+  }
+
+exec_sp_retry:
+  call_timing.err = 0;
+  sps = get_statement(sp_name, param_dir, param_type, param_length, param_count);
+  if (sps == NULL)
+    return -1;
+  stmt = sps->call;
+  call_timing.metrics = sps->metrics;
 
   count = 0;
   for (int n=0; n < param_count; n++)
   {
-    if (param_dir[n] == P_DIR_IN)
+    if ((param_dir[n] != P_DIR_IN) && !sps->out_params)
+      continue;
+
+    if (param_dir[n] == P_DIR_OUT)
     {
-      if (param_type[n] == P_TYPE_VARCHAR)
-      {
-        bind[count].buffer_type= MYSQL_TYPE_STRING;
-        bind[count].buffer= (char *)  (((string*)(param_value[n]))->c_str());
-        bind[count].buffer_length= (((string*)(param_value[n]))->length());
-        bind[count].is_null= 0;      
-      } else if (param_type[n] == P_TYPE_INT)
-      {
-        bind[count].buffer_type= MYSQL_TYPE_LONG;
-        bind[count].buffer= (char *) param_value[n];
-        bind[count].buffer_length= 0; //param_length[n];
-        bind[count].is_null= 0;      
-      } else if (param_type[n] == P_TYPE_FLOAT)
-      {
-        bind[count].buffer_type= MYSQL_TYPE_FLOAT;
-        bind[count].buffer= (char *) param_value[n];
-        bind[count].buffer_length= 0; //param_length[n];
-        bind[count].is_null= 0;      
-      } else if (param_type[n] == P_TYPE_TIMESTAMP)
-      {
-        bind[count].buffer_type= MYSQL_TYPE_TIMESTAMP;
-        bind[count].buffer= (char *) param_value[n];
-        bind[count].buffer_length= 4;
-        bind[count].is_null= 0;
-      }
-      count++;      
+      // Just a placeholder - the value comes back in the OUT params result set
+      sps->in_bind[count].buffer_type= MYSQL_TYPE_NULL;
+      sps->in_bind[count].buffer= NULL;
+      sps->in_bind[count].buffer_length= 0;
+    } else if (param_type[n] == P_TYPE_VARCHAR)
+    {
+      sps->in_bind[count].buffer_type= MYSQL_TYPE_STRING;
+      sps->in_bind[count].buffer= (char *)  (((string*)(param_value[n]))->c_str());
+      sps->in_bind[count].buffer_length= (((string*)(param_value[n]))->length());
+      sps->in_bind[count].is_null= 0;      
+    } else if (param_type[n] == P_TYPE_INT)
+    {
+      sps->in_bind[count].buffer_type= MYSQL_TYPE_LONG;
+      sps->in_bind[count].buffer= (char *) param_value[n];
+      sps->in_bind[count].buffer_length= 0; //param_length[n];
+      sps->in_bind[count].is_null= 0;      
+    } else if (param_type[n] == P_TYPE_FLOAT)
+    {
+      sps->in_bind[count].buffer_type= MYSQL_TYPE_FLOAT;
+      sps->in_bind[count].buffer= (char *) param_value[n];
+      sps->in_bind[count].buffer_length= 0; //param_length[n];
+      sps->in_bind[count].is_null= 0;      
+    } else if (param_type[n] == P_TYPE_TIMESTAMP)
+    {
+      sps->in_bind[count].buffer_type= MYSQL_TYPE_TIMESTAMP;
+      sps->in_bind[count].buffer= (char *) param_value[n];
+      sps->in_bind[count].buffer_length= 4;
+      sps->in_bind[count].is_null= 0;
     }
+    count++;      
   }
   
-  stmt = mysql_stmt_init(&mysql);
-  if (!stmt)
-    goto exec_sp_exit_fail;    
-  
-  myQuery = "call " + sp_name + "(";
-  for (int n=0; n < param_count; n++)
-  {
-    if (param_dir[n] == P_DIR_IN)
-      myQuery += "?";
-    else
-      myQuery += "@" + itos(n);
-    
-    if (n < (param_count-1))
-      myQuery += ",";
-  }
-  myQuery += ")";
-  
-  log->dbg("DB", "SQL = [" + myQuery + "]");
-  
-  if (mysql_stmt_prepare(stmt, myQuery.c_str(), myQuery.length()))
-  {
-    log->dbg("DB", "mysql_stmt_prepare failed: " + (string)mysql_error(&mysql));
-    log->dbg("DB", "sql = [" + myQuery + "]"); 
-    goto exec_sp_exit_fail;    
-  }  
-  
-  if (mysql_stmt_bind_param(stmt, bind))
+  if (mysql_stmt_bind_param(stmt, sps->in_bind))
   {
-    log->dbg("DB", "mysql_stmt_bind_param failed: " + (string)mysql_error(&mysql));
-    mysql_stmt_close(stmt);
-    goto exec_sp_exit_fail;    
+    NH_LOG_ERROR(log, "DB", "mysql_stmt_bind_param failed: " + (string)mysql_stmt_error(stmt));
+    clear_statements();
+    return -1;
   }
+
+  // Any OUT param the SP doesn't set comes back as 0 / ""
+  for (int n=0; n < param_count; n++)
+    if (sps->out_buf[n] != NULL)
+      memset(sps->out_buf[n], 0, (param_type[n] == P_TYPE_VARCHAR) ? param_length[n]+1 : sizeof(long));
  
-  if (mysql_stmt_execute(stmt))
+  exec_us = monotonic_us();
+  status = mysql_stmt_execute(stmt);
+  call_timing.execute_us += monotonic_us() - exec_us;
+  if (status)
   {
-    log->dbg("DB", "mysql_stmt_execute error: " + (string)mysql_error(&mysql));
-    mysql_stmt_close(stmt);
-    goto exec_sp_exit_fail;
+    unsigned int err = mysql_stmt_errno(stmt);
+
+    call_timing.err = err;
+    NH_LOG_ERROR(log, "DB", "mysql_stmt_execute error: " + (string)mysql_stmt_error(stmt));
+    clear_statements();
+
+    // The statement didn't get as far as running, so it's safe to prepare it again and retry (the
+    // prepare reconnects if the connection has gone)
+    if (stale_statement(err) && !retried)
+    {
+      NH_LOG_WARN(log, "DB", "Prepared statements no longer valid - retrying " + sp_name);
+      retried = true;
+      goto exec_sp_retry;
+    }
+    return -1;
   }
-  //Check for a result set 
-  if (mysql_more_results(&mysql))
-  { 
-    if (rs == NULL)
-      log->dbg("DB", "Result set returned, but no dbrows object passed in!");
-    else
+
+  // The first result set from the SP (if any) goes into rs. With out_params, the OUT params come next
+  // as a result set of their own, flagged by SERVER_PS_OUT_PARAMS. Then there's the status result that
+  // every CALL ends with. All of them have to be read before the statement can be used again.
+  got_rs = false;
+  do
+  {
+    if (mysql_stmt_field_count(stmt) == 0)
+      continue;
+
+    if (sps->out_params && (mysql.server_status & SERVER_PS_OUT_PARAMS))
     {
-      if (process_results(stmt, rs))
+      if (fetch_out_params(stmt, sps, param_dir, param_type, param_value))
       {
-        mysql_stmt_close(stmt);
-        goto exec_sp_exit_fail;
+        clear_statements();
+        return -1;
       }
-      else
+    }
+    else
+    {
+      if (got_rs)
+        NH_LOG_DEBUG(log, "DB", "Cleared additional result set...");
+      else if (rs == NULL)
+        NH_LOG_WARN(log, "DB", "Result set returned, but no CDBResult object passed in!");
+      else if (process_results(stmt, rs, row_cb, cb_obj, unbuffered))
       {
-        while (!mysql_next_result(&mysql))
-          log->dbg("Cleared additional result set...");
+        clear_statements();
+        return -1;
       }
+      got_rs = true;
     }
+    mysql_stmt_free_result(stmt);
+  } while ((status = mysql_stmt_next_result(stmt)) == 0);
+
+  if (status > 0)
+  {
+    call_timing.err = mysql_stmt_errno(stmt);
+    NH_LOG_ERROR(log, "DB", "mysql_stmt_next_result error: " + (string)mysql_stmt_error(stmt));
+    clear_statements();
+    return -1;
   }
   
-  /* TODO: check for any additional result sets (just clear them if present) */
-  
-  mysql_stmt_close(stmt);
-  
-  // If there aren't ant output parameters for the SP, then return success now
-  count = 0;
-  for (int x=0; x < param_count; x++)
-    if (param_dir[x] != P_DIR_IN)
-      count++; 
-  if (!count)
-  {
-    free(bind);  
-    free(is_null);
-    free(error);  
-    free(length);    
+  // If there aren't any output parameters for the SP (or they've been read already), then return success now
+  if (sps->select_out == NULL)
     return 0;
-  }
   
-  // Now get any outputs from the SP
-  memset(bind, 0,sizeof(MYSQL_BIND) * param_count);
-  stmt = mysql_stmt_init(&mysql);
-  if (!stmt)
-    goto exec_sp_exit_fail;   
-  
-  myQuery = "select ";
-  for (int n=0; n < param_count; n++)
+  // Otherwise, get them from the session variables the CALL left them in
+  stmt = sps->select_out;
+  exec_us = monotonic_us();
+  status = mysql_stmt_execute(stmt);
+  call_timing.execute_us += monotonic_us() - exec_us;
+  if (status)
   {
-    if (param_dir[n] != P_DIR_IN)
-    {
-      myQuery += "@" + itos(n);
-    
-      if (n < (param_count-1))
-        myQuery += ",";
-    }
-  }
-  
-  log->dbg("DB", "SQL = [" + myQuery + "]");  
+    call_timing.err = mysql_stmt_errno(stmt);
+    NH_LOG_ERROR(log, "DB", "mysql_stmt_execute error2: " + (string)mysql_stmt_error(stmt));
+    clear_statements();
+    return -1;
+  }  
 
-  if (mysql_stmt_prepare(stmt, myQuery.c_str(), myQuery.length()))
+  if (fetch_out_params(stmt, sps, param_dir, param_type, param_value))
   {
-    log->dbg("DB", "mysql_stmt_prepare failed2: " + (string)mysql_error(&mysql));
-    log->dbg("DB", "sql = [" + myQuery + "]");
-    goto exec_sp_exit_fail;
+    clear_statements();
+    return -1;
   }
  
-  if (mysql_stmt_execute(stmt))
-  {
-    log->dbg("DB", "mysql_stmt_execute error2: " + (string)mysql_error(&mysql));
-    mysql_stmt_close(stmt);
-    goto exec_sp_exit_fail;
-  }  
-  
-  count = 0;
-  for (int n=0; n < param_count; n++)
-  {
-    if (param_dir[n] != P_DIR_IN)
-    {  
-      if (param_type[n] == P_TYPE_VARCHAR)
-      {      
-        buf[n] = malloc(param_length[n]+1); // +1 for null term.
-        memset(buf[n], 0, param_length[n]+1);
-
-        bind[count].buffer_type= MYSQL_TYPE_STRING;
-        bind[count].buffer= buf[n];
-        bind[count].buffer_length= param_length[n];
-        bind[count].is_null= &is_null[n];
-        bind[count].length= &length[n];
-        bind[count].error= &error[n];
-      }
-      else if (param_type[n] == P_TYPE_INT)
-      {
-        buf[n] = malloc(sizeof(long));
-        memset(buf[n], 0, sizeof(long));
-        
-        bind[count].buffer_type= MYSQL_TYPE_LONG;
-        bind[count].buffer= buf[n];
-        bind[count].buffer_length= sizeof(long);
-        bind[count].is_null= &is_null[n];
-        bind[count].length= &length[n]; // 0
-        bind[count].error= &error[n];        
-      }
-      else if (param_type[n] == P_TYPE_FLOAT)
-      {
-		  buf[n] = malloc(sizeof(float));
-		  memset(buf[n], 0, sizeof(float));
-		  
-		  bind[count].buffer_type= MYSQL_TYPE_FLOAT;
-		  bind[count].buffer= buf[n];
-		  bind[count].buffer_length= sizeof(float);
-		  bind[count].is_null= &is_null[n];
-		  bind[count].length= &length[n]; // 0
-		  bind[count].error= &error[n];        
-      }
-      count++;
-    }
-  }
+  mysql_stmt_free_result(stmt); 
+  return 0;
+}
 
-  if (mysql_stmt_bind_result(stmt, bind))
+int CNHDBAccess::fetch_out_params(MYSQL_STMT *stmt, sp_statement *sps, const int param_dir[], const int param_type[], void **param_value)
+/* Read the OUT params result set (from the CALL or "select @n,...") into the caller's variables */
+{
+  if (mysql_stmt_bind_result(stmt, sps->out_bind))
   {
-    log->dbg("DB", "mysql_stmt_bind_result failed: " + (string)mysql_error(&mysql));
-    mysql_stmt_close(stmt);
-    goto exec_sp_exit_fail;
+    NH_LOG_ERROR(log, "DB", "mysql_stmt_bind_result failed: " + (string)mysql_stmt_error(stmt));
+    return -1;
   }
   
-  if (mysql_stmt_store_result(stmt))
-  {
-    log->dbg("DB", "mysql_stmt_store_result failed: " + (string)mysql_error(&mysql));
-    mysql_stmt_close(stmt);
-    goto exec_sp_exit_fail;
-  }  
-  
   while (!mysql_stmt_fetch(stmt))
   { 
-    for (int n=0; n < param_count; n++)
+    for (int n=0; n < sps->param_count; n++)
       if (param_dir[n] != P_DIR_IN)
       {  
         if (param_type[n] == P_TYPE_VARCHAR)    
-          *((string*)(param_value[n])) = (char*)buf[n];
+          *((string*)(param_value[n])) = (char*)sps->out_buf[n];
         
         if (param_type[n] == P_TYPE_INT)    
-          *((int*)(param_value[n])) = (*((long*)buf[n]));   
+          *((int*)(param_value[n])) = (*((long*)sps->out_buf[n]));   
         
         if (param_type[n] == P_TYPE_FLOAT)    
-          *((float*)(param_value[n])) = (*((float*)buf[n]));  
+          *((float*)(param_value[n])) = (*((float*)sps->out_buf[n]));  
       }    
-      
-    mysql_stmt_free_result(stmt); 
   }
- 
-  mysql_stmt_close(stmt); 
- 
-  // Free mysql output buffers
-  for (int n=0; n < param_count; n++)
-    if (param_dir[n] != P_DIR_IN)
-      if (buf[n]!=NULL) free(buf[n]);
-    
-  free(bind);  
-  free(is_null);
-  free(error);  
-  free(length);
+
   return 0;
-  
-  exec_sp_exit_fail:
-    // Free mysql output buffers
-    for (int n=0; n < param_count; n++)
-      if (param_dir[n] != P_DIR_IN)
-        if (buf[n]!=NULL) free(buf[n]);
+}
+
+CNHDBAccess::sp_statement *CNHDBAccess::get_statement(string sp_name, const int param_dir[], const int param_type[], const int param_length[], int param_count)
+/* Get the prepared statements for sp_name, preparing them if they're not cached */
+{
+  map<string, sp_statement*>::iterator i = stmt_cache.find(sp_name);
+  sp_statement *sps;
+  string myQuery;
+  int count;
+  uint64_t prepare_us;
+
+  if (i != stmt_cache.end())
+  {
+    if (i->second->param_count == param_count)
+      return i->second;
+    free_statement(i->second);
+    stmt_cache.erase(i);
+  }
+
+  prepare_us = monotonic_us();
+  sps = (sp_statement*) calloc(1, sizeof(sp_statement));
+  sps->metrics = metrics_for(sp_name);
+  sps->param_count = param_count;
+  sps->in_bind  = (MYSQL_BIND*   ) calloc(param_count + 1, sizeof(MYSQL_BIND));
+  sps->out_bind = (MYSQL_BIND*   ) calloc(param_count + 1, sizeof(MYSQL_BIND));
+  sps->out_buf  = (void**        ) calloc(param_count + 1, sizeof(void*));
+  sps->is_null  = (my_bool*      ) calloc(param_count + 1, sizeof(my_bool));
+  sps->error    = (my_bool*      ) calloc(param_count + 1, sizeof(my_bool));
+  sps->length   = (unsigned long*) calloc(param_count + 1, sizeof(unsigned long));
+
+  // OUT params are read into buffers bound once here, whichever way they come back
+  myQuery = "";
+  count = 0;
+  for (int n=0; n < param_count; n++)
+  {
+    if (param_dir[n] == P_DIR_IN)
+      continue;
+
+    myQuery += (myQuery == "") ? "select @" : ",@";
+    myQuery += itos(n);
+
+    if (param_type[n] == P_TYPE_VARCHAR)
+    {      
+      sps->out_buf[n] = calloc(1, param_length[n]+1); // +1 for null term.
+      sps->out_bind[count].buffer_type= MYSQL_TYPE_STRING;
+      sps->out_bind[count].buffer_length= param_length[n];
+    }
+    else if (param_type[n] == P_TYPE_INT)
+    {
+      sps->out_buf[n] = calloc(1, sizeof(long));
+      sps->out_bind[count].buffer_type= MYSQL_TYPE_LONG;
+      sps->out_bind[count].buffer_length= sizeof(long);
+    }
+    else if (param_type[n] == P_TYPE_FLOAT)
+    {
+      sps->out_buf[n] = calloc(1, sizeof(long));
+      sps->out_bind[count].buffer_type= MYSQL_TYPE_FLOAT;
+      sps->out_bind[count].buffer_length= sizeof(float);
+    }
+    sps->out_bind[count].buffer= sps->out_buf[n];
+    sps->out_bind[count].is_null= &sps->is_null[n];
+    sps->out_bind[count].length= &sps->length[n];
+    sps->out_bind[count].error= &sps->error[n];
+    count++;
+  }
+
+  sps->out_params = out_params_enabled && server_out_params && (myQuery != "");
+  if (sps->out_params)
+  {
+    sps->call = prepare(call_query(sp_name, param_dir, param_count, true));
+
+    // Shouldn't happen with a server that new, but something in between might not support it
+    if (sps->call == NULL)
+    {
+      NH_LOG_WARN(log, "DB", "Failed to prepare " + sp_name + " with OUT params as placeholders - reading them with \"select @n\" instead");
+      server_out_params = false;
+      sps->out_params = false;
+    }
+  }
+
+  if (!sps->out_params)
+  {
+    sps->call = prepare(call_query(sp_name, param_dir, param_count, false));
+    if ((sps->call != NULL) && (myQuery != ""))
+      sps->select_out = prepare(myQuery);
+
+    if ((sps->call == NULL) || ((myQuery != "") && (sps->select_out == NULL)))
+    {
+      free_statement(sps);
+      return NULL;
+    }
+  }
+
+  stmt_cache[sp_name] = sps;
+  stmt_cache_thread_id = mysql_thread_id(&mysql);
+
+  prepare_us = monotonic_us() - prepare_us;
+  call_timing.prepare_us += prepare_us;
+  sps->metrics->prepare.record(prepare_us);
+  return sps;
+}
+
+string CNHDBAccess::call_query(string sp_name, const int param_dir[], int param_count, bool out_params)
+/* "call sp_name(?,?,...)". Without out_params, OUT params go in session variables (@n) instead. */
+{
+  string query = "call " + sp_name + "(";
+
+  for (int n=0; n < param_count; n++)
+  {
+    if ((param_dir[n] == P_DIR_IN) || out_params)
+      query += "?";
+    else
+      query += "@" + itos(n);
     
-    free(bind);  
-    free(is_null);
-    free(error);  
-    free(length); 
-    return -1;
-  
+    if (n < (param_count-1))
+      query += ",";
+  }
+  query += ")";
+
+  return query;
+}
+
+MYSQL_STMT *CNHDBAccess::prepare(string query)
+{
+  MYSQL_STMT *stmt;
+
+  NH_LOGF_DEBUG(log, "DB", "SQL = [%s]", query.c_str());
+
+  stmt = mysql_stmt_init(&mysql);
+  if (!stmt)
+    return NULL;
+
+  if (mysql_stmt_prepare(stmt, query.c_str(), query.length()))
+  {
+    NH_LOG_ERROR(log, "DB", "mysql_stmt_prepare failed: " + (string)mysql_stmt_error(stmt));
+    NH_LOG_ERROR(log, "DB", "sql = [" + query + "]");
+    mysql_stmt_close(stmt);
+    return NULL;
+  }
+
+  // Have mysql_stmt_store_result() fill in max_length, so result buffers can be sized to fit
+  my_bool update_max_length = 1;
+  mysql_stmt_attr_set(stmt, STMT_ATTR_UPDATE_MAX_LENGTH, &update_max_length);
+
+  return stmt;
+}
+
+void CNHDBAccess::free_statement(sp_statement *sps)
+{
+  if (sps->call != NULL)
+    mysql_stmt_close(sps->call);
+  if (sps->select_out != NULL)
+    mysql_stmt_close(sps->select_out);
+
+  for (int n=0; n < sps->param_count; n++)
+    if (sps->out_buf[n] != NULL)
+      free(sps->out_buf[n]);
+
+  free(sps->in_bind);
+  free(sps->out_bind);
+  free(sps->out_buf);
+  free(sps->is_null);
+  free(sps->error);
+  free(sps->length);
+  free(sps);
+}
+
+void CNHDBAccess::clear_statements()
+{
+  for (map<string, sp_statement*>::iterator i = stmt_cache.begin(); i != stmt_cache.end(); ++i)
+    free_statement(i->second);
+  stmt_cache.clear();
+}
+
+bool CNHDBAccess::lost_connection(unsigned int err)
+/* True if a call failed because the server couldn't be reached, or stopped answering (including a
+ * read/write timeout, which is reported as the connection being lost) */
+{
+  return (err == CR_CONNECTION_ERROR) || (err == CR_CONN_HOST_ERROR) || (err == CR_SERVER_GONE_ERROR) || (err == CR_SERVER_LOST);
+}
+
+bool CNHDBAccess::stale_statement(unsigned int err)
+/* True if a statement failed because it (or its connection) has gone, before it was run */
+{
+  return (err == ER_UNKNOWN_STMT_HANDLER) || (err == CR_NO_PREPARE_STMT) || (err == CR_SERVER_GONE_ERROR);
 }
 
 
@@ -383,27 +719,32 @@ void CNHDBAccess::time_t2mysql(MYSQL_TIME *myTime, const time_t *cTime)
   myTime->second = ti.tm_sec;
 }
 
-int CNHDBAccess::process_results(MYSQL_STMT *stmt, dbrows *rs)
+int CNHDBAccess::process_results(MYSQL_STMT *stmt, CDBResult *rs, row_callback row_cb, void *cb_obj, bool unbuffered)
 {
   MYSQL_RES     *prepare_meta_result;  
-  MYSQL_BIND    *bind;
-  unsigned long *length;
-  my_bool       *is_null;
-  my_bool       *error;
-  
   int field_count;
+  int ret;
   
  //log->dbg("DB", "process_results> Processing result set");
   if (rs == NULL)
   {
-    log->dbg("DB", "process_results> ERROR - rs is null");
+    NH_LOG_ERROR(log, "DB", "process_results> ERROR - rs is null");
     return -1;
   }
   
   field_count = mysql_stmt_field_count(stmt); 
   if (field_count <= 0)
   {
-    log->dbg("DB", "process_results> Error - [" + itos(field_count) + "] fields in result set?!");
+    NH_LOG_ERROR(log, "DB", "process_results> Error - [" + itos(field_count) + "] fields in result set?!");
+    return -1;
+  }
+
+  // Read the whole result set in first, which gets the length of the longest value in each column.
+  // Unbuffered, rows are read from the server as they're fetched, and the buffers sized for the
+  // column instead (anything longer is still fetched in full by fetch_long_values()).
+  if (!unbuffered && mysql_stmt_store_result(stmt))
+  {
+    NH_LOG_ERROR(log, "DB", "mysql_stmt_store_result failed. error = " + (string)mysql_stmt_error(stmt));
     return -1;
   }
   
@@ -411,131 +752,260 @@ int CNHDBAccess::process_results(MYSQL_STMT *stmt, dbrows *rs)
   prepare_meta_result = mysql_stmt_result_metadata(stmt);
   if (!prepare_meta_result)
   {
-    log->dbg("DB", "mysql_stmt_result_metadata failed. error = " + (string)mysql_stmt_error(stmt));
+    NH_LOG_ERROR(log, "DB", "mysql_stmt_result_metadata failed. error = " + (string)mysql_stmt_error(stmt));
     return -1;
   }   
   
   field_count = mysql_num_fields(prepare_meta_result);
  //log->dbg("DB", "process_results> Field count: " + itos(field_count));
   if (field_count <= 0)
+  {
+    mysql_free_result(prepare_meta_result);
     return -1;  
+  }
   
-  // Allocate and initialise memory for bind buffers
-  bind    = (MYSQL_BIND*   )calloc(field_count, sizeof(MYSQL_BIND   ));
-  length  = (unsigned long*)calloc(field_count, sizeof(unsigned long));
-  is_null = (my_bool*      )calloc(field_count, sizeof(my_bool      ));
-  error   = (my_bool*      )calloc(field_count, sizeof(my_bool      ));
-  
-  get_results(stmt, rs, bind,length, is_null, error, field_count, prepare_meta_result);
-  
-  free(bind); 
-  free(length);
-  free(is_null);
-  free(error);
-  return 0;
-}
+  ret = get_results(stmt, rs, field_count, prepare_meta_result, row_cb, cb_obj);
+  mysql_free_result(prepare_meta_result);
 
+  // Keep the buffers for the next query - unless this one needed far more than usual
+  if (result_arena.capacity() > RESULT_ARENA_KEEP)
+    vector<char>().swap(result_arena);
+  if (result_long.capacity() > RESULT_ARENA_KEEP)
+    vector<char>().swap(result_long);
+
+  return ret;
+}
 
-int CNHDBAccess::get_results(MYSQL_STMT *stmt, dbrows *rs, MYSQL_BIND *bind, 
-                             unsigned long *length, my_bool *is_null, my_bool *error,
-                             int field_count, MYSQL_RES *prepare_meta_result)
+int CNHDBAccess::get_results(MYSQL_STMT *stmt, CDBResult *rs, int field_count, MYSQL_RES *prepare_meta_result, row_callback row_cb, void *cb_obj)
 {
-  int count = 0;
   int row_count, status;
   MYSQL_FIELD   *fields;
+  vector<unsigned long> buf_len(field_count);
+  vector<void*> buf(field_count);
+  size_t arena_len;
 
-  fields = mysql_fetch_field(prepare_meta_result);
-  while((fields = mysql_fetch_fields(prepare_meta_result)) && count < field_count)
+  fields = mysql_fetch_fields(prepare_meta_result);
+  if (fields == NULL)
+    return -1;
+
+  // Work out the buffer each column needs, so they can all be carved from result_arena in one go
+  result_bind.assign(field_count, MYSQL_BIND());
+  result_length.assign(field_count, 0);
+  result_is_null.assign(field_count, 0);
+  result_error.assign(field_count, 0);
+  memset(&result_bind[0], 0, field_count * sizeof(MYSQL_BIND));
+  arena_len = 0;
+  for (int i=0; i < field_count; i++)
   {
-    for (int i=0; i < field_count; i++)
+    switch(fields[i].type)
     {
-      switch(fields[i].type)
-      {
-        case MYSQL_TYPE_LONG:
-          bind[count].buffer_type = MYSQL_TYPE_LONG;
-          bind[count].buffer = (char *)malloc(sizeof(long));
-          bind[count].buffer_length = sizeof(long);
-          break;
-
-        case MYSQL_TYPE_FLOAT:
-          bind[count].buffer_type = MYSQL_TYPE_FLOAT;
-          bind[count].buffer = (char *)malloc(sizeof(float)); 
-          bind[count].buffer_length = sizeof(float);
-          break;
-
-        case MYSQL_TYPE_VAR_STRING:
-        case MYSQL_TYPE_STRING:
-          bind[count].buffer_type = MYSQL_TYPE_STRING;
-          bind[count].buffer = (char *)malloc(2000); //TODO: suitable value
-          bind[count].buffer_length = 2000;
-          break;
-
-        case MYSQL_TYPE_DATETIME:
-          bind[count].buffer_type = MYSQL_TYPE_DATETIME;
-          bind[count].buffer = (char *)malloc(sizeof(MYSQL_TIME));
-          bind[count].buffer_length = sizeof(MYSQL_TIME);
-          break;
-
-        default:
-          log->dbg("DB", "Error - unsupported datatype in result set (field [" + (string)fields[i].name + "]). Attempting to treat as string.");
-          bind[count].buffer_type = MYSQL_TYPE_STRING;
-          bind[count].buffer = (char *)malloc(2000); //TODO: suitable value
-          bind[count].buffer_length = 2000;
-          break;
-      }
-
-      bind[count].is_null= &is_null[count];
-      bind[count].length= &length[count];
-      bind[count].error= &error[count];  
-      count++;
+      case MYSQL_TYPE_LONG:
+        result_bind[i].buffer_type = MYSQL_TYPE_LONG;
+        buf_len[i] = sizeof(long);
+        break;
+
+      case MYSQL_TYPE_FLOAT:
+        result_bind[i].buffer_type = MYSQL_TYPE_FLOAT;
+        buf_len[i] = sizeof(float);
+        break;
+
+      case MYSQL_TYPE_DATETIME:
+        result_bind[i].buffer_type = MYSQL_TYPE_DATETIME;
+        buf_len[i] = sizeof(MYSQL_TIME);
+        break;
+
+      default:
+        NH_LOG_WARN(log, "DB", "Error - unsupported datatype in result set (field [" + (string)fields[i].name + "]). Attempting to treat as string.");
+        // fall through
+      case MYSQL_TYPE_VAR_STRING:
+      case MYSQL_TYPE_STRING:
+      case MYSQL_TYPE_BLOB:         // TEXT columns
+      case MYSQL_TYPE_MEDIUM_BLOB:
+      case MYSQL_TYPE_LONG_BLOB:
+        // max_length is the longest value actually in the result set (0 if they're all empty, or if
+        // the server didn't say), length the longest the column could hold
+        result_bind[i].buffer_type = MYSQL_TYPE_STRING;
+        buf_len[i] = (fields[i].max_length > 0) ? fields[i].max_length : fields[i].length;
+        if (buf_len[i] > RESULT_BUF_MAX)
+          buf_len[i] = RESULT_BUF_MAX;
+        buf_len[i]++; // room for the terminator
+        break;
     }
 
+    arena_len += (buf_len[i] + 7) & ~7UL; // keep each buffer aligned
   }
 
-  mysql_free_result(prepare_meta_result);
+  if (result_arena.size() < arena_len)
+    result_arena.resize(arena_len);
+
+  arena_len = 0;
+  for (int i=0; i < field_count; i++)
+  {
+    buf[i] = &result_arena[arena_len];
+    result_bind[i].buffer = buf[i];
+    result_bind[i].buffer_length = buf_len[i];
+    result_bind[i].is_null = &result_is_null[i];
+    result_bind[i].length = &result_length[i];
+    result_bind[i].error = &result_error[i];
+    arena_len += (buf_len[i] + 7) & ~7UL;
+  }
+
+  // (the names go with the metadata)
+  rs->set_columns(fields, field_count);
 
   /* Bind the result buffers */
-  if (mysql_stmt_bind_result(stmt, bind))
+  if (mysql_stmt_bind_result(stmt, &result_bind[0]))
   {
-    log->dbg("DB", "mysql_stmt_bind_result failed: [" + (string)mysql_stmt_error(stmt) + "]");
-    free_bind_buffers(bind, field_count);
+    NH_LOG_ERROR(log, "DB", "mysql_stmt_bind_result failed: [" + (string)mysql_stmt_error(stmt) + "]");
     return -1;
   }
 
   row_count = 0;
-  while ( !(status = mysql_stmt_fetch(stmt)) )
+  while (((status = mysql_stmt_fetch(stmt)) == 0) || (status == MYSQL_DATA_TRUNCATED))
   {
     row_count++;
-    get_row(rs, bind, field_count, fields);
+    if (fetch_long_values(stmt, field_count))
+      return -1;
+    rs->add_row(&result_bind[0]);
+
+    // Back to the bound buffers, if fetch_long_values() pointed any elsewhere
+    for (int i=0; i < field_count; i++)
+    {
+      result_bind[i].buffer = buf[i];
+      result_bind[i].buffer_length = buf_len[i];
+    }
+
+    if (row_cb != NULL)
+    {
+      int stop = row_cb(cb_obj, (*rs)[0]);
+
+      rs->clear_rows();
+      if (stop)
+      {
+        // (mysql_stmt_free_result() discards the rest)
+        NH_LOGF_DEBUG(log, "DB", "Stopped after row [%d]", row_count);
+        call_timing.rows += row_count;
+        return 0;
+      }
+    }
+  }
+  NH_LOGF_DEBUG(log, "DB", "Rowcount: [%d]", row_count);
+  call_timing.rows += row_count;
+
+  if (status != MYSQL_NO_DATA)
+  {
+    call_timing.err = mysql_stmt_errno(stmt);
+    NH_LOG_ERROR(log, "DB", "mysql_stmt_fetch failed: [" + (string)mysql_stmt_error(stmt) + "]");
+    return -1;
   }
-  log->dbg("DB", "Rowcount: [" + itos(row_count) + "]");
 
-  free_bind_buffers(bind, field_count);
   return 0;
 }
 
-int CNHDBAccess::get_row(dbrows *rs, MYSQL_BIND *bind, int field_count, MYSQL_FIELD *fields)
+int CNHDBAccess::fetch_long_values(MYSQL_STMT *stmt, int field_count)
+/* For any string in the row just fetched that was too long for its buffer, read the whole value into
+ * result_long and point its result_bind entry there (libmysql's copy of the binds still has the
+ * result_arena buffer, ready for the next row) */
 {
-  dbrow row;
-  
+  size_t long_len = 0;
+
+  for (int i=0; i < field_count; i++)
+    if ((result_bind[i].buffer_type == MYSQL_TYPE_STRING) && !result_is_null[i] && (result_length[i] >= result_bind[i].buffer_length))
+      long_len += result_length[i] + 1;
+
+  if (long_len == 0)
+    return 0;
+
+  if (result_long.size() < long_len)
+    result_long.resize(long_len);
+
+  long_len = 0;
   for (int i=0; i < field_count; i++)
   {
-    row[fields[i].name] = CDBValue(&bind[i]);
+    unsigned long value_len = result_length[i];
+    unsigned long offset;
+    char *value;
+
+    if ((result_bind[i].buffer_type != MYSQL_TYPE_STRING) || result_is_null[i] || (value_len < result_bind[i].buffer_length))
+      continue;
+
+    NH_LOGF_DEBUG(log, "DB", "Fetching %lu byte value for column %d in chunks", value_len, i);
+    value = &result_long[long_len];
+
+    // The start of it is in the bound buffer already (less the last byte, which is the terminator)
+    offset = result_bind[i].buffer_length - 1;
+    memcpy(value, result_bind[i].buffer, offset);
+    while (offset < value_len)
+    {
+      MYSQL_BIND chunk;
+      unsigned long chunk_len;
+      my_bool chunk_null;
+
+      memset(&chunk, 0, sizeof(chunk));
+      chunk.buffer_type = MYSQL_TYPE_STRING;
+      chunk.buffer = value + offset;
+      chunk.buffer_length = min((unsigned long)RESULT_CHUNK, value_len - offset) + 1;
+      chunk.length = &chunk_len;
+      chunk.is_null = &chunk_null;
+      if (mysql_stmt_fetch_column(stmt, &chunk, i, offset))
+      {
+        NH_LOG_ERROR(log, "DB", "mysql_stmt_fetch_column failed: [" + (string)mysql_stmt_error(stmt) + "]");
+        return -1;
+      }
+      offset += chunk.buffer_length - 1;
+    }
+    value[value_len] = '\0';
+
+    result_bind[i].buffer = value;
+    result_bind[i].buffer_length = value_len + 1;
+    long_len += value_len + 1;
   }
-  rs->push_back(row);
 
-  return 0;  
+  return 0;
 }
 
-void CNHDBAccess::free_bind_buffers(MYSQL_BIND *bind, int field_count)
+
+sp_metrics *CNHDBAccess::metrics_for(const string &sp_name)
+/* The (process wide) metrics for sp_name, created on first use. They're kept until exit (and map
+ * entries don't move), so the pointer can be held on to - it's looked up when a statement is
+ * prepared, not for every call. */
 {
-  for (int i=0; i < field_count; i++)
-  {
-    if (bind[i].buffer != NULL)
-      free(bind[i].buffer);
-  }
+  sp_metrics *metrics;
+
+  pthread_mutex_lock(&s_metrics_mutex);
+  map<string, sp_metrics>::iterator i = s_metrics.find(sp_name);
+  if (i == s_metrics.end())
+    i = s_metrics.emplace(piecewise_construct, forward_as_tuple(sp_name), forward_as_tuple(sp_name)).first;
+  metrics = &i->second;
+  pthread_mutex_unlock(&s_metrics_mutex);
+
+  return metrics;
 }
 
+string CNHDBAccess::metrics_json()
+{
+  stringstream ss;
+
+  pthread_mutex_lock(&s_metrics_mutex);
+  ss << "[";
+  for (map<string, sp_metrics>::iterator i = s_metrics.begin(); i != s_metrics.end(); ++i)
+    ss << ((i == s_metrics.begin()) ? "" : ",") << i->second.json();
+  ss << "]";
+  pthread_mutex_unlock(&s_metrics_mutex);
+
+  return ss.str();
+}
+
+void CNHDBAccess::set_slow_call_ms(unsigned int ms)
+{
+  s_slow_call_us = (uint64_t)ms * 1000;
+}
+
+void CNHDBAccess::set_deadlines(unsigned int timeout_secs, unsigned int breaker_failures, unsigned int breaker_cooldown_secs)
+{
+  s_timeout_secs = timeout_secs;
+  CNHDBBreaker::set_limits(breaker_failures, breaker_cooldown_secs, timeout_secs);
+}
 
 string itos(int n)
 {
@@ -4,10 +4,14 @@
 #include <stdlib.h>
 #include <map> 
 #include <list>
+#include <vector>
 #include <string>
 #include <time.h>
 #include "CLogging.h"
 #include "CDBValue.h"
+#include "CDBResult.h"
+#include "CMetrics.h"
+#include "CNHDBBreaker.h"
 
 
 #define P_DIR_IN 1
@@ -20,8 +24,13 @@
 #define P_TYPE_TEXT 4
 #define P_TYPE_TIMESTAMP 5
 
-typedef std::map<std::string, CDBValue>  dbrow; 
-typedef std::list<dbrow> dbrows;
+#define DB_SLOW_CALL_MS 1000 // default for set_slow_call_ms()
+
+// Returned by the sp_ functions (and exec_sp) when the server can't be reached, or didn't answer in
+// time - rather than -1, for any other error - so callers can take a degraded path
+#define DB_ERR_UNAVAILABLE -2
+
+class CNHDBWriter;
 
     
 class CNHDBAccess
@@ -31,18 +40,99 @@ class CNHDBAccess
     ~CNHDBAccess();
     int dbConnect();
     void dbDisconnect();
-    int exec_sp (std::string sp_name, int param_dir[], int param_type[], void **param_value, int param_length[], int param_count, dbrows *rs);
+    int ping();            // 0 if the server's still there
+    bool is_connected() { return connected; };
+    // The SP's result set goes into rs - or, with row_cb, each row is passed to row_cb as it's fetched
+    // instead, so only one row's in memory at a time. unbuffered (only with row_cb) also skips reading
+    // the whole result set from the server first; the connection's then tied up until the last row
+    // has been passed on, so keep row_cb quick. row_cb mustn't use this connection.
+    int exec_sp (std::string sp_name, const int param_dir[], const int param_type[], void **param_value, const int param_length[], int param_count, CDBResult *rs,
+                 row_callback row_cb=NULL, void *cb_obj=NULL, bool unbuffered=false);
+    void set_out_params(bool enable); // false to always read OUT params with a separate "select @n,..."
+    void set_writer(CNHDBWriter *w) { writer = w; }; // where async SP calls are queued (NULL to run them straight away)
+    int begin_transaction();
+    int commit();
+    int rollback();
+    unsigned long thread_id(); // changes if the connection's been remade
     void time_t2mysql(MYSQL_TIME *myTime, const time_t *cTime);
+
+    // Every call is timed (prepare, execute, and fetching the results) into per-SP histograms shared
+    // by all the connections in the process. Calls taking at least slow_call_ms (0 = never) are also
+    // logged, as JSON, with the timings.
+    static std::string metrics_json();
+    static void set_slow_call_ms(unsigned int ms);
+
+    // Connecting, and each read/write of a call, gives up after timeout_secs (0 = wait forever). After
+    // breaker_failures calls in a row fail like that (see CNHDBBreaker), calls to the server return
+    // DB_ERR_UNAVAILABLE straight away until a retry every breaker_cooldown_secs succeeds. Applies to
+    // connections made after it's called.
+    static void set_deadlines(unsigned int timeout_secs, unsigned int breaker_failures, unsigned int breaker_cooldown_secs);
+    bool available() { return breaker->available(); }; // false while the breaker's open
     
 // {AUTOGENERATED-SP-DEFINITIONS}
     
   private:
-      int process_results(MYSQL_STMT *stmt, dbrows *rs);
-      int get_results(MYSQL_STMT *stmt, dbrows *rs, MYSQL_BIND *bind, 
-                      unsigned long *length, my_bool *is_null, my_bool *error,
-                      int field_count, MYSQL_RES *prepare_meta_result);
-      int get_row(dbrows *rs, MYSQL_BIND *bind, int field_count, MYSQL_FIELD *fields);
-      void free_bind_buffers(MYSQL_BIND *bind, int field_count);
+      // A stored procedure's prepared statements and bind arrays, kept for its next call. They're
+      // only valid on the connection they were prepared on, so are dropped on reconnect.
+      struct sp_statement
+      {
+        MYSQL_STMT *call;        // "call sp_name(?,?,?...)", or "call sp_name(?,?,@2...)" without out_params
+        MYSQL_STMT *select_out;  // "select @2,..." for the OUT params (NULL if there aren't any, or out_params)
+        bool out_params;         // OUT params come back from call, as a result set of their own
+        int param_count;
+        MYSQL_BIND *in_bind;     // pointed at the caller's values each call
+        MYSQL_BIND *out_bind;    // bound to out_buf, for whichever statement returns the OUT params
+        void **out_buf;
+        my_bool *is_null;
+        my_bool *error;
+        unsigned long *length;
+        sp_metrics *metrics;
+      };
+      std::map<std::string, sp_statement*> stmt_cache;
+      unsigned long stmt_cache_thread_id; // connection the cached statements belong to
+      bool out_params_enabled;            // set_out_params()
+      bool server_out_params;             // server can return OUT params with the CALL (MySQL >= 5.5.3)
+      CNHDBWriter *writer;
+      CNHDBBreaker *breaker;
+      static unsigned int s_timeout_secs;
+
+      // Timings for the call in progress, filled in by run_sp()
+      struct
+      {
+        sp_metrics *metrics;
+        uint64_t prepare_us;
+        uint64_t execute_us;
+        unsigned int rows;
+        unsigned int err;     // mysql_stmt_errno() of a failed execute/fetch
+      } call_timing;
+
+      static pthread_mutex_t s_metrics_mutex;
+      static std::map<std::string, sp_metrics> s_metrics;
+      static uint64_t s_slow_call_us;
+      static sp_metrics *metrics_for(const std::string &sp_name);
+
+      int run_sp (std::string sp_name, const int param_dir[], const int param_type[], void **param_value, const int param_length[], int param_count, CDBResult *rs,
+                  row_callback row_cb, void *cb_obj, bool unbuffered);
+      sp_statement *get_statement(std::string sp_name, const int param_dir[], const int param_type[], const int param_length[], int param_count);
+      MYSQL_STMT *prepare(std::string query);
+      void free_statement(sp_statement *sps);
+      void clear_statements();
+      static std::string call_query(std::string sp_name, const int param_dir[], int param_count, bool out_params);
+      int fetch_out_params(MYSQL_STMT *stmt, sp_statement *sps, const int param_dir[], const int param_type[], void **param_value);
+      static bool stale_statement(unsigned int err);
+      static bool lost_connection(unsigned int err);
+      int process_results(MYSQL_STMT *stmt, CDBResult *rs, row_callback row_cb, void *cb_obj, bool unbuffered);
+      int get_results(MYSQL_STMT *stmt, CDBResult *rs, int field_count, MYSQL_RES *prepare_meta_result, row_callback row_cb, void *cb_obj);
+      int fetch_long_values(MYSQL_STMT *stmt, int field_count);
+
+      // Result set bind buffers, kept from one query to the next (and only used under mysql_mutex)
+      std::vector<char> result_arena;     // the column buffers, sized to fit the result
+      std::vector<char> result_long;      // values too long for those, fetched in chunks
+      std::vector<MYSQL_BIND> result_bind;
+      std::vector<unsigned long> result_length;
+      std::vector<my_bool> result_is_null;
+      std::vector<my_bool> result_error;
+
       std::string server;
       std::string username;
       std::string password;
@@ -51,5 +141,7 @@ class CNHDBAccess
       MYSQL_RES *result; 
       CLogging *log;
       bool connected;
+      // Held for any use of mysql (the generated sp_ wrappers take it around exec_sp()), so one
+      // CNHDBAccess can be shared by threads - e.g. CNHmqtt's message handler workers
       pthread_mutex_t mysql_mutex;
 };
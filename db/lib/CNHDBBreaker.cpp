@@ -0,0 +1,228 @@
+#include "CNHDBBreaker.h"
+#include "CMetrics.h"
+#include <time.h>
+#include <sstream>
+
+using namespace std;
+
+pthread_mutex_t CNHDBBreaker::s_breakers_mutex = PTHREAD_MUTEX_INITIALIZER;
+map<string, CNHDBBreaker*> CNHDBBreaker::s_breakers;
+unsigned int CNHDBBreaker::s_max_failures = DB_BREAKER_FAILURES;
+uint64_t CNHDBBreaker::s_cooldown_us = (uint64_t)DB_BREAKER_COOLDOWN_SECS * 1000000;
+unsigned int CNHDBBreaker::s_timeout_secs = DB_TIMEOUT_SECS;
+
+CNHDBBreaker::CNHDBBreaker(string server, string username, string password, string database)
+{
+  _server = server;
+  _username = username;
+  _password = password;
+  _database = database;
+  _refs = 0;
+  _failures = 0;
+  _open_until = 0;
+  _probing = false;
+  _closed = false;
+  _trips = 0;
+  _probe_joinable = false;
+  _stopping = false;
+  pthread_mutex_init(&_probe_mutex, NULL);
+  pthread_cond_init(&_probe_cond, NULL);
+}
+
+CNHDBBreaker::~CNHDBBreaker()
+{
+  pthread_mutex_lock(&_probe_mutex);
+  _stopping = true;
+  pthread_cond_signal(&_probe_cond);
+  pthread_mutex_unlock(&_probe_mutex);
+
+  if (_probe_joinable)
+    pthread_join(_probe_thread, NULL);
+
+  pthread_mutex_destroy(&_probe_mutex);
+  pthread_cond_destroy(&_probe_cond);
+}
+
+CNHDBBreaker *CNHDBBreaker::get(string server, string username, string password, string database)
+{
+  string key = server + "\n" + username + "\n" + database;
+  CNHDBBreaker *breaker;
+
+  pthread_mutex_lock(&s_breakers_mutex);
+  map<string, CNHDBBreaker*>::iterator i = s_breakers.find(key);
+  if (i == s_breakers.end())
+  {
+    breaker = new CNHDBBreaker(server, username, password, database);
+    breaker->_key = key;
+    s_breakers[key] = breaker;
+  }
+  else
+    breaker = i->second;
+  breaker->_refs++;
+  pthread_mutex_unlock(&s_breakers_mutex);
+
+  return breaker;
+}
+
+void CNHDBBreaker::put(CNHDBBreaker *breaker)
+{
+  if (breaker == NULL)
+    return;
+
+  pthread_mutex_lock(&s_breakers_mutex);
+  if (--breaker->_refs > 0)
+  {
+    pthread_mutex_unlock(&s_breakers_mutex);
+    return;
+  }
+  s_breakers.erase(breaker->_key);
+  pthread_mutex_unlock(&s_breakers_mutex);
+
+  // (nothing else can be using it now, so no failed() can start another probe)
+  delete breaker;
+}
+
+void CNHDBBreaker::set_limits(unsigned int max_failures, unsigned int cooldown_secs, unsigned int timeout_secs)
+/* max_failures of 0 turns the breaker off */
+{
+  s_max_failures = max_failures;
+  s_cooldown_us = (uint64_t)((cooldown_secs > 0) ? cooldown_secs : 1) * 1000000;
+  s_timeout_secs = timeout_secs;
+}
+
+string CNHDBBreaker::json()
+{
+  stringstream ss;
+
+  pthread_mutex_lock(&s_breakers_mutex);
+  ss << "[";
+  for (map<string, CNHDBBreaker*>::iterator i = s_breakers.begin(); i != s_breakers.end(); ++i)
+  {
+    CNHDBBreaker *b = i->second;
+    ss << ((i == s_breakers.begin()) ? "" : ",")
+       << "{\"server\":" << json_string(b->_server)
+       << ",\"open\":" << (b->available() ? "false" : "true")
+       << ",\"failures\":" << b->_failures.load(memory_order_relaxed)
+       << ",\"trips\":" << b->_trips.load(memory_order_relaxed) << "}";
+  }
+  ss << "]";
+  pthread_mutex_unlock(&s_breakers_mutex);
+
+  return ss.str();
+}
+
+void CNHDBBreaker::failed(CLogging *log)
+{
+  unsigned int failures = _failures.fetch_add(1, memory_order_relaxed) + 1;
+
+  if ((s_max_failures == 0) || (failures < s_max_failures) || !available())
+    return;
+
+  // Only one thread gets to open it (and start the probe)
+  if (_probing.exchange(true))
+    return;
+
+  _open_until = monotonic_us() + s_cooldown_us;
+  _trips++;
+  _closed = false;
+  NH_LOGF_ERROR(log, "DB", "%s unavailable after %u consecutive failures - failing calls straight away until it can be reached again", _server.c_str(), failures);
+
+  // The last probe thread has finished (it clears _probing as it ends), but still needs joining
+  pthread_mutex_lock(&_probe_mutex);
+  if (_probe_joinable)
+    pthread_join(_probe_thread, NULL);
+  _probe_joinable = (pthread_create(&_probe_thread, NULL, &CNHDBBreaker::s_probe_thread, this) == 0);
+  pthread_mutex_unlock(&_probe_mutex);
+
+  if (!_probe_joinable)
+  {
+    // Nothing would close it again, so leave it closed
+    NH_LOG_ERROR(log, "DB", "Failed to start probe thread");
+    _open_until = 0;
+    _probing = false;
+  }
+}
+
+void *CNHDBBreaker::s_probe_thread(void *arg)
+{
+  ((CNHDBBreaker*)arg)->probe_thread();
+  return NULL;
+}
+
+void CNHDBBreaker::probe_thread()
+{
+  bool reachable = false;
+
+  mysql_thread_init();
+
+  pthread_mutex_lock(&_probe_mutex);
+  while (!_stopping)
+  {
+    uint64_t now = monotonic_us();
+    uint64_t until = _open_until.load(memory_order_relaxed);
+
+    if (now < until)
+    {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec  += (until - now) / 1000000;
+      ts.tv_nsec += ((until - now) % 1000000) * 1000;
+      if (ts.tv_nsec >= 1000000000L)
+      {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&_probe_cond, &_probe_mutex, &ts);
+      continue;
+    }
+
+    pthread_mutex_unlock(&_probe_mutex);
+    reachable = (probe() == 0);
+    pthread_mutex_lock(&_probe_mutex);
+
+    if (reachable)
+      break;
+
+    _open_until = monotonic_us() + s_cooldown_us;
+  }
+  pthread_mutex_unlock(&_probe_mutex);
+
+  if (reachable)
+  {
+    _failures = 0;
+    _closed = true;
+    _open_until = 0;
+  }
+  _probing = false;
+
+  mysql_thread_end();
+}
+
+void CNHDBBreaker::report_closed(CLogging *log)
+{
+  if (_closed.exchange(false))
+    NH_LOGF_INFO(log, "DB", "%s reachable again", _server.c_str());
+}
+
+int CNHDBBreaker::probe()
+/* Connect (on a connection of its own, with the same timeouts) and ping */
+{
+  MYSQL mysql;
+  int ret = -1;
+
+  if (mysql_init(&mysql) == NULL)
+    return -1;
+
+  if (s_timeout_secs > 0)
+  {
+    mysql_options(&mysql, MYSQL_OPT_CONNECT_TIMEOUT, &s_timeout_secs);
+    mysql_options(&mysql, MYSQL_OPT_READ_TIMEOUT, &s_timeout_secs);
+    mysql_options(&mysql, MYSQL_OPT_WRITE_TIMEOUT, &s_timeout_secs);
+  }
+
+  if (mysql_real_connect(&mysql, _server.c_str(), _username.c_str(), _password.c_str(), _database.c_str(), 0, 0, 0))
+    ret = mysql_ping(&mysql) ? -1 : 0;
+
+  mysql_close(&mysql);
+  return ret;
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <mysql/mysql.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include "CLogging.h"
+
+#define DB_TIMEOUT_SECS          5  // default for CNHDBAccess::set_deadlines()
+#define DB_BREAKER_FAILURES      3
+#define DB_BREAKER_COOLDOWN_SECS 10
+
+/* Circuit breaker for a database server, shared by every connection in the process to it. After
+ * max_failures consecutive calls have failed because the server couldn't be reached (or timed out),
+ * it opens: calls fail straight away instead of each waiting for the timeout, while a background
+ * thread tries connecting every cooldown_secs. Once that works, it closes again.
+ * The connections sharing it can each have their own log (e.g. under nh-host), so it doesn't keep
+ * one: the call that opens it logs that, and the first call to succeed after it closes logs that. */
+class CNHDBBreaker
+{
+  public:
+    // The breaker for this server/login, created on first use. Each get() needs a put(), and the
+    // breaker goes with the last one (after stopping its probe thread).
+    static CNHDBBreaker *get(std::string server, std::string username, std::string password, std::string database);
+    static void put(CNHDBBreaker *breaker);
+    static void set_limits(unsigned int max_failures, unsigned int cooldown_secs, unsigned int timeout_secs);
+    static std::string json(); // all of them, for STATUS DETAIL
+
+    bool available() { return (_open_until.load(std::memory_order_relaxed) == 0); };
+    void succeeded(CLogging *log)
+    {
+      _failures.store(0, std::memory_order_relaxed);
+      if (_closed.load(std::memory_order_relaxed))
+        report_closed(log);
+    };
+    void failed(CLogging *log);
+
+  private:
+    CNHDBBreaker(std::string server, std::string username, std::string password, std::string database);
+    ~CNHDBBreaker();
+
+    std::string _key;
+    std::string _server;
+    std::string _username;
+    std::string _password;
+    std::string _database;
+    unsigned int _refs;                   // get() calls not yet matched by put()
+    std::atomic<unsigned int> _failures;  // consecutive
+    std::atomic<uint64_t> _open_until;    // monotonic_us() of the next probe, 0 when closed
+    std::atomic<bool> _probing;
+    std::atomic<bool> _closed;            // by the probe thread, and not yet logged
+    std::atomic<uint64_t> _trips;
+
+    // Probe thread
+    pthread_t _probe_thread;
+    bool _probe_joinable;                 // started, and not yet joined
+    bool _stopping;
+    pthread_mutex_t _probe_mutex;
+    pthread_cond_t _probe_cond;           // signalled to stop it waiting for the next probe
+
+    static pthread_mutex_t s_breakers_mutex;
+    static std::map<std::string, CNHDBBreaker*> s_breakers;
+    static unsigned int s_max_failures;
+    static uint64_t s_cooldown_us;
+    static unsigned int s_timeout_secs;
+
+    static void *s_probe_thread(void *arg);
+    void probe_thread();
+    void report_closed(CLogging *log);
+    int probe();
+};
@@ -0,0 +1,228 @@
+#include "CNHDBPool.h"
+#include <sstream>
+
+using namespace std;
+
+pthread_mutex_t CNHDBPool::s_pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+map<string, CNHDBPool*> CNHDBPool::s_pools;
+
+CNHDBPool::CNHDBPool(string server, string username, string password, string database, CLogging *log, unsigned int max_size)
+{
+  _server = server;
+  _username = username;
+  _password = password;
+  _database = database;
+  _log = log;
+  _max_size = (max_size > 0) ? max_size : 1;
+  _count = 0;
+  _refs = 0;
+  _writer = NULL;
+  pthread_mutex_init(&_mutex, NULL);
+  pthread_cond_init(&_cond, NULL);
+}
+
+CNHDBPool::~CNHDBPool()
+{
+  if (!_held.empty())
+    NH_LOGF_WARN(_log, "DB", "Connection pool deleted with %u connection(s) still checked out", (unsigned int)_held.size());
+
+  // Drains the write-behind queue first
+  delete _writer;
+
+  for (unsigned int n=0; n < _idle.size(); n++)
+    delete _idle[n].db;
+  _idle.clear();
+
+  pthread_mutex_destroy(&_mutex);
+  pthread_cond_destroy(&_cond);
+}
+
+CNHDBPool *CNHDBPool::get_pool(string server, string username, string password, string database, CLogging *log, unsigned int max_size, unsigned int write_behind_ms)
+{
+  string key = server + "\n" + username + "\n" + password + "\n" + database;
+  CNHDBPool *pool;
+
+  pthread_mutex_lock(&s_pools_mutex);
+  map<string, CNHDBPool*>::iterator i = s_pools.find(key);
+  if (i == s_pools.end())
+  {
+    pool = new CNHDBPool(server, username, password, database, log, max_size);
+    pool->_key = key;
+    s_pools[key] = pool;
+  }
+  else
+  {
+    pool = i->second;
+
+    // Services sharing the pool may have asked for different sizes - go with the largest
+    pthread_mutex_lock(&pool->_mutex);
+    if (max_size > pool->_max_size)
+    {
+      pool->_max_size = max_size;
+      pthread_cond_broadcast(&pool->_cond);
+    }
+    pthread_mutex_unlock(&pool->_mutex);
+  }
+
+  if ((write_behind_ms > 0) && (pool->_writer == NULL))
+    pool->_writer = new CNHDBWriter(new CNHDBAccess(server, username, password, database, log), log, write_behind_ms);
+
+  pool->_refs++;
+  pthread_mutex_unlock(&s_pools_mutex);
+
+  return pool;
+}
+
+void CNHDBPool::put_pool(CNHDBPool *pool)
+{
+  if (pool == NULL)
+    return;
+
+  pthread_mutex_lock(&s_pools_mutex);
+  if (--pool->_refs > 0)
+  {
+    pthread_mutex_unlock(&s_pools_mutex);
+    return;
+  }
+  s_pools.erase(pool->_key);
+  pthread_mutex_unlock(&s_pools_mutex);
+
+  delete pool;
+}
+
+CNHDBAccess *CNHDBPool::checkout()
+{
+  pthread_t self = pthread_self();
+  CNHDBAccess *db;
+
+  pthread_mutex_lock(&_mutex);
+
+  map<pthread_t, held_conn>::iterator i = _held.find(self);
+  if (i != _held.end())
+  {
+    i->second.depth++;
+    db = i->second.db;
+    pthread_mutex_unlock(&_mutex);
+    return db;
+  }
+
+  while (_idle.empty() && (_count >= _max_size))
+    pthread_cond_wait(&_cond, &_mutex);
+
+  if (!_idle.empty())
+  {
+    idle_conn ic = _idle.back();
+    _idle.pop_back();
+    _held[self].db = ic.db;
+    _held[self].depth = 1;
+    ic.db->set_writer(_writer);
+    pthread_mutex_unlock(&_mutex);
+
+    health_check(ic.db, ic.last_used);
+    return ic.db;
+  }
+
+  // Make a new one - without holding the lock, as connecting can take a while
+  _count++;
+  pthread_mutex_unlock(&_mutex);
+
+  db = new CNHDBAccess(_server, _username, _password, _database, _log);
+  db->dbConnect();
+
+  pthread_mutex_lock(&_mutex);
+  db->set_writer(_writer);
+  _held[self].db = db;
+  _held[self].depth = 1;
+  NH_LOGF_DEBUG(_log, "DB", "Connection pool now has %u connection(s)", _count);
+  pthread_mutex_unlock(&_mutex);
+
+  return db;
+}
+
+void CNHDBPool::checkin(CNHDBAccess *db)
+{
+  pthread_mutex_lock(&_mutex);
+
+  map<pthread_t, held_conn>::iterator i = _held.find(pthread_self());
+  if ((i == _held.end()) || (i->second.db != db))
+  {
+    NH_LOG_ERROR(_log, "DB", "checkin() of a connection not held by this thread!");
+    pthread_mutex_unlock(&_mutex);
+    return;
+  }
+
+  if (--i->second.depth == 0)
+  {
+    idle_conn ic;
+
+    ic.db = db;
+    ic.last_used = time(NULL);
+    _held.erase(i);
+    _idle.push_back(ic);
+    pthread_cond_signal(&_cond);
+  }
+
+  pthread_mutex_unlock(&_mutex);
+}
+
+unsigned int CNHDBPool::size()
+{
+  unsigned int count;
+
+  pthread_mutex_lock(&_mutex);
+  count = _count;
+  pthread_mutex_unlock(&_mutex);
+
+  return count;
+}
+
+unsigned int CNHDBPool::in_use()
+{
+  unsigned int count;
+
+  pthread_mutex_lock(&_mutex);
+  count = _held.size();
+  pthread_mutex_unlock(&_mutex);
+
+  return count;
+}
+
+string CNHDBPool::json()
+{
+  stringstream ss;
+
+  pthread_mutex_lock(&_mutex);
+  ss << "{\"size\":" << _count << ",\"in_use\":" << _held.size();
+  pthread_mutex_unlock(&_mutex);
+
+  if (_writer != NULL)
+    ss << ",\"write_behind\":" << _writer->json();
+  ss << ",\"breakers\":" << CNHDBBreaker::json() << ",\"sps\":" << CNHDBAccess::metrics_json() << "}";
+
+  return ss.str();
+}
+
+void CNHDBPool::health_check(CNHDBAccess *db, time_t last_used)
+/* Called by the thread that's just checked db out, so nothing else is using it */
+{
+  // (calls fail straight away anyway - no point waiting on a reconnect or ping)
+  if (!db->available())
+    return;
+
+  if (!db->is_connected())
+  {
+    db->dbConnect();
+    return;
+  }
+
+  if ((time(NULL) - last_used) < DB_POOL_PING_SECS)
+    return;
+
+  // (MYSQL_OPT_RECONNECT means the ping itself reconnects if it can)
+  if (db->ping())
+  {
+    NH_LOG_WARN(_log, "DB", "Pooled connection failed ping - reconnecting");
+    db->dbDisconnect();
+    db->dbConnect();
+  }
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include "CNHDBAccess.h"
+#include "CNHDBWriter.h"
+#include <pthread.h>
+#include <time.h>
+#include <map>
+#include <vector>
+#include <string>
+
+#define DB_POOL_DEFAULT_SIZE 4
+#define DB_POOL_PING_SECS    60 // an idle connection is checked before reuse if it's not been used for this long
+
+/* A bounded set of database connections, shared by every thread (and every nh-host service) in the
+ * process using the same server/database/login. A thread checks a connection out for as long as it
+ * needs it, and has it to itself until it's checked back in; checkouts by a thread already holding
+ * one get the same connection, so nested calls can't deadlock waiting on the pool. Connections are
+ * made when first needed, and any that have been idle a while are pinged (and reconnected if that
+ * fails) before being handed out again. */
+class CNHDBPool
+{
+  public:
+    // The pool for these settings, created on first use. Each get_pool() needs a put_pool(), and the
+    // pool (and its connections) goes with the last one. A write_behind_ms > 0 gives the pool a
+    // CNHDBWriter (with a connection of its own), which the async SPs of its connections are queued to.
+    static CNHDBPool *get_pool(std::string server, std::string username, std::string password, std::string database,
+                               CLogging *log, unsigned int max_size=DB_POOL_DEFAULT_SIZE, unsigned int write_behind_ms=0);
+    static void put_pool(CNHDBPool *pool);
+
+    // Waits while all max_size connections are held by other threads. Never NULL, but it won't be
+    // connected if the server can't be reached - calls then fail as they would on any other error.
+    CNHDBAccess *checkout();
+    void checkin(CNHDBAccess *db);
+
+    unsigned int size();    // connections made so far
+    unsigned int in_use();  // of which checked out
+    std::string json();     // connection & write-behind counts, and per-SP timings, for STATUS DETAIL
+
+    // Holds a connection for the calling thread while in scope, e.g.
+    //   CNHDBPool::conn db(db_pool);
+    //   db->sp_log_event(...);
+    class conn
+    {
+      public:
+        conn(CNHDBPool *pool) { _pool = pool; _db = pool->checkout(); };
+        ~conn() { _pool->checkin(_db); };
+        CNHDBAccess *operator->() { return _db; };
+
+      private:
+        CNHDBPool *_pool;
+        CNHDBAccess *_db;
+
+        conn(const conn&);
+        conn &operator=(const conn&);
+    };
+
+  private:
+    CNHDBPool(std::string server, std::string username, std::string password, std::string database, CLogging *log, unsigned int max_size);
+    ~CNHDBPool();
+
+    struct idle_conn
+    {
+      CNHDBAccess *db;
+      time_t last_used;
+    };
+
+    struct held_conn
+    {
+      CNHDBAccess *db;
+      unsigned int depth; // nested checkouts by the thread holding it
+    };
+
+    std::string _key;
+    std::string _server;
+    std::string _username;
+    std::string _password;
+    std::string _database;
+    CLogging *_log;
+    unsigned int _max_size;
+    unsigned int _count;              // connections in existence (idle, held or being made)
+    unsigned int _refs;               // get_pool() calls not yet matched by put_pool()
+    std::vector<idle_conn> _idle;     // most recently used last, so the busiest stay warm
+    std::map<pthread_t, held_conn> _held;
+    CNHDBWriter *_writer;             // NULL unless write-behind's enabled
+    pthread_mutex_t _mutex;
+    pthread_cond_t _cond;
+
+    static pthread_mutex_t s_pools_mutex;
+    static std::map<std::string, CNHDBPool*> s_pools;
+
+    void health_check(CNHDBAccess *db, time_t last_used);
+};
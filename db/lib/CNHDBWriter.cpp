@@ -0,0 +1,305 @@
+#include "CNHDBWriter.h"
+#include "CMetrics.h"
+#include <time.h>
+#include <sstream>
+
+using namespace std;
+
+CNHDBWriter::CNHDBWriter(CNHDBAccess *db, CLogging *log, unsigned int max_delay_ms)
+{
+  _db = db;
+  _log = log;
+  _max_delay_us = (uint64_t)max_delay_ms * 1000;
+  _writing = 0;
+  _thread_started = false;
+  _thread_pid = 0;
+  _stopping = false;
+  _flush_requests = 0;
+  _queued = 0;
+  _written_count = 0;
+  _failed = 0;
+  _overflow = 0;
+  _batches = 0;
+  _last_batch = 0;
+  _max_batch = 0;
+  pthread_mutex_init(&_mutex, NULL);
+  pthread_cond_init(&_cond, NULL);
+  pthread_cond_init(&_written, NULL);
+}
+
+CNHDBWriter::~CNHDBWriter()
+{
+  stop();
+  delete _db;
+  pthread_mutex_destroy(&_mutex);
+  pthread_cond_destroy(&_cond);
+  pthread_cond_destroy(&_written);
+}
+
+int CNHDBWriter::enqueue(const char *sp_name, const int param_dir[], const int param_type[], void **param_value, const int param_length[], int param_count)
+{
+  list<queued_call> call(1);
+  queued_call &qc = call.front();
+
+  // Copy the params before taking the lock
+  qc.sp_name = sp_name;
+  qc.param_dir = param_dir;
+  qc.param_type = param_type;
+  qc.param_length = param_length;
+  qc.param_count = param_count;
+  qc.params.resize(param_count);
+  qc.done = false;
+  for (int n=0; n < param_count; n++)
+  {
+    if ((param_type[n] == P_TYPE_VARCHAR) || (param_type[n] == P_TYPE_TEXT))
+      qc.params[n].str = *((string*)param_value[n]);
+    else if (param_type[n] == P_TYPE_INT)
+      qc.params[n].i = *((int*)param_value[n]);
+    else if (param_type[n] == P_TYPE_FLOAT)
+      qc.params[n].f = *((float*)param_value[n]);
+    else if (param_type[n] == P_TYPE_TIMESTAMP)
+      qc.params[n].tim = *((MYSQL_TIME*)param_value[n]);
+  }
+
+  pthread_mutex_lock(&_mutex);
+
+  if (_stopping)
+  {
+    pthread_mutex_unlock(&_mutex);
+    return -1;
+  }
+
+  if (_queue.size() >= DB_WRITER_QUEUE)
+  {
+    _overflow++;
+    pthread_mutex_unlock(&_mutex);
+    return -1;
+  }
+
+  // Started here rather than when constructed, as it wouldn't survive daemonize()
+  if (!_thread_started || (_thread_pid != getpid()))
+  {
+    if (pthread_create(&_thread, NULL, &CNHDBWriter::s_writer_thread, this))
+    {
+      NH_LOG_ERROR(_log, "DB", "Failed to start write-behind thread");
+      pthread_mutex_unlock(&_mutex);
+      return -1;
+    }
+    _thread_started = true;
+    _thread_pid = getpid();
+  }
+
+  qc.queued_us = monotonic_us();
+  _queue.splice(_queue.end(), call);
+  _queued++;
+  // The thread waits without a timeout while the queue's empty, so wake it for the first call (it then
+  // waits until that's due, or there's a full batch)
+  if ((_queue.size() == 1) || (_queue.size() == DB_WRITER_BATCH))
+    pthread_cond_signal(&_cond);
+
+  pthread_mutex_unlock(&_mutex);
+  return 0;
+}
+
+void CNHDBWriter::flush()
+{
+  pthread_mutex_lock(&_mutex);
+  if (_thread_started)
+  {
+    _flush_requests++;
+    pthread_cond_signal(&_cond);
+    while (!_queue.empty() || (_writing > 0))
+      pthread_cond_wait(&_written, &_mutex);
+    _flush_requests--;
+  }
+  pthread_mutex_unlock(&_mutex);
+}
+
+void CNHDBWriter::stop()
+{
+  bool join;
+  unsigned int depth;
+
+  pthread_mutex_lock(&_mutex);
+  join = _thread_started && !_stopping;
+  depth = _queue.size() + _writing;
+  _stopping = true;
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_mutex);
+
+  // The thread writes everything still queued before it ends
+  if (join)
+  {
+    if (depth > 0)
+      NH_LOGF_INFO(_log, "DB", "Writing %u queued call(s) before stopping", depth);
+    pthread_join(_thread, NULL);
+  }
+}
+
+unsigned int CNHDBWriter::queue_depth()
+{
+  unsigned int depth;
+
+  pthread_mutex_lock(&_mutex);
+  depth = _queue.size() + _writing;
+  pthread_mutex_unlock(&_mutex);
+
+  return depth;
+}
+
+string CNHDBWriter::json()
+{
+  stringstream ss;
+
+  pthread_mutex_lock(&_mutex);
+  ss << "{\"queue\":" << (_queue.size() + _writing)
+     << ",\"queued\":" << _queued
+     << ",\"written\":" << _written_count
+     << ",\"failed\":" << _failed
+     << ",\"overflow\":" << _overflow
+     << ",\"batches\":" << _batches
+     << ",\"last_batch\":" << _last_batch
+     << ",\"max_batch\":" << _max_batch << "}";
+  pthread_mutex_unlock(&_mutex);
+
+  return ss.str();
+}
+
+void *CNHDBWriter::s_writer_thread(void *arg)
+{
+  ((CNHDBWriter*)arg)->writer_thread();
+  return NULL;
+}
+
+void CNHDBWriter::writer_thread()
+{
+  mysql_thread_init();
+
+  pthread_mutex_lock(&_mutex);
+  while (true)
+  {
+    if (_queue.empty())
+    {
+      if (_stopping)
+        break;
+      pthread_cond_wait(&_cond, &_mutex);
+      continue;
+    }
+
+    // Wait for a full batch, unless the oldest call is due (or everything's wanted now)
+    if ((_queue.size() < DB_WRITER_BATCH) && !_stopping && (_flush_requests == 0))
+    {
+      uint64_t due = _queue.front().queued_us + _max_delay_us;
+      uint64_t now = monotonic_us();
+
+      if (now < due)
+      {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec  += (due - now) / 1000000;
+        ts.tv_nsec += ((due - now) % 1000000) * 1000;
+        if (ts.tv_nsec >= 1000000000L)
+        {
+          ts.tv_sec++;
+          ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&_cond, &_mutex, &ts);
+        continue;
+      }
+    }
+
+    list<queued_call> batch;
+    list<queued_call>::iterator end = _queue.begin();
+    for (unsigned int n=0; (n < DB_WRITER_BATCH) && (end != _queue.end()); n++)
+      ++end;
+    batch.splice(batch.begin(), _queue, _queue.begin(), end);
+    _writing = batch.size();
+    pthread_mutex_unlock(&_mutex);
+
+    unsigned int failed = write_batch(batch);
+
+    pthread_mutex_lock(&_mutex);
+    _writing = 0;
+    _written_count += batch.size() - failed;
+    _failed += failed;
+    _batches++;
+    _last_batch = batch.size();
+    if (_last_batch > _max_batch)
+      _max_batch = _last_batch;
+    pthread_cond_broadcast(&_written);
+  }
+  pthread_mutex_unlock(&_mutex);
+
+  mysql_thread_end();
+}
+
+unsigned int CNHDBWriter::write_batch(list<queued_call> &batch)
+/* Returns how many of the calls failed */
+{
+  list<queued_call>::iterator i;
+  unsigned int failed = 0;
+  unsigned long tid;
+
+  if (!_db->is_connected())
+    _db->dbConnect();
+
+  if ((batch.size() > 1) && (_db->begin_transaction() == 0))
+  {
+    tid = _db->thread_id();
+    for (i = batch.begin(); i != batch.end(); ++i)
+    {
+      int ret = write_call(*i);
+
+      if (_db->thread_id() != tid)
+      {
+        // Reconnected, which ends the transaction - the calls before this one went with it, but this
+        // one (if it worked) was made after, by itself
+        i->done = (ret == 0);
+        break;
+      }
+
+      if (ret)
+        break;
+    }
+
+    if ((i == batch.end()) && (_db->commit() == 0))
+      return 0;
+
+    _db->rollback();
+    NH_LOGF_WARN(_log, "DB", "Write-behind batch of %u calls failed - writing them one at a time", (unsigned int)batch.size());
+  }
+
+  for (i = batch.begin(); i != batch.end(); ++i)
+  {
+    if (i->done)
+      continue;
+
+    if (write_call(*i))
+    {
+      NH_LOGF_ERROR(_log, "DB", "Queued call to %s failed, and has been dropped", i->sp_name);
+      failed++;
+    }
+  }
+
+  return failed;
+}
+
+int CNHDBWriter::write_call(queued_call &call)
+{
+  vector<void*> param_value(call.param_count);
+
+  for (int n=0; n < call.param_count; n++)
+  {
+    if ((call.param_type[n] == P_TYPE_VARCHAR) || (call.param_type[n] == P_TYPE_TEXT))
+      param_value[n] = &call.params[n].str;
+    else if (call.param_type[n] == P_TYPE_INT)
+      param_value[n] = &call.params[n].i;
+    else if (call.param_type[n] == P_TYPE_FLOAT)
+      param_value[n] = &call.params[n].f;
+    else if (call.param_type[n] == P_TYPE_TIMESTAMP)
+      param_value[n] = &call.params[n].tim;
+  }
+
+  // (no need for mysql_mutex - nothing else uses this connection)
+  return _db->exec_sp(call.sp_name, call.param_dir, call.param_type, param_value.data(), call.param_length, call.param_count, NULL);
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include "CNHDBAccess.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <list>
+#include <vector>
+#include <string>
+
+#define DB_WRITE_BEHIND_MS 200  // default longest a queued call waits before the writer starts on it
+#define DB_WRITER_BATCH    50   // most calls written in one transaction
+#define DB_WRITER_QUEUE    1000 // calls queued before callers have to make them themselves
+
+/* Write-behind for the SPs in async_sps.txt, whose results are never used. Their generated wrappers
+ * enqueue() the call (with copies of the params) and return straight away, and a background thread
+ * writes them, on a connection of its own, in transactions of up to DB_WRITER_BATCH calls. Calls are
+ * written in the order they were queued, within max_delay_ms of being queued unless the database is
+ * slower than that.
+ *
+ * If a batch fails, it's rolled back and its calls are written one at a time instead, so a single
+ * bad call only loses itself (it's logged and counted as failed). The thread starts on the first
+ * enqueue() - so after daemonize() - and stop() (or deleting it) writes everything still queued. */
+class CNHDBWriter
+{
+  public:
+    // Takes db, which it connects and deletes
+    CNHDBWriter(CNHDBAccess *db, CLogging *log, unsigned int max_delay_ms=DB_WRITE_BEHIND_MS);
+    ~CNHDBWriter();
+
+    // 0 if it's been queued. Otherwise (the queue's full, or the writer's stopped) the caller should
+    // make the call itself.
+    int enqueue(const char *sp_name, const int param_dir[], const int param_type[], void **param_value, const int param_length[], int param_count);
+
+    void flush();  // returns once everything queued so far has been written (or failed)
+    void stop();   // flush, then end the thread; later calls aren't queued
+
+    unsigned int queue_depth(); // queued, or being written
+    std::string json();         // counters for STATUS DETAIL
+
+  private:
+    struct queued_param
+    {
+      std::string str;
+      int i;
+      float f;
+      MYSQL_TIME tim;
+    };
+
+    struct queued_call
+    {
+      const char *sp_name;    // these all point to the generated wrapper's static strings/arrays
+      const int *param_dir;
+      const int *param_type;
+      const int *param_length;
+      int param_count;
+      std::vector<queued_param> params;
+      uint64_t queued_us;
+      bool done;              // already written, while a failed batch is redone
+    };
+
+    CNHDBAccess *_db;
+    CLogging *_log;
+    uint64_t _max_delay_us;
+    std::list<queued_call> _queue;
+    unsigned int _writing;    // calls taken from _queue by the thread, not yet written
+    bool _thread_started;
+    pid_t _thread_pid;        // the process it was started in
+    bool _stopping;
+    unsigned int _flush_requests;
+    pthread_t _thread;
+    pthread_mutex_t _mutex;
+    pthread_cond_t _cond;     // signalled when there's something for the thread to do
+    pthread_cond_t _written;  // signalled by the thread after each batch
+
+    // Counters
+    uint64_t _queued;
+    uint64_t _written_count;
+    uint64_t _failed;
+    uint64_t _overflow;       // calls the caller had to make, as the queue was full
+    uint64_t _batches;
+    unsigned int _last_batch;
+    unsigned int _max_batch;
+
+    static void *s_writer_thread(void *arg);
+    void writer_thread();
+    unsigned int write_batch(std::list<queued_call> &batch);
+    int write_call(queued_call &call);
+};
@@ -48,6 +48,14 @@ enum lang
    LANG_PHP
 };
 
+/* How the generated function returns the SP's result set */
+enum rs_type
+{
+   RS_CDBRESULT,  /* CDBResult *rs  */
+   RS_DBROWS,     /* dbrows *rs     */
+   RS_CALLBACK    /* row_callback, called per row as it's fetched */
+};
+
 
 struct param 
 {
@@ -62,6 +70,7 @@ struct sp_def
 {
   char sp_name[66]; 
   struct param *sp_params; 
+  int async;            /* listed in async_sps.txt - see read_async_list() */
   struct sp_def *next_sp;
 };
 
@@ -70,7 +79,9 @@ int seek_to(FILE *fp, char *search_str, int case_sensitive);
 int generate_sp_function(struct sp_def *sp, FILE *out_imp);
 //int generate_sp_header(struct sp_def *sp, FILE *out_hed);
 int read_file(char *filename, struct sp_def *sps);
-int output_func_def(struct sp_def *sps, FILE *out, int header);
+int read_async_list(char *path, struct sp_def *sp_list);
+int output_func_def(struct sp_def *sps, FILE *out, int header, enum rs_type rs);
+int output_param_setup(struct sp_def *sp, FILE *out_imp);
 int write_file(char *path, char *template_filename, char *output_filename, char *search_str, struct sp_def *sp_list, enum lang langtyp);
 int output_body(FILE *fh_out, struct sp_def *sp_ptr, enum lang langtyp);
 
@@ -108,6 +119,7 @@ int main(int argc, char *argv[])
  // generate_sp_function(sp_list_base, stdout);
   
   /* argv[1] = path */
+  read_async_list(argv[1], sp_list_base);
   write_file(argv[1], "/CNHDBAccess_template.cpp", "/CNHDBAccess.cpp", "// {AUTOGENERATED-SP-CALLS}\n"      , sp_list_base, LANG_CPP_FUNC);
   write_file(argv[1], "/CNHDBAccess_template.h"  , "/CNHDBAccess.h"  , "// {AUTOGENERATED-SP-DEFINITIONS}\n", sp_list_base, LANG_CPP_HEAD);
   write_file(argv[1], "/CNHDBAccess_template.php", "/CNHDBAccess.php", "// {AUTOGENERATED-SP-CALLS}\n"      , sp_list_base, LANG_PHP);
@@ -239,6 +251,54 @@ int write_file(char *path, char *template_filename, char *output_filename, char
   return 0;
 }
 
+int read_async_list(char *path, struct sp_def *sp_list)
+/* <path>/async_sps.txt lists (one per line, # for comments) SPs whose results are never needed, so
+ * can be queued for CNHDBWriter to write in the background instead of the caller waiting for them.
+ * Only SPs with just IN params can be - any others listed are left as they are. */
+{
+  FILE *fp;
+  char file_path[512];
+  char line[256];
+  char *name;
+  int n;
+  struct sp_def *sp_ptr;
+  struct param *lst;
+
+  snprintf(file_path, sizeof(file_path), "%s/async_sps.txt", path);
+  fp = fopen(file_path, "r");
+  if (fp == NULL)
+    return 0; /* none, then */
+
+  while (fgets(line, sizeof(line), fp) != NULL)
+  {
+    if ((name = strtok(line, " \t\r\n")) == NULL || (name[0] == '#'))
+      continue;
+
+    n = 0;
+    for (sp_ptr = sp_list; sp_ptr != NULL; sp_ptr = sp_ptr->next_sp)
+    {
+      if (strcmp(sp_ptr->sp_name, name))
+        continue;
+      n++;
+
+      for (lst = sp_ptr->sp_params; lst != NULL; lst = lst->next_param)
+        if (lst->p_direction != P_DIR_IN)
+          break;
+
+      if (lst != NULL)
+        printf("Error - %s has OUT params, so can't be async\n", name);
+      else
+        sp_ptr->async = 1;
+    }
+
+    if (n == 0)
+      printf("Warning - %s listed in async_sps.txt not found\n", name);
+  }
+
+  fclose(fp);
+  return 0;
+}
+
 int read_file(char *filename, struct sp_def *sps)
 {
   FILE *fp;
@@ -533,7 +593,7 @@ int add_param(struct param **param_list, char *param_line)
   return 0;
 }
 
-int output_func_def(struct sp_def *sps, FILE *out, int header)
+int output_func_def(struct sp_def *sps, FILE *out, int header, enum rs_type rs)
 {
   char *sp_name;
   struct param *param_list;
@@ -588,35 +648,71 @@ int output_func_def(struct sp_def *sps, FILE *out, int header)
       param_count++;
     } while (lst != NULL);  
     
-    if (header)
-      fprintf(out, "dbrows *rs=NULL);\n");
+    // The dbrows version is for code not yet using CDBResult - so it's the one without the default
+    if (rs == RS_CALLBACK)
+      fprintf(out, "row_callback row_cb, void *cb_obj, bool unbuffered%s)", header ? "=false" : "");
+    else if (rs == RS_DBROWS)
+      fprintf(out, "dbrows *rs)");
     else
-      fprintf(out, "dbrows *rs)\n");
+      fprintf(out, "CDBResult *rs%s)", header ? "=NULL" : "");
+    fprintf(out, header ? ";\n" : "\n");
   }
   
   return param_count;
 }
 
-int generate_sp_function(struct sp_def *sp, FILE *out_imp)
+int output_param_setup(struct sp_def *sp, FILE *out_imp)
+/* The start of a generated function's body - its param arrays, and param_value pointed at the args.
+ * The types, directions & lengths are fixed, so are only set up once (exec_sp keeps the prepared
+ * statement and OUT param buffers for the next call too). */
 {
-  char *sp_name;
-  struct param *param_list;
-  
+  struct param *param_list = sp->sp_params;
   struct param *lst;
-  int param_count;
-  param_count = 0;
-  
-  sp_name = sp->sp_name;
-  param_list = sp->sp_params;
-    
-  param_count = output_func_def(sp, out_imp,0);
-  fprintf(out_imp, "{\n");
-  
-  // Function body
-  fprintf(out_imp, "  int param_type[%d];\n"   , param_count);  
-  fprintf(out_imp, "  int param_dir[%d];\n"    , param_count);
+  int param_count = 0;
+
+  for (lst = param_list; lst != NULL; lst = lst->next_param)
+    param_count++;
+
+  fprintf(out_imp, "  static const int param_type[%d] = {", param_count);
+  for (lst = param_list; lst != NULL; lst = lst->next_param)
+  {
+    if (lst->p_type == P_TYPE_INT) 
+      fprintf(out_imp, "P_TYPE_INT");
+    else if ((lst->p_type == P_TYPE_VARCHAR))
+      fprintf(out_imp, "P_TYPE_VARCHAR");
+    else if ((lst->p_type == P_TYPE_FLOAT))
+      fprintf(out_imp, "P_TYPE_FLOAT");
+    else if ((lst->p_type == P_TYPE_TEXT))
+      fprintf(out_imp, "P_TYPE_TEXT");
+    else if ((lst->p_type == P_TYPE_TIMESTAMP))
+      fprintf(out_imp, "P_TYPE_TIMESTAMP");
+    else 
+      return -1;
+    fprintf(out_imp, "%s", (lst->next_param != NULL) ? ", " : "");
+  }
+  fprintf(out_imp, "};\n");
+
+  fprintf(out_imp, "  static const int param_dir[%d]  = {", param_count);
+  for (lst = param_list; lst != NULL; lst = lst->next_param)
+  {
+    if (lst->p_direction == P_DIR_IN) 
+      fprintf(out_imp, "P_DIR_IN");
+    else if ((lst->p_direction == P_DIR_OUT))
+      fprintf(out_imp, "P_DIR_OUT");
+    else if ((lst->p_direction == P_DIR_INOUT))
+      fprintf(out_imp, "P_DIR_INOUT");
+    else 
+      return -1;
+    fprintf(out_imp, "%s", (lst->next_param != NULL) ? ", " : "");
+  }
+  fprintf(out_imp, "};\n");
+
+  fprintf(out_imp, "  static const int param_len[%d]  = {", param_count);
+  for (lst = param_list; lst != NULL; lst = lst->next_param)
+    fprintf(out_imp, "%d%s", lst->p_len, (lst->next_param != NULL) ? ", " : "");
+  fprintf(out_imp, "};\n");
+
   fprintf(out_imp, "  void *param_value[%d];\n", param_count);
-  fprintf(out_imp, "  int param_len[%d];\n"    , param_count);
   fprintf(out_imp, "  int retval;\n");   
   fprintf(out_imp, "\n");
   
@@ -626,28 +722,6 @@ int generate_sp_function(struct sp_def *sp, FILE *out_imp)
     lst = param_list;
     do
     {
-      if (lst->p_type == P_TYPE_INT) 
-        fprintf(out_imp, "  param_type[%d] =  P_TYPE_INT;\n", param_count);
-      else if ((lst->p_type == P_TYPE_VARCHAR))
-        fprintf(out_imp, "  param_type[%d] =  P_TYPE_VARCHAR;\n", param_count);
-      else if ((lst->p_type == P_TYPE_FLOAT))
-        fprintf(out_imp, "  param_type[%d] =  P_TYPE_FLOAT;\n", param_count);
-      else if ((lst->p_type == P_TYPE_TEXT))
-        fprintf(out_imp, "  param_type[%d] =  P_TYPE_TEXT;\n", param_count);
-      else if ((lst->p_type == P_TYPE_TIMESTAMP))
-        fprintf(out_imp, "  param_type[%d] =  P_TYPE_TIMESTAMP;\n", param_count);
-      else 
-        return -1;
-
-      if (lst->p_direction == P_DIR_IN) 
-        fprintf(out_imp, "  param_dir[%d] = P_DIR_IN;\n", param_count);
-      else if ((lst->p_direction == P_DIR_OUT))
-        fprintf(out_imp, "  param_dir[%d] = P_DIR_OUT;\n", param_count);
-      else if ((lst->p_direction == P_DIR_INOUT))
-        fprintf(out_imp, "  param_dir[%d] = P_DIR_INOUT;\n", param_count);   
-      else 
-        return -1;      
-   
       if ((lst->p_type == P_TYPE_TIMESTAMP))
       {
         fprintf(out_imp, "  MYSQL_TIME MyTime%d;\n", param_count);
@@ -657,18 +731,78 @@ int generate_sp_function(struct sp_def *sp, FILE *out_imp)
       {
         fprintf(out_imp, "  param_value[%d] = &%s;\n", param_count, lst->p_name);
       }
-      fprintf(out_imp, "  param_len[%d] = %d;\n", param_count, lst->p_len);
-      fprintf(out_imp, "\n");
         
       lst = lst->next_param;
       param_count++;
     } while (lst != NULL);
     
+    fprintf(out_imp, "\n");
+  }
+
+  return param_count;
+}
+
+int generate_sp_function(struct sp_def *sp, FILE *out_imp)
+{
+  char *sp_name;
+  struct param *param_list;
+  
+  struct param *lst;
+  int param_count;
+  param_count = 0;
+  
+  sp_name = sp->sp_name;
+  param_list = sp->sp_params;
+    
+  param_count = output_func_def(sp, out_imp, 0, RS_CDBRESULT);
+  fprintf(out_imp, "{\n");
+  
+  if (output_param_setup(sp, out_imp) < 0)
+    return -1;
+
+  if (param_list != NULL)
+  {
+    if (sp->async)
+    {
+      fprintf(out_imp, "  // Async - the writer copies the params, and the call's done later (on its connection)\n");
+      fprintf(out_imp, "  if ((rs == NULL) && (writer != NULL) && (writer->enqueue(\"%s\", param_dir, param_type, param_value, param_len, %d) == 0))\n", sp_name, param_count);
+      fprintf(out_imp, "    return 0;\n");
+      fprintf(out_imp, "\n");
+    }
+
     fprintf(out_imp, "  pthread_mutex_lock(&mysql_mutex);\n");
     fprintf(out_imp, "  retval = exec_sp(\"%s\", param_dir, param_type, param_value, param_len, %d, rs);\n", sp_name, param_count);
     fprintf(out_imp, "  pthread_mutex_unlock(&mysql_mutex);\n");
     fprintf(out_imp, "  return retval;\n");
     fprintf(out_imp, "}\n\n");
+
+    // And the dbrows version, which converts the CDBResult
+    output_func_def(sp, out_imp, 0, RS_DBROWS);
+    fprintf(out_imp, "{\n");
+    fprintf(out_imp, "  CDBResult res;\n");
+    fprintf(out_imp, "  int retval;\n");
+    fprintf(out_imp, "\n");
+    fprintf(out_imp, "  retval = %s(", sp_name);
+    for (lst = param_list; lst != NULL; lst = lst->next_param)
+      fprintf(out_imp, "%s, ", lst->p_name);
+    fprintf(out_imp, "(rs != NULL) ? &res : NULL);\n");
+    fprintf(out_imp, "  if (rs != NULL)\n");
+    fprintf(out_imp, "    res.to_dbrows(rs);\n");
+    fprintf(out_imp, "  return retval;\n");
+    fprintf(out_imp, "}\n\n");
+
+    // And one streaming the rows to a callback (not for async SPs, which have no result)
+    if (!sp->async)
+    {
+      output_func_def(sp, out_imp, 0, RS_CALLBACK);
+      fprintf(out_imp, "{\n");
+      output_param_setup(sp, out_imp);
+      fprintf(out_imp, "  pthread_mutex_lock(&mysql_mutex);\n");
+      fprintf(out_imp, "  retval = exec_sp(\"%s\", param_dir, param_type, param_value, param_len, %d, NULL, row_cb, cb_obj, unbuffered);\n", sp_name, param_count);
+      fprintf(out_imp, "  pthread_mutex_unlock(&mysql_mutex);\n");
+      fprintf(out_imp, "  return retval;\n");
+      fprintf(out_imp, "}\n\n");
+    }
   }   
   
   return 0;
@@ -763,7 +897,10 @@ int output_body(FILE *fh_out, struct sp_def *sp_ptr, enum lang langtyp)
   switch (langtyp)
   {
     case LANG_CPP_HEAD:
-      output_func_def(sp_ptr, fh_out, 1);
+      output_func_def(sp_ptr, fh_out, 1, RS_CDBRESULT);
+      output_func_def(sp_ptr, fh_out, 1, RS_DBROWS);
+      if (!sp_ptr->async)
+        output_func_def(sp_ptr, fh_out, 1, RS_CALLBACK);
       break;
     
     case LANG_CPP_FUNC: